@@ -0,0 +1,489 @@
+/*
+ *
+ * bench.c - replays recorded ADDS responses through metar's decoders,
+ *           renderer and caches, and reports how fast each one goes
+ *
+ * built and run by `make bench`, against libmetar.c compiled alongside it,
+ * so every stage is measured exactly as metar runs it.  see metar.c for
+ * the license.
+ *
+ */
+
+#include "../metar_internal.h"
+
+#define BENCH_FIXTURE "bench/fixtures/adds-24h.xml"
+#define BENCH_FORMAT  "{station_id} {observation_time} {temp_c}/{dewpoint_c} {wind_dir_degrees}@{wind_speed_kt}G{wind_gust_kt} {visibility_statute_mi} {altim_in_hg} {sky_condition} {flight_category}"
+#define BENCH_MAXREPS 1000
+
+struct bench_fixture
+{
+  char *data;        // the recorded response, NUL-terminated
+  size_t *records;   // (start, end) of each <METAR>, from findMetarRecords()
+  size_t count;
+  size_t *groups;    // (first record, records) of each station in it
+  size_t groupCount;
+};
+
+struct bench_case
+{
+  int stations, hours;
+  char *xml;         // the synthesized response
+  size_t len;
+  size_t reports;    // how many <METAR>s it has
+  size_t found;      // ...and how many of them the indexed cache took
+
+  struct metar_parser *parser; // every report, decoded by the stages below
+  struct metar *weather;       // room for xmlToMetar(), and for unpacking
+  struct metar_format raw, formatted;
+  struct output out;           // /dev/null
+  struct arena scratch;
+  struct metar_cache *cache;
+  char file[METAR_BUFSIZE + 11]; // the XML cache file behind the sidecar
+  char (*ids)[METAR_CACHE_KEYSIZE];
+  struct metar_settings settings; // the indexed cache's lookups
+  const char *stage; // what's under way, for when it fails
+};
+
+int loadFixture(const char *restrict file, struct bench_fixture *restrict f);
+void freeFixture(struct bench_fixture *f);
+int buildCase(const struct bench_fixture *restrict f, struct bench_case *restrict c);
+void freeCase(struct bench_case *c);
+int prepareCaches(struct bench_case *restrict c, const char *restrict dir);
+int runStage(const char *restrict name, int (*stage)(struct bench_case *), struct bench_case *restrict c, size_t reports, int warmups, int reps);
+int compareTimes(const void *a, const void *b);
+int stageDom(struct bench_case *c);
+int stageSax(struct bench_case *c);
+int stageParallel(struct bench_case *c);
+int stageRaw(struct bench_case *c);
+int stageDecoded(struct bench_case *c);
+int stageFormat(struct bench_case *c);
+int stageSidecar(struct bench_case *c);
+int stageIndexed(struct bench_case *c);
+
+int main(int argc, const char *argv[])
+{
+  // every stage of every case is run warmups times unmeasured, then reps
+  // times; the median rep is reported.
+  const int stations[] = { 1, 100, 5000 };
+  const int hours[] = { 1, 24 };
+  struct bench_fixture fixture;
+  struct bench_case c;
+  char dir[32] = "/tmp/metar-bench-XXXXXX"; // room for the '/'
+  char bin[METAR_BUFSIZE + 11];
+  const char *file;
+  int warmups, reps, s, h, c0, ret;
+
+  warmups = 1;
+  reps = 5;
+  while ( (c0 = getopt(argc, (char * const *)argv, "r:w:")) != -1 )
+  {
+    switch ( c0 )
+    {
+      case 'r':
+      {
+        reps = atoi(optarg);
+        if ( reps < 1 ) reps = 1;
+        if ( reps > BENCH_MAXREPS ) reps = BENCH_MAXREPS;
+        break;
+      }
+      case 'w':
+      {
+        warmups = atoi(optarg);
+        if ( warmups < 0 ) warmups = 0;
+        break;
+      }
+      default:
+      {
+        fputs("Usage: bench [-r reps] [-w warmups] [fixture]\n\t-r <num>\tmeasured runs of each stage (default 5)\n\t-w <num>\tunmeasured runs before them (default 1)\n\tfixture\t\ta recorded response (default " BENCH_FIXTURE ")\n", stderr);
+        return 1;
+      }
+    }
+  }
+  file = (optind < argc) ? argv[optind] : BENCH_FIXTURE;
+
+  LIBXML_TEST_VERSION
+
+  if ( loadFixture(file, &fixture) != 0 )
+  {
+    fprintf(stderr, "%s: error: Cannot read %s.\n", argv[0], file);
+    return 2;
+  }
+  if ( !mkdtemp(dir) )
+  {
+    fprintf(stderr, "%s: error: Cannot create %s.\n", argv[0], dir);
+    freeFixture(&fixture);
+    return 2;
+  }
+  strcat(dir, "/");
+
+  printf("%-9s %8s %5s %8s %14s %10s\n", "stage", "stations", "hours", "reports", "reports/s", "ns/report");
+  for ( ret = 0, s = 0; (s < 3) && (ret == 0); ++s )
+  {
+    for ( h = 0; (h < 2) && (ret == 0); ++h )
+    {
+      memset((void *)&c, 0, sizeof(struct bench_case));
+      c.out.fd = -1;
+      c.settings.maxAge = (time_t)1 << 30; // nothing goes stale mid-run
+      c.settings.wanted = wholeReports;
+      c.stations = stations[s];
+      c.hours = hours[h];
+      c.stage = "setup";
+
+      ret = buildCase(&fixture, &c);
+      if ( ret == 0 ) ret = runStage("dom", stageDom, &c, c.reports, warmups, reps);
+      if ( ret == 0 ) ret = runStage("sax", stageSax, &c, c.reports, warmups, reps);
+      if ( ret == 0 ) ret = runStage("sax/4", stageParallel, &c, c.reports, warmups, reps);
+      if ( ret == 0 ) ret = prepareCaches(&c, dir);
+      if ( ret == 0 ) ret = runStage("raw", stageRaw, &c, c.reports, warmups, reps);
+      if ( ret == 0 ) ret = runStage("decoded", stageDecoded, &c, c.reports, warmups, reps);
+      if ( ret == 0 ) ret = runStage("format", stageFormat, &c, c.reports, warmups, reps);
+      if ( ret == 0 ) ret = runStage("sidecar", stageSidecar, &c, c.reports, warmups, reps);
+      if ( ret == 0 ) ret = runStage("indexed", stageIndexed, &c, c.found, warmups, reps);
+      freeCase(&c);
+
+      if ( ret != 0 )
+        fprintf(stderr, "%s: error: %d stations over %dh failed in %s.\n", argv[0], stations[s], hours[h], c.stage);
+    }
+  }
+
+  // the cache files, and where they were
+  strcpy(c.file, dir);
+  strcat(c.file, "metar.cache");
+  unlink(c.file);
+  cachePath(c.file, dir, "BENCH");
+  sidecarPath(bin, c.file);
+  unlink(c.file);
+  unlink(bin);
+  rmdir(dir);
+
+  freeFixture(&fixture);
+  xmlCleanupParser();
+  return ret ? 2 : 0;
+}
+
+int loadFixture(const char *restrict file, struct bench_fixture *restrict f)
+{
+  // reads a recorded response and notes where each station's records are;
+  // the service sends a station's records one after the other.
+  FILE *fp;
+  long size;
+  size_t k, n;
+  const char *id, *prev;
+
+  memset((void *)f, 0, sizeof(struct bench_fixture));
+  fp = fopen(file, "r");
+  if ( !fp ) return -1;
+
+  if ( (fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) <= 0) || (fseek(fp, 0, SEEK_SET) != 0)
+    || ((f->data = (char *)malloc((size_t)size + 1)) == NULL)
+    || (fread(f->data, 1, (size_t)size, fp) != (size_t)size) )
+  {
+    fclose(fp);
+    freeFixture(f);
+    return -1;
+  }
+  fclose(fp);
+  f->data[size] = '\0';
+
+  if ( (findMetarRecords(f->data, &f->records, &f->count) != 0) || (f->count == 0)
+    || ((f->groups = (size_t *)malloc(sizeof(size_t) * 2 * f->count)) == NULL) )
+  {
+    freeFixture(f);
+    return -1;
+  }
+
+  for ( prev = NULL, n = 0, k = 0; k < f->count; ++k )
+  {
+    id = strstr(&f->data[f->records[k * 2]], "<station_id>");
+    if ( !id || ((size_t)(id - f->data) > f->records[k * 2 + 1]) )
+    {
+      freeFixture(f);
+      return -1;
+    }
+    id += 12;
+
+    if ( !prev || (memcmp(prev, id, 4) != 0) )
+    {
+      f->groups[n * 2] = k;
+      f->groups[n * 2 + 1] = 0;
+      ++n;
+    }
+    ++f->groups[(n - 1) * 2 + 1];
+    prev = id;
+  }
+  f->groupCount = n;
+
+  return 0;
+}
+
+void freeFixture(struct bench_fixture *f)
+{
+  if ( f->data ) free(f->data);
+  if ( f->records ) free(f->records);
+  if ( f->groups ) free(f->groups);
+  memset((void *)f, 0, sizeof(struct bench_fixture));
+}
+
+int buildCase(const struct bench_fixture *restrict f, struct bench_case *restrict c)
+{
+  // a response for c->stations stations over c->hours hours: the fixture's
+  // stations in turn, each under a made-up ICAO id, with no more than
+  // c->hours of its newest records.
+  const char header[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<response>\n  <data num_results=\"%u\">\n";
+  const char footer[] = "  </data>\n</response>\n";
+  const size_t *group;
+  char id[5], old[4], *at, *end;
+  size_t size, k, first, n;
+  int s;
+
+  for ( size = sizeof(header) + 16 + sizeof(footer), s = 0; s < c->stations; ++s )
+  {
+    group = &f->groups[(s % f->groupCount) * 2];
+    n = (group[1] < (size_t)c->hours) ? group[1] : (size_t)c->hours;
+    size += f->records[(group[0] + n - 1) * 2 + 1] - f->records[group[0] * 2] + 5 * n;
+    c->reports += n;
+  }
+
+  c->xml = (char *)malloc(size);
+  c->ids = (char (*)[METAR_CACHE_KEYSIZE])calloc(c->stations, METAR_CACHE_KEYSIZE);
+  if ( !c->xml || !c->ids ) return -1;
+
+  c->len = (size_t)snprintf(c->xml, size, header, (unsigned int)c->reports);
+  for ( s = 0; s < c->stations; ++s )
+  {
+    group = &f->groups[(s % f->groupCount) * 2];
+    n = (group[1] < (size_t)c->hours) ? group[1] : (size_t)c->hours;
+
+    id[0] = 'K';
+    id[1] = 'A' + (s / 676) % 26;
+    id[2] = 'A' + (s / 26) % 26;
+    id[3] = 'A' + s % 26;
+    id[4] = '\0';
+    memcpy(c->ids[s], id, 5);
+    memcpy(old, strstr(&f->data[f->records[group[0] * 2]], "<station_id>") + 12, 4);
+
+    for ( k = group[0]; k < group[0] + n; ++k )
+    {
+      first = c->len;
+      memcpy(&c->xml[c->len], "    ", 4);
+      memcpy(&c->xml[c->len + 4], &f->data[f->records[k * 2]], f->records[k * 2 + 1] - f->records[k * 2]);
+      c->len += 4 + f->records[k * 2 + 1] - f->records[k * 2];
+      c->xml[c->len++] = '\n';
+
+      // the id turns up in raw_text and station_id, and nowhere else
+      for ( at = &c->xml[first], end = &c->xml[c->len - 4]; at <= end; ++at )
+        if ( memcmp(at, old, 4) == 0 )
+          memcpy(at, id, 4);
+    }
+  }
+  memcpy(&c->xml[c->len], footer, sizeof(footer));
+  c->len += sizeof(footer) - 1;
+
+  c->parser = newMetarParser(0, wholeReports.fields);
+  c->weather = (struct metar *)malloc(sizeof(struct metar) * c->reports);
+  if ( !c->parser || !c->weather
+    || (compileFormat(&c->raw, "{raw_text}") != 0)
+    || (compileFormat(&c->formatted, BENCH_FORMAT) != 0) )
+    return -1;
+
+  initOutput(&c->out, open("/dev/null", O_WRONLY));
+  return (c->out.fd >= 0) ? 0 : -1;
+}
+
+void freeCase(struct bench_case *c)
+{
+  closeOutput(&c->out);
+  if ( c->out.fd >= 0 ) close(c->out.fd);
+  if ( c->xml ) free(c->xml);
+  if ( c->ids ) free(c->ids);
+  if ( c->parser ) freeMetarParser(c->parser);
+  if ( c->weather ) free(c->weather);
+  freeFormat(&c->raw);
+  freeFormat(&c->formatted);
+  freeArena(&c->scratch);
+  closeIndexedCache(c->cache);
+}
+
+int prepareCaches(struct bench_case *restrict c, const char *restrict dir)
+{
+  // the whole response as one XML cache file and sidecar, and each
+  // station's share of it in a fresh indexed cache
+  struct metar_table table;
+  const struct metar_table *all;
+  size_t k;
+  int s, ret;
+  FILE *fp;
+
+  c->stage = "caches";
+  if ( (stageSax(c) != 0) )
+    return -1;
+  all = &c->parser->reports;
+
+  cachePath(c->file, dir, "BENCH");
+  fp = fopen(c->file, "w");
+  if ( !fp ) return -1;
+  fwrite(c->xml, 1, c->len, fp);
+  fclose(fp);
+  if ( writeSidecar(c->file, all, NULL, &wholeReports) != 0 )
+    return -1;
+
+  c->cache = openIndexedCache(dir);
+  if ( !c->cache || (purgeIndexedCache(c->cache) != 0) )
+    return -1;
+
+  // a full index is started over, so no more stations are stored than
+  // three quarters of METAR_CACHE_SLOTS; those are what's looked up
+  ret = 0;
+  c->found = 0;
+  initMetarTable(&table);
+  for ( s = 0, k = 0; (s < c->stations) && (ret == 0); ++s )
+  {
+    table.count = 0;
+    table.stringsLen = 0;
+    for ( ; (k < all->count) && (strcmp(all->reports[k].station_id, c->ids[s]) == 0); ++k )
+      if ( copyPackedMetar(&table, all, k) != 0 )
+        ret = -1;
+    if ( (ret == 0) && (s < METAR_CACHE_SLOTS / 4 * 3)
+      && (storeCachedReports(c->cache, c->ids[s], &table, NULL, &wholeReports) == 0) )
+      c->found += table.count;
+    else
+      c->ids[s][0] = '\0';
+  }
+  freeMetarTable(&table);
+
+  return ret;
+}
+
+int runStage(const char *restrict name, int (*stage)(struct bench_case *), struct bench_case *restrict c, size_t reports, int warmups, int reps)
+{
+  int64_t times[BENCH_MAXREPS], start, median;
+  int k;
+
+  c->stage = name;
+  for ( k = 0; k < warmups; ++k )
+    if ( stage(c) != 0 ) return -1;
+
+  for ( k = 0; k < reps; ++k )
+  {
+    start = clockMicros();
+    if ( stage(c) != 0 ) return -1;
+    times[k] = clockMicros() - start;
+  }
+  qsort(times, reps, sizeof(int64_t), compareTimes);
+  median = times[reps / 2];
+  if ( median < 1 ) median = 1;
+
+  printf("%-9s %8d %5d %8lu %14.0f %10.1f\n",
+    name,
+    c->stations,
+    c->hours,
+    (unsigned long)reports,
+    (double)reports * 1e6 / (double)median,
+    reports ? (double)median * 1e3 / (double)reports : 0.0);
+  fflush(stdout);
+  return 0;
+}
+
+int compareTimes(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+  return (x < y) ? -1 : (x > y);
+}
+
+int stageDom(struct bench_case *c)
+{
+  // the old way: the whole tree, then XPath over it
+  xmlDoc *xml;
+  size_t count;
+  int ret;
+
+  xml = xmlReadMemory(c->xml, (int)c->len, NULL, NULL, 0);
+  if ( !xml ) return -1;
+
+  count = xmlGetMetarCount(xml);
+  ret = (count == c->reports) ? xmlToMetar(xml, c->weather, count) : -1;
+  xmlFreeDoc(xml);
+  return (ret < 0) ? -1 : 0;
+}
+
+int stageSax(struct bench_case *c)
+{
+  // as metar parses a response: chunk by chunk as if it were arriving
+  size_t at, len;
+
+  resetMetarParser(c->parser);
+  for ( at = 0; at < c->len; at += len )
+  {
+    len = ((c->len - at) < METAR_BIGBUFSIZE) ? c->len - at : METAR_BIGBUFSIZE;
+    if ( feedMetarParser(c->parser, &c->xml[at], len) != 0 )
+      return -1;
+  }
+  return (finishMetarParser(c->parser) == (int)c->reports) ? 0 : -1;
+}
+
+int stageParallel(struct bench_case *c)
+{
+  // as a large combined response is decoded with -j 4
+  resetMetarParser(c->parser);
+  if ( decodeMetars(c->parser, c->xml, c->len, 4) < 0 )
+    return -1;
+  return (c->parser->reports.count == c->reports) ? 0 : -1;
+}
+
+int stageRaw(struct bench_case *c)
+{
+  if ( printMetars(&c->parser->reports, INT_MAX, 0, &c->raw, &c->out) != 0 )
+    return -1;
+  return flushOutput(&c->out, NULL, 0);
+}
+
+int stageDecoded(struct bench_case *c)
+{
+  if ( printMetars(&c->parser->reports, INT_MAX, METARFLAG_DECODED | METARFLAG_SPECIAL, &c->raw, &c->out) != 0 )
+    return -1;
+  return flushOutput(&c->out, NULL, 0);
+}
+
+int stageFormat(struct bench_case *c)
+{
+  if ( printMetars(&c->parser->reports, INT_MAX, METARFLAG_DECODED, &c->formatted, &c->out) != 0 )
+    return -1;
+  return flushOutput(&c->out, NULL, 0);
+}
+
+int stageSidecar(struct bench_case *c)
+{
+  // a fresh XML cache file, read back through its sidecar and unpacked,
+  // as printMetars() would
+  struct metar_table loaded;
+  size_t k;
+
+  resetArena(&c->scratch);
+  if ( (readSidecar(c->file, &loaded, &c->scratch) != 0) || (loaded.count != c->reports) )
+    return -1;
+  for ( k = 0; k < loaded.count; ++k )
+    unpackMetar(&loaded, k, &c->weather[k]);
+  return 0;
+}
+
+int stageIndexed(struct bench_case *c)
+{
+  // every station that fit, looked up in the indexed cache and unpacked
+  struct metar_table cached;
+  size_t found, k;
+  int s;
+
+  resetArena(&c->scratch);
+  for ( found = 0, s = 0; s < c->stations; ++s )
+  {
+    if ( c->ids[s][0] == '\0' ) continue;
+    if ( (findCachedReports(c->cache, c->ids[s], 0, &c->settings, &cached, &c->scratch) != 0)
+      || (found + cached.count > c->found) )
+      return -1;
+    for ( k = 0; k < cached.count; ++k )
+      unpackMetar(&cached, k, &c->weather[found + k]);
+    found += cached.count;
+  }
+  return (found == c->found) ? 0 : -1;
+}
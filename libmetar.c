@@ -0,0 +1,5872 @@
+/*
+ *
+ * libmetar.c - retrieving, caching, decoding and rendering METARs
+ * some rights reserved under the BSD License:
+
+Copyright (c) 2013, Nijumi "Ninja" Ardetus-Libera
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the software nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ *
+ */
+
+#include "metar_internal.h"
+
+const struct metar_projection wholeReports = { METAR_FIELDS_ALL, 0 };
+// one for the whole process, however many runs and contexts share it:
+// it keeps to the service's rate, not any one caller's
+static struct rate_limiter limiter = { PTHREAD_MUTEX_INITIALIZER, METAR_BURST, 0, 0, 0, 0 }; // full, to begin with
+
+int printMetars(const struct metar_table *reports, int entries, int flags, struct metar_format *format, struct output *out)
+{
+  // renders reports into out; every path appends by length, and nothing
+  // reaches the descriptor until out fills up or is flushed.
+  size_t j, k, len;
+  char when[METAR_TINYBUFSIZE];
+  const char *text;
+  struct metar w; // the report at hand, unpacked
+  int color;
+
+  color = ((flags & METARFLAG_COLOR) == METARFLAG_COLOR) ? 1 : 0;
+
+  // binary output is the struct itself, padding and all; unpackMetar()
+  // sets (and zero-fills the text of) everything else
+  if ( (flags & METARFLAG_BINARY) == METARFLAG_BINARY )
+    memset((void *)&w, 0, sizeof(struct metar));
+
+  for ( j = 0; (j < reports->count) && (j < entries); ++j )
+  {
+    unpackMetar(reports, j, &w);
+    if ( format && format->where && !matchesFilter(format->where, &w) )
+      continue;
+
+    if ( (flags & METARFLAG_JSONL) == METARFLAG_JSONL )
+      printJsonMetar(out, &w);
+    else if ( (flags & METARFLAG_BINARY) == METARFLAG_BINARY )
+      printBinaryMetar(out, &w);
+    else if ( (flags & METARFLAG_DECODED) != METARFLAG_DECODED )
+    {
+      // output raw, I guess.
+      outputString(out, w.raw_text);
+      outputBytes(out, "\n", 1);
+    }
+    else if ( (flags & METARFLAG_SPECIAL) == METARFLAG_SPECIAL )
+    {
+      // build our format.
+      strftime(when, METAR_TINYBUFSIZE, "%Y-%m-%d %H:%M:%S",
+        gmtime(&w.observation_time));
+
+      // raw text (see decodeRawMetar()) doesn't say where the station is
+      if ( isnan(w.latitude) || isnan(w.longitude) )
+        outputFormat(out,
+          "%s [%s] at %s\n",
+          w.station_id,
+          flightConditions(w.flight_category, color),
+          when);
+      else
+        outputFormat(out,
+          "%s (%.2f, %.2f) [%s] at %s\n",
+          w.station_id,
+          w.latitude,
+          w.longitude,
+          flightConditions(w.flight_category, color),
+          when);
+
+      strftime(when, METAR_TINYBUFSIZE, "%Y-%m-%d %H:%M:%S",
+        localtime(&w.observation_time));
+
+      outputFormat(out, "(Local time: %s)\n", when);
+
+      // corrected?
+      if ( (w.quality_control_flags & METAR_QUALITY_CORRECTED) == METAR_QUALITY_CORRECTED )
+      {
+        if ( color )
+          outputString(out, "\033[1;33mCorrected version\033[0m\n");
+        else
+          outputString(out, "Corrected version\n");
+      }
+
+      outputString(out, "\n");
+
+      // winds
+      if ( w.wind_dir_degrees >= 0 )
+      {
+        if ( w.wind_speed_kt == 0 )
+        {
+          outputString(out, "\tWinds: Calm\n");
+        }
+        else
+        {
+          if ( w.wind_dir_degrees == 0 )
+          {
+            if ( color )
+            {
+              if ( w.wind_speed_kt >= 10 )
+                outputFormat(out, "\tWinds: Variable at \033[1;31m%d knots\033[0m", w.wind_speed_kt);
+              else
+                outputFormat(out, "\tWinds: Variable at %d knots", w.wind_speed_kt);
+
+              if ( w.wind_gust_kt > 0 )
+              {
+                if ( (w.wind_gust_kt - w.wind_speed_kt) >= 5 )
+                  outputFormat(out, " \033[1;31mgusting %d knots\033[0m", w.wind_gust_kt);
+                else
+                  outputFormat(out, " gusting %d knots", w.wind_gust_kt);
+              }
+
+              outputString(out, "\n");
+            }
+            else
+            {
+              if ( w.wind_gust_kt > 0 )
+                outputFormat(out,
+                  "\tWinds: Variable at %d knots gusting %d knots\n",
+                  w.wind_speed_kt,
+                  w.wind_gust_kt);
+              else
+                outputFormat(out,
+                  "\tWinds: Variable at %d knots\n",
+                  w.wind_speed_kt);
+            }
+          }
+          else
+          {
+            if ( color )
+            {
+              if ( w.wind_speed_kt >= 10 )
+                outputFormat(out, "\tWinds: %d* at \033[1;31m%d knots\033[0m",
+                  w.wind_dir_degrees,
+                  w.wind_speed_kt);
+              else
+                outputFormat(out, "\tWinds: %d* at %d knots",
+                  w.wind_dir_degrees,
+                  w.wind_speed_kt);
+
+              if ( w.wind_gust_kt > 0 )
+              {
+                if ( (w.wind_gust_kt - w.wind_speed_kt) >= 5 )
+                  outputFormat(out, " \033[1;31mgusting %d knots\033[0m", w.wind_gust_kt);
+                else
+                  outputFormat(out, " gusting %d knots", w.wind_gust_kt);
+              }
+
+              outputString(out, "\n");
+            }
+            else
+            {
+              if ( w.wind_gust_kt > 0 )
+                outputFormat(out,
+                  "\tWinds: %d* at %d knots gusting %d knots\n",
+                  w.wind_dir_degrees,
+                  w.wind_speed_kt,
+                  w.wind_gust_kt);
+              else
+                outputFormat(out,
+                  "\tWinds: %d* at %d knots\n",
+                  w.wind_dir_degrees,
+                  w.wind_speed_kt);
+            }
+          }
+        }
+      }
+
+      // visibility
+      if ( !isnan(w.visibility_statute_mi) )
+      {
+        if ( color && (w.visibility_statute_mi < 5.0f) )
+        {
+          if ( w.visibility_statute_mi >= 3.0f )
+            outputFormat(out,
+              "\tVisibility: \033[1;34m%.1f miles\033[0m\n",
+              w.visibility_statute_mi);
+          else if ( w.visibility_statute_mi >= 1.0f )
+            outputFormat(out,
+              "\tVisibility: \033[1;31m%.1f miles\033[0m\n",
+              w.visibility_statute_mi);
+          else
+            outputFormat(out,
+              "\tVisibility: \033[1;35m%.1f miles\033[0m\n",
+              w.visibility_statute_mi);
+        }
+        else
+        {
+          outputFormat(out,
+            "\tVisibility: %.1f miles\n",
+            w.visibility_statute_mi);
+        }
+      }
+
+      // sky conditions
+      if ( w.sky_condition_count > 0 )
+      {
+        for ( k = 0; k < w.sky_condition_count; ++k )
+        {
+          if ( w.sky_condition[k].sky_cover == METAR_SKYCOND_CLR )
+          {
+            outputString(out, "\tSky condition: Clear\n");
+          }
+          else
+          {
+            if ( color && (!isVfrWeather(w.sky_condition[k].sky_cover)) && (w.sky_condition[k].cloud_base_ft_agl <= 3000) )
+            {
+              if ( w.sky_condition[k].cloud_base_ft_agl >= 1000 )
+                outputFormat(out,
+                  "\tSky condition: \033[1;34m%s at %d feet\033[0m above ground level\n",
+                  skyCondition(w.sky_condition[k].sky_cover),
+                  w.sky_condition[k].cloud_base_ft_agl);
+              else if ( w.sky_condition[k].cloud_base_ft_agl >= 500 )
+                outputFormat(out,
+                  "\tSky condition: \033[1;31m%s at %d feet\033[0m above ground level\n",
+                  skyCondition(w.sky_condition[k].sky_cover),
+                  w.sky_condition[k].cloud_base_ft_agl);
+              else
+                outputFormat(out,
+                  "\tSky condition: \033[1;35m%s at %d feet\033[0m above ground level\n",
+                  skyCondition(w.sky_condition[k].sky_cover),
+                  w.sky_condition[k].cloud_base_ft_agl);
+            }
+            else
+            {
+              outputFormat(out,
+                "\tSky condition: %s at %d feet above ground level\n",
+                skyCondition(w.sky_condition[k].sky_cover),
+                w.sky_condition[k].cloud_base_ft_agl);
+            }
+          }
+        }
+      }
+
+      // temperature
+      if ( !isnan(w.temp_c) )
+      {
+        outputFormat(out, "\tTemperature: %.1f*C (%.1f*F)\n",
+          w.temp_c,
+          w.temp_c * 9.0f/5.0f + 32.0f);
+      }
+
+      // dewpoint
+      if ( !isnan(w.dewpoint_c) )
+      {
+        outputFormat(out, "\tDewpoint: %.1f*C (%.1f*F)\n",
+          w.dewpoint_c,
+          w.dewpoint_c * 9.0f/5.0f + 32.0f);
+      }
+
+      // altimeter
+      if ( !isnan(w.altim_in_hg) )
+      {
+        outputFormat(out, "\tPressure: %.2f\" Hg (%.1f mb)\n",
+          w.altim_in_hg,
+          33.85f * w.altim_in_hg);
+      }
+
+      // adverse weather
+      if ( w.wx_string[0] != '\0' )
+      {
+        outputString(out, "\tAdverse weather: ");
+        if ( color )
+          outputString(out, "\033[1;33m");
+        outputString(out, w.wx_string);
+        if ( color )
+          outputString(out, "\033[0m");
+        outputString(out, "\n");
+      }
+
+      // notes
+      if ( (w.quality_control_flags & METAR_QUALITY_MAINTENANCE) == METAR_QUALITY_MAINTENANCE )
+      {
+        if ( color )
+          outputString(out, "\t\033[1;33mWarning\033[0m: Station needs maintenance\n");
+        else
+          outputString(out, "\tWarning: Station needs maintenance\n");
+      }
+
+      if ( (w.quality_control_flags & METAR_QUALITY_NO_WEATHER) == METAR_QUALITY_MAINTENANCE )
+      {
+        if ( color )
+          outputString(out, "\t\033[1;31mWarning\033[0m: Station offline\n");
+        else
+          outputString(out, "\tWarning: Station offline\n");
+      }
+
+      if ( (w.quality_control_flags & (METAR_QUALITY_AUTO | METAR_QUALITY_AUTO_STATION)) )
+      {
+        outputString(out, "\tAutomated weather available.\n");
+      }
+
+      // raw, and a blank line before the next report
+      outputString(out, "\t");
+      outputString(out, w.raw_text);
+      outputString(out, "\n\n");
+    }
+    else
+    {
+      // formatting time!
+      text = renderFormat(format, &w, color, &len);
+      outputBytes(out, text, len);
+      outputBytes(out, "\n", 1);
+    }
+  }
+
+  return 0;
+}
+
+void printJsonMetar(struct output *restrict o, const struct metar *restrict w)
+{
+  // one line of JSON per report, straight into out's buffer when there's
+  // room for the longest one can be.  anything the report doesn't have is
+  // left out, and the time is in seconds since the epoch.
+  static const char *const covers[] = { "SKC", "CLR", "CAVOK", "FEW", "SCT", "BKN", "OVC", "OVX" }; // by sky_cover_type
+  static const char *const qualities[] = { "corrected", "auto", "auto_station", "maintenance_indicator", "no_signal",
+    "lightning_sensor_off", "freezing_rain_sensor_off", "present_weather_sensor_off" }; // by METAR_QUALITY_* bit
+  char line[METAR_BIGBUFSIZE], *start, *p;
+  size_t k;
+
+  start = (o->data && (METAR_OUTBUFSIZE - o->len >= METAR_BIGBUFSIZE)) ? &o->data[o->len] : line;
+  p = start;
+  *p++ = '{';
+  p = jsonString(p, "station_id", w->station_id);
+  p = jsonNumber(p, "observation_time", w->observation_time ? (double)w->observation_time : NAN, 0);
+  p = jsonString(p, "raw_text", w->raw_text);
+  p = jsonNumber(p, "latitude", w->latitude, 5);
+  p = jsonNumber(p, "longitude", w->longitude, 5);
+  p = jsonNumber(p, "temp_c", w->temp_c, 1);
+  p = jsonNumber(p, "dewpoint_c", w->dewpoint_c, 1);
+  p = jsonNumber(p, "wind_dir_degrees", (w->wind_dir_degrees >= 0) ? w->wind_dir_degrees : NAN, 0);
+  p = jsonNumber(p, "wind_speed_kt", (w->wind_speed_kt >= 0) ? w->wind_speed_kt : NAN, 0);
+  p = jsonNumber(p, "wind_gust_kt", (w->wind_gust_kt >= 0) ? w->wind_gust_kt : NAN, 0);
+  p = jsonNumber(p, "visibility_statute_mi", w->visibility_statute_mi, 2);
+  p = jsonNumber(p, "altim_in_hg", w->altim_in_hg, 6);
+  p = jsonNumber(p, "sea_level_pressure_mb", w->sea_level_pressure_mb, 1);
+  p = jsonString(p, "wx_string", w->wx_string);
+  if ( w->sky_condition_count > 0 )
+  {
+    memcpy(p, "\"sky_condition\":[", 17);
+    p += 17;
+    for ( k = 0; k < w->sky_condition_count; ++k )
+    {
+      *p++ = '{';
+      if ( (w->sky_condition[k].sky_cover >= METAR_SKYCOND_SKC) && (w->sky_condition[k].sky_cover <= METAR_SKYCOND_OVX) )
+        p = jsonString(p, "sky_cover", covers[w->sky_condition[k].sky_cover]);
+      p = jsonNumber(p, "cloud_base_ft_agl", (w->sky_condition[k].cloud_base_ft_agl >= 0) ? w->sky_condition[k].cloud_base_ft_agl : NAN, 0);
+      if ( p[-1] == ',' ) --p;
+      *p++ = '}';
+      *p++ = ',';
+    }
+    p[-1] = ']';
+    *p++ = ',';
+  }
+  if ( w->flight_category != METAR_CATEGORY_UNKNOWN )
+    p = jsonString(p, "flight_category", flightConditions(w->flight_category, 0));
+  p = jsonNumber(p, "three_hr_pressure_tendency_mb", w->three_hr_pressure_tendency_mb, 1);
+  p = jsonNumber(p, "maxT_c", w->maxT_c, 1);
+  p = jsonNumber(p, "minT_c", w->minT_c, 1);
+  p = jsonNumber(p, "maxT24hr_c", w->maxT24hr_c, 1);
+  p = jsonNumber(p, "minT24hr_c", w->minT24hr_c, 1);
+  p = jsonNumber(p, "precip_in", w->precip_in, 3);
+  p = jsonNumber(p, "pcp3hr_in", w->pcp3hr_in, 3);
+  p = jsonNumber(p, "pcp6hr_in", w->pcp6hr_in, 3);
+  p = jsonNumber(p, "pcp24hr_in", w->pcp24hr_in, 3);
+  p = jsonNumber(p, "snow_in", w->snow_in, 3);
+  p = jsonNumber(p, "vert_vis_ft", (w->vert_vis_ft >= 0) ? w->vert_vis_ft : NAN, 0);
+  if ( w->metar_type != METAR_TYPE_UNKNOWN )
+    p = jsonString(p, "metar_type", (w->metar_type == METAR_TYPE_SPECI) ? "SPECI" : "METAR");
+  p = jsonNumber(p, "elevation_m", w->elevation_m, 1);
+  if ( w->quality_control_flags != 0 )
+  {
+    memcpy(p, "\"quality_control_flags\":[", 25);
+    p += 25;
+    for ( k = 0; k < 8; ++k )
+    {
+      if ( !(w->quality_control_flags & (1 << k)) ) continue;
+      *p++ = '"';
+      memcpy(p, qualities[k], strlen(qualities[k]));
+      p += strlen(qualities[k]);
+      *p++ = '"';
+      *p++ = ',';
+    }
+    p[-1] = ']';
+    *p++ = ',';
+  }
+  if ( p[-1] == ',' ) --p;
+  *p++ = '}';
+  *p++ = '\n';
+
+  if ( start == line )
+    outputBytes(o, line, p - line);
+  else
+    o->len += p - start;
+}
+
+char *jsonString(char *restrict p, const char *restrict key, const char *restrict value)
+{
+  // "key":"value", escaped, at p; nothing for an empty value.  returns
+  // where it ends.
+  static const char hex[] = "0123456789abcdef";
+  unsigned char c;
+
+  if ( value[0] == '\0' ) return p;
+
+  *p++ = '"';
+  memcpy(p, key, strlen(key));
+  p += strlen(key);
+  memcpy(p, "\":\"", 3);
+  p += 3;
+  for ( ; *value; ++value )
+  {
+    c = (unsigned char)*value;
+    if ( (c == '"') || (c == '\\') )
+    {
+      *p++ = '\\';
+      *p++ = (char)c;
+    }
+    else if ( c < 0x20 )
+    {
+      memcpy(p, "\\u00", 4);
+      p += 4;
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 15];
+    }
+    else
+      *p++ = (char)c;
+  }
+  *p++ = '"';
+  *p++ = ',';
+  return p;
+}
+
+char *jsonNumber(char *restrict p, const char *restrict key, double value, int digits)
+{
+  // "key":value, at p, to at most digits decimals (as many as
+  // packedFields[] keeps) without trailing zeros; nothing for a NaN.
+  static const double scales[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+  char reversed[24];
+  unsigned long long u;
+  long long fixed;
+  int n;
+
+  if ( isnan(value) ) return p;
+
+  *p++ = '"';
+  memcpy(p, key, strlen(key));
+  p += strlen(key);
+  *p++ = '"';
+  *p++ = ':';
+
+  fixed = llround(value * scales[digits]);
+  if ( fixed < 0 )
+  {
+    *p++ = '-';
+    u = (unsigned long long)-fixed;
+  }
+  else
+    u = (unsigned long long)fixed;
+  while ( (digits > 0) && (u % 10 == 0) )
+  {
+    u /= 10;
+    --digits;
+  }
+
+  // at least one digit ahead of the point
+  n = 0;
+  do
+  {
+    reversed[n++] = (char)('0' + u % 10);
+    u /= 10;
+  } while ( (u > 0) || (n <= digits) );
+  while ( n > 0 )
+  {
+    *p++ = reversed[--n];
+    if ( (n == digits) && (digits > 0) ) *p++ = '.';
+  }
+
+  *p++ = ',';
+  return p;
+}
+
+void printBinaryMetar(struct output *restrict o, const struct metar *restrict w)
+{
+  // the report as this build lays struct metar out, after a uint32_t of
+  // its size
+  uint32_t len = (uint32_t)sizeof(struct metar);
+
+  outputBytes(o, (const char *)&len, sizeof(len));
+  outputBytes(o, (const char *)w, sizeof(struct metar));
+}
+
+void outputUnavailable(struct output *restrict o, int flags, const char *restrict station, const char *restrict reason)
+{
+  // that a station has no weather information: with the text, or on its
+  // own on stderr when the output is for a program to read
+  if ( (flags & (METARFLAG_JSONL | METARFLAG_BINARY)) != 0 )
+    fprintf(stderr, "No weather information for %s: %s.\n", station, reason);
+  else
+    outputFormat(o, "No weather information for %s: %s.\n", station, reason);
+}
+
+const char *flightConditions(enum flight_rules rules, int color)
+{
+  switch ( rules )
+  {
+    case METAR_CATEGORY_VFR:
+      if ( color )
+        return "\033[1;32mVFR\033[0m";
+      else
+        return "VFR";
+    case METAR_CATEGORY_MVFR:
+      if ( color )
+        return "\033[1;34mMVFR\033[0m";
+      else
+        return "MVFR";
+    case METAR_CATEGORY_IFR:
+      if ( color )
+        return "\033[1;31mIFR\033[0m";
+      else
+        return "IFR";
+    case METAR_CATEGORY_LIFR:
+      if ( color )
+        return "\033[1;35mLIFR\033[0m";
+      else
+        return "LIFR";
+    default:
+      return "???";
+  }
+}
+
+size_t writeDocument(void *data, size_t len, size_t width, void *rest)
+{
+  size_t actual = len * width;
+  struct document *mem = (struct document *)rest;
+  size_t size;
+  int64_t started;
+  char *grown;
+
+  if ( mem->len + actual + 1 > mem->size )
+  {
+    // doubling keeps a document's reallocs logarithmic in its length
+    size = mem->size ? mem->size * 2 : METAR_BIGBUFSIZE;
+    if ( size < METAR_BIGBUFSIZE ) size = METAR_BIGBUFSIZE;
+    while ( size < mem->len + actual + 1 ) size *= 2;
+
+    grown = realloc(mem->data, size);
+    if ( !grown )
+    {
+      fputs("Not enough memory to write the XML document.\n", stderr);
+      return 0;
+    }
+    mem->data = grown;
+    mem->size = size;
+    ++mem->resizes;
+  }
+
+  memcpy(&(mem->data[mem->len]), data, actual);
+  mem->len += actual;
+  mem->data[mem->len] = 0;
+
+  if ( mem->parser && ((mem->window == 0) || (mem->len <= mem->window)) )
+  {
+    started = mem->stats ? clockMicros() : 0;
+    if ( feedMetarParser(mem->parser, data, actual) != 0 )
+    {
+      fputs("Not enough memory to parse the XML document.\n", stderr);
+      return 0;
+    }
+    if ( mem->stats ) mem->stats->parse += clockMicros() - started;
+  }
+
+  return actual;
+}
+
+void initOutput(struct output *o, int fd)
+{
+  // the buffer itself is only allocated once there's something to put in it
+  o->fd = fd;
+  o->data = NULL;
+  o->len = 0;
+  o->eager = isatty(fd);
+  o->writes = 0;
+}
+
+int flushOutput(struct output *o, const char *extra, size_t len)
+{
+  // writes out whatever is buffered and then extra, if given, with as few
+  // writev() calls as the descriptor allows.  returns -1 on a write error,
+  // in which case the buffered text is dropped.
+  struct iovec iov[2];
+  ssize_t n;
+  int k;
+
+  iov[0].iov_base = (void *)o->data;
+  iov[0].iov_len = o->len;
+  iov[1].iov_base = (void *)extra;
+  iov[1].iov_len = extra ? len : 0;
+  o->len = 0;
+
+  for ( k = 0; ; )
+  {
+    while ( (k < 2) && (iov[k].iov_len == 0) ) ++k;
+    if ( k == 2 ) return 0;
+
+    n = writev(o->fd, &iov[k], 2 - k);
+    ++o->writes;
+    if ( n < 0 )
+    {
+      if ( errno == EINTR ) continue;
+      return -1;
+    }
+
+    for ( ; (k < 2) && ((size_t)n >= iov[k].iov_len); ++k )
+      n -= iov[k].iov_len;
+    if ( k < 2 )
+    {
+      iov[k].iov_base = (void *)((char *)iov[k].iov_base + n);
+      iov[k].iov_len -= n;
+    }
+  }
+}
+
+void closeOutput(struct output *o)
+{
+  if ( o->data )
+  {
+    flushOutput(o, NULL, 0);
+    free(o->data);
+    o->data = NULL;
+  }
+}
+
+int outputBytes(struct output *o, const char *text, size_t len)
+{
+  // appends len bytes of text.  anything at least half the buffer's size
+  // goes out directly, in the same writev() as what's ahead of it; without
+  // memory for a buffer at all, everything does.
+  if ( !o->data )
+  {
+    o->data = (char *)malloc(METAR_OUTBUFSIZE);
+    if ( !o->data ) return flushOutput(o, text, len);
+  }
+
+  if ( o->len + len > METAR_OUTBUFSIZE )
+  {
+    if ( len >= METAR_OUTBUFSIZE / 2 ) return flushOutput(o, text, len);
+    if ( flushOutput(o, NULL, 0) != 0 ) return -1;
+  }
+
+  memcpy(&o->data[o->len], text, len);
+  o->len += len;
+  return 0;
+}
+
+int outputString(struct output *o, const char *text)
+{
+  return outputBytes(o, text, strlen(text));
+}
+
+int outputFormat(struct output *o, const char *format, ...)
+{
+  // printf()s into the buffer in place when there's room.  as with the
+  // fixed-size buffers this replaced, one call yields at most
+  // METAR_BUFSIZE - 1 characters.
+  char line[METAR_BUFSIZE];
+  va_list args;
+  int n;
+
+  if ( o->data && ((METAR_OUTBUFSIZE - o->len) >= METAR_BUFSIZE) )
+  {
+    va_start(args, format);
+    n = vsnprintf(&o->data[o->len], METAR_BUFSIZE, format, args);
+    va_end(args);
+    if ( n < 0 ) return -1;
+    o->len += (n < METAR_BUFSIZE) ? n : METAR_BUFSIZE - 1;
+    return 0;
+  }
+
+  va_start(args, format);
+  n = vsnprintf(line, METAR_BUFSIZE, format, args);
+  va_end(args);
+  if ( n < 0 ) return -1;
+  return outputBytes(o, line, (n < METAR_BUFSIZE) ? n : METAR_BUFSIZE - 1);
+}
+
+void *arenaAlloc(struct arena *a, size_t len)
+{
+  // bump allocation out of the newest block; a block too small for len is
+  // followed by one at least twice its size, so a reset arena soon settles
+  // on a single block that fits a whole station.
+  struct arena_block *block;
+  size_t size;
+  void *mem;
+
+  len = (len + 7) & ~(size_t)7;
+  if ( !a->head || (a->head->size - a->head->used < len) )
+  {
+    size = a->head ? a->head->size * 2 : METAR_ARENABLOCK;
+    while ( size < len ) size *= 2;
+
+    block = (struct arena_block *)malloc(sizeof(struct arena_block) + size);
+    if ( !block ) return NULL;
+    block->next = a->head;
+    block->size = size;
+    block->used = 0;
+    a->head = block;
+    ++a->blocks;
+  }
+
+  mem = &a->head->data[a->head->used];
+  a->head->used += len;
+  ++a->allocs;
+  return mem;
+}
+
+void resetArena(struct arena *a)
+{
+  // keeps the newest (largest) block for reuse
+  struct arena_block *block, *next;
+
+  if ( !a->head ) return;
+  for ( block = a->head->next; block; block = next )
+  {
+    next = block->next;
+    free(block);
+  }
+  a->head->next = NULL;
+  a->head->used = 0;
+}
+
+void freeArena(struct arena *a)
+{
+  resetArena(a);
+  if ( a->head ) free(a->head);
+  a->head = NULL;
+}
+
+void init_metar(struct metar *weather)
+{
+  //memset((void *)weather, 0, sizeof(struct metar));
+  weather->flight_category = METAR_CATEGORY_UNKNOWN;
+  weather->metar_type = METAR_TYPE_UNKNOWN;
+  weather->observation_time = 0;
+  weather->quality_control_flags = 0;
+  weather->raw_text[0] =
+    weather->station_id[0] =
+    weather->wx_string[0] = '\0';
+  weather->vert_vis_ft =
+    weather->wind_dir_degrees =
+    weather->wind_gust_kt =
+    weather->wind_speed_kt = -1;
+  weather->altim_in_hg =
+    weather->dewpoint_c =
+    weather->elevation_m =
+    weather->latitude =
+    weather->longitude =
+    weather->maxT24hr_c =
+    weather->maxT_c =
+    weather->minT24hr_c =
+    weather->minT_c =
+    weather->pcp24hr_in =
+    weather->pcp3hr_in =
+    weather->pcp6hr_in =
+    weather->precip_in =
+    weather->sea_level_pressure_mb =
+    weather->snow_in =
+    weather->temp_c =
+    weather->three_hr_pressure_tendency_mb =
+    weather->visibility_statute_mi =
+    0.0f / 0.0f; // NaN
+  weather->sky_condition_count = 0;
+  weather->sky_condition[0].cloud_base_ft_agl =
+    weather->sky_condition[1].cloud_base_ft_agl =
+    weather->sky_condition[2].cloud_base_ft_agl =
+    weather->sky_condition[3].cloud_base_ft_agl = -1;
+  weather->sky_condition[0].sky_cover =
+    weather->sky_condition[1].sky_cover =
+    weather->sky_condition[2].sky_cover =
+    weather->sky_condition[3].sky_cover = METAR_SKYCOND_UNKNOWN;
+}
+
+const struct packed_field packedFields[] =
+{
+  // bit k of metar_packed.present is packedFields[k]
+  { offsetof(struct metar, latitude), offsetof(struct metar_packed, latitude), 1, 1e5 },
+  { offsetof(struct metar, longitude), offsetof(struct metar_packed, longitude), 1, 1e5 },
+  { offsetof(struct metar, temp_c), offsetof(struct metar_packed, temp_c), 0, 1e1 },
+  { offsetof(struct metar, dewpoint_c), offsetof(struct metar_packed, dewpoint_c), 0, 1e1 },
+  { offsetof(struct metar, visibility_statute_mi), offsetof(struct metar_packed, visibility_statute_mi), 0, 1e2 },
+  { offsetof(struct metar, altim_in_hg), offsetof(struct metar_packed, altim_in_hg), 1, 1e6 },
+  { offsetof(struct metar, sea_level_pressure_mb), offsetof(struct metar_packed, sea_level_pressure_mb), 0, 1e1 },
+  { offsetof(struct metar, three_hr_pressure_tendency_mb), offsetof(struct metar_packed, three_hr_pressure_tendency_mb), 0, 1e1 },
+  { offsetof(struct metar, maxT_c), offsetof(struct metar_packed, maxT_c), 0, 1e1 },
+  { offsetof(struct metar, minT_c), offsetof(struct metar_packed, minT_c), 0, 1e1 },
+  { offsetof(struct metar, maxT24hr_c), offsetof(struct metar_packed, maxT24hr_c), 0, 1e1 },
+  { offsetof(struct metar, minT24hr_c), offsetof(struct metar_packed, minT24hr_c), 0, 1e1 },
+  { offsetof(struct metar, precip_in), offsetof(struct metar_packed, precip_in), 1, 1e3 },
+  { offsetof(struct metar, pcp3hr_in), offsetof(struct metar_packed, pcp3hr_in), 1, 1e3 },
+  { offsetof(struct metar, pcp6hr_in), offsetof(struct metar_packed, pcp6hr_in), 1, 1e3 },
+  { offsetof(struct metar, pcp24hr_in), offsetof(struct metar_packed, pcp24hr_in), 1, 1e3 },
+  { offsetof(struct metar, snow_in), offsetof(struct metar_packed, snow_in), 1, 1e3 },
+  { offsetof(struct metar, elevation_m), offsetof(struct metar_packed, elevation_m), 1, 1e1 }
+};
+
+void initMetarTable(struct metar_table *t)
+{
+  memset((void *)t, 0, sizeof(struct metar_table));
+}
+
+void freeMetarTable(struct metar_table *t)
+{
+  // views into an arena or a history log own nothing
+  if ( (t->size > 0) || (t->stringsSize > 0) )
+  {
+    if ( t->reports ) free(t->reports);
+    if ( t->strings ) free(t->strings);
+  }
+  initMetarTable(t);
+}
+
+int internMetarString(struct metar_table *restrict t, const char *restrict text, uint32_t *restrict offset)
+{
+  // appends text to the table's strings.  "" is always offset 0.
+  size_t len, size;
+  char *strings;
+
+  len = strlen(text);
+  if ( t->stringsLen == 0 ) ++len; // room for the leading ""
+
+  if ( t->stringsLen + len + 1 > t->stringsSize )
+  {
+    size = t->stringsSize ? t->stringsSize * 2 : METAR_BIGBUFSIZE;
+    while ( size < t->stringsLen + len + 1 ) size *= 2;
+    strings = (char *)realloc(t->strings, size);
+    if ( !strings ) return -1;
+    t->strings = strings;
+    t->stringsSize = size;
+  }
+
+  if ( t->stringsLen == 0 )
+    t->strings[t->stringsLen++] = '\0';
+
+  *offset = 0;
+  if ( text[0] == '\0' ) return 0;
+
+  *offset = (uint32_t)t->stringsLen;
+  strcpy(&t->strings[t->stringsLen], text);
+  t->stringsLen += strlen(text) + 1;
+  return 0;
+}
+
+int packMetar(struct metar_table *restrict t, const struct metar *restrict w)
+{
+  // appends w to t
+  const struct packed_field *f;
+  struct metar_packed *reports, *p;
+  size_t size, k;
+  double fixed, limit;
+  float value;
+
+  if ( t->count == t->size )
+  {
+    size = t->size ? t->size * 2 : 16;
+    reports = (struct metar_packed *)realloc(t->reports, sizeof(struct metar_packed) * size);
+    if ( !reports ) return -1;
+    t->reports = reports;
+    t->size = size;
+  }
+
+  p = &t->reports[t->count];
+  memset((void *)p, 0, sizeof(struct metar_packed));
+
+  if ( internMetarString(t, w->raw_text, &p->raw_text) != 0 )
+    return -1;
+
+  // weather tends to repeat from one hour to the next
+  if ( (t->count > 0) && (strcmp(&t->strings[t->reports[t->count - 1].wx_string], w->wx_string) == 0) )
+    p->wx_string = t->reports[t->count - 1].wx_string;
+  else if ( internMetarString(t, w->wx_string, &p->wx_string) != 0 )
+    return -1;
+
+  for ( k = 0; k < sizeof(packedFields) / sizeof(packedFields[0]); ++k )
+  {
+    f = &packedFields[k];
+    value = *(const float *)((const char *)w + f->full);
+    if ( isnan(value) ) continue;
+
+    limit = f->wide ? 2147483647.0 : 32767.0;
+    fixed = round((double)value * f->scale);
+    if ( fixed > limit ) fixed = limit;
+    if ( fixed < -limit ) fixed = -limit;
+
+    if ( f->wide )
+      *(int32_t *)((char *)p + f->packed) = (int32_t)fixed;
+    else
+      *(int16_t *)((char *)p + f->packed) = (int16_t)fixed;
+    p->present |= 1U << k;
+  }
+
+  p->observation_time = (int64_t)w->observation_time;
+  p->wind_dir_degrees = (int16_t)w->wind_dir_degrees;
+  p->wind_speed_kt = (int16_t)w->wind_speed_kt;
+  p->wind_gust_kt = (int16_t)w->wind_gust_kt;
+  p->vert_vis_ft = (int16_t)w->vert_vis_ft;
+  p->quality_control_flags = (uint8_t)w->quality_control_flags;
+  p->flight_category = (int8_t)w->flight_category;
+  p->metar_type = (int8_t)w->metar_type;
+  p->sky_condition_count = (uint8_t)w->sky_condition_count;
+  for ( k = 0; k < 4; ++k )
+  {
+    p->sky_cover[k] = (int8_t)w->sky_condition[k].sky_cover;
+    p->cloud_base_ft_agl[k] = w->sky_condition[k].cloud_base_ft_agl;
+  }
+  memcpy(p->station_id, w->station_id, 5);
+
+  ++t->count;
+  return 0;
+}
+
+int copyPackedMetar(struct metar_table *restrict dst, const struct metar_table *restrict src, size_t k)
+{
+  // appends src's k-th report to dst, text and all
+  struct metar w;
+
+  unpackMetar(src, k, &w);
+  return packMetar(dst, &w);
+}
+
+void unpackMetar(const struct metar_table *restrict t, size_t k, struct metar *restrict w)
+{
+  // the accessor: expands a packed report back into a struct metar, just
+  // as the decoder produced it, for the printers.
+  const struct metar_packed *p = &t->reports[k];
+  const struct packed_field *f;
+  float *value;
+  size_t j;
+
+  init_metar(w);
+
+  for ( j = 0; j < sizeof(packedFields) / sizeof(packedFields[0]); ++j )
+  {
+    f = &packedFields[j];
+    if ( (p->present & (1U << j)) == 0 ) continue;
+
+    value = (float *)((char *)w + f->full);
+    if ( f->wide )
+      *value = (float)(*(const int32_t *)((const char *)p + f->packed) / f->scale);
+    else
+      *value = (float)(*(const int16_t *)((const char *)p + f->packed) / f->scale);
+  }
+
+  strncpy(w->raw_text, &t->strings[p->raw_text], METAR_BUFSIZE);
+  w->raw_text[METAR_BUFSIZE - 1] = '\0';
+  strncpy(w->wx_string, &t->strings[p->wx_string], METAR_TINYBUFSIZE);
+  w->wx_string[METAR_TINYBUFSIZE - 1] = '\0';
+  memcpy(w->station_id, p->station_id, 5);
+  w->station_id[4] = '\0';
+
+  w->observation_time = (time_t)p->observation_time;
+  w->wind_dir_degrees = p->wind_dir_degrees;
+  w->wind_speed_kt = p->wind_speed_kt;
+  w->wind_gust_kt = p->wind_gust_kt;
+  w->vert_vis_ft = p->vert_vis_ft;
+  w->quality_control_flags = p->quality_control_flags;
+  w->flight_category = (enum flight_rules)p->flight_category;
+  w->metar_type = (enum metar_type_info)p->metar_type;
+  // a table from outside is checked as it's loaded (isMetarTableValid());
+  // this is so that one that wasn't still can't overrun sky_condition[]
+  w->sky_condition_count = (p->sky_condition_count > 4) ? 4 : p->sky_condition_count;
+  for ( j = 0; j < 4; ++j )
+  {
+    w->sky_condition[j].sky_cover = (enum sky_cover_type)p->sky_cover[j];
+    w->sky_condition[j].cloud_base_ft_agl = p->cloud_base_ft_agl[j];
+  }
+}
+
+int isMetarTableValid(const struct metar_table *t)
+{
+  // whether a table read in from outside the process (a sidecar, the
+  // indexed cache, a history log or a daemon's reply) can be unpacked
+  // without reading past it: every offset falls inside its strings, which
+  // end in a NUL, every id is terminated, and no report has more sky
+  // conditions than struct metar has room for
+  const struct metar_packed *p;
+  size_t k;
+
+  if ( t->count == 0 ) return 1;
+  if ( (t->stringsLen == 0) || (t->strings[t->stringsLen - 1] != '\0') ) return 0;
+
+  for ( k = 0; k < t->count; ++k )
+  {
+    p = &t->reports[k];
+    if ( (p->raw_text >= t->stringsLen) || (p->wx_string >= t->stringsLen)
+      || (p->station_id[4] != '\0') || (p->sky_condition_count > 4) )
+      return 0;
+  }
+  return 1;
+}
+
+size_t xmlGetMetarCount(xmlDoc *xml)
+{
+  xmlXPathObject *expr;
+  size_t val;
+
+  expr = getXmlNodes(xml, "count(//response/data/METAR)");
+  if ( !expr ) return 0;
+  val = (size_t)expr->floatval;
+  xmlXPathFreeObject(expr);
+
+  return val;
+}
+
+xmlXPathObject *getXmlNodes(xmlDoc *restrict xml, const char *restrict xpath)
+{
+  xmlXPathContext *ctx;
+  xmlXPathObject *expr;
+
+  if ( !xml ) return NULL;
+
+  ctx = xmlXPathNewContext(xml);
+  if ( !ctx ) return NULL;
+
+  expr = xmlXPathEvalExpression(xpath, ctx);
+  xmlXPathFreeContext(ctx);
+
+  return expr;
+}
+
+int xmlToMetar(xmlDoc *restrict xml, struct metar *restrict w, size_t count)
+{
+  size_t i;
+  xmlNode *cur, *inner;
+  xmlXPathContext *xpath;
+  xmlXPathObject *expr;
+  xmlAttr *xattr;
+  xmlChar *xstr;
+  struct metar *weather;
+  enum xml_name code;
+
+  weather = w;
+
+      if ( !xml )
+      {
+        //printf("No weather information for %s: invalid XML data.\n", argv[i]);
+        return -1;
+      }
+
+      xpath = xmlXPathNewContext(xml);
+      if ( !xpath )
+      {
+        //printf("No weather information for %s: invalid XPath context.\n", argv[i]);
+        return -2;
+      }
+
+      // compile our weather information
+      expr = xmlXPathEvalExpression("//response/data/METAR", xpath);
+      xmlXPathFreeContext(xpath);
+
+      if ( !expr )
+      {
+        //printf("No weather information for %s: invalid XPath expression.\n", argv[i]);
+        return -3;
+      }
+
+      if ( xmlXPathNodeSetIsEmpty(expr->nodesetval) )
+      {
+        //printf("No weather information for %s is available at this time.\n", argv[i]);
+        return 0;
+      }
+
+      for ( i = 0; (i < expr->nodesetval->nodeNr) && (i < count); ++i )
+      {
+        // all elements directly contain text except sky_condition,
+        // which has the sky_cover and cloud_base_ft_agl attributes.
+        if ( strcmp(expr->nodesetval->nodeTab[i]->name, "METAR") == 0 )
+        {
+          init_metar(weather);
+          for ( cur = expr->nodesetval->nodeTab[i]->children;
+                cur;
+                cur = cur->next )
+          {
+            if ( cur->type != XML_ELEMENT_NODE ) continue;
+
+            // xmlNodeGetContent() allocates, so only ask for what gets used
+            code = lookupXmlName(cur->name, strlen(cur->name));
+            if ( code == XML_SKY_CONDITION )
+            {
+              for ( xattr = cur->properties; xattr && xattr->name && xattr->children; xattr = xattr->next )
+              {
+                code = lookupXmlName(xattr->name, strlen(xattr->name));
+                if ( (code != XML_SKY_COVER) && (code != XML_CLOUD_BASE_FT_AGL) ) continue;
+                xstr = xmlNodeGetContent(xattr->children);
+                setMetarSkyCondition(weather, code, xstr);
+                xmlFree(xstr); // inside a loop, unfortunately
+              }
+            }
+            else if ( code == XML_QUALITY_CONTROL_FLAGS )
+            {
+              for ( inner = cur->children; inner; inner = inner->next )
+              {
+                if ( inner->type != XML_ELEMENT_NODE ) continue;
+                code = lookupXmlName(inner->name, strlen(inner->name));
+                if ( (code < XML_CORRECTED) || (code > XML_PRESENT_WEATHER_SENSOR_OFF) ) continue;
+                xstr = xmlNodeGetContent(inner);
+                setMetarQualityFlag(weather, code, xstr);
+                xmlFree(xstr);
+              }
+            }
+            else if ( (code >= XML_RAW_TEXT) && (code <= XML_ELEVATION_M) )
+            {
+              xstr = xmlNodeGetContent(cur);
+              setMetarField(weather, code, xstr);
+              xmlFree(xstr);
+            }
+          }
+          ++weather;
+        }
+      }
+
+  xmlXPathFreeObject(expr);
+  return i;
+}
+
+const struct xml_name_slot xmlNames[METAR_XMLNAMES] =
+{
+  // each name sits at the slot lookupXmlName() hashes it to; the multiplier
+  // there was picked so that none of them collide.  Adding a name means
+  // finding it a free slot, and possibly a new multiplier.
+  [1] = { "precip_in", 9, XML_PRECIP_IN },
+  [2] = { "three_hr_pressure_tendency_mb", 29, XML_THREE_HR_PRESSURE_TENDENCY_MB },
+  [3] = { "station_id", 10, XML_STATION_ID },
+  [4] = { "OVX", 3, XML_OVX },
+  [5] = { "wx_string", 9, XML_WX_STRING },
+  [10] = { "latitude", 8, XML_LATITUDE },
+  [11] = { "raw_text", 8, XML_RAW_TEXT },
+  [13] = { "dewpoint_c", 10, XML_DEWPOINT_C },
+  [14] = { "minT_c", 6, XML_MINT_C },
+  [16] = { "wind_speed_kt", 13, XML_WIND_SPEED_KT },
+  [17] = { "maxT24hr_c", 10, XML_MAXT24HR_C },
+  [18] = { "VFR", 3, XML_VFR },
+  [20] = { "metar_type", 10, XML_METAR_TYPE },
+  [23] = { "auto_station", 12, XML_AUTO_STATION },
+  [25] = { "wind_gust_kt", 12, XML_WIND_GUST_KT },
+  [27] = { "sea_level_pressure_mb", 21, XML_SEA_LEVEL_PRESSURE_MB },
+  [30] = { "lightning_sensor_off", 20, XML_LIGHTNING_SENSOR_OFF },
+  [35] = { "observation_time", 16, XML_OBSERVATION_TIME },
+  [36] = { "maxT_c", 6, XML_MAXT_C },
+  [40] = { "minT24hr_c", 10, XML_MINT24HR_C },
+  [45] = { "CAVOK", 5, XML_CAVOK },
+  [47] = { "corrected", 9, XML_CORRECTED },
+  [55] = { "pcp24hr_in", 10, XML_PCP24HR_IN },
+  [56] = { "wind_dir_degrees", 16, XML_WIND_DIR_DEGREES },
+  [58] = { "CLR", 3, XML_CLR },
+  [59] = { "response", 8, XML_RESPONSE },
+  [60] = { "FEW", 3, XML_FEW },
+  [64] = { "temp_c", 6, XML_TEMP_C },
+  [66] = { "pcp3hr_in", 9, XML_PCP3HR_IN },
+  [68] = { "freezing_rain_sensor_off", 24, XML_FREEZING_RAIN_SENSOR_OFF },
+  [69] = { "sky_condition", 13, XML_SKY_CONDITION },
+  [72] = { "LIFR", 4, XML_LIFR },
+  [73] = { "cloud_base_ft_agl", 17, XML_CLOUD_BASE_FT_AGL },
+  [74] = { "MVFR", 4, XML_MVFR },
+  [75] = { "present_weather_sensor_off", 26, XML_PRESENT_WEATHER_SENSOR_OFF },
+  [76] = { "no_signal", 9, XML_NO_SIGNAL },
+  [78] = { "auto", 4, XML_AUTO },
+  [81] = { "longitude", 9, XML_LONGITUDE },
+  [83] = { "OVC", 3, XML_OVC },
+  [86] = { "maintenance_indicator", 21, XML_MAINTENANCE_INDICATOR },
+  [87] = { "METAR", 5, XML_METAR },
+  [88] = { "vert_vis_ft", 11, XML_VERT_VIS_FT },
+  [89] = { "SCT", 3, XML_SCT },
+  [90] = { "elevation_m", 11, XML_ELEVATION_M },
+  [91] = { "flight_category", 15, XML_FLIGHT_CATEGORY },
+  [95] = { "snow_in", 7, XML_SNOW_IN },
+  [96] = { "BKN", 3, XML_BKN },
+  [108] = { "data", 4, XML_DATA },
+  [110] = { "pcp6hr_in", 9, XML_PCP6HR_IN },
+  [111] = { "sky_cover", 9, XML_SKY_COVER },
+  [112] = { "SKC", 3, XML_SKC },
+  [115] = { "altim_in_hg", 11, XML_ALTIM_IN_HG },
+  [117] = { "IFR", 3, XML_IFR },
+  [121] = { "quality_control_flags", 21, XML_QUALITY_CONTROL_FLAGS },
+  [122] = { "visibility_statute_mi", 21, XML_VISIBILITY_STATUTE_MI },
+  [123] = { "SPECI", 5, XML_SPECI }
+};
+
+enum xml_name lookupXmlName(const char *name, size_t len)
+{
+  // maps an element, attribute or value the parser cares about to its code:
+  // one FNV-1a pass, a multiply, and a single comparison to confirm.
+  const struct xml_name_slot *slot;
+  unsigned long hash;
+  size_t k;
+
+  hash = 2166136261UL;
+  for ( k = 0; k < len; ++k )
+  {
+    hash ^= (unsigned char)name[k];
+    hash = (hash * 16777619UL) & 0xffffffffUL;
+  }
+
+  slot = &xmlNames[((hash * 1151305UL) & 0xffffffffUL) >> 25];
+  if ( slot->name && (slot->len == len) && (memcmp(slot->name, name, len) == 0) )
+    return slot->code;
+  return XML_UNKNOWN;
+}
+
+void setMetarField(struct metar *restrict weather, enum xml_name field, const char *restrict value)
+{
+  // stores the text of one of a <METAR>'s child elements.  <sky_condition>
+  // and <quality_control_flags> carry their data elsewhere; see below.
+  if ( !value ) return;
+
+  switch ( field )
+  {
+    case XML_RAW_TEXT:
+      // <raw_text>string</raw_text>
+      strncpy(weather->raw_text, value, METAR_BUFSIZE);
+      weather->raw_text[METAR_BUFSIZE - 1] = '\0';
+      break;
+    case XML_STATION_ID:
+      // <station_id>char(4)</station_id>
+      strncpy(weather->station_id, value, 4);
+      weather->station_id[4] = '\0';
+      break;
+    case XML_OBSERVATION_TIME:
+      // <observation_time>ISO8601 string</observation_time>
+      parseIsoTime(value, &weather->observation_time);
+      break;
+    case XML_LATITUDE:
+      // <latitude>float</latitude>
+      parseDecimal(value, &weather->latitude);
+      break;
+    case XML_LONGITUDE:
+      // <longitude>float</longitude>
+      parseDecimal(value, &weather->longitude);
+      break;
+    case XML_TEMP_C:
+      // <temp_c>float</temp_c>
+      parseDecimal(value, &weather->temp_c);
+      break;
+    case XML_DEWPOINT_C:
+      // <dewpoint_c>float</dewpoint_c>
+      parseDecimal(value, &weather->dewpoint_c);
+      break;
+    case XML_WIND_DIR_DEGREES:
+      // <wind_dir_degrees>int</wind_dir_degrees>
+      if ( !parseInteger(value, &weather->wind_dir_degrees) && (strcmp(value, "VRB") == 0) )
+        weather->wind_dir_degrees = 0; // variable
+      break;
+    case XML_WIND_SPEED_KT:
+      // <wind_speed_kt>int</wind_speed_kt>
+      parseInteger(value, &weather->wind_speed_kt);
+      break;
+    case XML_WIND_GUST_KT:
+      // <wind_gust_kt>int</wind_gust_kt>
+      parseInteger(value, &weather->wind_gust_kt);
+      break;
+    case XML_VISIBILITY_STATUTE_MI:
+      // <visibility_statue_mi>float</visibility_statue_mi>
+      parseDecimal(value, &weather->visibility_statute_mi);
+      break;
+    case XML_ALTIM_IN_HG:
+      // <altim_in_hg>float</altim_in_hg>
+      parseDecimal(value, &weather->altim_in_hg);
+      break;
+    case XML_SEA_LEVEL_PRESSURE_MB:
+      // <sea_level_pressure_mb>float</sea_level_pressure_mb>
+      parseDecimal(value, &weather->sea_level_pressure_mb);
+      break;
+    case XML_WX_STRING:
+      // <wx_string>unknown</wx_string>
+      strncpy(weather->wx_string, value, METAR_TINYBUFSIZE);
+      weather->wx_string[METAR_TINYBUFSIZE - 1] = '\0';
+      break;
+    case XML_FLIGHT_CATEGORY:
+      // <flight_category>string</flight_category>
+      switch ( lookupXmlName(value, strlen(value)) )
+      {
+        case XML_VFR: weather->flight_category = METAR_CATEGORY_VFR; break;
+        case XML_MVFR: weather->flight_category = METAR_CATEGORY_MVFR; break;
+        case XML_IFR: weather->flight_category = METAR_CATEGORY_IFR; break;
+        case XML_LIFR: weather->flight_category = METAR_CATEGORY_LIFR; break;
+        default: weather->flight_category = METAR_CATEGORY_UNKNOWN; break;
+      }
+      break;
+    case XML_THREE_HR_PRESSURE_TENDENCY_MB:
+      // <three_hr_pressure_tendency_mb>float</three_hr_pressure_tendency_mb>
+      parseDecimal(value, &weather->three_hr_pressure_tendency_mb);
+      break;
+    case XML_MAXT_C:
+      // <maxT_c>float</maxT_c>
+      parseDecimal(value, &weather->maxT_c);
+      break;
+    case XML_MINT_C:
+      // <minT_c>float</minT_c>
+      parseDecimal(value, &weather->minT_c);
+      break;
+    case XML_MAXT24HR_C:
+      // <maxT24hr_c>float</maxT24hr_c>
+      parseDecimal(value, &weather->maxT24hr_c);
+      break;
+    case XML_MINT24HR_C:
+      // <minT24hr_c>float</minT24hr_c>
+      parseDecimal(value, &weather->minT24hr_c);
+      break;
+    case XML_PRECIP_IN:
+      // <precip_in>float</precip_in>
+      parseDecimal(value, &weather->precip_in);
+      break;
+    case XML_PCP3HR_IN:
+      // <pcp3hr_in>float</pcp3hr_in>
+      parseDecimal(value, &weather->pcp3hr_in);
+      break;
+    case XML_PCP6HR_IN:
+      // <pcp6hr_in>float</pcp6hr_in>
+      parseDecimal(value, &weather->pcp6hr_in);
+      break;
+    case XML_PCP24HR_IN:
+      // <pcp24hr_in>float</pcp24hr_in>
+      parseDecimal(value, &weather->pcp24hr_in);
+      break;
+    case XML_SNOW_IN:
+      // <snow_in>float</snow_in>
+      parseDecimal(value, &weather->snow_in);
+      break;
+    case XML_VERT_VIS_FT:
+      // <vert_vis_ft>int</vert_vis_ft>
+      parseInteger(value, &weather->vert_vis_ft);
+      break;
+    case XML_METAR_TYPE:
+      // <metar_type>string</metar_type>
+      switch ( lookupXmlName(value, strlen(value)) )
+      {
+        case XML_METAR: weather->metar_type = METAR_TYPE_METAR; break;
+        case XML_SPECI: weather->metar_type = METAR_TYPE_SPECI; break;
+        default: weather->metar_type = METAR_TYPE_UNKNOWN; break;
+      }
+      break;
+    case XML_ELEVATION_M:
+      // <elevation_m>float</elevation_m>
+      parseDecimal(value, &weather->elevation_m);
+      break;
+    default:
+      break;
+  }
+}
+
+void setMetarSkyCondition(struct metar *restrict weather, enum xml_name attr, const char *restrict value)
+{
+  // <sky_condition sky_cover="string" cloud_base_ft_agl="string"/>
+  // attributes arrive in document order; a layer is complete once its base
+  // is known, except for CLR, which never has one.
+  struct sky_condition_entry *layer;
+
+  if ( !value || (weather->sky_condition_count >= 4) ) return;
+  layer = &weather->sky_condition[weather->sky_condition_count];
+
+  if ( attr == XML_SKY_COVER )
+  {
+    switch ( lookupXmlName(value, strlen(value)) )
+    {
+      case XML_SKC: layer->sky_cover = METAR_SKYCOND_SKC; break;
+      case XML_CLR: layer->sky_cover = METAR_SKYCOND_CLR; ++weather->sky_condition_count; break;
+      case XML_CAVOK: layer->sky_cover = METAR_SKYCOND_CAVOK; break;
+      case XML_FEW: layer->sky_cover = METAR_SKYCOND_FEW; break;
+      case XML_SCT: layer->sky_cover = METAR_SKYCOND_SCT; break;
+      case XML_BKN: layer->sky_cover = METAR_SKYCOND_BKN; break;
+      case XML_OVC: layer->sky_cover = METAR_SKYCOND_OVC; break;
+      case XML_OVX: layer->sky_cover = METAR_SKYCOND_OVX; break;
+      default: layer->sky_cover = METAR_SKYCOND_UNKNOWN; break;
+    }
+  }
+  else if ( attr == XML_CLOUD_BASE_FT_AGL )
+  {
+    parseInteger(value, &layer->cloud_base_ft_agl);
+    ++weather->sky_condition_count;
+  }
+}
+
+void setMetarQualityFlag(struct metar *restrict weather, enum xml_name flag, const char *restrict value)
+{
+  // <quality_control_flags>
+  //  <corrected>bool</corrected>
+  //  <auto>bool</auto>
+  //  <auto_station>bool</auto_station>
+  //  <maintenance_indicator>bool?</maintenance_indicator>
+  //  <no_signal>bool</no_signal>
+  //  <lightning_sensor_off>bool</lightning_sensor_off>
+  //  <freezing_rain_sensor_off>bool</freezing_rain_sensor_off>
+  //  <present_weather_sensor_off>bool</present_weather_sensor_off>
+  // </quality_control_flags>
+  if ( !value || (strcasecmp(value, "TRUE") != 0) ) return;
+
+  switch ( flag )
+  {
+    case XML_CORRECTED: weather->quality_control_flags |= METAR_QUALITY_CORRECTED; break;
+    case XML_AUTO: weather->quality_control_flags |= METAR_QUALITY_AUTO; break;
+    case XML_AUTO_STATION: weather->quality_control_flags |= METAR_QUALITY_AUTO_STATION; break;
+    case XML_MAINTENANCE_INDICATOR: weather->quality_control_flags |= METAR_QUALITY_MAINTENANCE; break;
+    case XML_NO_SIGNAL: weather->quality_control_flags |= METAR_QUALITY_NO_SIGNAL; break;
+    case XML_LIGHTNING_SENSOR_OFF: weather->quality_control_flags |= METAR_QUALITY_NO_LIGHTNING; break;
+    case XML_FREEZING_RAIN_SENSOR_OFF: weather->quality_control_flags |= METAR_QUALITY_NO_FREEZING; break;
+    case XML_PRESENT_WEATHER_SENSOR_OFF: weather->quality_control_flags |= METAR_QUALITY_NO_WEATHER; break;
+    default: break;
+  }
+}
+
+struct metar_parser *newMetarParser(int echo, uint32_t fields)
+{
+  // a parser keeping only the fields of each report that fields has a bit
+  // for (see formatFields()), for as many documents as it's reset for
+  struct metar_parser *p;
+  xmlSAXHandler sax;
+
+  p = (struct metar_parser *)calloc(1, sizeof(struct metar_parser));
+  if ( !p ) return NULL;
+  p->fields = fields;
+
+  if ( echo )
+  {
+    p->echo.data = malloc(1);
+    if ( !p->echo.data )
+    {
+      free(p);
+      return NULL;
+    }
+    p->echo.data[0] = '\0';
+    p->echo.size = 1;
+  }
+
+  memset((void *)&sax, 0, sizeof(xmlSAXHandler));
+  sax.initialized = XML_SAX2_MAGIC;
+  sax.startElementNs = metarParserStart;
+  sax.endElementNs = metarParserEnd;
+  sax.characters = metarParserText;
+  sax.ignorableWhitespace = metarParserText;
+
+  p->ctxt = xmlCreatePushParserCtxt(&sax, (void *)p, NULL, 0, "metar.xml");
+  if ( !p->ctxt )
+  {
+    freeMetarParser(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+void resetMetarParser(struct metar_parser *p)
+{
+  // readies p for another document, keeping everything it has allocated,
+  // and the fields it keeps
+  xmlCtxtResetPush(p->ctxt, NULL, 0, "metar.xml", NULL);
+  p->ctxt->userData = (void *)p;
+
+  p->reports.count = 0;
+  p->reports.stringsLen = 0;
+  p->echo.len = 0;
+  if ( p->echo.data ) p->echo.data[0] = '\0';
+  p->depth = p->matched = p->flags = p->error = 0;
+  p->element = XML_UNKNOWN;
+  p->text[0] = '\0';
+  p->textLen = 0;
+}
+
+void freeMetarParser(struct metar_parser *p)
+{
+  if ( !p ) return;
+  if ( p->ctxt ) xmlFreeParserCtxt(p->ctxt);
+  freeMetarTable(&p->reports);
+  if ( p->spans ) free(p->spans);
+  if ( p->echo.data ) free(p->echo.data);
+  free(p);
+}
+
+size_t inflateDocument(void *data, size_t len, size_t width, void *rest)
+{
+  // CURLOPT_WRITEFUNCTION for a gzip'd response: nothing is kept but what
+  // the parser makes of it.  one that isn't gzip'd after all (a server
+  // that set Content-Encoding, which curl has already undone) goes to the
+  // parser as is.
+  size_t actual = len * width;
+  struct inflater *z = (struct inflater *)rest;
+  int ret;
+
+  z->bytes += actual;
+  if ( z->error ) return 0;
+  if ( actual == 0 ) return 0;
+
+  if ( z->state == 0 )
+  {
+    z->state = (((unsigned char *)data)[0] == 0x1f) ? 1 : 2;
+    if ( (z->state == 1) && (inflateInit2(&z->stream, 15 + 16) != Z_OK) )
+    {
+      z->state = 0;
+      z->error = -2;
+      return 0;
+    }
+  }
+
+  if ( z->state == 2 )
+  {
+    if ( feedMetarParser(z->parser, data, actual) != 0 ) z->error = -2;
+    return z->error ? 0 : actual;
+  }
+
+  z->stream.next_in = (Bytef *)data;
+  z->stream.avail_in = (uInt)actual;
+  while ( (z->stream.avail_in > 0) && !z->error )
+  {
+    z->stream.next_out = (Bytef *)z->out;
+    z->stream.avail_out = sizeof(z->out);
+    ret = inflate(&z->stream, Z_NO_FLUSH);
+    if ( (ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR) )
+    {
+      z->error = (ret == Z_MEM_ERROR) ? -2 : -1;
+      break;
+    }
+    if ( feedMetarParser(z->parser, z->out, sizeof(z->out) - z->stream.avail_out) != 0 )
+      z->error = -2;
+
+    // gzip allows several members back to back
+    if ( (ret == Z_STREAM_END) && (inflateReset(&z->stream) != Z_OK) )
+      z->error = -1;
+  }
+
+  return z->error ? 0 : actual;
+}
+
+int feedMetarParser(struct metar_parser *p, const char *data, size_t len)
+{
+  // malformed input just stops the parser (see finishMetarParser());
+  // only running out of memory is worth aborting a transfer over.  a whole
+  // response is given in pieces, as libxml2 won't take more than about
+  // 10MB in one go.
+  size_t take;
+
+  if ( p->error == -2 ) return -1;
+  for ( ; (p->error == 0) && (len > 0); data += take, len -= take )
+  {
+    take = (len < METAR_PARSECHUNK) ? len : METAR_PARSECHUNK;
+    xmlParseChunk(p->ctxt, data, (int)take, 0);
+  }
+  return (p->error == -2) ? -1 : 0;
+}
+
+int finishMetarParser(struct metar_parser *p)
+{
+  // returns the number of reports decoded, -1 if the document was not
+  // well-formed XML, or -2 if memory ran out.
+  if ( p->error == 0 )
+  {
+    xmlParseChunk(p->ctxt, NULL, 0, 1);
+    if ( !p->ctxt->wellFormed && (p->error == 0) )
+      p->error = -1;
+  }
+  return (p->error != 0) ? p->error : (int)p->reports.count;
+}
+
+void metarParserEcho(struct metar_parser *p, const char *text, size_t len, int escape)
+{
+  // re-serializes part of a <METAR> into p->echo.  escape is 0 for markup,
+  // 1 for element text and 2 for attribute values.
+  const char *esc;
+  size_t start, k;
+
+  if ( !p->echo.data || (p->error != 0) ) return;
+
+  for ( start = k = 0; k <= len; ++k )
+  {
+    esc = NULL;
+    if ( (k < len) && escape )
+    {
+      if ( text[k] == '&' ) esc = "&amp;";
+      else if ( text[k] == '<' ) esc = "&lt;";
+      else if ( text[k] == '>' ) esc = "&gt;";
+      else if ( (text[k] == '"') && (escape == 2) ) esc = "&quot;";
+    }
+    if ( !esc && (k < len) ) continue;
+
+    if ( ((k > start) && (writeDocument((void *)&text[start], 1, k - start, (void *)&p->echo) == 0))
+      || (esc && (writeDocument((void *)esc, 1, strlen(esc), (void *)&p->echo) == 0)) )
+    {
+      p->error = -2;
+      return;
+    }
+    start = k + 1;
+  }
+}
+
+void metarParserStart(void *ctx, const xmlChar *name, const xmlChar *prefix, const xmlChar *uri, int nsCount, const xmlChar **ns, int attrCount, int defaulted, const xmlChar **attrs)
+{
+  // attrs holds (localname, prefix, uri, value, end) for each attribute;
+  // the values are not terminated, hence the copying below.
+  static const enum xml_name path[] = { XML_RESPONSE, XML_DATA, XML_METAR };
+  struct metar_parser *p = (struct metar_parser *)ctx;
+  enum xml_name code;
+  size_t *spans;
+  char value[METAR_TINYBUFSIZE];
+  size_t len, size;
+  int k;
+
+  if ( p->error != 0 ) return;
+  ++p->depth;
+
+  // only names the parser might act on are worth looking up
+  code = XML_UNKNOWN;
+  if ( (p->depth <= 4) || ((p->depth == 5) && p->flags) )
+    code = lookupXmlName(name, strlen(name));
+
+  if ( (p->depth <= 3) && (p->matched == p->depth - 1) )
+  {
+    if ( code == path[p->depth - 1] )
+      p->matched = p->depth;
+
+    if ( p->matched == 3 )
+    {
+      // a new report
+      if ( p->reports.count == p->size )
+      {
+        size = p->size ? p->size * 2 : 16;
+        spans = (size_t *)realloc(p->spans, sizeof(size_t) * 2 * size);
+        if ( !spans )
+        {
+          p->error = -2;
+          return;
+        }
+        p->spans = spans;
+        p->size = size;
+      }
+      init_metar(&p->current);
+      p->spans[p->reports.count * 2] = p->echo.len;
+    }
+  }
+
+  if ( p->matched < 3 ) return;
+
+  if ( p->echo.data )
+  {
+    metarParserEcho(p, "<", 1, 0);
+    metarParserEcho(p, name, strlen(name), 0);
+    for ( k = 0; k < attrCount; ++k )
+    {
+      metarParserEcho(p, " ", 1, 0);
+      metarParserEcho(p, attrs[k * 5], strlen(attrs[k * 5]), 0);
+      metarParserEcho(p, "=\"", 2, 0);
+      metarParserEcho(p, attrs[k * 5 + 3], attrs[k * 5 + 4] - attrs[k * 5 + 3], 2);
+      metarParserEcho(p, "\"", 1, 0);
+    }
+    metarParserEcho(p, ">", 1, 0);
+  }
+
+  if ( p->depth == 4 )
+  {
+    if ( (code == XML_SKY_CONDITION) && (p->fields & (1UL << XML_SKY_CONDITION)) )
+    {
+      for ( k = 0; k < attrCount; ++k )
+      {
+        len = attrs[k * 5 + 4] - attrs[k * 5 + 3];
+        if ( len >= METAR_TINYBUFSIZE ) len = METAR_TINYBUFSIZE - 1;
+        memcpy(value, attrs[k * 5 + 3], len);
+        value[len] = '\0';
+        setMetarSkyCondition(&p->current, lookupXmlName(attrs[k * 5], strlen(attrs[k * 5])), value);
+      }
+    }
+    p->flags = (code == XML_QUALITY_CONTROL_FLAGS) && (p->fields & (1UL << XML_QUALITY_CONTROL_FLAGS));
+  }
+
+  // text is kept only for the fields there's somewhere to put it, and
+  // that something will use
+  if ( (p->depth == 4) && (code >= XML_RAW_TEXT) && (code <= XML_ELEVATION_M) && (p->fields & (1UL << code)) )
+    p->element = code;
+  else if ( (p->depth == 5) && p->flags && (code >= XML_CORRECTED) && (code <= XML_PRESENT_WEATHER_SENSOR_OFF) )
+    p->element = code;
+  else
+    p->element = XML_UNKNOWN;
+  p->textLen = 0;
+  p->text[0] = '\0';
+}
+
+void metarParserEnd(void *ctx, const xmlChar *name, const xmlChar *prefix, const xmlChar *uri)
+{
+  struct metar_parser *p = (struct metar_parser *)ctx;
+
+  if ( p->error != 0 ) return;
+
+  if ( (p->matched == 3) && (p->depth >= 3) )
+  {
+    if ( p->echo.data )
+    {
+      metarParserEcho(p, "</", 2, 0);
+      metarParserEcho(p, name, strlen(name), 0);
+      metarParserEcho(p, ">", 1, 0);
+    }
+
+    if ( (p->depth == 5) && p->flags )
+      setMetarQualityFlag(&p->current, p->element, p->text);
+    else if ( (p->depth == 4) && !p->flags )
+      setMetarField(&p->current, p->element, p->text);
+    else if ( p->depth == 4 )
+      p->flags = 0;
+    else if ( p->depth == 3 )
+    {
+      p->spans[p->reports.count * 2 + 1] = p->echo.len;
+      if ( packMetar(&p->reports, &p->current) != 0 )
+        p->error = -2;
+    }
+    p->element = XML_UNKNOWN;
+  }
+
+  if ( p->matched == p->depth ) --p->matched;
+  --p->depth;
+}
+
+void metarParserText(void *ctx, const xmlChar *text, int len)
+{
+  struct metar_parser *p = (struct metar_parser *)ctx;
+  size_t room;
+
+  if ( (p->error != 0) || (p->matched < 3) ) return;
+
+  metarParserEcho(p, text, len, 1);
+
+  // element text may arrive in pieces
+  if ( p->element != XML_UNKNOWN )
+  {
+    room = METAR_BUFSIZE - 1 - p->textLen;
+    if ( (size_t)len < room ) room = len;
+    memcpy(&p->text[p->textLen], text, room);
+    p->textLen += room;
+    p->text[p->textLen] = '\0';
+  }
+}
+
+const struct format_name formatNames[] =
+{
+  { "raw_text", FORMAT_RAW_TEXT },
+  { "station_id", FORMAT_STATION_ID },
+  { "observation_time", FORMAT_OBSERVATION_TIME },
+  { "observation_localtime", FORMAT_OBSERVATION_LOCALTIME },
+  { "observation_time_local", FORMAT_OBSERVATION_LOCALTIME }, // as the help text has it
+  { "latitude", FORMAT_LATITUDE },
+  { "longitude", FORMAT_LONGITUDE },
+  { "temp_c", FORMAT_TEMP_C },
+  { "temp_f", FORMAT_TEMP_F },
+  { "dewpoint_c", FORMAT_DEWPOINT_C },
+  { "dewpoint_f", FORMAT_DEWPOINT_F },
+  { "wind_dir_degrees", FORMAT_WIND_DIR_DEGREES },
+  { "wind_speed_kt", FORMAT_WIND_SPEED_KT },
+  { "wind_gust_kt", FORMAT_WIND_GUST_KT },
+  { "visibility_statute_mi", FORMAT_VISIBILITY_STATUTE_MI },
+  { "altim_in_hg", FORMAT_ALTIM_IN_HG },
+  { "sea_level_pressure_mb", FORMAT_SEA_LEVEL_PRESSURE_MB },
+  { "wx_string", FORMAT_WX_STRING },
+  { "three_hr_pressure_tendency_mb", FORMAT_THREE_HR_PRESSURE_TENDENCY_MB },
+  { "maxT_c", FORMAT_MAXT_C },
+  { "minT_c", FORMAT_MINT_C },
+  { "maxT24hr_c", FORMAT_MAXT24HR_C },
+  { "minT24hr_c", FORMAT_MINT24HR_C },
+  { "precip_in", FORMAT_PRECIP_IN },
+  { "pcp3hr_in", FORMAT_PCP3HR_IN },
+  { "pcp6hr_in", FORMAT_PCP6HR_IN },
+  { "pcp24hr_in", FORMAT_PCP24HR_IN },
+  { "snow_in", FORMAT_SNOW_IN },
+  { "vert_vis_ft", FORMAT_VERT_VIS_FT },
+  { "elevation_m", FORMAT_ELEVATION_M },
+  { "quality_control_flags", FORMAT_QUALITY_CONTROL_FLAGS },
+  { "sky_condition", FORMAT_SKY_CONDITION },
+  { "sky_conditions", FORMAT_SKY_CONDITION }, // as the help text has it
+  { "metar_type", FORMAT_METAR_TYPE },
+  { "flight_category", FORMAT_FLIGHT_CATEGORY },
+  { NULL, FORMAT_LITERAL }
+};
+
+// the <METAR> child each -f field is made from
+const enum xml_name formatSources[] =
+{
+  [FORMAT_LITERAL] = XML_UNKNOWN,
+  [FORMAT_RAW_TEXT] = XML_RAW_TEXT,
+  [FORMAT_STATION_ID] = XML_STATION_ID,
+  [FORMAT_OBSERVATION_TIME] = XML_OBSERVATION_TIME,
+  [FORMAT_OBSERVATION_LOCALTIME] = XML_OBSERVATION_TIME,
+  [FORMAT_LATITUDE] = XML_LATITUDE,
+  [FORMAT_LONGITUDE] = XML_LONGITUDE,
+  [FORMAT_TEMP_C] = XML_TEMP_C,
+  [FORMAT_TEMP_F] = XML_TEMP_C,
+  [FORMAT_DEWPOINT_C] = XML_DEWPOINT_C,
+  [FORMAT_DEWPOINT_F] = XML_DEWPOINT_C,
+  [FORMAT_WIND_DIR_DEGREES] = XML_WIND_DIR_DEGREES,
+  [FORMAT_WIND_SPEED_KT] = XML_WIND_SPEED_KT,
+  [FORMAT_WIND_GUST_KT] = XML_WIND_GUST_KT,
+  [FORMAT_VISIBILITY_STATUTE_MI] = XML_VISIBILITY_STATUTE_MI,
+  [FORMAT_ALTIM_IN_HG] = XML_ALTIM_IN_HG,
+  [FORMAT_SEA_LEVEL_PRESSURE_MB] = XML_SEA_LEVEL_PRESSURE_MB,
+  [FORMAT_WX_STRING] = XML_WX_STRING,
+  [FORMAT_THREE_HR_PRESSURE_TENDENCY_MB] = XML_THREE_HR_PRESSURE_TENDENCY_MB,
+  [FORMAT_MAXT_C] = XML_MAXT_C,
+  [FORMAT_MINT_C] = XML_MINT_C,
+  [FORMAT_MAXT24HR_C] = XML_MAXT24HR_C,
+  [FORMAT_MINT24HR_C] = XML_MINT24HR_C,
+  [FORMAT_PRECIP_IN] = XML_PRECIP_IN,
+  [FORMAT_PCP3HR_IN] = XML_PCP3HR_IN,
+  [FORMAT_PCP6HR_IN] = XML_PCP6HR_IN,
+  [FORMAT_PCP24HR_IN] = XML_PCP24HR_IN,
+  [FORMAT_SNOW_IN] = XML_SNOW_IN,
+  [FORMAT_VERT_VIS_FT] = XML_VERT_VIS_FT,
+  [FORMAT_ELEVATION_M] = XML_ELEVATION_M,
+  [FORMAT_QUALITY_CONTROL_FLAGS] = XML_QUALITY_CONTROL_FLAGS,
+  [FORMAT_SKY_CONDITION] = XML_SKY_CONDITION,
+  [FORMAT_METAR_TYPE] = XML_METAR_TYPE,
+  [FORMAT_FLIGHT_CATEGORY] = XML_FLIGHT_CATEGORY
+};
+
+int findMetarRecords(const char *restrict data, size_t **restrict records, size_t *restrict count)
+{
+  // finds where each <METAR> element begins and ends in a response, without
+  // parsing it; records gets a (start, end) pair per element.  data must be
+  // NUL-terminated.  decodeMetars() double-checks the result against the
+  // parser's, so this only has to be right for what the service sends.
+  const char *cur, *end;
+  size_t *grown, size, n;
+
+  *records = NULL;
+  size = n = 0;
+  for ( cur = strstr(data, "<METAR"); cur; cur = strstr(end, "<METAR") )
+  {
+    end = cur + 6;
+    if ( (*end != '>') && (*end != '/') && !isspace((unsigned char)*end) )
+      continue;
+
+    end = strchr(end, '>');
+    if ( !end ) break;
+    if ( end[-1] != '/' )
+    {
+      end = strstr(end, "</METAR>");
+      if ( !end ) break;
+      end += 7;
+    }
+    ++end;
+
+    if ( n == size )
+    {
+      size = size ? size * 2 : 256;
+      grown = (size_t *)realloc(*records, sizeof(size_t) * 2 * size);
+      if ( !grown )
+      {
+        free(*records);
+        *records = NULL;
+        return -1;
+      }
+      *records = grown;
+    }
+    (*records)[n * 2] = cur - data;
+    (*records)[n * 2 + 1] = end - data;
+    ++n;
+  }
+
+  *count = n;
+  return 0;
+}
+
+void *runDecodeJob(void *arg)
+{
+  // one worker's share: the document with everyone else's reports cut out
+  struct decode_job *job = (struct decode_job *)arg;
+
+  if ( (feedMetarParser(job->parser, job->head, job->headLen) == 0)
+    && (feedMetarParser(job->parser, job->body, job->bodyLen) == 0)
+    && (feedMetarParser(job->parser, job->tail, job->tailLen) == 0) )
+    job->result = finishMetarParser(job->parser);
+  else
+    job->result = -2;
+
+  return NULL;
+}
+
+int decodeMetars(struct metar_parser *restrict p, const char *restrict data, size_t len, int threads)
+{
+  // decodes a whole, already retrieved response into p (which must be fresh
+  // or reset), splitting its reports across up to threads workers.  each
+  // worker parses the response's head and tail around a contiguous run of
+  // reports, which is itself a well-formed response, and the runs are
+  // stitched back together in document order, so the result is exactly
+  // what feeding p the response would give.  returns as finishMetarParser().
+  struct decode_job *jobs;
+  pthread_t *tids;
+  size_t *records, *spans;
+  size_t count, first, last, k, r;
+  int workers, w, ret;
+
+  if ( findMetarRecords(data, &records, &count) != 0 ) return -2;
+
+  workers = threads;
+  if ( (size_t)workers > count / METAR_DECODEMIN ) workers = (int)(count / METAR_DECODEMIN);
+  if ( workers < 2 )
+  {
+    if ( records ) free(records);
+    if ( feedMetarParser(p, data, len) != 0 ) return -2;
+    return finishMetarParser(p);
+  }
+
+  jobs = (struct decode_job *)calloc(workers, sizeof(struct decode_job));
+  tids = (pthread_t *)calloc(workers, sizeof(pthread_t));
+  ret = (jobs && tids) ? 0 : -2;
+
+  for ( w = 0; (w < workers) && (ret == 0); ++w )
+  {
+    first = count * w / workers;
+    last = count * (w + 1) / workers;
+    jobs[w].parser = newMetarParser(0, p->fields);
+    if ( !jobs[w].parser )
+    {
+      ret = -2;
+      break;
+    }
+    jobs[w].head = data;
+    jobs[w].headLen = records[0];
+    jobs[w].body = &data[records[first * 2]];
+    jobs[w].bodyLen = records[(last - 1) * 2 + 1] - records[first * 2];
+    jobs[w].tail = &data[records[count * 2 - 1]];
+    jobs[w].tailLen = len - records[count * 2 - 1];
+    jobs[w].count = last - first;
+  }
+
+  if ( ret == 0 )
+  {
+    // the first share is this thread's; any worker that won't start runs
+    // here too, just later
+    for ( w = 1; w < workers; ++w )
+      jobs[w].started = (pthread_create(&tids[w], NULL, runDecodeJob, (void *)&jobs[w]) == 0);
+    runDecodeJob((void *)&jobs[0]);
+    for ( w = 1; w < workers; ++w )
+    {
+      if ( jobs[w].started )
+        pthread_join(tids[w], NULL);
+      else
+        runDecodeJob((void *)&jobs[w]);
+    }
+
+    for ( w = 0; w < workers; ++w )
+    {
+      if ( jobs[w].result == -2 )
+        ret = -2;
+      else if ( (ret == 0) && ((jobs[w].result < 0) || ((size_t)jobs[w].result != jobs[w].count)) )
+        ret = -1; // not what the scan promised; start over the slow way
+    }
+  }
+
+  if ( ret == 0 )
+  {
+    if ( p->size < count )
+    {
+      spans = (size_t *)realloc(p->spans, sizeof(size_t) * 2 * count);
+      if ( spans )
+      {
+        p->spans = spans;
+        p->size = count;
+      }
+      else
+        ret = -2;
+    }
+
+    // the raw text of each report stands in for its re-serialization
+    for ( w = 0, r = 0; (w < workers) && (ret == 0); ++w )
+    {
+      for ( k = 0; (k < jobs[w].parser->reports.count) && (ret == 0); ++k, ++r )
+      {
+        if ( copyPackedMetar(&p->reports, &jobs[w].parser->reports, k) != 0 )
+          ret = -2;
+        else if ( p->echo.data )
+        {
+          p->spans[r * 2] = p->echo.len;
+          if ( writeDocument((void *)&data[records[r * 2]], 1, records[r * 2 + 1] - records[r * 2], (void *)&p->echo) == 0 )
+            ret = -2;
+          p->spans[r * 2 + 1] = p->echo.len;
+        }
+      }
+    }
+  }
+
+  if ( jobs )
+  {
+    for ( w = 0; w < workers; ++w )
+      freeMetarParser(jobs[w].parser);
+    free(jobs);
+  }
+  if ( tids ) free(tids);
+  free(records);
+
+  if ( ret == -1 )
+  {
+    resetMetarParser(p);
+    if ( feedMetarParser(p, data, len) != 0 ) return -2;
+    return finishMetarParser(p);
+  }
+  if ( ret != 0 )
+  {
+    p->error = -2;
+    return -2;
+  }
+  return (int)p->reports.count;
+}
+
+int compileFormat(struct metar_format *restrict fmt, const char *restrict format)
+{
+  // splits the format string into literal runs and {field} references
+  // once, up front.  literal tokens point into format, which must outlive
+  // fmt.  unrecognized {names} are kept as literal text.
+  const char *p, *q, *open, *close;
+  size_t k, max;
+
+  // at most one field per '{', plus a literal on either side of each
+  for ( max = 1, p = format; *p; ++p )
+    if ( *p == '{' )
+      max += 2;
+
+  fmt->count = 0;
+  fmt->where = NULL;
+  fmt->tokens = (struct format_token *)malloc(sizeof(struct format_token) * max);
+  fmt->out = (char *)malloc(METAR_BIGBUFSIZE);
+  if ( !fmt->tokens || !fmt->out )
+  {
+    freeFormat(fmt);
+    return -1;
+  }
+
+  for ( p = format; *p; p = close )
+  {
+    // the literal run up to the next {name}
+    open = strchr(p, '{');
+    close = open ? strchr(open, '}') : NULL;
+    if ( !close )
+      close = open = p + strlen(p);
+    else
+      ++close;
+
+    // "{{name}" is a literal brace followed by a field
+    while ( (open < close) && (q = memchr(open + 1, '{', close - open - 1)) != NULL )
+      open = q;
+
+    for ( k = 0; (open < close) && formatNames[k].name; ++k )
+    {
+      if ( (strlen(formatNames[k].name) == (size_t)(close - open - 2))
+        && (strncmp(formatNames[k].name, open + 1, close - open - 2) == 0) )
+        break;
+    }
+
+    if ( (open < close) && !formatNames[k].name )
+      open = close; // not a field after all
+
+    if ( open > p )
+    {
+      if ( (fmt->count > 0) && (fmt->tokens[fmt->count - 1].field == FORMAT_LITERAL) )
+      {
+        fmt->tokens[fmt->count - 1].len += open - p;
+      }
+      else
+      {
+        fmt->tokens[fmt->count].field = FORMAT_LITERAL;
+        fmt->tokens[fmt->count].text = p;
+        fmt->tokens[fmt->count].len = open - p;
+        ++fmt->count;
+      }
+    }
+
+    if ( open < close )
+    {
+      fmt->tokens[fmt->count].field = formatNames[k].field;
+      fmt->tokens[fmt->count].text = NULL;
+      fmt->tokens[fmt->count].len = 0;
+      ++fmt->count;
+    }
+  }
+
+  return 0;
+}
+
+void freeFormat(struct metar_format *fmt)
+{
+  if ( fmt->tokens ) free(fmt->tokens);
+  if ( fmt->out ) free(fmt->out);
+  fmt->tokens = NULL;
+  fmt->out = NULL;
+  fmt->count = 0;
+}
+
+uint32_t formatFields(const struct metar_format *fmt, int flags)
+{
+  // the <METAR> children that output with flags (and fmt, for -f) is made
+  // from, as a projection's fields.  the id, time and type are always kept: they
+  // sort combined responses out and say when the next report is due.
+  uint32_t fields;
+  size_t k;
+
+  if ( (flags & (METARFLAG_SPECIAL | METARFLAG_JSONL | METARFLAG_BINARY)) != 0 )
+    return METAR_FIELDS_ALL; // -d shows nearly everything, and --output all of it
+
+  fields = (1UL << XML_STATION_ID) | (1UL << XML_OBSERVATION_TIME) | (1UL << XML_METAR_TYPE);
+  if ( (flags & METARFLAG_DECODED) != METARFLAG_DECODED )
+    return fields | (1UL << XML_RAW_TEXT);
+
+  for ( k = 0; k < fmt->count; ++k )
+    fields |= 1UL << formatSources[fmt->tokens[k].field];
+  return fields & METAR_FIELDS_ALL;
+}
+
+void projectionQuery(char *restrict dest, size_t size, int batched, const struct metar_projection *restrict wanted)
+{
+  // the query parameters that have the service send only what wanted
+  // keeps: "" if that's everything
+  size_t len, k;
+  int code;
+
+  dest[0] = '\0';
+  len = 0;
+  if ( wanted->fields != METAR_FIELDS_ALL )
+  {
+    len = snprintf(dest, size, "&fields=");
+    for ( code = XML_RAW_TEXT; code <= XML_QUALITY_CONTROL_FLAGS; ++code )
+    {
+      if ( !(wanted->fields & (1UL << code)) ) continue;
+      for ( k = 0; (k < METAR_XMLNAMES) && !(xmlNames[k].name && (xmlNames[k].code == code)); ++k ) ;
+      if ( (k < METAR_XMLNAMES) && (len < size) )
+        len += snprintf(&dest[len], size - len, "%s%s", (dest[len - 1] == '=') ? "" : ",", xmlNames[k].name);
+    }
+  }
+  if ( wanted->latest && (len < size) )
+    snprintf(&dest[len], size - len, batched ? "&mostRecentForEachStation=constraint" : "&mostRecent=true");
+}
+
+int coversProjection(uint32_t fields, uint32_t latest, const struct metar_projection *wanted)
+{
+  // whether reports retrieved with that projection have everything wanted
+  // does
+  return ((fields & wanted->fields) == wanted->fields) && (!latest || wanted->latest);
+}
+
+int compileFilter(struct metar_filter *restrict f, const char *restrict expr)
+{
+  // compiles a --where expression into postfix once, up front.  a test is
+  // a field by its -f name, alone (the report has it) or followed by one
+  // of = != < <= > >= ~ (has) and a value; tests are joined by and (&&
+  // or ","), or (||) and not (!), with parentheses.  text values point
+  // into expr, which must outlive f.  returns 0, -1 if out of memory, or
+  // one more than how far into expr it stops making sense.
+  const char *p, *start;
+  size_t max;
+
+  // every op takes up at least a character of expr
+  max = strlen(expr) + 1;
+  f->count = 0;
+  f->ops = (struct filter_op *)malloc(sizeof(struct filter_op) * max);
+  f->stack = (char *)malloc(max);
+  if ( !f->ops || !f->stack )
+  {
+    freeFilter(f);
+    return -1;
+  }
+
+  p = expr;
+  if ( (compileFilterExpr(f, &p, 0) == 0) && (nextFilterToken(p, &start) == 0) )
+    return 0;
+
+  nextFilterToken(p, &start);
+  freeFilter(f);
+  return (int)(start - expr) + 1;
+}
+
+int compileFilterExpr(struct metar_filter *restrict f, const char **restrict p, int level)
+{
+  // level 0 is a run of ors, 1 of ands, and 2 a not, a parenthesis or a
+  // test.  on failure, *p is left before what doesn't fit.
+  const char *start;
+  size_t len;
+
+  if ( level == 2 )
+  {
+    len = nextFilterToken(*p, &start);
+    if ( isFilterWord(start, len, "not") || isFilterWord(start, len, "!") )
+    {
+      *p = start + len;
+      if ( compileFilterExpr(f, p, 2) != 0 ) return -1;
+      f->ops[f->count++].code = FILTER_NOT;
+      return 0;
+    }
+    if ( isFilterWord(start, len, "(") )
+    {
+      *p = start + len;
+      if ( compileFilterExpr(f, p, 0) != 0 ) return -1;
+      len = nextFilterToken(*p, &start);
+      if ( !isFilterWord(start, len, ")") ) return -1;
+      *p = start + len;
+      return 0;
+    }
+    return compileFilterTest(f, p);
+  }
+
+  if ( compileFilterExpr(f, p, level + 1) != 0 ) return -1;
+  for ( ;; )
+  {
+    len = nextFilterToken(*p, &start);
+    if ( (level == 0) ? !(isFilterWord(start, len, "or") || isFilterWord(start, len, "||"))
+      : !(isFilterWord(start, len, "and") || isFilterWord(start, len, "&&") || isFilterWord(start, len, ",")) )
+      return 0;
+    *p = start + len;
+    if ( compileFilterExpr(f, p, level + 1) != 0 ) return -1;
+    f->ops[f->count++].code = (level == 0) ? FILTER_OR : FILTER_AND;
+  }
+}
+
+int compileFilterTest(struct metar_filter *restrict f, const char **restrict p)
+{
+  // <field>, or <field> <op> <value>.  flight categories, report types
+  // and quality control flags are compared by name, text by substring
+  // (~) or whole (= and !=), regardless of case; the rest are numbers.
+  static const char *const comparisons[] = { "", "=", "!=", "<", "<=", ">", ">=", "~" }; // by filter_code
+  static const char *const categories[] = { "VFR", "MVFR", "IFR", "LIFR" }; // by flight_rules
+  static const char *const types[] = { "METAR", "SPECI" }; // by metar_type_info
+  char number[METAR_TINYBUFSIZE], *end;
+  const char *start, *value, *next;
+  struct filter_op *op;
+  enum xml_name flag;
+  size_t len, k;
+
+  len = nextFilterToken(*p, &start);
+  for ( k = 0; formatNames[k].name; ++k )
+    if ( (strlen(formatNames[k].name) == len) && (strncmp(formatNames[k].name, start, len) == 0) )
+      break;
+  if ( !formatNames[k].name
+    || (formatNames[k].field == FORMAT_OBSERVATION_TIME)
+    || (formatNames[k].field == FORMAT_OBSERVATION_LOCALTIME)
+    || (formatNames[k].field == FORMAT_SKY_CONDITION) )
+    return -1; // times and sky conditions have nothing to compare them with
+
+  op = &f->ops[f->count];
+  op->code = FILTER_PRESENT;
+  op->field = formatNames[k].field;
+  op->number = 0.0;
+  op->text = NULL;
+  op->len = 0;
+  *p = start + len;
+
+  len = nextFilterToken(*p, &start);
+  for ( k = FILTER_EQ; (k <= FILTER_HAS) && !isFilterWord(start, len, comparisons[k]); ++k ) ;
+  if ( isFilterWord(start, len, "==") ) k = FILTER_EQ;
+  if ( k > FILTER_HAS )
+  {
+    ++f->count; // just whether it's there
+    return 0;
+  }
+  op->code = (enum filter_code)k;
+  *p = start + len;
+
+  len = nextFilterToken(*p, &start);
+  next = start + len;
+  value = start;
+  if ( (len >= 2) && (start[0] == '"') && (start[len - 1] == '"') )
+  {
+    value = start + 1;
+    len -= 2;
+  }
+  else if ( (len == 0) || strchr("\"()<>=!~&|,", start[0]) )
+    return -1;
+
+  switch ( op->field )
+  {
+    case FORMAT_RAW_TEXT:
+    case FORMAT_STATION_ID:
+    case FORMAT_WX_STRING:
+      if ( (op->code != FILTER_EQ) && (op->code != FILTER_NE) && (op->code != FILTER_HAS) ) return -1;
+      op->text = value;
+      op->len = len;
+      break;
+    case FORMAT_FLIGHT_CATEGORY:
+      for ( k = 0; (k < 4) && !isFilterWord(value, len, categories[k]); ++k ) ;
+      if ( (k == 4) || (op->code == FILTER_HAS) ) return -1;
+      op->number = (double)k; // ordered from best to worst
+      break;
+    case FORMAT_METAR_TYPE:
+      for ( k = 0; (k < 2) && !isFilterWord(value, len, types[k]); ++k ) ;
+      if ( (k == 2) || ((op->code != FILTER_EQ) && (op->code != FILTER_NE)) ) return -1;
+      op->number = (double)k;
+      break;
+    case FORMAT_QUALITY_CONTROL_FLAGS:
+      // by their names in <quality_control_flags>; see METAR_QUALITY_*
+      flag = lookupXmlName(value, len);
+      if ( (op->code != FILTER_HAS) || (flag < XML_CORRECTED) || (flag > XML_PRESENT_WEATHER_SENSOR_OFF) ) return -1;
+      op->number = (double)(1 << (flag - XML_CORRECTED));
+      break;
+    default:
+      if ( (op->code == FILTER_HAS) || (len >= METAR_TINYBUFSIZE) ) return -1;
+      memcpy(number, value, len);
+      number[len] = '\0';
+      op->number = strtod(number, &end);
+      if ( (len == 0) || (end != &number[len]) ) return -1;
+      op->number = (double)(float)op->number; // as the report has it
+      break;
+  }
+
+  *p = next;
+  ++f->count;
+  return 0;
+}
+
+size_t nextFilterToken(const char *restrict p, const char **restrict start)
+{
+  // the length of the token at p, which *start is set to after any space:
+  // a word, a "quoted value", an operator or a parenthesis.  0 at the end.
+  const char *q;
+
+  while ( isspace((unsigned char)*p) ) ++p;
+  *start = p;
+  if ( *p == '"' )
+  {
+    q = strchr(p + 1, '"');
+    return q ? (size_t)(q - p) + 1 : strlen(p);
+  }
+
+  for ( q = p; isalnum((unsigned char)*q) || ((*q != '\0') && strchr("_.+-/", *q)); ++q ) ;
+  if ( q > p ) return q - p;
+  if ( *p == '\0' ) return 0;
+  if ( ((p[0] == '&') && (p[1] == '&')) || ((p[0] == '|') && (p[1] == '|'))
+    || (strchr("<>=!", p[0]) && (p[1] == '=')) )
+    return 2;
+  return 1;
+}
+
+int isFilterWord(const char *restrict token, size_t len, const char *restrict word)
+{
+  return (strlen(word) == len) && (strncasecmp(token, word, len) == 0);
+}
+
+void freeFilter(struct metar_filter *f)
+{
+  if ( f->ops ) free(f->ops);
+  if ( f->stack ) free(f->stack);
+  f->ops = NULL;
+  f->stack = NULL;
+  f->count = 0;
+}
+
+uint32_t filterFields(const struct metar_filter *f)
+{
+  // the <METAR> children f's tests look at, as a projection's fields
+  uint32_t fields;
+  size_t k;
+
+  fields = 0;
+  for ( k = 0; k < f->count; ++k )
+    if ( f->ops[k].code < FILTER_AND )
+      fields |= 1UL << formatSources[f->ops[k].field];
+  return fields & METAR_FIELDS_ALL;
+}
+
+int filterField(const struct metar *restrict w, enum format_field field, double *restrict number, const char **restrict text)
+{
+  // a report's value for a test, in number or text.  0 if it has none:
+  // missing numbers are NaN or negative, as init_metar() leaves them.
+  *text = NULL;
+  *number = NAN;
+  switch ( field )
+  {
+    case FORMAT_RAW_TEXT: *text = w->raw_text; break;
+    case FORMAT_STATION_ID: *text = w->station_id; break;
+    case FORMAT_WX_STRING: *text = w->wx_string; break;
+    case FORMAT_LATITUDE: *number = w->latitude; break;
+    case FORMAT_LONGITUDE: *number = w->longitude; break;
+    case FORMAT_TEMP_C: *number = w->temp_c; break;
+    case FORMAT_TEMP_F: *number = w->temp_c * 9.0f/5.0f + 32.0f; break;
+    case FORMAT_DEWPOINT_C: *number = w->dewpoint_c; break;
+    case FORMAT_DEWPOINT_F: *number = w->dewpoint_c * 9.0f/5.0f + 32.0f; break;
+    case FORMAT_VISIBILITY_STATUTE_MI: *number = w->visibility_statute_mi; break;
+    case FORMAT_ALTIM_IN_HG: *number = w->altim_in_hg; break;
+    case FORMAT_SEA_LEVEL_PRESSURE_MB: *number = w->sea_level_pressure_mb; break;
+    case FORMAT_THREE_HR_PRESSURE_TENDENCY_MB: *number = w->three_hr_pressure_tendency_mb; break;
+    case FORMAT_MAXT_C: *number = w->maxT_c; break;
+    case FORMAT_MINT_C: *number = w->minT_c; break;
+    case FORMAT_MAXT24HR_C: *number = w->maxT24hr_c; break;
+    case FORMAT_MINT24HR_C: *number = w->minT24hr_c; break;
+    case FORMAT_PRECIP_IN: *number = w->precip_in; break;
+    case FORMAT_PCP3HR_IN: *number = w->pcp3hr_in; break;
+    case FORMAT_PCP6HR_IN: *number = w->pcp6hr_in; break;
+    case FORMAT_PCP24HR_IN: *number = w->pcp24hr_in; break;
+    case FORMAT_SNOW_IN: *number = w->snow_in; break;
+    case FORMAT_ELEVATION_M: *number = w->elevation_m; break;
+    case FORMAT_WIND_DIR_DEGREES: if ( w->wind_dir_degrees >= 0 ) *number = w->wind_dir_degrees; break;
+    case FORMAT_WIND_SPEED_KT: if ( w->wind_speed_kt >= 0 ) *number = w->wind_speed_kt; break;
+    case FORMAT_WIND_GUST_KT: if ( w->wind_gust_kt >= 0 ) *number = w->wind_gust_kt; break;
+    case FORMAT_VERT_VIS_FT: if ( w->vert_vis_ft >= 0 ) *number = w->vert_vis_ft; break;
+    case FORMAT_QUALITY_CONTROL_FLAGS: if ( w->quality_control_flags != 0 ) *number = w->quality_control_flags; break;
+    case FORMAT_FLIGHT_CATEGORY: if ( w->flight_category != METAR_CATEGORY_UNKNOWN ) *number = w->flight_category; break;
+    case FORMAT_METAR_TYPE: if ( w->metar_type != METAR_TYPE_UNKNOWN ) *number = w->metar_type; break;
+    default: break;
+  }
+
+  return *text ? ((*text)[0] != '\0') : !isnan(*number);
+}
+
+int matchesFilter(const struct metar_filter *restrict f, const struct metar *restrict w)
+{
+  // one pass over the postfix ops.  a test of something the report
+  // doesn't have fails, whatever it compares.
+  const struct filter_op *op;
+  const char *text;
+  double number;
+  size_t k, n, j;
+  int result;
+
+  for ( n = k = 0; k < f->count; ++k )
+  {
+    op = &f->ops[k];
+    if ( op->code == FILTER_AND )
+    {
+      --n;
+      f->stack[n - 1] = f->stack[n - 1] && f->stack[n];
+      continue;
+    }
+    if ( op->code == FILTER_OR )
+    {
+      --n;
+      f->stack[n - 1] = f->stack[n - 1] || f->stack[n];
+      continue;
+    }
+    if ( op->code == FILTER_NOT )
+    {
+      f->stack[n - 1] = !f->stack[n - 1];
+      continue;
+    }
+
+    result = filterField(w, op->field, &number, &text);
+    if ( result && text )
+    {
+      if ( op->code == FILTER_HAS )
+      {
+        for ( result = 0, j = 0; !result && (text[j] != '\0'); ++j )
+          result = (strncasecmp(&text[j], op->text, op->len) == 0);
+      }
+      else if ( op->code != FILTER_PRESENT )
+        result = ((strlen(text) == op->len) && (strncasecmp(text, op->text, op->len) == 0)) == (op->code == FILTER_EQ);
+    }
+    else if ( result )
+    {
+      switch ( op->code )
+      {
+        case FILTER_EQ: result = (number == op->number); break;
+        case FILTER_NE: result = (number != op->number); break;
+        case FILTER_LT: result = (number < op->number); break;
+        case FILTER_LE: result = (number <= op->number); break;
+        case FILTER_GT: result = (number > op->number); break;
+        case FILTER_GE: result = (number >= op->number); break;
+        case FILTER_HAS: result = (((int)number & (int)op->number) != 0); break;
+        default: break;
+      }
+    }
+    f->stack[n++] = (char)result;
+  }
+
+  return (n > 0) ? f->stack[0] : 1;
+}
+
+const char *renderFormat(struct metar_format *restrict fmt, const struct metar *restrict w, int color, size_t *restrict len)
+{
+  // one pass over the tokens, straight into fmt->out
+  char buf[METAR_BUFSIZE];
+  const char *src;
+  size_t t, k, pos, n;
+  struct tm when;
+  int ival, digits;
+  float fval;
+
+  pos = 0;
+  for ( t = 0; t < fmt->count; ++t )
+  {
+    src = buf;
+    n = (size_t)-1;
+    buf[0] = '\0';
+    ival = -1;
+    fval = 0.0f / 0.0f; // NaN
+    digits = 0;
+
+    switch ( fmt->tokens[t].field )
+    {
+      case FORMAT_LITERAL:
+        src = fmt->tokens[t].text;
+        n = fmt->tokens[t].len;
+        break;
+      case FORMAT_RAW_TEXT: src = w->raw_text; break;
+      case FORMAT_STATION_ID: src = w->station_id; break;
+      case FORMAT_WX_STRING: src = w->wx_string; break;
+      case FORMAT_OBSERVATION_TIME:
+      case FORMAT_OBSERVATION_LOCALTIME:
+        if ( w->observation_time == 0 )
+          src = "(unknown)";
+        else if ( fmt->tokens[t].field == FORMAT_OBSERVATION_TIME )
+          strftime(buf, METAR_BUFSIZE, "%Y-%m-%d %H:%M:%S (UTC)", gmtime_r(&w->observation_time, &when));
+        else
+          strftime(buf, METAR_BUFSIZE, "%Y-%m-%d %H:%M:%S (local)", localtime_r(&w->observation_time, &when));
+        break;
+      case FORMAT_LATITUDE: fval = w->latitude; digits = 2; break;
+      case FORMAT_LONGITUDE: fval = w->longitude; digits = 2; break;
+      case FORMAT_TEMP_C: fval = w->temp_c; digits = 1; break;
+      case FORMAT_TEMP_F: fval = w->temp_c * 9.0f/5.0f + 32.0f; digits = 1; break;
+      case FORMAT_DEWPOINT_C: fval = w->dewpoint_c; digits = 1; break;
+      case FORMAT_DEWPOINT_F: fval = w->dewpoint_c * 9.0f/5.0f + 32.0f; digits = 1; break;
+      case FORMAT_VISIBILITY_STATUTE_MI: fval = w->visibility_statute_mi; digits = 1; break;
+      case FORMAT_ALTIM_IN_HG: fval = w->altim_in_hg; digits = 2; break;
+      case FORMAT_SEA_LEVEL_PRESSURE_MB: fval = w->sea_level_pressure_mb; digits = 2; break;
+      case FORMAT_THREE_HR_PRESSURE_TENDENCY_MB: fval = w->three_hr_pressure_tendency_mb; digits = 2; break;
+      case FORMAT_MAXT_C: fval = w->maxT_c; digits = 1; break;
+      case FORMAT_MINT_C: fval = w->minT_c; digits = 1; break;
+      case FORMAT_MAXT24HR_C: fval = w->maxT24hr_c; digits = 1; break;
+      case FORMAT_MINT24HR_C: fval = w->minT24hr_c; digits = 1; break;
+      case FORMAT_PRECIP_IN: fval = w->precip_in; digits = 1; break;
+      case FORMAT_PCP3HR_IN: fval = w->pcp3hr_in; digits = 1; break;
+      case FORMAT_PCP6HR_IN: fval = w->pcp6hr_in; digits = 1; break;
+      case FORMAT_PCP24HR_IN: fval = w->pcp24hr_in; digits = 1; break;
+      case FORMAT_SNOW_IN: fval = w->snow_in; digits = 1; break;
+      case FORMAT_ELEVATION_M: fval = w->elevation_m; digits = 1; break;
+      case FORMAT_WIND_DIR_DEGREES: ival = w->wind_dir_degrees; digits = -1; break;
+      case FORMAT_WIND_SPEED_KT: ival = w->wind_speed_kt; digits = -1; break;
+      case FORMAT_WIND_GUST_KT: ival = w->wind_gust_kt; digits = -1; break;
+      case FORMAT_VERT_VIS_FT: ival = w->vert_vis_ft; digits = -1; break;
+      case FORMAT_QUALITY_CONTROL_FLAGS:
+        if ( (w->quality_control_flags & METAR_QUALITY_CORRECTED) == METAR_QUALITY_CORRECTED )
+          strcat(buf, "COR ");
+        if ( (w->quality_control_flags & METAR_QUALITY_AUTO) == METAR_QUALITY_AUTO )
+          strcat(buf, "AUTO ");
+        if ( (w->quality_control_flags & METAR_QUALITY_AUTO_STATION) == METAR_QUALITY_AUTO_STATION )
+          strcat(buf, "AUTOST ");
+        if ( (w->quality_control_flags & METAR_QUALITY_MAINTENANCE) == METAR_QUALITY_MAINTENANCE )
+          strcat(buf, "MAINT ");
+        if ( (w->quality_control_flags & METAR_QUALITY_NO_SIGNAL) == METAR_QUALITY_NO_SIGNAL )
+          strcat(buf, "NOSIG ");
+        if ( (w->quality_control_flags & METAR_QUALITY_NO_LIGHTNING) == METAR_QUALITY_NO_LIGHTNING )
+          strcat(buf, "NOLTN ");
+        if ( (w->quality_control_flags & METAR_QUALITY_NO_FREEZING) == METAR_QUALITY_NO_FREEZING )
+          strcat(buf, "NOFRZ ");
+        if ( (w->quality_control_flags & METAR_QUALITY_NO_WEATHER) == METAR_QUALITY_NO_WEATHER )
+          strcat(buf, "INOP ");
+        if ( buf[0] != '\0' )
+          buf[strlen(buf) - 1] = '\0';
+        break;
+      case FORMAT_SKY_CONDITION:
+        for ( n = 0, k = 0; k < w->sky_condition_count; ++k )
+        {
+          switch ( w->sky_condition[k].sky_cover )
+          {
+            case METAR_SKYCOND_SKC: src = "SKC"; break;
+            case METAR_SKYCOND_CLR: src = "CLR"; break;
+            case METAR_SKYCOND_CAVOK: src = "CAVOK"; break;
+            case METAR_SKYCOND_FEW: src = "FEW"; break;
+            case METAR_SKYCOND_SCT: src = "SCT"; break;
+            case METAR_SKYCOND_BKN: src = "BKN"; break;
+            case METAR_SKYCOND_OVC: src = "OVC"; break;
+            case METAR_SKYCOND_OVX: src = "OVX"; break;
+            default: src = "???"; break;
+          }
+
+          if ( w->sky_condition[k].sky_cover != METAR_SKYCOND_CLR )
+            n += snprintf(&buf[n], METAR_BUFSIZE - n, "%s%s%d", (n > 0) ? " " : "", src, w->sky_condition[k].cloud_base_ft_agl);
+          else
+            n += snprintf(&buf[n], METAR_BUFSIZE - n, "%s%s", (n > 0) ? " " : "", src);
+        }
+        src = buf;
+        n = (size_t)-1;
+        break;
+      case FORMAT_METAR_TYPE:
+        src = (w->metar_type == METAR_TYPE_SPECI) ? "SPECI" : "METAR";
+        break;
+      case FORMAT_FLIGHT_CATEGORY:
+        src = flightConditions(w->flight_category, color);
+        break;
+    }
+
+    if ( digits > 0 )
+    {
+      if ( isnan(fval) )
+        src = "(unknown)";
+      else if ( digits == 1 )
+        snprintf(buf, METAR_BUFSIZE, "%.1f", roundf(fval * 10.0f) / 10.0f);
+      else
+        snprintf(buf, METAR_BUFSIZE, "%.2f", roundf(fval * 100.0f) / 100.0f);
+    }
+    else if ( digits < 0 )
+    {
+      if ( ival < 0 )
+        src = "(unknown)";
+      else
+        snprintf(buf, METAR_BUFSIZE, "%d", ival);
+    }
+
+    if ( n == (size_t)-1 )
+      n = strlen(src);
+    if ( n > (METAR_BIGBUFSIZE - 1 - pos) )
+      n = METAR_BIGBUFSIZE - 1 - pos;
+    memcpy(&fmt->out[pos], src, n);
+    pos += n;
+  }
+
+  fmt->out[pos] = '\0';
+  if ( len ) *len = pos;
+  return fmt->out;
+}
+
+void cachePath(char *restrict dest, const char *restrict path, const char *restrict station)
+{
+  // dest must hold at least METAR_BUFSIZE + 11 bytes
+  strncpy(dest, path, METAR_BUFSIZE);
+  strcat(dest, "metar-");
+  strncat(dest, station, METAR_BUFSIZE - strlen(path));
+  strcat(dest, ".xml");
+}
+
+gzFile createCacheFile(const char *file, int flags)
+{
+  // replaces an XML cache file, gzip'd with -z and as is otherwise.
+  // gzread() takes either, so a cache can be switched with files of both
+  // kinds in it.
+  unlink(file);
+  return gzopen(file, ((flags & METARFLAG_GZIP) == METARFLAG_GZIP) ? "wb6" : "wbT");
+}
+
+int isCacheFresh(const char *restrict file, int flags, const struct metar_settings *restrict settings)
+{
+  // an XML cache file is good until its sidecar says a newer report is
+  // due (or for METAR_OLDAGE seconds if it has no sidecar), -a at most
+  struct sidecar_header header;
+  struct stat fs;
+  time_t expires;
+  int fd;
+
+  memset((void *)&fs, 0, sizeof(struct stat));
+  if ( lstat(file, &fs) != 0 )
+    return 0;
+
+  // ...and has every field that's asked for, stale or not
+  fd = openSidecar(file, &header);
+  if ( fd >= 0 )
+  {
+    close(fd);
+    if ( !coversProjection(header.fields, header.latest, &settings->wanted) )
+      return 0;
+    expires = (time_t)header.expires;
+  }
+  else
+    expires = fs.st_mtime + METAR_OLDAGE;
+  if ( (flags & METARFLAG_NOTS) == METARFLAG_NOTS )
+    return 1;
+
+  return time(NULL) < cacheDeadline(fs.st_mtime, expires, settings->maxAge);
+}
+
+time_t predictExpiry(const struct metar_table *reports, time_t fetched)
+{
+  // when reports retrieved at fetched stop being the newest there are:
+  // the latest routine observation, plus the station's cadence as its two
+  // latest show it, plus how long reports take to show up.  one that's
+  // late is looked for again every METAR_RETRYAGE seconds for a cadence,
+  // and after that (the station's likely down) every quarter cadence.
+  // SPECIs come whenever they like, so they only count when there's
+  // nothing else.
+  time_t newest, latest, before, cadence, due, t;
+  size_t k;
+
+  newest = latest = before = 0;
+  for ( k = 0; k < reports->count; ++k )
+  {
+    t = (time_t)reports->reports[k].observation_time;
+    if ( t > newest ) newest = t;
+    if ( reports->reports[k].metar_type == METAR_TYPE_SPECI ) continue;
+
+    if ( t > latest )
+    {
+      before = latest;
+      latest = t;
+    }
+    else if ( (t < latest) && (t > before) )
+      before = t;
+  }
+  if ( newest == 0 )
+    return fetched + METAR_CADENCE;
+  if ( latest == 0 )
+    latest = newest;
+
+  cadence = latest - before;
+  if ( (before == 0) || (cadence < 600) || (cadence > 3 * METAR_CADENCE) )
+    cadence = METAR_CADENCE;
+
+  due = latest + cadence + METAR_ISSUELAG;
+  if ( due > fetched )
+    return due;
+  if ( (fetched - due) < cadence )
+    return fetched + METAR_RETRYAGE;
+  return fetched + cadence / 4;
+}
+
+time_t cacheDeadline(time_t fetched, time_t expires, time_t maxAge)
+{
+  // when a copy retrieved at fetched, with a newer one expected at
+  // expires, stops being fresh, if none is trusted for more than maxAge
+  return ((expires - fetched) < maxAge) ? expires : fetched + maxAge;
+}
+
+void sidecarPath(char *restrict dest, const char *restrict file)
+{
+  // metar-XXXX.xml => metar-XXXX.bin; dest must be as large as file
+  size_t len;
+
+  strcpy(dest, file);
+  len = strlen(dest);
+  if ( len >= 4 ) strcpy(&dest[len - 4], ".bin");
+}
+
+void fillSidecarHeader(struct sidecar_header *restrict header, const char *restrict magic, uint64_t count, uint64_t strings, const struct metar_projection *restrict kept)
+{
+  memset((void *)header, 0, sizeof(struct sidecar_header));
+  memcpy(header->magic, magic, 4);
+  header->version = METAR_SIDECAR_VERSION;
+  header->byteOrder = 0x01020304;
+  header->layout = (uint32_t)metarLayoutHash();
+  header->count = count;
+  header->strings = strings;
+  header->fields = kept->fields;
+  header->latest = (uint32_t)kept->latest;
+}
+
+int writeSidecar(const char *restrict file, const struct metar_table *restrict reports, const struct validators *restrict validators, const struct metar_projection *restrict kept)
+{
+  // stores the decoded reports beside their XML, so that a warm run
+  // never has to parse it again.  written aside and renamed into place.
+  char bin[METAR_BUFSIZE + 11], part[METAR_BUFSIZE + 16];
+  struct sidecar_header header;
+  struct iovec iov[3];
+  ssize_t want;
+  int fd, ret;
+
+  sidecarPath(bin, file);
+  snprintf(part, sizeof(part), "%s.%d", bin, (int)getpid());
+
+  fillSidecarHeader(&header, METAR_SIDECAR_MAGIC, reports->count, reports->stringsLen, kept);
+  header.expires = (int64_t)predictExpiry(reports, time(NULL));
+  if ( validators ) header.validators = *validators;
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = (void *)reports->reports;
+  iov[1].iov_len = sizeof(struct metar_packed) * reports->count;
+  iov[2].iov_base = (void *)reports->strings;
+  iov[2].iov_len = reports->stringsLen;
+  want = (ssize_t)(iov[0].iov_len + iov[1].iov_len + iov[2].iov_len);
+
+  fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if ( fd < 0 ) return -1;
+
+  ret = (writev(fd, iov, reports->count > 0 ? 3 : 1) == want) ? 0 : -1;
+  if ( close(fd) != 0 ) ret = -1;
+  if ( (ret == 0) && (rename(part, bin) != 0) ) ret = -1;
+  if ( ret != 0 ) unlink(part);
+
+  return ret;
+}
+
+int openSidecar(const char *restrict file, struct sidecar_header *restrict header)
+{
+  // opens an XML cache file's sidecar just past its header.  fails if the
+  // sidecar is missing, older than the XML, or was written by an
+  // incompatible build.
+  char bin[METAR_BUFSIZE + 11];
+  struct stat xs, bs;
+  int fd;
+
+  sidecarPath(bin, file);
+  fd = open(bin, O_RDONLY);
+  if ( fd < 0 ) return -1;
+
+  if ( (fstat(fd, &bs) != 0) || (stat(file, &xs) != 0) || (bs.st_mtime < xs.st_mtime)
+    || (read(fd, header, sizeof(struct sidecar_header)) != sizeof(struct sidecar_header))
+    || (memcmp(header->magic, METAR_SIDECAR_MAGIC, 4) != 0)
+    || (header->version != METAR_SIDECAR_VERSION)
+    || (header->byteOrder != 0x01020304)
+    || (header->layout != (uint32_t)metarLayoutHash())
+    || (header->count > (uint64_t)bs.st_size / sizeof(struct metar_packed))
+    || ((uint64_t)bs.st_size != sizeof(struct sidecar_header) + header->count * sizeof(struct metar_packed) + header->strings) )
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int readSidecar(const char *restrict file, struct metar_table *restrict reports, struct arena *restrict scratch)
+{
+  // the decoded reports for an XML cache file, in scratch memory
+  struct sidecar_header header;
+  struct iovec iov[2];
+  size_t runs;
+  int fd;
+
+  initMetarTable(reports);
+  fd = openSidecar(file, &header);
+  if ( fd < 0 ) return -1;
+
+  // size and stringsSize stay 0: the table is the arena's, not ours
+  runs = sizeof(struct metar_packed) * header.count;
+  reports->reports = (struct metar_packed *)arenaAlloc(scratch, runs);
+  reports->strings = (char *)arenaAlloc(scratch, header.strings);
+  reports->count = header.count;
+  reports->stringsLen = header.strings;
+  if ( !reports->reports || !reports->strings )
+  {
+    initMetarTable(reports);
+    close(fd);
+    return -1;
+  }
+
+  iov[0].iov_base = reports->reports;
+  iov[0].iov_len = runs;
+  iov[1].iov_base = reports->strings;
+  iov[1].iov_len = header.strings;
+
+  if ( ((runs + header.strings > 0) && (readv(fd, iov, 2) != (ssize_t)(runs + header.strings)))
+    || !isMetarTableValid(reports) )
+  {
+    initMetarTable(reports);
+    close(fd);
+    return -1;
+  }
+
+  close(fd);
+  return 0;
+}
+
+int readValidators(const char *restrict file, struct validators *restrict validators, const struct metar_projection *restrict wanted)
+{
+  // what the response behind an XML cache file came with, from its sidecar
+  struct sidecar_header header;
+  int fd;
+
+  memset((void *)validators, 0, sizeof(struct validators));
+  fd = openSidecar(file, &header);
+  if ( fd < 0 ) return -1;
+  close(fd);
+  if ( !coversProjection(header.fields, header.latest, wanted) )
+    return -1; // what they'd validate isn't what's asked for
+
+  *validators = header.validators;
+  validators->etag[METAR_ETAGSIZE - 1] = '\0';
+  validators->modified[METAR_DATESIZE - 1] = '\0';
+  return 0;
+}
+
+int touchSidecar(const char *file, time_t expires)
+{
+  // gives an XML cache file's sidecar, already known to be valid, a new
+  // expiry
+  char bin[METAR_BUFSIZE + 11];
+  int64_t value = (int64_t)expires;
+  int fd, ret;
+
+  sidecarPath(bin, file);
+  fd = open(bin, O_WRONLY);
+  if ( fd < 0 ) return -1;
+
+  ret = (pwrite(fd, &value, sizeof(value), offsetof(struct sidecar_header, expires)) == sizeof(value)) ? 0 : -1;
+  close(fd);
+  return ret;
+}
+
+int isStationFresh(struct metar_cache *cache, const char *path, const char *station, int flags, const struct metar_settings *settings)
+{
+  // whether the station can be served from whichever cache is in use
+  char tmp[METAR_BUFSIZE + 11];
+
+  if ( (flags & METARFLAG_UPDATE) == METARFLAG_UPDATE )
+    return 0;
+
+  if ( cache )
+    return findCachedReports(cache, station, flags, settings, NULL, NULL) == 0;
+
+  cachePath(tmp, path, station);
+  return isCacheFresh(tmp, flags, settings);
+}
+
+unsigned long metarLayoutHash(void)
+{
+  // changes whenever the in-memory shape of a report does, so that caches
+  // written by a differently-built metar are never misread.
+  const size_t layout[] =
+  {
+    sizeof(struct metar_packed),
+    sizeof(size_t),
+    offsetof(struct metar_packed, present),
+    offsetof(struct metar_packed, raw_text),
+    offsetof(struct metar_packed, latitude),
+    offsetof(struct metar_packed, cloud_base_ft_agl),
+    offsetof(struct metar_packed, temp_c),
+    offsetof(struct metar_packed, vert_vis_ft),
+    offsetof(struct metar_packed, sky_cover),
+    offsetof(struct metar_packed, station_id)
+  };
+  unsigned long hash;
+  size_t k;
+
+  hash = 2166136261UL;
+  for ( k = 0; k < sizeof(layout); ++k )
+  {
+    hash ^= ((const unsigned char *)layout)[k];
+    hash = (hash * 16777619UL) & 0xffffffffUL;
+  }
+
+  return hash;
+}
+
+int cacheKey(char *restrict key, const char *restrict station)
+{
+  // upper-cased and NUL-padded, as stored in struct cache_slot
+  size_t k;
+
+  memset(key, 0, METAR_CACHE_KEYSIZE);
+  for ( k = 0; station[k]; ++k )
+  {
+    if ( k >= METAR_CACHE_KEYSIZE - 1 ) return -1;
+    key[k] = toupper((unsigned char)station[k]);
+  }
+
+  return (k > 0) ? 0 : -1;
+}
+
+struct cache_slot *findCacheSlot(struct metar_cache *cache, const char *station, int vacant)
+{
+  // open addressing with linear probing.  returns the station's slot, or
+  // with vacant set, the free slot it would go into.
+  char key[METAR_CACHE_KEYSIZE];
+  struct cache_slot *slot;
+  unsigned long hash;
+  size_t k, mask;
+
+  if ( cacheKey(key, station) != 0 ) return NULL;
+
+  hash = 2166136261UL;
+  for ( k = 0; key[k]; ++k )
+  {
+    hash ^= (unsigned char)key[k];
+    hash = (hash * 16777619UL) & 0xffffffffUL;
+  }
+
+  mask = METAR_CACHE_SLOTS - 1;
+  for ( k = 0; k < METAR_CACHE_SLOTS; ++k )
+  {
+    slot = &cache->slots[(hash + k) & mask];
+    if ( slot->station[0] == '\0' )
+      return vacant ? slot : NULL;
+    if ( memcmp(slot->station, key, METAR_CACHE_KEYSIZE) == 0 )
+      return slot;
+  }
+
+  return NULL; // full
+}
+
+int mapIndexedCache(struct metar_cache *cache)
+{
+  struct stat fs;
+  void *map;
+
+  if ( fstat(cache->fd, &fs) != 0 ) return -1;
+  if ( cache->map && ((size_t)fs.st_size == cache->size) ) return 0;
+
+  if ( cache->map ) munmap(cache->map, cache->size);
+  cache->map = NULL;
+  cache->size = 0;
+
+  map = mmap(NULL, fs.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+  if ( map == MAP_FAILED ) return -1;
+
+  cache->map = (char *)map;
+  cache->size = fs.st_size;
+  cache->header = (struct cache_header *)map;
+  cache->slots = (struct cache_slot *)(cache->map + sizeof(struct cache_header));
+  return 0;
+}
+
+int resetIndexedCache(struct metar_cache *cache)
+{
+  // empties the index; must be called with the file locked exclusively.
+  // the file shrinks back to just the index, so records are gone too.
+  struct cache_header header;
+  size_t size;
+
+  size = sizeof(struct cache_header) + sizeof(struct cache_slot) * METAR_CACHE_SLOTS;
+  if ( cache->map ) munmap(cache->map, cache->size);
+  cache->map = NULL;
+  cache->size = 0;
+
+  if ( (ftruncate(cache->fd, 0) != 0) || (ftruncate(cache->fd, size) != 0) )
+    return -1;
+
+  memset((void *)&header, 0, sizeof(struct cache_header));
+  memcpy(header.magic, METAR_CACHE_MAGIC, 4);
+  header.version = METAR_CACHE_VERSION;
+  header.byteOrder = 0x01020304;
+  header.layout = metarLayoutHash();
+  header.slots = METAR_CACHE_SLOTS;
+  header.end = size;
+  if ( pwrite(cache->fd, &header, sizeof(struct cache_header), 0) != sizeof(struct cache_header) )
+    return -1;
+
+  return mapIndexedCache(cache);
+}
+
+int isIndexedCacheValid(const struct metar_cache *cache)
+{
+  const struct cache_header *h = cache->header;
+
+  return (cache->size >= sizeof(struct cache_header) + sizeof(struct cache_slot) * METAR_CACHE_SLOTS)
+    && (memcmp(h->magic, METAR_CACHE_MAGIC, 4) == 0)
+    && (h->version == METAR_CACHE_VERSION)
+    && (h->byteOrder == 0x01020304)
+    && (h->layout == metarLayoutHash())
+    && (h->slots == METAR_CACHE_SLOTS)
+    && (h->end <= cache->size);
+}
+
+struct metar_cache *openIndexedCache(const char *path)
+{
+  // the whole cache lives in <path>metar.cache:
+  //
+  //   struct cache_header
+  //   struct cache_slot[METAR_CACHE_SLOTS]   hash index keyed by ICAO id
+  //   struct metar_packed[...], text ...     one run per stored station
+  //
+  // the file stays mapped for the whole run, but is only locked while it's
+  // looked at: shared for each lookup, which copies out what it finds, and
+  // exclusive for each store.  between them another process may grow it or
+  // start it over, so every lock is followed by a remap.  a file from an
+  // incompatible build is simply started over.
+  char file[METAR_BUFSIZE + 11];
+  struct metar_cache *cache;
+
+  cache = (struct metar_cache *)calloc(1, sizeof(struct metar_cache));
+  if ( !cache ) return NULL;
+
+  strncpy(file, path, METAR_BUFSIZE);
+  file[METAR_BUFSIZE - 1] = '\0';
+  strcat(file, "metar.cache");
+
+  cache->fd = open(file, O_RDWR | O_CREAT, 0644);
+  if ( cache->fd < 0 )
+  {
+    free(cache);
+    return NULL;
+  }
+
+  if ( (flock(cache->fd, LOCK_SH) != 0) || (mapIndexedCache(cache) != 0) || !isIndexedCacheValid(cache) )
+  {
+    if ( (flock(cache->fd, LOCK_EX) != 0)
+      || (((mapIndexedCache(cache) != 0) || !isIndexedCacheValid(cache)) && (resetIndexedCache(cache) != 0)) )
+    {
+      closeIndexedCache(cache);
+      return NULL;
+    }
+  }
+
+  flock(cache->fd, LOCK_UN);
+  return cache;
+}
+
+void closeIndexedCache(struct metar_cache *cache)
+{
+  if ( !cache ) return;
+  if ( cache->map ) munmap(cache->map, cache->size);
+  if ( cache->fd >= 0 ) close(cache->fd); // drops the lock
+  free(cache);
+}
+
+int purgeIndexedCache(struct metar_cache *cache)
+{
+  int ret;
+
+  if ( flock(cache->fd, LOCK_EX) != 0 ) return -1;
+  ret = resetIndexedCache(cache);
+  flock(cache->fd, LOCK_UN);
+  return ret;
+}
+
+int isCacheSlotValid(const struct metar_cache *restrict cache, const struct cache_slot *restrict slot)
+{
+  // whether the slot's reports, text and validators lie inside what's been
+  // stored; asked before any sum of them can wrap
+  uint64_t end = cache->header->end;
+
+  return (slot->offset <= end)
+    && (slot->count <= (end - slot->offset) / sizeof(struct metar_packed))
+    && (slot->strings <= end - slot->offset - slot->count * sizeof(struct metar_packed))
+    && (sizeof(struct validators) <= end - slot->offset - slot->count * sizeof(struct metar_packed) - slot->strings);
+}
+
+int copyCachedReports(const struct metar_cache *restrict cache, const struct cache_slot *restrict slot, struct metar_table *restrict reports, struct arena *restrict scratch)
+{
+  // the slot's reports, out of the mapping and into scratch memory; size
+  // and stringsSize stay 0, since the table is the arena's, not ours
+  size_t runs;
+
+  initMetarTable(reports);
+  runs = slot->count * sizeof(struct metar_packed);
+  reports->reports = (struct metar_packed *)arenaAlloc(scratch, runs);
+  reports->strings = (char *)arenaAlloc(scratch, slot->strings);
+  if ( !reports->reports || !reports->strings )
+  {
+    initMetarTable(reports);
+    return -1;
+  }
+
+  memcpy((void *)reports->reports, cache->map + slot->offset, runs);
+  memcpy(reports->strings, cache->map + slot->offset + runs, slot->strings);
+  reports->count = slot->count;
+  reports->stringsLen = slot->strings;
+  if ( !isMetarTableValid(reports) )
+  {
+    initMetarTable(reports);
+    return -1;
+  }
+  return 0;
+}
+
+int findCachedReports(struct metar_cache *restrict cache, const char *restrict station, int flags, const struct metar_settings *restrict settings, struct metar_table *restrict reports, struct arena *restrict scratch)
+{
+  // a fresh hit is one probe into the mapping and a copy: no parsing.
+  // the copy is in scratch memory, so it stays good however the file
+  // changes once the lock is let go.  without reports, only says whether
+  // there's a hit.
+  const struct cache_slot *slot;
+  int ret;
+
+  if ( flock(cache->fd, LOCK_SH) != 0 ) return -1;
+
+  ret = -1;
+  if ( (mapIndexedCache(cache) == 0) && isIndexedCacheValid(cache)
+    && ((slot = findCacheSlot(cache, station, 0)) != NULL)
+    && coversProjection(slot->fields, slot->latest, &settings->wanted)
+    && ((time(NULL) < cacheDeadline((time_t)slot->fetched, (time_t)slot->expires, settings->maxAge)) || ((flags & METARFLAG_NOTS) == METARFLAG_NOTS))
+    && isCacheSlotValid(cache, slot) )
+    ret = reports ? copyCachedReports(cache, slot, reports, scratch) : 0;
+
+  flock(cache->fd, LOCK_UN);
+  return ret;
+}
+
+int findCachedValidators(struct metar_cache *restrict cache, const char *restrict station, const struct metar_projection *restrict wanted, struct validators *restrict validators)
+{
+  // what the station's reports were retrieved with, fresh or not
+  const struct cache_slot *slot;
+  uint64_t at;
+  int ret;
+
+  memset((void *)validators, 0, sizeof(struct validators));
+  if ( flock(cache->fd, LOCK_SH) != 0 ) return -1;
+
+  ret = -1;
+  if ( (mapIndexedCache(cache) == 0) && isIndexedCacheValid(cache)
+    && ((slot = findCacheSlot(cache, station, 0)) != NULL)
+    && coversProjection(slot->fields, slot->latest, wanted)
+    && isCacheSlotValid(cache, slot) )
+  {
+    at = slot->offset + slot->count * sizeof(struct metar_packed) + slot->strings;
+    memcpy((void *)validators, cache->map + at, sizeof(struct validators));
+    validators->etag[METAR_ETAGSIZE - 1] = '\0';
+    validators->modified[METAR_DATESIZE - 1] = '\0';
+    ret = 0;
+  }
+
+  flock(cache->fd, LOCK_UN);
+  return ret;
+}
+
+int touchCachedReports(struct metar_cache *cache, const char *station)
+{
+  // makes the station's reports count as just retrieved
+  struct cache_slot *slot;
+  struct metar_table view;
+  int ret;
+
+  if ( flock(cache->fd, LOCK_EX) != 0 ) return -1;
+
+  ret = -1;
+  if ( (mapIndexedCache(cache) == 0) && isIndexedCacheValid(cache)
+    && ((slot = findCacheSlot(cache, station, 0)) != NULL)
+    && isCacheSlotValid(cache, slot) )
+  {
+    view.reports = (struct metar_packed *)(cache->map + slot->offset);
+    view.count = slot->count;
+    slot->fetched = (int64_t)time(NULL);
+    slot->expires = (int64_t)predictExpiry(&view, (time_t)slot->fetched);
+    ret = 0;
+  }
+
+  flock(cache->fd, LOCK_UN);
+  return ret;
+}
+
+int storeCachedReports(struct metar_cache *restrict cache, const char *restrict station, const struct metar_table *restrict reports, const struct validators *restrict validators, const struct metar_projection *restrict kept)
+{
+  // appends the reports and points the station's slot at them.  records
+  // are never rewritten in place; once the file outgrows METAR_CACHE_MAXSIZE
+  // it is started over rather than compacted.
+  struct cache_slot *slot;
+  uint64_t offset, need, runs;
+  size_t grow;
+  int ret, again;
+
+  runs = reports->count * sizeof(struct metar_packed);
+
+  if ( flock(cache->fd, LOCK_EX) != 0 ) return -1;
+
+  ret = -1;
+  for ( again = 1; again >= 0; --again )
+  {
+    // another process may have stored (or purged) since we last looked
+    if ( (mapIndexedCache(cache) != 0) || (!isIndexedCacheValid(cache) && (resetIndexedCache(cache) != 0)) )
+      break;
+
+    offset = (cache->header->end + 7) & ~(uint64_t)7;
+    need = offset + runs + reports->stringsLen + sizeof(struct validators);
+    slot = findCacheSlot(cache, station, 1);
+    if ( (!slot || (need > METAR_CACHE_MAXSIZE)) && again )
+    {
+      if ( resetIndexedCache(cache) != 0 ) break;
+      continue;
+    }
+    if ( !slot || (need > METAR_CACHE_MAXSIZE) ) break;
+
+    if ( need > cache->size )
+    {
+      // grow in big steps to keep remaps rare
+      grow = cache->size * 2;
+      if ( grow < need ) grow = need;
+      if ( grow > METAR_CACHE_MAXSIZE ) grow = METAR_CACHE_MAXSIZE;
+      if ( (ftruncate(cache->fd, grow) != 0) || (mapIndexedCache(cache) != 0) )
+        break;
+      slot = findCacheSlot(cache, station, 1); // the mapping moved
+    }
+
+    if ( runs > 0 )
+      memcpy(cache->map + offset, reports->reports, runs);
+    if ( reports->stringsLen > 0 )
+      memcpy(cache->map + offset + runs, reports->strings, reports->stringsLen);
+    if ( validators )
+      memcpy(cache->map + offset + runs + reports->stringsLen, (const void *)validators, sizeof(struct validators));
+    else
+      memset(cache->map + offset + runs + reports->stringsLen, 0, sizeof(struct validators));
+    slot->fetched = (int64_t)time(NULL);
+    slot->expires = (int64_t)predictExpiry(reports, (time_t)slot->fetched);
+    slot->offset = offset;
+    slot->count = reports->count;
+    slot->strings = reports->stringsLen;
+    slot->fields = kept->fields;
+    slot->latest = (uint32_t)kept->latest;
+    cacheKey(slot->station, station);
+    cache->header->end = need;
+    ret = 0;
+    break;
+  }
+
+  flock(cache->fd, LOCK_UN);
+  return ret;
+}
+
+
+void setupTransfer(CURL *curl, const char *request, struct document *doc)
+{
+  // with doc->known, the request only gets a body back if it has changed
+  char line[METAR_ETAGSIZE + 32];
+  struct curl_slist *list;
+
+  doc->status = 0;
+  doc->retryAfter = 0;
+  memset((void *)&doc->validators, 0, sizeof(struct validators));
+  if ( doc->headers ) curl_slist_free_all(doc->headers);
+  doc->headers = NULL;
+
+  if ( doc->known && (doc->known->etag[0] != '\0') )
+  {
+    snprintf(line, sizeof(line), "If-None-Match: %s", doc->known->etag);
+    if ( (list = curl_slist_append(doc->headers, line)) != NULL ) doc->headers = list;
+  }
+  if ( doc->known && (doc->known->modified[0] != '\0') )
+  {
+    snprintf(line, sizeof(line), "If-Modified-Since: %s", doc->known->modified);
+    if ( (list = curl_slist_append(doc->headers, line)) != NULL ) doc->headers = list;
+  }
+
+  curl_easy_setopt(curl, CURLOPT_URL, request);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeDocument);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)doc);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, readHeader);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)doc);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, doc->headers);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, "Metar/1.0");
+
+  // XML shrinks about tenfold; curl undoes whatever the server picked
+  // before writeDocument() sees it, so the parser still gets it as it comes
+  curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+int64_t clockMicros(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void sleepMicros(int64_t micros)
+{
+  // cut short by a signal, so that --daemon and --watch still stop
+  struct timespec t;
+
+  if ( micros <= 0 ) return;
+  t.tv_sec = (time_t)(micros / 1000000);
+  t.tv_nsec = (long)(micros % 1000000) * 1000;
+  nanosleep(&t, NULL);
+}
+
+int64_t requestDelay(int take)
+{
+  // how long, in micros, until the limiter lets another request go; 0 if
+  // one may now, and with take, it's on its way.  the bucket fills at
+  // METAR_RATE a minute up to METAR_BURST, so a run that's mostly cache
+  // hits never waits, and one that isn't settles at the rate.  a backoff
+  // holds everything up.
+  int64_t now, wait;
+#ifndef METAR_NO_THROTTLE
+  int64_t owed;
+#endif
+
+  pthread_mutex_lock(&limiter.lock);
+  now = clockMicros();
+  wait = (limiter.until > now) ? limiter.until - now : 0;
+#ifndef METAR_NO_THROTTLE
+  if ( limiter.refilled == 0 ) limiter.refilled = now;
+  limiter.tokens += (double)(now - limiter.refilled) * METAR_RATE / 60e6;
+  if ( limiter.tokens > METAR_BURST ) limiter.tokens = METAR_BURST;
+  limiter.refilled = now;
+  if ( limiter.tokens < 1.0 )
+  {
+    owed = (int64_t)((1.0 - limiter.tokens) * 60e6 / METAR_RATE) + 1;
+    if ( owed > wait ) wait = owed;
+  }
+#endif
+  if ( take && (wait == 0) ) limiter.tokens -= 1.0;
+  pthread_mutex_unlock(&limiter.lock);
+  return wait;
+}
+
+void awaitRequest(void)
+{
+  int64_t wait;
+
+  while ( (wait = requestDelay(1)) > 0 )
+    sleepMicros(wait);
+}
+
+int noteRequest(CURLcode res, const struct document *doc, int attempt)
+{
+  // feeds how a request went back into the limiter.  a 429, a 5xx or no
+  // answer at all holds every request up for METAR_BACKOFF, doubled for
+  // each such failure in a row, or for as long as Retry-After says if
+  // that's longer.  the jitter keeps transfers that failed together from
+  // coming back together.  nonzero if it's worth making again, which it
+  // is METAR_RETRIES more times at most.
+  int64_t backoff, asked;
+  int n, failed;
+
+  switch ( res )
+  {
+    case CURLE_OK:
+      failed = (doc->status == 429) || ((doc->status >= 500) && (doc->status < 600));
+      break;
+    case CURLE_WRITE_ERROR: // out of memory, or the parser is
+    case CURLE_OUT_OF_MEMORY:
+    case CURLE_URL_MALFORMAT:
+    case CURLE_UNSUPPORTED_PROTOCOL:
+      return 0; // no fault of the service's, and no better next time
+    default:
+      failed = 1;
+  }
+
+  pthread_mutex_lock(&limiter.lock);
+  if ( !failed )
+  {
+    limiter.failures = 0;
+    pthread_mutex_unlock(&limiter.lock);
+    return 0;
+  }
+
+  for ( backoff = METAR_BACKOFF, n = 0; (n < limiter.failures) && (backoff < METAR_MAXBACKOFF); ++n )
+    backoff *= 2;
+  if ( backoff > METAR_MAXBACKOFF ) backoff = METAR_MAXBACKOFF;
+  ++limiter.failures;
+
+  // somewhere in the upper half
+  if ( limiter.seed == 0 ) limiter.seed = (uint32_t)clockMicros() ^ (uint32_t)getpid();
+  limiter.seed = limiter.seed * 1103515245U + 12345U;
+  backoff = backoff / 2 + (int64_t)(((uint64_t)limiter.seed * (uint64_t)(backoff / 2)) >> 32);
+
+  asked = (int64_t)doc->retryAfter * 1000000;
+  if ( asked > METAR_MAXBACKOFF ) asked = METAR_MAXBACKOFF;
+  if ( asked > backoff ) backoff = asked;
+
+  if ( limiter.until < clockMicros() + backoff )
+    limiter.until = clockMicros() + backoff;
+  pthread_mutex_unlock(&limiter.lock);
+  return attempt < METAR_RETRIES;
+}
+
+const char *statusReason(long status)
+{
+  // why a response that came back with an HTTP error has no reports
+  switch ( status )
+  {
+    case 400: return "HTTP 400 Bad Request";
+    case 403: return "HTTP 403 Forbidden";
+    case 404: return "HTTP 404 Not Found";
+    case 429: return "HTTP 429 Too Many Requests";
+    case 500: return "HTTP 500 Internal Server Error";
+    case 502: return "HTTP 502 Bad Gateway";
+    case 503: return "HTTP 503 Service Unavailable";
+    case 504: return "HTTP 504 Gateway Timeout";
+  }
+  return (status < 500) ? "HTTP client error" : "HTTP server error";
+}
+
+void rewindDocument(struct document *doc)
+{
+  // readies doc to take a retried request's response from the start
+  doc->len = 0;
+  if ( doc->data ) doc->data[0] = '\0';
+  if ( doc->parser ) resetMetarParser(doc->parser);
+  doc->status = 0;
+  doc->retryAfter = 0;
+  memset((void *)&doc->validators, 0, sizeof(struct validators));
+}
+
+CURLcode performRequest(CURL *curl, struct document *doc)
+{
+  // curl_easy_perform() for a transfer setupTransfer() has readied, once
+  // the limiter lets it go, and again for as long as noteRequest() says
+  CURLcode res;
+  int attempt;
+
+  for ( attempt = 0; ; ++attempt )
+  {
+    awaitRequest();
+    res = curl_easy_perform(curl);
+    if ( !noteRequest(res, doc, attempt) ) return res;
+    rewindDocument(doc);
+  }
+}
+
+void addTransferStats(struct metar_stats *restrict stats, CURL *restrict curl)
+{
+  // curl times every phase from the start of the transfer, so each is the
+  // difference from the one before; a reused connection has none to speak
+  // of, and a plain HTTP one no TLS.
+  curl_off_t dns, connect, tls, total, bytes;
+
+  dns = connect = tls = total = bytes = 0;
+#if LIBCURL_VERSION_NUM >= 0x073d00
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+#else
+  double seconds;
+
+  if ( curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &seconds) == CURLE_OK ) dns = (curl_off_t)(seconds * 1e6);
+  if ( curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &seconds) == CURLE_OK ) connect = (curl_off_t)(seconds * 1e6);
+  if ( curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &seconds) == CURLE_OK ) tls = (curl_off_t)(seconds * 1e6);
+  if ( curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &seconds) == CURLE_OK ) total = (curl_off_t)(seconds * 1e6);
+  if ( curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &seconds) == CURLE_OK ) bytes = (curl_off_t)seconds;
+#endif
+
+  if ( connect < dns ) connect = dns;
+  if ( tls < connect ) tls = connect;
+  if ( total < tls ) total = tls;
+
+  stats->dns += (int64_t)dns;
+  stats->connect += (int64_t)(connect - dns);
+  stats->tls += (int64_t)(tls - connect);
+  stats->transfer += (int64_t)(total - tls);
+  stats->bytes += (uint64_t)bytes;
+  ++stats->requests;
+}
+
+void addStats(struct metar_stats *restrict total, const struct metar_stats *restrict stats)
+{
+  total->cache += stats->cache;
+  total->dns += stats->dns;
+  total->connect += stats->connect;
+  total->tls += stats->tls;
+  total->transfer += stats->transfer;
+  total->parse += stats->parse;
+  total->render += stats->render;
+  total->requests += stats->requests;
+  total->bytes += stats->bytes;
+  total->allocs += stats->allocs;
+}
+
+void printStats(const char *restrict label, const struct metar_stats *restrict stats)
+{
+  // one --stats line: the label, then every counter as key=value
+  fprintf(stderr, "stats %s requests=%llu bytes=%llu cache_us=%lld dns_us=%lld connect_us=%lld tls_us=%lld transfer_us=%lld parse_us=%lld render_us=%lld allocs=%llu\n",
+    label,
+    (unsigned long long)stats->requests,
+    (unsigned long long)stats->bytes,
+    (long long)stats->cache,
+    (long long)stats->dns,
+    (long long)stats->connect,
+    (long long)stats->tls,
+    (long long)stats->transfer,
+    (long long)stats->parse,
+    (long long)stats->render,
+    (unsigned long long)stats->allocs);
+}
+
+size_t readHeader(char *line, size_t size, size_t count, void *rest)
+{
+  // CURLOPT_HEADERFUNCTION: notes the status and cache validators of the
+  // final response.  lines aren't terminated, and each response in a chain
+  // of redirects starts over.
+  struct document *doc = (struct document *)rest;
+  size_t len = size * count;
+  size_t n, end, room;
+  char *dest;
+
+  if ( (len > 5) && (strncmp(line, "HTTP/", 5) == 0) )
+  {
+    memset((void *)&doc->validators, 0, sizeof(struct validators));
+    doc->status = 0;
+    doc->retryAfter = 0;
+    for ( n = 5; (n < len) && (line[n] != ' '); ++n ) ;
+    for ( ++n; (n < len) && isdigit((unsigned char)line[n]); ++n )
+      doc->status = doc->status * 10 + (line[n] - '0');
+    return len;
+  }
+
+  if ( (len > 12) && (strncasecmp(line, "Retry-After:", 12) == 0) )
+  {
+    // only the delay-seconds form; an HTTP date is as good as none
+    doc->retryAfter = 0;
+    for ( n = 12; (n < len) && ((line[n] == ' ') || (line[n] == '\t')); ++n ) ;
+    for ( ; (n < len) && isdigit((unsigned char)line[n]) && (doc->retryAfter < METAR_MAXBACKOFF / 1000000); ++n )
+      doc->retryAfter = doc->retryAfter * 10 + (line[n] - '0');
+    return len;
+  }
+
+  if ( (len > 5) && (strncasecmp(line, "ETag:", 5) == 0) )
+  {
+    dest = doc->validators.etag;
+    room = METAR_ETAGSIZE;
+    n = 5;
+  }
+  else if ( (len > 14) && (strncasecmp(line, "Last-Modified:", 14) == 0) )
+  {
+    dest = doc->validators.modified;
+    room = METAR_DATESIZE;
+    n = 14;
+  }
+  else
+    return len;
+
+  while ( (n < len) && ((line[n] == ' ') || (line[n] == '\t')) ) ++n;
+  for ( end = len; (end > n) && isspace((unsigned char)line[end - 1]); --end ) ;
+
+  // one too long to send back is as good as none
+  if ( (end - n) < room )
+  {
+    memcpy(dest, &line[n], end - n);
+    dest[end - n] = '\0';
+  }
+  else
+    dest[0] = '\0';
+
+  return len;
+}
+
+int revalidateStation(struct metar_cache *restrict cache, const char *restrict file, const char *restrict station, const struct metar_settings *restrict settings, struct metar_table *restrict reports, struct arena *restrict scratch)
+{
+  // after a 304: marks the station's cached copy as just retrieved and
+  // hands it back in scratch memory.  fails if the copy has gone missing in
+  // the meantime.
+  char bin[METAR_BUFSIZE + 11];
+
+  if ( cache )
+  {
+    if ( touchCachedReports(cache, station) != 0 ) return -1;
+    return findCachedReports(cache, station, 0, settings, reports, scratch);
+  }
+
+  // the sidecar is only trusted while it's at least as new as the XML, so
+  // it's rewritten before, and touched after, the XML is
+  if ( (readSidecar(file, reports, scratch) != 0)
+    || (touchSidecar(file, predictExpiry(reports, time(NULL))) != 0) )
+    return -1;
+  sidecarPath(bin, file);
+  if ( (utimes(file, NULL) != 0) || (utimes(bin, NULL) != 0) ) return -1;
+  return 0;
+}
+
+void historyPath(char *restrict dest, const char *restrict path, const char *restrict station, const char *restrict extension)
+{
+  // dest must hold at least METAR_BUFSIZE + 16 bytes
+  snprintf(dest, METAR_BUFSIZE + 16, "%smetar-%s.%s", path, station, extension);
+}
+
+int openHistory(struct metar_history *restrict h, const char *restrict path, const char *restrict station, int writable)
+{
+  // maps a station's history log, locked shared, or exclusively to be
+  // written to.  fails if there's none, or it was written by an
+  // incompatible build (or crashed while being rewritten); a writable one
+  // stays open and locked regardless, to be started over.  closeHistory()
+  // it either way.
+  char file[METAR_BUFSIZE + 16];
+  struct stat fs, ss;
+  int64_t generation;
+  int mode;
+
+  memset((void *)h, 0, sizeof(struct metar_history));
+  h->fd = h->strfd = -1;
+  mode = writable ? (O_RDWR | O_CREAT) : O_RDONLY;
+
+  historyPath(file, path, station, "hist");
+  if ( (h->fd = open(file, mode, 0644)) < 0 ) return -1;
+  if ( flock(h->fd, writable ? LOCK_EX : LOCK_SH) != 0 ) return -1;
+  historyPath(file, path, station, "hstr");
+  if ( (h->strfd = open(file, mode, 0644)) < 0 ) return -1;
+
+  if ( (fstat(h->fd, &fs) != 0) || (fstat(h->strfd, &ss) != 0)
+    || (pread(h->fd, &h->header, sizeof(struct history_header), 0) != sizeof(struct history_header))
+    || (pread(h->strfd, &generation, sizeof(generation), 0) != sizeof(generation))
+    || (memcmp(h->header.magic, METAR_HISTORY_MAGIC, 4) != 0)
+    || (h->header.version != METAR_HISTORY_VERSION)
+    || (h->header.byteOrder != 0x01020304)
+    || (h->header.layout != (uint32_t)metarLayoutHash())
+    || (h->header.generation != generation)
+    || (h->header.strings == 0)
+    || (h->header.count > (uint64_t)fs.st_size / sizeof(struct metar_packed))
+    || ((uint64_t)fs.st_size < sizeof(struct history_header) + h->header.count * sizeof(struct metar_packed))
+    || ((uint64_t)ss.st_size < sizeof(generation) + h->header.strings) )
+  {
+    memset((void *)&h->header, 0, sizeof(struct history_header));
+    return -1;
+  }
+
+  // a range scan only ever touches the pages it needs
+  h->mapSize = sizeof(struct history_header) + h->header.count * sizeof(struct metar_packed);
+  h->strMapSize = sizeof(generation) + h->header.strings;
+  h->map = mmap(NULL, h->mapSize, PROT_READ, MAP_SHARED, h->fd, 0);
+  h->strMap = mmap(NULL, h->strMapSize, PROT_READ, MAP_SHARED, h->strfd, 0);
+  if ( (h->map == MAP_FAILED) || (h->strMap == MAP_FAILED) )
+  {
+    if ( h->map != MAP_FAILED ) munmap(h->map, h->mapSize);
+    if ( h->strMap != MAP_FAILED ) munmap(h->strMap, h->strMapSize);
+    h->map = h->strMap = NULL;
+    memset((void *)&h->header, 0, sizeof(struct history_header));
+    return -1;
+  }
+
+  h->view.reports = (struct metar_packed *)((char *)h->map + sizeof(struct history_header));
+  h->view.count = h->header.count;
+  h->view.strings = (char *)h->strMap + sizeof(generation);
+  h->view.stringsLen = h->header.strings;
+
+  // every record is looked at before any is used; see isInHistory()
+  if ( !isMetarTableValid(&h->view) )
+  {
+    munmap(h->map, h->mapSize);
+    munmap(h->strMap, h->strMapSize);
+    h->map = h->strMap = NULL;
+    initMetarTable(&h->view);
+    memset((void *)&h->header, 0, sizeof(struct history_header));
+    return -1;
+  }
+  return 0;
+}
+
+void closeHistory(struct metar_history *h)
+{
+  if ( h->map ) munmap(h->map, h->mapSize);
+  if ( h->strMap ) munmap(h->strMap, h->strMapSize);
+  if ( h->strfd >= 0 ) close(h->strfd);
+  if ( h->fd >= 0 ) close(h->fd); // and with it the lock
+  memset((void *)h, 0, sizeof(struct metar_history));
+  h->fd = h->strfd = -1;
+}
+
+size_t findHistory(const struct metar_history *h, time_t since)
+{
+  // the first report observed since then, or the count if there's none
+  size_t lo, hi, mid;
+
+  for ( lo = 0, hi = h->view.count; lo < hi; )
+  {
+    mid = lo + (hi - lo) / 2;
+    if ( h->view.reports[mid].observation_time < (int64_t)since )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int readHistory(const struct metar_history *restrict h, time_t since, struct metar_table *restrict reports)
+{
+  // copies the reports observed since then into reports, newest first as
+  // the service has them.  returns how many, or -1 if out of memory.
+  size_t first, k;
+
+  initMetarTable(reports);
+  first = findHistory(h, since);
+  for ( k = h->view.count; k > first; --k )
+    if ( copyPackedMetar(reports, &h->view, k - 1) != 0 )
+    {
+      freeMetarTable(reports);
+      return -1;
+    }
+  return (int)reports->count;
+}
+
+int isInHistory(const struct metar_history *restrict h, const struct metar_table *restrict reports, size_t k)
+{
+  // whether reports' k-th is already logged: same time, same text
+  const struct metar_packed *p = &reports->reports[k];
+  size_t j;
+
+  for ( j = findHistory(h, (time_t)p->observation_time);
+    (j < h->view.count) && (h->view.reports[j].observation_time == p->observation_time); ++j )
+    if ( strcmp(&h->view.strings[h->view.reports[j].raw_text], &reports->strings[p->raw_text]) == 0 )
+      return 1;
+  return 0;
+}
+
+int appendHistory(const char *restrict path, const char *restrict station, const struct metar_table *restrict fresh, time_t covered, time_t fetched)
+{
+  // logs whichever of fresh's reports aren't already, and that the log is
+  // now complete from covered until fetched.  reports newer than any
+  // logged, which is nearly always all of them, are written past the end
+  // and only then counted in the header; anything else has the log
+  // rewritten in order, aside, and renamed into place.
+  char file[METAR_BUFSIZE + 16], part[METAR_BUFSIZE + 32];
+  struct metar_packed tail[METAR_HISTORY_TAIL], *p;
+  struct metar_table added, merged, recent;
+  struct metar_history h;
+  struct history_header header;
+  int64_t newest;
+  uint32_t empty;
+  size_t k, j, n;
+  int valid, inPlace, ret, fd;
+
+  valid = (openHistory(&h, path, station, 1) == 0);
+  if ( h.strfd < 0 )
+  {
+    closeHistory(&h);
+    return -1;
+  }
+
+  // what's new, oldest first; fresh is newest first, and a handful
+  initMetarTable(&added);
+  initMetarTable(&merged);
+  ret = 0;
+  for ( k = fresh->count; (k > 0) && (ret == 0); --k )
+  {
+    if ( isInHistory(&h, fresh, k - 1) ) continue;
+    for ( j = 0; j < added.count; ++j )
+      if ( (added.reports[j].observation_time == fresh->reports[k - 1].observation_time)
+        && (strcmp(&added.strings[added.reports[j].raw_text], &fresh->strings[fresh->reports[k - 1].raw_text]) == 0) )
+        break;
+    if ( j < added.count ) continue;
+    if ( copyPackedMetar(&added, fresh, k - 1) != 0 ) ret = -1;
+
+    for ( j = added.count - 1; (j > 0) && (added.reports[j - 1].observation_time > added.reports[j].observation_time); --j )
+    {
+      struct metar_packed swap = added.reports[j];
+      added.reports[j] = added.reports[j - 1];
+      added.reports[j - 1] = swap;
+    }
+  }
+
+  newest = (h.view.count > 0) ? h.view.reports[h.view.count - 1].observation_time : INT64_MIN;
+  inPlace = valid && ((added.count == 0) || (added.reports[0].observation_time >= newest));
+
+  memset((void *)&header, 0, sizeof(struct history_header));
+  if ( valid ) header = h.header;
+  memcpy(header.magic, METAR_HISTORY_MAGIC, 4);
+  header.version = METAR_HISTORY_VERSION;
+  header.byteOrder = 0x01020304;
+  header.layout = (uint32_t)metarLayoutHash();
+  header.covered = (int64_t)covered;
+  header.fetched = (int64_t)fetched;
+
+  if ( (ret == 0) && inPlace && (added.count > 0) )
+  {
+    // added's strings start with the "" every table has; the log has one
+    for ( k = 0; k < added.count; ++k )
+    {
+      p = &added.reports[k];
+      if ( p->raw_text ) p->raw_text += (uint32_t)header.strings - 1;
+      if ( p->wx_string ) p->wx_string += (uint32_t)header.strings - 1;
+    }
+    n = added.count * sizeof(struct metar_packed);
+    if ( (pwrite(h.strfd, added.strings + 1, added.stringsLen - 1, sizeof(int64_t) + header.strings) != (ssize_t)(added.stringsLen - 1))
+      || (pwrite(h.fd, added.reports, n, sizeof(struct history_header) + header.count * sizeof(struct metar_packed)) != (ssize_t)n) )
+      ret = -1;
+    header.count += added.count;
+    header.strings += added.stringsLen - 1;
+  }
+  else if ( (ret == 0) && !inPlace )
+  {
+    // the two, merged by observation_time
+    for ( k = j = 0; (ret == 0) && ((k < h.view.count) || (j < added.count)); )
+    {
+      if ( (j >= added.count) || ((k < h.view.count) && (h.view.reports[k].observation_time <= added.reports[j].observation_time)) )
+        ret = copyPackedMetar(&merged, &h.view, k++);
+      else
+        ret = copyPackedMetar(&merged, &added, j++);
+    }
+    if ( (ret == 0) && (merged.stringsLen == 0) && (internMetarString(&merged, "", &empty) != 0) )
+      ret = -1;
+
+    header.generation = (int64_t)time(NULL) * 1000003 + (int64_t)getpid() + header.generation + 1;
+    header.count = merged.count;
+    header.strings = merged.stringsLen;
+
+    historyPath(file, path, station, "hstr");
+    snprintf(part, sizeof(part), "%s.%d", file, (int)getpid());
+    fd = (ret == 0) ? open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if ( (fd < 0)
+      || (write(fd, &header.generation, sizeof(int64_t)) != sizeof(int64_t))
+      || (write(fd, merged.strings, merged.stringsLen) != (ssize_t)merged.stringsLen) )
+      ret = -1;
+    if ( (fd >= 0) && (close(fd) != 0) ) ret = -1;
+    if ( (ret == 0) && (rename(part, file) != 0) ) ret = -1;
+    if ( ret != 0 ) unlink(part);
+
+    // the records, header first, go over the locked file itself
+    n = merged.count * sizeof(struct metar_packed);
+    if ( (ret == 0) && (((n > 0) && (pwrite(h.fd, merged.reports, n, sizeof(struct history_header)) != (ssize_t)n))
+      || (ftruncate(h.fd, sizeof(struct history_header) + n) != 0)) )
+      ret = -1;
+  }
+
+  // whenever the next one is due, going by the newest few
+  if ( ret == 0 )
+  {
+    initMetarTable(&recent);
+    recent.reports = tail;
+    for ( k = 0; (k < METAR_HISTORY_TAIL) && (k < header.count); ++k )
+    {
+      j = header.count - 1 - k;
+      if ( !inPlace ) tail[k] = merged.reports[j];
+      else if ( j >= h.view.count ) tail[k] = added.reports[j - h.view.count];
+      else tail[k] = h.view.reports[j];
+    }
+    recent.count = k;
+    header.expires = (int64_t)predictExpiry(&recent, fetched);
+
+    if ( pwrite(h.fd, &header, sizeof(struct history_header), 0) != sizeof(struct history_header) )
+      ret = -1;
+  }
+
+  freeMetarTable(&added);
+  freeMetarTable(&merged);
+  closeHistory(&h);
+  return ret;
+}
+
+int historyMetars(CURL *restrict curl, struct document *restrict doc, const char *restrict url, const char *restrict path, const char *restrict station, int hours, int flags, const struct metar_settings *restrict settings, struct metar_table *restrict reports, const char **restrict error)
+{
+  // with -H, the station's reports from the last `hours', answered from
+  // its history log.  if the log is stale, only the hours since its newest
+  // report are asked for, or all of them if it doesn't go back far enough.
+  // doc must have a parser.  returns 0 with reports its own, -1 (and why)
+  // if they can't be retrieved, or -2 if out of memory.
+  char request[METAR_MAXURL];
+  struct metar_history h;
+  time_t now, since, end, asked, logged;
+  CURLcode res;
+  int ask, fresh, count;
+
+  *error = NULL;
+  initMetarTable(reports);
+  now = time(NULL);
+  since = now - (time_t)hours * 3600;
+  ask = hours;
+  fresh = 0;
+  end = logged = 0;
+
+  if ( (openHistory(&h, path, station, 0) == 0) && (h.header.covered <= (int64_t)since) )
+  {
+    fresh = ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE)
+      && (((flags & METARFLAG_NOTS) == METARFLAG_NOTS) || (now < cacheDeadline((time_t)h.header.fetched, (time_t)h.header.expires, settings->maxAge)));
+
+    // complete until its newest report, or what was last asked for, less
+    // however late a report can be to show up
+    end = (h.view.count > 0) ? (time_t)h.view.reports[h.view.count - 1].observation_time
+      : (time_t)h.header.fetched - METAR_ISSUELAG;
+    logged = (time_t)h.header.covered;
+    if ( end > since )
+    {
+      ask = (end < now) ? (int)((now - end) / 3600) + 1 : 1;
+      if ( ask > hours ) ask = hours;
+    }
+  }
+  if ( fresh )
+  {
+    count = readHistory(&h, since, reports);
+    closeHistory(&h);
+    return (count < 0) ? -2 : 0;
+  }
+  closeHistory(&h);
+
+  snprintf(request, METAR_MAXURL,
+    "%s?dataSource=metars&requestType=retrieve&format=xml&stationString=%s&hoursBeforeNow=%d",
+    url,
+    station,
+    ask);
+  request[METAR_MAXURL - 1] = '\0';
+  setupTransfer(curl, request, doc);
+  res = performRequest(curl, doc);
+  if ( doc->stats ) addTransferStats(doc->stats, curl);
+  if ( res != CURLE_OK )
+  {
+    if ( doc->parser->error == -2 ) return -2;
+    *error = curl_easy_strerror(res);
+    return -1;
+  }
+  if ( doc->status >= 400 )
+  {
+    *error = statusReason(doc->status);
+    return -1;
+  }
+  switch ( finishMetarParser(doc->parser) )
+  {
+    case -2: return -2;
+    case -1: *error = "invalid XML data"; return -1;
+  }
+
+  // what was asked for joins up with the log if it reaches back to its end
+  asked = now - (time_t)ask * 3600;
+  if ( appendHistory(path, station, &doc->parser->reports, (end && (asked <= end)) ? logged : asked, now) != 0 )
+  {
+    // can't be kept, but can still be shown, if it's all there
+    if ( ask == hours )
+    {
+      *reports = doc->parser->reports;
+      initMetarTable(&doc->parser->reports);
+      return 0;
+    }
+    *error = "cannot keep its history";
+    return -1;
+  }
+
+  count = -1;
+  if ( openHistory(&h, path, station, 0) == 0 )
+    count = readHistory(&h, since, reports);
+  closeHistory(&h);
+  if ( count == -1 ) return -2;
+  return 0;
+}
+
+struct fetch_pool *openFetchPool(int jobs)
+{
+  // a multi handle with `jobs' easy handles that outlive any one batch of
+  // transfers.  DNS, TLS sessions and connections are shared between them,
+  // so consecutive requests to the same host normally ride an existing
+  // keep-alive connection.
+  struct fetch_pool *pool;
+  int k;
+
+  pool = (struct fetch_pool *)calloc(1, sizeof(struct fetch_pool));
+  if ( !pool ) return NULL;
+
+  pool->jobs = jobs;
+  pool->multi = curl_multi_init();
+  pool->share = curl_share_init();
+  pool->handles = (CURL **)calloc(jobs, sizeof(CURL *));
+  if ( !pool->multi || !pool->share || !pool->handles )
+  {
+    closeFetchPool(pool);
+    return NULL;
+  }
+
+  curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+  curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  curl_multi_setopt(pool->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)jobs);
+  curl_multi_setopt(pool->multi, CURLMOPT_MAXCONNECTS, (long)jobs);
+
+  for ( k = 0; k < jobs; ++k )
+  {
+    pool->handles[k] = curl_easy_init();
+    if ( !pool->handles[k] )
+    {
+      closeFetchPool(pool);
+      return NULL;
+    }
+    curl_easy_setopt(pool->handles[k], CURLOPT_SHARE, pool->share);
+  }
+
+  return pool;
+}
+
+void closeFetchPool(struct fetch_pool *pool)
+{
+  int k;
+
+  if ( !pool ) return;
+  for ( k = 0; pool->handles && (k < pool->jobs); ++k )
+    if ( pool->handles[k] ) curl_easy_cleanup(pool->handles[k]);
+  if ( pool->handles ) free(pool->handles);
+  if ( pool->multi ) curl_multi_cleanup(pool->multi);
+  if ( pool->share ) curl_share_cleanup(pool->share);
+  free(pool);
+}
+
+struct fetch_run *startFetch(CURL *curl, struct fetch_pool *pool, struct metar_cache *cache, const char *url, const char *path, int hours, int flags, const struct metar_settings *settings, int first, int last, const char *argv[], struct prefetch *slots)
+{
+  // gathers every station in argv[first..last) that isn't served by the
+  // cache into requests: with METARFLAG_BATCH, as many stations to each as
+  // METAR_MAXURL allows.  each one's slot is set to -1 until its request
+  // has landed and been fanned out by finishTransfer(); nothing is
+  // retrieved until stepFetch() or awaitStation() is called.  given a pool,
+  // the first pool->jobs requests are queued on it straight away.
+  char request[METAR_MAXURL], projection[METAR_BUFSIZE];
+  char tmp[METAR_BUFSIZE + 11];
+  struct fetch_run *run;
+  struct transfer *xfer;
+  size_t base, len, idLen, k;
+  int i, named, chunk;
+
+  run = (struct fetch_run *)calloc(1, sizeof(struct fetch_run));
+  if ( !run ) return NULL;
+  run->curl = curl;
+  run->pool = pool;
+  run->cache = cache;
+  run->path = path;
+  run->flags = flags;
+  run->argv = argv;
+  run->slots = slots;
+  run->settings = *settings;
+
+  projectionQuery(projection, sizeof(projection), (flags & METARFLAG_BATCH) == METARFLAG_BATCH, &run->settings.wanted);
+  base = snprintf(request, METAR_MAXURL,
+    "%s?dataSource=metars&requestType=retrieve&format=xml&hoursBeforeNow=%d%s&stationString=",
+    url,
+    hours,
+    projection);
+  if ( base >= METAR_MAXURL )
+    return run; // nothing fits; leave everyone to the one-at-a-time path
+
+  run->xfers = (struct transfer *)calloc(last - first, sizeof(struct transfer));
+  if ( !run->xfers )
+  {
+    free(run);
+    return NULL;
+  }
+
+  // gather the uncached stations into requests
+  named = i = first;
+  while ( i < last )
+  {
+    len = base;
+    chunk = 0;
+    xfer = &run->xfers[run->count];
+    for ( xfer->first = i; i < last; ++i )
+    {
+      // or already had from somewhere else (see --feed)
+      if ( slots[i].done || isStationFresh(cache, path, argv[i], flags, &run->settings) )
+        continue;
+
+      if ( (chunk > 0) && ((flags & METARFLAG_BATCH) != METARFLAG_BATCH) )
+        break;
+
+      idLen = strlen(argv[i]);
+      if ( (len + idLen + 1) >= METAR_MAXURL )
+        break;
+
+      if ( chunk > 0 )
+        request[len++] = ',';
+      memcpy(&request[len], argv[i], idLen);
+      len += idLen;
+      request[len] = '\0';
+
+      slots[i].done = -1; // part of this request
+      named = i;
+      ++chunk;
+    }
+    xfer->last = i;
+
+    if ( chunk == 0 )
+    {
+      if ( i < last ) ++i; // too long to batch; fetched on its own later
+      continue;
+    }
+
+    // combined responses are re-serialized per report as they're parsed,
+    // so that each station's share can be cached on its own.
+    xfer->single = (chunk == 1);
+    xfer->request = strdup(request);
+    xfer->doc.data = malloc(1);
+    xfer->doc.len = 0;
+    xfer->doc.size = 1;
+    xfer->doc.parser = newMetarParser(!xfer->single, run->settings.wanted.fields);
+    if ( !xfer->single && pool && (pool->jobs > 1) )
+      xfer->doc.window = METAR_DECODEWINDOW;
+    if ( (flags & METARFLAG_STATS) == METARFLAG_STATS )
+      xfer->doc.stats = &xfer->stats;
+
+    // one station's stale copy may only need revalidating; combined
+    // requests are always made in full
+    if ( xfer->single && ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE) )
+    {
+      cachePath(tmp, path, argv[named]);
+      if ( ((cache ? findCachedValidators(cache, argv[named], &run->settings.wanted, &xfer->known) : readValidators(tmp, &xfer->known, &run->settings.wanted)) == 0)
+        && ((xfer->known.etag[0] != '\0') || (xfer->known.modified[0] != '\0')) )
+        xfer->doc.known = &xfer->known;
+    }
+    ++run->count;
+    if ( !xfer->request || !xfer->doc.data || !xfer->doc.parser )
+    {
+      endFetch(run);
+      return NULL;
+    }
+    xfer->doc.data[0] = '\0';
+  }
+
+  // the pool's handles each take a request to begin with, as far as the
+  // limiter allows
+  if ( pool )
+  {
+    run->idle = (CURL **)malloc(pool->jobs * sizeof(CURL *));
+    if ( !run->idle )
+    {
+      endFetch(run);
+      return NULL;
+    }
+    for ( k = pool->jobs; k > 0; --k )
+      run->idle[run->idles++] = pool->handles[k - 1];
+    dispatchFetch(run);
+  }
+
+  return run;
+}
+
+void dispatchFetch(struct fetch_run *run)
+{
+  // hands the pool's idle handles whatever requests are due, those being
+  // retried first, for as long as the limiter lets them go.  the handle
+  // last to finish goes first, so its connection is the one reused.
+  struct transfer *xfer;
+  CURL *handle;
+  size_t k;
+
+  while ( run->idles > 0 )
+  {
+    xfer = NULL;
+    for ( k = 0; run->retries && !xfer && (k < run->next); ++k )
+      if ( run->xfers[k].retry ) xfer = &run->xfers[k];
+    if ( !xfer && (run->next < run->count) ) xfer = &run->xfers[run->next];
+    if ( !xfer || (requestDelay(1) > 0) ) return;
+
+    if ( xfer->retry )
+    {
+      xfer->retry = 0;
+      --run->retries;
+    }
+    else
+      ++run->next;
+
+    handle = run->idle[--run->idles];
+    setupTransfer(handle, xfer->request, &xfer->doc);
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, (void *)xfer);
+    curl_multi_add_handle(run->pool->multi, handle);
+    ++run->active;
+  }
+}
+
+int stepFetch(struct fetch_run *run)
+{
+  // moves the run along until at least one more request has landed (and
+  // finishTransfer() has handed out its stations).  without a pool,
+  // requests are made one at a time on run->curl, in order.  either way
+  // they go as the limiter allows, and those the service fails go again.
+  // 0, or -1 if out of memory.
+  CURLMsg *msg;
+  struct transfer *xfer;
+  struct fetch_pool *pool;
+  int64_t delay;
+  int running, queued, landed, wait;
+
+  if ( run->error || (run->landed >= run->count) ) return run->error;
+
+  pool = run->pool;
+  if ( !pool )
+  {
+    xfer = &run->xfers[run->next++];
+    setupTransfer(run->curl, xfer->request, &xfer->doc);
+    xfer->res = performRequest(run->curl, &xfer->doc);
+    addTransferStats(&xfer->stats, run->curl);
+    return finishTransfer(run, xfer);
+  }
+
+  for ( landed = 0; !landed && !run->error; )
+  {
+    if ( curl_multi_perform(pool->multi, &running) != CURLM_OK )
+    {
+      run->error = -1;
+      break;
+    }
+
+    while ( (msg = curl_multi_info_read(pool->multi, &queued)) != NULL )
+    {
+      if ( msg->msg != CURLMSG_DONE ) continue;
+
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&xfer);
+      xfer->res = msg->data.result;
+      addTransferStats(&xfer->stats, msg->easy_handle);
+      curl_multi_remove_handle(pool->multi, msg->easy_handle);
+      run->idle[run->idles++] = msg->easy_handle;
+      --run->active;
+
+      if ( noteRequest(xfer->res, &xfer->doc, xfer->attempts++) )
+      {
+        // goes again once the backoff is over
+        rewindDocument(&xfer->doc);
+        xfer->retry = 1;
+        ++run->retries;
+        continue;
+      }
+
+      // hand the now-idle handle (and its connection) to the next request
+      // before this one's decoded, so that it's under way while it is
+      dispatchFetch(run);
+      finishTransfer(run, xfer);
+      landed = 1;
+    }
+
+    if ( landed ) break;
+    dispatchFetch(run);
+    if ( (run->active == 0) && (run->retries == 0) && (run->next >= run->count) ) break;
+
+    // until something arrives, or the limiter lets another request go
+    wait = 1000;
+    if ( (run->idles > 0) && ((run->retries > 0) || (run->next < run->count)) )
+    {
+      delay = requestDelay(0) / 1000 + 1;
+      if ( delay < wait ) wait = (int)delay;
+    }
+    if ( run->active == 0 )
+      sleepMicros((int64_t)wait * 1000);
+    else if ( curl_multi_wait(pool->multi, NULL, 0, wait, NULL) != CURLM_OK )
+      run->error = -1;
+  }
+
+  return run->error;
+}
+
+int awaitStation(struct fetch_run *run, int station)
+{
+  // steps the run until argv[station] has been handed out, if it's part
+  // of a request at all.  0, or -1 if out of memory.
+  while ( !run->error && (run->slots[station].done == -1) && (run->landed < run->count) )
+    stepFetch(run);
+
+  return run->error;
+}
+
+int finishTransfer(struct fetch_run *run, struct transfer *xfer)
+{
+  // finishes decoding a request that has landed and fans its reports out
+  // to the stations it covers, in argv order, writing each station's own
+  // cache file so that later runs can't tell the difference.  a combined
+  // response that outgrew its window (METAR_DECODEWINDOW) is decoded here
+  // on pool->jobs threads, now that it has all arrived.  the request's
+  // memory goes back as soon as it's done with.
+  char tmp[METAR_BUFSIZE + 11];
+  struct metar_parser *parser;
+  struct metar_table kept; // a revalidated copy
+  struct prefetch *slots;
+  const char **argv;
+  const char *error;
+  size_t k, n;
+  int64_t mark;
+  int s, credited;
+  gzFile fp;
+
+  ++run->landed;
+  if ( run->error ) return run->error;
+
+  slots = run->slots;
+  argv = run->argv;
+  parser = xfer->doc.parser;
+  error = NULL;
+
+  if ( parser->error == -2 )
+  {
+    run->error = -1;
+    return run->error;
+  }
+  else if ( xfer->res != CURLE_OK )
+  {
+    error = curl_easy_strerror(xfer->res);
+  }
+  else if ( xfer->doc.status >= 400 )
+  {
+    // whatever's in the body, it isn't this bunch of reports
+    error = statusReason(xfer->doc.status);
+  }
+  else if ( xfer->doc.known && (xfer->doc.status == 304) )
+  {
+    // nothing to decode; see below
+  }
+  else if ( xfer->doc.window && (xfer->doc.len > xfer->doc.window) )
+  {
+    // too big to have been parsed on the way in; start over, in parallel
+    mark = clockMicros();
+    resetMetarParser(parser);
+    switch ( decodeMetars(parser, xfer->doc.data, xfer->doc.len, run->pool->jobs) )
+    {
+      case -2: run->error = -1; return run->error;
+      case -1: error = "invalid XML data"; break;
+    }
+    xfer->stats.parse += clockMicros() - mark;
+  }
+  else
+  {
+    mark = clockMicros();
+    switch ( finishMetarParser(parser) )
+    {
+      case -2: run->error = -1; return run->error;
+      case -1: error = "invalid XML data"; break;
+    }
+    xfer->stats.parse += clockMicros() - mark;
+  }
+
+  for ( credited = 0, s = xfer->first; (s < xfer->last) && !run->error; ++s )
+  {
+    if ( slots[s].done != -1 ) continue;
+
+    // the whole request is put down to the first station it covers
+    if ( !credited ) slots[s].stats = xfer->stats;
+    credited = 1;
+
+    slots[s].done = 1;
+    slots[s].error = error;
+    if ( error ) continue;
+
+    cachePath(tmp, run->path, argv[s]);
+    if ( xfer->doc.known && (xfer->doc.status == 304) )
+    {
+      // unchanged since: what's cached will do, as if just retrieved.
+      // if it's gone in the meantime, the one-at-a-time path asks again.
+      mark = clockMicros();
+      resetArena(&run->scratch);
+      if ( revalidateStation(run->cache, tmp, argv[s], &run->settings, &kept, &run->scratch) != 0 )
+      {
+        slots[s].done = 0;
+        continue;
+      }
+      slots[s].stats.cache += clockMicros() - mark;
+      for ( k = 0; (k < kept.count) && !run->error; ++k )
+        if ( copyPackedMetar(&slots[s].reports, &kept, k) != 0 )
+          run->error = -1;
+      continue;
+    }
+
+    // a request for one station is taken at its word, exactly as the
+    // one-at-a-time path does; combined ones are split by station_id.
+    if ( xfer->single )
+    {
+      slots[s].reports = parser->reports;
+      initMetarTable(&parser->reports);
+
+      if ( run->cache )
+      {
+        storeCachedReports(run->cache, argv[s], &slots[s].reports, &xfer->doc.validators, &run->settings.wanted);
+      }
+      else if ( (fp = createCacheFile(tmp, run->flags)) != NULL )
+      {
+        gzwrite(fp, xfer->doc.data, (unsigned int)xfer->doc.len);
+        gzclose(fp);
+        writeSidecar(tmp, &slots[s].reports, &xfer->doc.validators, &run->settings.wanted);
+      }
+      continue;
+    }
+
+    for ( n = 0, k = 0; k < parser->reports.count; ++k )
+      if ( strcasecmp(parser->reports.reports[k].station_id, argv[s]) == 0 )
+        ++n;
+
+    fp = run->cache ? NULL : createCacheFile(tmp, run->flags);
+    if ( fp )
+      gzprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<response>\n  <data num_results=\"%u\">\n", (unsigned int)n);
+
+    for ( k = 0; k < parser->reports.count; ++k )
+    {
+      if ( strcasecmp(parser->reports.reports[k].station_id, argv[s]) != 0 ) continue;
+
+      if ( copyPackedMetar(&slots[s].reports, &parser->reports, k) != 0 )
+      {
+        run->error = -1;
+        break;
+      }
+      if ( fp )
+      {
+        gzputs(fp, "    ");
+        gzwrite(fp, &parser->echo.data[parser->spans[k * 2]], (unsigned int)(parser->spans[k * 2 + 1] - parser->spans[k * 2]));
+        gzputs(fp, "\n");
+      }
+    }
+
+    if ( fp )
+    {
+      gzputs(fp, "  </data>\n</response>\n");
+      gzclose(fp);
+      if ( !run->error ) writeSidecar(tmp, &slots[s].reports, NULL, &run->settings.wanted);
+      else unlink(tmp);
+    }
+
+    if ( run->error ) break;
+    if ( run->cache )
+      storeCachedReports(run->cache, argv[s], &slots[s].reports, NULL, &run->settings.wanted);
+  }
+
+  freeTransfer(xfer);
+  return run->error;
+}
+
+void freeTransfer(struct transfer *xfer)
+{
+  if ( xfer->request ) free(xfer->request);
+  if ( xfer->doc.data ) free(xfer->doc.data);
+  if ( xfer->doc.parser ) freeMetarParser(xfer->doc.parser);
+  if ( xfer->doc.headers ) curl_slist_free_all(xfer->doc.headers);
+  xfer->request = NULL;
+  xfer->doc.data = NULL;
+  xfer->doc.parser = NULL;
+  xfer->doc.headers = NULL;
+}
+
+int endFetch(struct fetch_run *run)
+{
+  // frees the run, whether or not everything in it has landed, and leaves
+  // the pool idle for next time.  whatever stepFetch() last returned.
+  size_t k;
+  int ret;
+
+  if ( !run ) return 0;
+
+  ret = run->error;
+  if ( run->pool )
+    for ( k = 0; k < (size_t)run->pool->jobs; ++k )
+      curl_multi_remove_handle(run->pool->multi, run->pool->handles[k]);
+  for ( k = 0; k < run->count; ++k )
+    freeTransfer(&run->xfers[k]);
+  if ( run->xfers ) free(run->xfers);
+  if ( run->idle ) free(run->idle);
+  freeArena(&run->scratch);
+  free(run);
+  return ret;
+}
+
+int fetchStations(CURL *curl, struct fetch_pool *pool, struct metar_cache *cache, const char *url, const char *path, int hours, int flags, const struct metar_settings *settings, int first, int last, const char *argv[], struct prefetch *slots)
+{
+  // the whole of a run at once: every station in argv[first..last) that
+  // isn't served by the cache is retrieved, and its reports are handed
+  // back through slots[] in argv order.  see startFetch().
+  struct fetch_run *run;
+
+  run = startFetch(curl, pool, cache, url, path, hours, flags, settings, first, last, argv, slots);
+  if ( !run ) return -1;
+
+  while ( !run->error && (run->landed < run->count) )
+    stepFetch(run);
+
+  return endFetch(run);
+}
+
+int loadFeed(CURL *restrict curl, const char *restrict url, const char *restrict path, int flags, const struct metar_settings *restrict settings, struct metar_table *restrict reports, struct arena *restrict scratch)
+{
+  // every station's reports from a bulk file of raw METARs at url (see
+  // decodeMetarCycle()), kept as <path>metar-feed.txt with its decoded
+  // sidecar beside it.  the file is rewritten all the time, so a copy is
+  // trusted for METAR_OLDAGE seconds (or -a, if that's less).  reports is
+  // borrowed from scratch, or owned if it was just retrieved.  returns 0,
+  // -1 if the feed can't be retrieved, or -2 if out of memory.
+  char file[METAR_BUFSIZE + 16];
+  struct document doc;
+  time_t now;
+  CURLcode res;
+  gzFile fp;
+  int count;
+
+  snprintf(file, sizeof(file), "%smetar-feed.txt", path);
+  initMetarTable(reports);
+  if ( ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE) && isCacheFresh(file, flags, settings)
+    && (readSidecar(file, reports, scratch) == 0) )
+    return 0;
+
+  memset((void *)&doc, 0, sizeof(struct document));
+  doc.data = malloc(1);
+  doc.size = 1;
+  if ( !doc.data ) return -2;
+  doc.data[0] = '\0';
+
+  setupTransfer(curl, url, &doc);
+  res = performRequest(curl, &doc);
+  if ( doc.headers ) curl_slist_free_all(doc.headers);
+  if ( (res != CURLE_OK) || (doc.status >= 400) || (doc.len == 0) )
+  {
+    free(doc.data);
+    return -1;
+  }
+
+  now = time(NULL);
+  count = decodeMetarCycle(doc.data, doc.len, now, reports);
+  if ( count >= 0 )
+  {
+    if ( (fp = createCacheFile(file, flags)) != NULL )
+    {
+      // what raw text decodes to, whatever this run shows
+      gzwrite(fp, doc.data, (unsigned int)doc.len);
+      gzclose(fp);
+      if ( writeSidecar(file, reports, &doc.validators, &wholeReports) == 0 )
+        touchSidecar(file, now + METAR_OLDAGE);
+    }
+  }
+  free(doc.data);
+
+  if ( count < 0 )
+  {
+    freeMetarTable(reports);
+    return -2;
+  }
+  return 0;
+}
+
+int comparePicks(const void *a, const void *b)
+{
+  // by station, then newest first as the service has them, then in
+  // document order
+  const struct prefetch_pick *x = (const struct prefetch_pick *)a, *y = (const struct prefetch_pick *)b;
+  int order = strcasecmp(x->station, y->station);
+
+  if ( order != 0 ) return order;
+  if ( x->observed != y->observed ) return (x->observed > y->observed) ? -1 : 1;
+  return (x->k < y->k) ? -1 : (x->k > y->k);
+}
+
+int prefetchMetars(CURL *restrict curl, struct metar_cache *restrict cache, const char *restrict url, const char *restrict path, int flags, const struct metar_settings *restrict settings)
+{
+  // fills the cache for every station in one of the service's bulk files
+  // (METAR_PREFETCHURL), gzip'd XML in the same form as its responses.  it
+  // is decompressed and decoded as it arrives, then split by station just
+  // as a combined request is (see finishTransfer()).  when it was last
+  // retrieved, and with what validators, is kept beside an empty
+  // <path>metar-prefetch.xml, so it's asked for at most once every
+  // METAR_OLDAGE seconds and only sent again if it has changed.  returns
+  // how many stations were cached, -1 if the file can't be retrieved or
+  // decoded, or -2 if out of memory.
+  char stamp[METAR_BUFSIZE + 16], tmp[METAR_BUFSIZE + 11];
+  struct prefetch_pick *picks;
+  struct metar_parser *parser;
+  struct metar_table station;
+  struct validators known;
+  struct inflater *z;
+  struct document doc;
+  size_t i, j, k, n;
+  CURLcode res;
+  int ret, attempt;
+  gzFile xml;
+  FILE *fp;
+
+  snprintf(stamp, sizeof(stamp), "%smetar-prefetch.xml", path);
+  if ( ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE) && isCacheFresh(stamp, flags, settings) )
+    return 0;
+
+  memset((void *)&doc, 0, sizeof(struct document));
+  if ( ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE) && (readValidators(stamp, &known, &settings->wanted) == 0) )
+    doc.known = &known;
+
+  // every station's copy is whole, whatever this run shows
+  z = (struct inflater *)calloc(1, sizeof(struct inflater));
+  parser = newMetarParser(cache ? 0 : 1, wholeReports.fields);
+  if ( !z || !parser )
+  {
+    if ( z ) free(z);
+    if ( parser ) freeMetarParser(parser);
+    return -2;
+  }
+  z->parser = parser;
+
+  setupTransfer(curl, url, &doc);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, inflateDocument);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)z);
+  for ( attempt = 0; ; ++attempt )
+  {
+    // performRequest(), but what's to start over is the inflater's
+    awaitRequest();
+    res = curl_easy_perform(curl);
+    if ( (z->error == -2) || !noteRequest(res, &doc, attempt) ) break;
+    if ( z->state == 1 ) inflateEnd(&z->stream);
+    z->state = z->error = 0;
+    z->bytes = 0;
+    resetMetarParser(parser);
+    rewindDocument(&doc);
+  }
+  if ( doc.headers ) curl_slist_free_all(doc.headers);
+  if ( z->state == 1 ) inflateEnd(&z->stream);
+
+  ret = 0;
+  if ( z->error == -2 )
+    ret = -2;
+  else if ( doc.known && (doc.status == 304) )
+    ret = -3; // unchanged; every station's copy stands
+  else if ( (res != CURLE_OK) || (doc.status >= 400) || z->error )
+    ret = -1;
+  else if ( (ret = finishMetarParser(parser)) >= 0 )
+    ret = 0;
+  free(z);
+
+  // every station's reports, together
+  picks = NULL;
+  n = parser->reports.count;
+  if ( (ret == 0) && (n > 0) )
+  {
+    picks = (struct prefetch_pick *)malloc(sizeof(struct prefetch_pick) * n);
+    if ( !picks ) ret = -2;
+  }
+  if ( picks )
+  {
+    for ( k = 0; k < n; ++k )
+    {
+      memcpy(picks[k].station, parser->reports.reports[k].station_id, 5);
+      picks[k].station[5] = '\0';
+      picks[k].observed = parser->reports.reports[k].observation_time;
+      picks[k].k = k;
+    }
+    qsort(picks, n, sizeof(struct prefetch_pick), comparePicks);
+  }
+
+  for ( k = 0; (ret >= 0) && (k < n); k = j )
+  {
+    for ( j = k; (j < n) && (strcasecmp(picks[j].station, picks[k].station) == 0); ++j ) ;
+    // ids come from the file; only plain ones are made into file names
+    for ( i = 0; isalnum((unsigned char)picks[k].station[i]); ++i ) ;
+    if ( (i == 0) || (picks[k].station[i] != '\0') ) continue;
+
+    initMetarTable(&station);
+    for ( i = k; (i < j) && (ret >= 0); ++i )
+      if ( copyPackedMetar(&station, &parser->reports, picks[i].k) != 0 )
+        ret = -2;
+
+    if ( ret >= 0 )
+    {
+      if ( cache )
+        storeCachedReports(cache, picks[k].station, &station, NULL, &wholeReports);
+      else
+      {
+        cachePath(tmp, path, picks[k].station);
+        if ( (xml = createCacheFile(tmp, flags)) != NULL )
+        {
+          gzprintf(xml, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<response>\n  <data num_results=\"%u\">\n", (unsigned int)(j - k));
+          for ( i = k; i < j; ++i )
+          {
+            gzputs(xml, "    ");
+            gzwrite(xml, &parser->echo.data[parser->spans[picks[i].k * 2]], (unsigned int)(parser->spans[picks[i].k * 2 + 1] - parser->spans[picks[i].k * 2]));
+            gzputs(xml, "\n");
+          }
+          gzputs(xml, "  </data>\n</response>\n");
+          gzclose(xml);
+          writeSidecar(tmp, &station, NULL, &wholeReports);
+        }
+      }
+      ++ret;
+    }
+    freeMetarTable(&station);
+  }
+  // and where they all are, for --near and --bbox
+  if ( ret >= 0 ) updateStationIndex(path, &parser->reports);
+  if ( picks ) free(picks);
+  freeMetarParser(parser);
+
+  // stamped even if unchanged, so the next look is a cycle away
+  if ( (ret >= 0) || (ret == -3) )
+  {
+    if ( ret >= 0 )
+    {
+      initMetarTable(&station);
+      unlink(stamp);
+      if ( (fp = fopen(stamp, "w")) != NULL )
+      {
+        fclose(fp);
+        writeSidecar(stamp, &station, &doc.validators, &wholeReports);
+      }
+    }
+    touchSidecar(stamp, time(NULL) + METAR_OLDAGE);
+  }
+
+  return (ret == -3) ? 0 : ret;
+}
+
+uint32_t stationCell(double latitude, double longitude)
+{
+  // the grid is by rows of latitude from the south pole, each starting at
+  // the antimeridian
+  int row, col;
+
+  row = (int)floor(latitude + 90.0);
+  col = (int)floor(longitude + 180.0) % 360;
+  if ( row < 0 ) row = 0;
+  if ( row > 179 ) row = 179;
+  if ( col < 0 ) col += 360;
+  return (uint32_t)(row * 360 + col);
+}
+
+int compareStationIds(const void *a, const void *b)
+{
+  return strcmp(((const struct station_location *)a)->station, ((const struct station_location *)b)->station);
+}
+
+int compareStationCells(const void *a, const void *b)
+{
+  // by cell, then id
+  const struct station_location *x = (const struct station_location *)a, *y = (const struct station_location *)b;
+
+  if ( x->cell != y->cell ) return (x->cell < y->cell) ? -1 : 1;
+  return strcmp(x->station, y->station);
+}
+
+int compareStationMatches(const void *a, const void *b)
+{
+  // nearest first, then by id
+  const struct station_match *x = (const struct station_match *)a, *y = (const struct station_match *)b;
+
+  if ( x->nm != y->nm ) return (x->nm < y->nm) ? -1 : 1;
+  return strcmp(x->station.station, y->station.station);
+}
+
+int openStationIndex(struct station_index *restrict ix, const char *restrict path)
+{
+  // maps <path>metar-stations.bin.  fails if there's none, or it was
+  // written by an incompatible build.
+  char file[METAR_BUFSIZE + 24];
+  struct stat fs;
+  size_t cells;
+  int fd;
+
+  memset((void *)ix, 0, sizeof(struct station_index));
+  snprintf(file, sizeof(file), "%smetar-stations.bin", path);
+  fd = open(file, O_RDONLY);
+  if ( fd < 0 ) return -1;
+
+  cells = sizeof(uint32_t) * (METAR_GRID_CELLS + 1);
+  if ( (fstat(fd, &fs) != 0) || ((size_t)fs.st_size < sizeof(struct station_header) + cells) )
+  {
+    close(fd);
+    return -1;
+  }
+  ix->size = (size_t)fs.st_size;
+  ix->map = mmap(NULL, ix->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if ( ix->map == MAP_FAILED )
+  {
+    ix->map = NULL;
+    return -1;
+  }
+
+  ix->header = (const struct station_header *)ix->map;
+  ix->cells = (const uint32_t *)(ix->header + 1);
+  ix->stations = (const struct station_location *)(ix->cells + METAR_GRID_CELLS + 1);
+  if ( (memcmp(ix->header->magic, METAR_STATIONS_MAGIC, 4) != 0)
+    || (ix->header->version != METAR_STATIONS_VERSION)
+    || (ix->header->byteOrder != 0x01020304)
+    || (ix->size != sizeof(struct station_header) + cells + sizeof(struct station_location) * ix->header->count)
+    || (ix->cells[METAR_GRID_CELLS] != ix->header->count) )
+  {
+    closeStationIndex(ix);
+    return -1;
+  }
+  return 0;
+}
+
+void closeStationIndex(struct station_index *ix)
+{
+  if ( ix->map ) munmap(ix->map, ix->size);
+  memset((void *)ix, 0, sizeof(struct station_index));
+}
+
+int updateStationIndex(const char *restrict path, const struct metar_table *restrict reports)
+{
+  // adds where reports' stations are to the index, their latest position
+  // replacing what it had.  written aside and renamed into place.
+  char file[METAR_BUFSIZE + 24], part[METAR_BUFSIZE + 40];
+  struct station_location *all, *loc;
+  const struct metar_packed *p;
+  struct station_header header;
+  struct station_index ix;
+  struct iovec iov[3];
+  uint32_t *cells;
+  size_t k, j, n, fresh, have;
+  ssize_t want;
+  int fd, ret;
+
+  have = (openStationIndex(&ix, path) == 0) ? ix.header->count : 0;
+  all = (struct station_location *)malloc(sizeof(struct station_location) * (reports->count + have + 1));
+  cells = (uint32_t *)calloc(METAR_GRID_CELLS + 1, sizeof(uint32_t));
+  if ( !all || !cells )
+  {
+    if ( all ) free(all);
+    if ( cells ) free(cells);
+    closeStationIndex(&ix);
+    return -1;
+  }
+
+  // only reports that say where they are, from stations with plain ids
+  for ( n = 0, k = 0; k < reports->count; ++k )
+  {
+    p = &reports->reports[k];
+    if ( (p->present & 3) != 3 ) continue;
+    for ( j = 0; (j < 5) && isalnum((unsigned char)p->station_id[j]); ++j ) ;
+    if ( (j == 0) || ((j < 5) && (p->station_id[j] != '\0')) ) continue;
+
+    loc = &all[n++];
+    memset((void *)loc, 0, sizeof(struct station_location));
+    for ( j = 0; (j < 5) && p->station_id[j]; ++j )
+      loc->station[j] = toupper((unsigned char)p->station_id[j]);
+    loc->latitude = p->latitude;
+    loc->longitude = p->longitude;
+    loc->elevation_m = (p->present & (1U << 17)) ? p->elevation_m : INT32_MIN;
+  }
+
+  // one each, and whatever the index had of the others
+  qsort(all, n, sizeof(struct station_location), compareStationIds);
+  for ( fresh = 0, k = 0; k < n; ++k )
+    if ( (fresh == 0) || (strcmp(all[fresh - 1].station, all[k].station) != 0) )
+      all[fresh++] = all[k];
+  for ( n = fresh, k = 0; k < have; ++k )
+    if ( !bsearch(&ix.stations[k], all, fresh, sizeof(struct station_location), compareStationIds) )
+      all[n++] = ix.stations[k];
+  closeStationIndex(&ix);
+
+  for ( k = 0; k < n; ++k )
+    all[k].cell = stationCell(all[k].latitude / 1e5, all[k].longitude / 1e5);
+  qsort(all, n, sizeof(struct station_location), compareStationCells);
+
+  // where each cell starts; the last one is where they all end
+  for ( k = 0; k < n; ++k )
+    ++cells[all[k].cell + 1];
+  for ( k = 1; k <= METAR_GRID_CELLS; ++k )
+    cells[k] += cells[k - 1];
+
+  memset((void *)&header, 0, sizeof(struct station_header));
+  memcpy(header.magic, METAR_STATIONS_MAGIC, 4);
+  header.version = METAR_STATIONS_VERSION;
+  header.byteOrder = 0x01020304;
+  header.count = (uint32_t)n;
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(struct station_header);
+  iov[1].iov_base = cells;
+  iov[1].iov_len = sizeof(uint32_t) * (METAR_GRID_CELLS + 1);
+  iov[2].iov_base = all;
+  iov[2].iov_len = sizeof(struct station_location) * n;
+  want = (ssize_t)(iov[0].iov_len + iov[1].iov_len + iov[2].iov_len);
+
+  snprintf(file, sizeof(file), "%smetar-stations.bin", path);
+  snprintf(part, sizeof(part), "%s.%d", file, (int)getpid());
+  ret = -1;
+  fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if ( fd >= 0 )
+  {
+    ret = (writev(fd, iov, 3) == want) ? 0 : -1;
+    if ( close(fd) != 0 ) ret = -1;
+    if ( (ret == 0) && (rename(part, file) != 0) ) ret = -1;
+    if ( ret != 0 ) unlink(part);
+  }
+
+  free(all);
+  free(cells);
+  return ret;
+}
+
+double stationDistance(double lat1, double lon1, double lat2, double lon2)
+{
+  // great-circle distance in nautical miles, by the haversine formula
+  double dlat, dlon, a;
+
+  lat1 *= M_PI / 180.0;
+  lat2 *= M_PI / 180.0;
+  dlat = lat2 - lat1;
+  dlon = (lon2 - lon1) * M_PI / 180.0;
+  a = sin(dlat / 2) * sin(dlat / 2) + cos(lat1) * cos(lat2) * sin(dlon / 2) * sin(dlon / 2);
+  if ( a > 1.0 ) a = 1.0;
+  return 2.0 * METAR_EARTH_NM * asin(sqrt(a));
+}
+
+int findStations(const char *restrict path, const struct station_area *restrict area, struct station_match **restrict found, size_t *restrict count)
+{
+  // the stations in area, looked up a grid cell at a time: nearest first
+  // for a radius, by id for a box.  returns 0 with found ours to free(),
+  // -1 if there's no index, or -2 if out of memory.
+  const struct station_location *loc;
+  struct station_match *matches, *grown;
+  struct station_index ix;
+  double south, west, north, east, dlon, lat, lon, nm;
+  int row, rowFirst, rowLast, col, colFirst, colLast;
+  size_t k, size;
+  uint32_t cell;
+
+  *found = NULL;
+  *count = 0;
+  if ( openStationIndex(&ix, path) != 0 ) return -1;
+
+  if ( area->radius )
+  {
+    // the box around the circle, which may take in a pole or wrap
+    south = area->latitude - area->nm / 60.0;
+    north = area->latitude + area->nm / 60.0;
+    dlon = (fabs(area->latitude) < 89.0) ? area->nm / (60.0 * cos(area->latitude * M_PI / 180.0)) : 360.0;
+    west = area->longitude - dlon;
+    east = area->longitude + dlon;
+    if ( (south <= -90.0) || (north >= 90.0) || (dlon >= 180.0) )
+    {
+      west = -180.0;
+      east = 180.0;
+    }
+    if ( west < -180.0 ) west += 360.0;
+    if ( east > 180.0 ) east -= 360.0;
+  }
+  else
+  {
+    south = area->south;
+    north = area->north;
+    west = area->west;
+    east = area->east;
+  }
+
+  rowFirst = (int)(stationCell(south, 0.0) / 360);
+  rowLast = (int)(stationCell(north, 0.0) / 360);
+  colFirst = (int)(stationCell(0.0, west) % 360);
+  colLast = (int)(stationCell(0.0, east) % 360);
+  if ( (west <= -180.0) && (east >= 180.0) )
+  {
+    colFirst = 0;
+    colLast = 359;
+  }
+
+  matches = NULL;
+  size = 0;
+  for ( row = rowFirst; row <= rowLast; ++row )
+  {
+    // a box over the antimeridian runs on from the east end of the row
+    for ( col = colFirst; ; col = (col + 1) % 360 )
+    {
+      cell = (uint32_t)(row * 360 + col);
+      for ( k = ix.cells[cell]; k < ix.cells[cell + 1]; ++k )
+      {
+        loc = &ix.stations[k];
+        lat = loc->latitude / 1e5;
+        lon = loc->longitude / 1e5;
+        if ( (lat < south) || (lat > north) ) continue;
+        if ( (west <= east) ? ((lon < west) || (lon > east)) : ((lon < west) && (lon > east)) ) continue;
+
+        nm = 0.0;
+        if ( area->radius && ((nm = stationDistance(area->latitude, area->longitude, lat, lon)) > area->nm) )
+          continue;
+
+        if ( *count == size )
+        {
+          size = size ? size * 2 : 64;
+          grown = (struct station_match *)realloc(matches, sizeof(struct station_match) * size);
+          if ( !grown )
+          {
+            if ( matches ) free(matches);
+            closeStationIndex(&ix);
+            *count = 0;
+            return -2;
+          }
+          matches = grown;
+        }
+        matches[*count].station = *loc;
+        matches[*count].nm = nm;
+        ++*count;
+      }
+      if ( col == colLast ) break;
+    }
+  }
+  closeStationIndex(&ix);
+
+  if ( matches ) qsort(matches, *count, sizeof(struct station_match), compareStationMatches);
+  *found = matches;
+  return 0;
+}
+
+int selectStationReports(const struct metar_table *restrict all, const char *restrict station, time_t since, struct metar_table *restrict reports)
+{
+  // copies station's reports from all, observed since then, into reports,
+  // newest first as the service has them.  returns how many, or -1 if out
+  // of memory.
+  size_t k, j, n;
+
+  for ( n = 0, k = 0; k < all->count; ++k )
+  {
+    if ( (strcasecmp(all->reports[k].station_id, station) != 0) || (all->reports[k].observation_time < since) )
+      continue;
+    if ( copyPackedMetar(reports, all, k) != 0 ) return -1;
+
+    // one insertion step keeps them in order; a station has a handful
+    for ( j = reports->count - 1; (j > 0) && (reports->reports[j - 1].observation_time < reports->reports[j].observation_time); --j )
+    {
+      struct metar_packed swap = reports->reports[j];
+      reports->reports[j] = reports->reports[j - 1];
+      reports->reports[j - 1] = swap;
+    }
+    ++n;
+  }
+  return (int)n;
+}
+
+const char *skyCondition(enum sky_cover_type ceil)
+{
+  switch ( ceil )
+  {
+    case METAR_SKYCOND_BKN: return "Broken clouds";
+    case METAR_SKYCOND_CAVOK: return "Ceiling/visibility okay";
+    case METAR_SKYCOND_FEW: return "Few clouds";
+    case METAR_SKYCOND_OVC: return "Overcast";
+    case METAR_SKYCOND_OVX: return "Sky obscured";
+    case METAR_SKYCOND_SCT: return "Scattered clouds";
+    case METAR_SKYCOND_SKC: return "Sky clear";
+    default: return "Unknown";
+  }
+}
+
+int isVfrWeather(enum sky_cover_type ceil)
+{
+  if ( (ceil == METAR_SKYCOND_CAVOK) || (ceil == METAR_SKYCOND_FEW) || (ceil == METAR_SKYCOND_SCT)
+    || (ceil == METAR_SKYCOND_SKC) || (ceil == METAR_SKYCOND_CLR) )
+    return 1;
+  return 0;
+}
+
+int decodeRawMetar(const char *restrict text, time_t reference, struct metar *restrict weather)
+{
+  // decodes the text of one METAR or SPECI ("KJFK 141751Z 00000KT 10SM
+  // FEW050 08/M06 A2989 RMK AO2 SLP122 T00831061") into what the service's
+  // XML would have said of it, less what only the service knows: where the
+  // station is.  its day and time are taken to be the latest ones at or
+  // before reference.  groups that aren't understood are passed over;
+  // returns 0 if there's no station and time to go on.
+  char buf[METAR_BUFSIZE];
+  char *tokens[METAR_RAWTOKENS];
+  char *save;
+  const char *t;
+  size_t count, len, k;
+  int stage, whole, ceiling, n;
+  float vis;
+
+  init_metar(weather);
+  while ( (*text == ' ') || (*text == '\t') ) ++text;
+  if ( (strncmp(text, "METAR ", 6) == 0) || (strncmp(text, "SPECI ", 6) == 0) )
+  {
+    weather->metar_type = (text[0] == 'S') ? METAR_TYPE_SPECI : METAR_TYPE_METAR;
+    text += 6;
+  }
+  else
+    weather->metar_type = METAR_TYPE_METAR;
+
+  strncpy(weather->raw_text, text, METAR_BUFSIZE);
+  weather->raw_text[METAR_BUFSIZE - 1] = '\0';
+  len = strlen(weather->raw_text);
+  while ( (len > 0) && strchr(" \t\r\n=", weather->raw_text[len - 1]) )
+    weather->raw_text[--len] = '\0';
+
+  // split on blanks; the groups are read in place
+  memcpy(buf, weather->raw_text, len + 1);
+  for ( count = 0, t = strtok_r(buf, " \t", &save); t && (count < METAR_RAWTOKENS); t = strtok_r(NULL, " \t", &save) )
+    tokens[count++] = (char *)t;
+
+  if ( (count < 2) || (strlen(tokens[0]) != 4) ) return 0;
+  strcpy(weather->station_id, tokens[0]);
+
+  k = 1;
+  if ( (strcmp(tokens[k], "COR") == 0) && (k + 1 < count) )
+  {
+    weather->quality_control_flags |= METAR_QUALITY_CORRECTED;
+    ++k;
+  }
+  if ( !parseRawTime(tokens[k], reference, &weather->observation_time) ) return 0;
+
+  for ( ++k, stage = 0, whole = 0; k < count; ++k )
+  {
+    t = tokens[k];
+    len = strlen(t);
+
+    if ( strcmp(t, "$") == 0 )
+    {
+      weather->quality_control_flags |= METAR_QUALITY_MAINTENANCE;
+      continue;
+    }
+    if ( strcmp(t, "RMK") == 0 )
+    {
+      stage = 2;
+      continue;
+    }
+    if ( stage == 2 )
+    {
+      decodeRawRemark(t, len, weather);
+      continue;
+    }
+    if ( (stage == 1) || (strcmp(t, "NOSIG") == 0) || (strcmp(t, "BECMG") == 0) || (strcmp(t, "TEMPO") == 0) )
+    {
+      stage = 1; // a forecast of what's to come, which isn't the weather
+      continue;
+    }
+
+    if ( strcmp(t, "AUTO") == 0 )
+      weather->quality_control_flags |= METAR_QUALITY_AUTO;
+    else if ( strcmp(t, "COR") == 0 )
+      weather->quality_control_flags |= METAR_QUALITY_CORRECTED;
+    else if ( decodeRawWind(t, len, weather) )
+      ;
+    else if ( (len == 7) && isdigit((unsigned char)t[0]) && (t[3] == 'V') && isdigit((unsigned char)t[4]) )
+      ; // the direction varies between the two; the mean will do
+    else if ( (len <= 2) && (strspn(t, "0123456789") == len) && (k + 1 < count)
+      && strchr(tokens[k + 1], '/') && (strstr(tokens[k + 1], "SM") != NULL) )
+      whole = rawDigits(t, len); // "1 1/2SM"
+    else if ( (len > 2) && (strcmp(&t[len - 2], "SM") == 0) && parseRawFraction(t, len - 2, &vis) )
+    {
+      weather->visibility_statute_mi = (float)whole + vis;
+      whole = 0;
+    }
+    else if ( ((len == 4) || ((len == 7) && (strcmp(&t[4], "NDV") == 0))) && (strspn(t, "0123456789") >= 4) )
+    {
+      // metres, where 9999 is 10km or more
+      n = rawDigits(t, 4);
+      weather->visibility_statute_mi = (float)(floor((n == 9999 ? 10000 : n) / 16.09344 + 0.5) / 100.0);
+    }
+    else if ( strcmp(t, "CAVOK") == 0 )
+    {
+      weather->visibility_statute_mi = 6.21f;
+      if ( weather->sky_condition_count < 4 )
+        weather->sky_condition[weather->sky_condition_count++].sky_cover = METAR_SKYCOND_CAVOK;
+    }
+    else if ( (t[0] == 'R') && isdigit((unsigned char)t[1]) && strchr(t, '/') )
+      ; // runway visual range, which struct metar has no room for
+    else if ( decodeRawSky(t, len, weather) )
+      ;
+    else if ( decodeRawTemperatures(t, weather) )
+      ;
+    else if ( (len == 5) && ((t[0] == 'A') || (t[0] == 'Q')) && (strspn(&t[1], "0123456789") == 4) )
+    {
+      n = rawDigits(&t[1], 4);
+      weather->altim_in_hg = (t[0] == 'A') ? (float)(n / 100.0) : (float)(n * 0.0295300);
+    }
+    else
+      appendRawWeather(t, len, weather);
+  }
+
+  // the lowest broken or overcast layer (or an obscuration) is the ceiling
+  for ( ceiling = -1, k = 0; k < weather->sky_condition_count; ++k )
+  {
+    if ( isVfrWeather(weather->sky_condition[k].sky_cover) ) continue;
+    n = weather->sky_condition[k].cloud_base_ft_agl;
+    if ( weather->sky_condition[k].sky_cover == METAR_SKYCOND_OVX ) n = weather->vert_vis_ft;
+    if ( (n >= 0) && ((ceiling < 0) || (n < ceiling)) ) ceiling = n;
+  }
+  vis = weather->visibility_statute_mi;
+  if ( isnan(vis) && (ceiling < 0) )
+    weather->flight_category = METAR_CATEGORY_UNKNOWN;
+  else if ( ((ceiling >= 0) && (ceiling < 500)) || (vis < 1.0f) )
+    weather->flight_category = METAR_CATEGORY_LIFR;
+  else if ( ((ceiling >= 0) && (ceiling < 1000)) || (vis < 3.0f) )
+    weather->flight_category = METAR_CATEGORY_IFR;
+  else if ( ((ceiling >= 0) && (ceiling <= 3000)) || (vis <= 5.0f) )
+    weather->flight_category = METAR_CATEGORY_MVFR;
+  else
+    weather->flight_category = METAR_CATEGORY_VFR;
+
+  return 1;
+}
+
+int parseRawTime(const char *restrict group, time_t reference, time_t *restrict when)
+{
+  // DDHHMMZ, in the month of reference, or the one before if that would
+  // put it after reference.  returns 0, leaving *when alone, for anything
+  // else.
+  struct tm ref;
+  time_t t;
+  int day, hour, min, year, month, k;
+
+  if ( (strlen(group) != 7) || (group[6] != 'Z') || (strspn(group, "0123456789") != 6) )
+    return 0;
+  day = (group[0] - '0') * 10 + (group[1] - '0');
+  hour = (group[2] - '0') * 10 + (group[3] - '0');
+  min = (group[4] - '0') * 10 + (group[5] - '0');
+  if ( (day < 1) || (day > 31) || (hour > 23) || (min > 59) ) return 0;
+
+  if ( !gmtime_r(&reference, &ref) ) return 0;
+  year = ref.tm_year + 1900;
+  month = ref.tm_mon + 1;
+  for ( k = 0; k < 3; ++k )
+  {
+    // a 31st that the month doesn't have rolls into the next one, and so
+    // is too late
+    t = (time_t)(daysFromCivil(year, month, day) * 86400 + hour * 3600 + min * 60);
+    if ( (t <= reference) && (daysFromCivil(year, month, day) < daysFromCivil(year + (month == 12), (month % 12) + 1, 1)) )
+    {
+      *when = t;
+      return 1;
+    }
+    if ( --month == 0 )
+    {
+      month = 12;
+      --year;
+    }
+  }
+  return 0;
+}
+
+int parseRawFraction(const char *restrict group, size_t len, float *restrict value)
+{
+  // "10", "1/2", "M1/4", "P6" and "1.5", as visibility has them; the M or
+  // P goes
+  int whole, num, den;
+  size_t k;
+
+  if ( (len > 0) && ((group[0] == 'M') || (group[0] == 'P')) )
+  {
+    ++group;
+    --len;
+  }
+  for ( whole = 0, k = 0; (k < len) && isdigit((unsigned char)group[k]); ++k )
+    whole = whole * 10 + (group[k] - '0');
+  if ( k == 0 ) return 0;
+  if ( k == len )
+  {
+    *value = (float)whole;
+    return 1;
+  }
+  if ( group[k] == '.' )
+  {
+    // not in the standard, but seen
+    for ( num = 0, den = 1, ++k; (k < len) && isdigit((unsigned char)group[k]) && (den < 1000); ++k, den *= 10 )
+      num = num * 10 + (group[k] - '0');
+    if ( k != len ) return 0;
+    *value = (float)whole + (float)num / (float)den;
+    return 1;
+  }
+  if ( group[k++] != '/' ) return 0;
+  for ( num = whole, den = 0; (k < len) && isdigit((unsigned char)group[k]); ++k )
+    den = den * 10 + (group[k] - '0');
+  if ( (k != len) || (den == 0) ) return 0;
+  *value = (float)num / (float)den;
+  return 1;
+}
+
+int decodeRawWind(const char *restrict group, size_t len, struct metar *restrict weather)
+{
+  // dddff(f)(Gff(f))KT, or VRB for ddd, or in MPS or KMH, as knots
+  const char *c;
+  double knots;
+  int dir, speed, gust;
+  size_t unit;
+
+  if ( (len > 3) && (strcmp(&group[len - 2], "KT") == 0) ) { unit = 2; knots = 1.0; }
+  else if ( (len > 3) && (strcmp(&group[len - 3], "MPS") == 0) ) { unit = 3; knots = 1.943844; }
+  else if ( (len > 3) && (strcmp(&group[len - 3], "KMH") == 0) ) { unit = 3; knots = 0.539957; }
+  else return 0;
+
+  if ( strncmp(group, "VRB", 3) == 0 )
+    dir = 0;
+  else if ( (strspn(group, "0123456789") >= 5) )
+    dir = (group[0] - '0') * 100 + (group[1] - '0') * 10 + (group[2] - '0');
+  else
+    return 0;
+
+  for ( c = &group[3], speed = 0; isdigit((unsigned char)*c); ++c )
+    speed = speed * 10 + (*c - '0');
+  if ( (c - group < 5) || (c - group > 6) ) return 0;
+
+  gust = -1;
+  if ( *c == 'G' )
+  {
+    for ( ++c, gust = 0; isdigit((unsigned char)*c); ++c )
+      gust = gust * 10 + (*c - '0');
+  }
+  if ( (size_t)(c - group) != len - unit ) return 0;
+
+  weather->wind_dir_degrees = dir;
+  weather->wind_speed_kt = (int)floor(speed * knots + 0.5);
+  if ( gust >= 0 ) weather->wind_gust_kt = (int)floor(gust * knots + 0.5);
+  return 1;
+}
+
+int decodeRawSky(const char *restrict group, size_t len, struct metar *restrict weather)
+{
+  // FEWhhh, SCThhh, BKNhhh and OVChhh (in hundreds of feet, perhaps with
+  // CB or TCU after), VVhhh, and SKC, CLR, NSC and NCD
+  static const struct { const char *name; enum sky_cover_type cover; } covers[] =
+  {
+    { "FEW", METAR_SKYCOND_FEW }, { "SCT", METAR_SKYCOND_SCT },
+    { "BKN", METAR_SKYCOND_BKN }, { "OVC", METAR_SKYCOND_OVC },
+    { "SKC", METAR_SKYCOND_SKC }, { "CLR", METAR_SKYCOND_CLR },
+    { "NSC", METAR_SKYCOND_CLR }, { "NCD", METAR_SKYCOND_CLR }
+  };
+  struct sky_condition_entry *layer;
+  size_t k;
+
+  if ( (len >= 5) && (strncmp(group, "VV", 2) == 0) )
+  {
+    if ( strspn(&group[2], "0123456789") == 3 )
+      weather->vert_vis_ft = rawDigits(&group[2], 3) * 100;
+    else if ( strncmp(&group[2], "///", 3) != 0 )
+      return 0;
+    if ( weather->sky_condition_count < 4 )
+    {
+      layer = &weather->sky_condition[weather->sky_condition_count++];
+      layer->sky_cover = METAR_SKYCOND_OVX;
+      layer->cloud_base_ft_agl = 0;
+    }
+    return 1;
+  }
+
+  for ( k = 0; k < sizeof(covers) / sizeof(covers[0]); ++k )
+  {
+    if ( (len < 3) || (strncmp(group, covers[k].name, 3) != 0) ) continue;
+    if ( (k >= 4) && (len != 3) ) return 0;
+    if ( (k < 4) && ((len < 6) || ((strspn(&group[3], "0123456789") != 3) && (strncmp(&group[3], "///", 3) != 0))) )
+      return 0;
+
+    if ( weather->sky_condition_count < 4 )
+    {
+      layer = &weather->sky_condition[weather->sky_condition_count++];
+      layer->sky_cover = covers[k].cover;
+      if ( (k < 4) && isdigit((unsigned char)group[3]) )
+        layer->cloud_base_ft_agl = rawDigits(&group[3], 3) * 100;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+int decodeRawTemperatures(const char *restrict group, struct metar *restrict weather)
+{
+  // TT/DD in whole degrees, M for minus, either of which may be missing
+  const char *slash;
+  int temp, dew;
+
+  slash = strchr(group, '/');
+  if ( !slash || strchr(slash + 1, '/') ) return 0;
+
+  temp = parseRawDegrees(group, slash - group, &weather->temp_c);
+  dew = parseRawDegrees(slash + 1, strlen(slash + 1), &weather->dewpoint_c);
+  return temp || dew;
+}
+
+int parseRawDegrees(const char *restrict group, size_t len, float *restrict value)
+{
+  int negative;
+
+  negative = (len == 3) && (group[0] == 'M');
+  if ( negative ) ++group;
+  if ( (len != 2 + (size_t)negative) || !isdigit((unsigned char)group[0]) || !isdigit((unsigned char)group[1]) )
+    return 0;
+  *value = (float)((group[0] - '0') * 10 + (group[1] - '0')) * (negative ? -1.0f : 1.0f);
+  return 1;
+}
+
+void appendRawWeather(const char *restrict group, size_t len, struct metar *restrict weather)
+{
+  // present weather, such as -RA, +TSRA, VCSH and FZFG, to wx_string as
+  // the service has it: every group, separated by spaces
+  static const char codes[] = "MIPRBCDRBLSHTSFZDZRASNSGICPLGRGSUPBRFGFUVADUSAHZPYPOSQFCSSDS";
+  const char *c;
+  size_t k, used;
+
+  c = group;
+  if ( (*c == '-') || (*c == '+') ) ++c;
+  else if ( strncmp(c, "VC", 2) == 0 ) c += 2;
+  if ( (*c == '\0') || ((strlen(c) % 2) != 0) ) return;
+
+  for ( ; *c != '\0'; c += 2 )
+  {
+    for ( k = 0; codes[k] != '\0'; k += 2 )
+      if ( (codes[k] == c[0]) && (codes[k + 1] == c[1]) ) break;
+    if ( codes[k] == '\0' ) return;
+  }
+
+  used = strlen(weather->wx_string);
+  if ( used + len + 2 > METAR_TINYBUFSIZE ) return;
+  if ( used > 0 ) weather->wx_string[used++] = ' ';
+  memcpy(&weather->wx_string[used], group, len + 1);
+}
+
+void decodeRawRemark(const char *restrict group, size_t len, struct metar *restrict weather)
+{
+  // the remarks that the service breaks out: AO1/AO2, SLPppp, the
+  // TsTTTsDDD tenths, the 1snTTT/2snTTT and 4snTTTsnTTT extremes, the
+  // 5appp tendency, Prrrr/6rrrr/7rrrr precipitation, 4/sss snow depth and
+  // the sensor-out flags.  metric values are tenths, inches hundredths.
+  int digits, hour, n;
+
+  digits = (int)strspn(group, "0123456789");
+
+  if ( (strcmp(group, "AO1") == 0) || (strcmp(group, "AO2") == 0) )
+    weather->quality_control_flags |= METAR_QUALITY_AUTO_STATION;
+  else if ( strcmp(group, "TSNO") == 0 )
+    weather->quality_control_flags |= METAR_QUALITY_NO_LIGHTNING;
+  else if ( strcmp(group, "FZRANO") == 0 )
+    weather->quality_control_flags |= METAR_QUALITY_NO_FREEZING;
+  else if ( strcmp(group, "PWINO") == 0 )
+    weather->quality_control_flags |= METAR_QUALITY_NO_WEATHER;
+  else if ( (len == 6) && (strncmp(group, "SLP", 3) == 0) && (strspn(&group[3], "0123456789") == 3) )
+  {
+    n = rawDigits(&group[3], 3);
+    weather->sea_level_pressure_mb = (float)(((n < 500) ? 10000 + n : 9000 + n) / 10.0);
+  }
+  else if ( (len == 9) && (group[0] == 'T') && (strspn(&group[1], "0123456789") == 8)
+    && (group[1] <= '1') && (group[5] <= '1') )
+  {
+    weather->temp_c = (float)(rawDigits(&group[2], 3) / 10.0) * ((group[1] == '1') ? -1.0f : 1.0f);
+    weather->dewpoint_c = (float)(rawDigits(&group[6], 3) / 10.0) * ((group[5] == '1') ? -1.0f : 1.0f);
+  }
+  else if ( (len == 5) && (digits == 5) && ((group[0] == '1') || (group[0] == '2')) && (group[1] <= '1') )
+  {
+    // the six hours' max (1) or min (2)
+    *((group[0] == '1') ? &weather->maxT_c : &weather->minT_c) = (float)(rawDigits(&group[2], 3) / 10.0) * ((group[1] == '1') ? -1.0f : 1.0f);
+  }
+  else if ( (len == 9) && (digits == 9) && (group[0] == '4') && (group[1] <= '1') && (group[5] <= '1') )
+  {
+    weather->maxT24hr_c = (float)(rawDigits(&group[2], 3) / 10.0) * ((group[1] == '1') ? -1.0f : 1.0f);
+    weather->minT24hr_c = (float)(rawDigits(&group[6], 3) / 10.0) * ((group[5] == '1') ? -1.0f : 1.0f);
+  }
+  else if ( (len == 5) && (strncmp(group, "4/", 2) == 0) && (strspn(&group[2], "0123456789") == 3) )
+    weather->snow_in = (float)rawDigits(&group[2], 3);
+  else if ( (len == 5) && (digits == 5) && (group[0] == '5') && (group[1] <= '8') )
+  {
+    // steady (4), up (0-3) or down (5-8) this much over three hours
+    n = rawDigits(&group[2], 3);
+    weather->three_hr_pressure_tendency_mb = (float)(n / 10.0) * ((group[1] > '4') ? -1.0f : (group[1] == '4') ? 0.0f : 1.0f);
+  }
+  else if ( (len == 5) && (group[0] == 'P') && (strspn(&group[1], "0123456789") == 4) )
+    weather->precip_in = (float)(rawDigits(&group[1], 4) / 100.0);
+  else if ( (len == 5) && (digits == 5) && (group[0] == '6') )
+  {
+    // three hours' worth in the reports nearest 03, 09, 15 and 21Z, six
+    // hours' otherwise
+    hour = (int)(((weather->observation_time + 1800) / 3600) % 24);
+    *(((hour % 6) == 3) ? &weather->pcp3hr_in : &weather->pcp6hr_in) = (float)(rawDigits(&group[1], 4) / 100.0);
+  }
+  else if ( (len == 5) && (digits == 5) && (group[0] == '7') )
+    weather->pcp24hr_in = (float)(rawDigits(&group[1], 4) / 100.0);
+}
+
+int rawDigits(const char *group, size_t count)
+{
+  // the value of count digits that have already been checked to be there
+  int n;
+
+  for ( n = 0; count > 0; --count, ++group )
+    n = n * 10 + (*group - '0');
+  return n;
+}
+
+int decodeMetarCycle(const char *restrict data, size_t len, time_t fetched, struct metar_table *restrict reports)
+{
+  // every report in a bulk file of raw METARs, such as NOAA's cycle files:
+  // one per line, each after a "YYYY/MM/DD HH:MM" line saying when it was
+  // issued, which dates it.  lines that aren't reports are skipped.
+  // returns how many were decoded, or -2 if out of memory.
+  char line[METAR_BUFSIZE];
+  struct metar w;
+  const char *end, *next;
+  time_t issued;
+  size_t n;
+  int count, year, month, day, hour, min;
+
+  issued = fetched;
+  for ( count = 0, end = data + len; data < end; data = next )
+  {
+    next = memchr(data, '\n', end - data);
+    next = next ? next + 1 : end;
+    n = next - data;
+    if ( n >= METAR_BUFSIZE ) continue;
+    memcpy(line, data, n);
+    line[n] = '\0';
+
+    if ( sscanf(line, "%4d/%2d/%2d %2d:%2d", &year, &month, &day, &hour, &min) == 5 )
+    {
+      // a little grace, for clocks that run ahead of the issuer's
+      issued = (time_t)(daysFromCivil(year, month, day) * 86400 + hour * 3600 + min * 60) + METAR_ISSUELAG;
+      continue;
+    }
+    if ( !decodeRawMetar(line, issued, &w) ) continue;
+    if ( packMetar(reports, &w) != 0 ) return -2;
+    ++count;
+    issued = fetched;
+  }
+
+  return count;
+}
+
+int parseIsoTime(const char *restrict value, time_t *restrict when)
+{
+  // decodes the service's "YYYY-MM-DDTHH:MM:SSZ" straight into seconds since
+  // the epoch.  Every field sits at a fixed offset, so this is a handful of
+  // digit reads and no libc time calls; nothing global is touched, and the
+  // parse is safe to run on several threads.  Returns 0, leaving *when
+  // alone, if value isn't in that form.
+  static const char shape[] = "dddd-dd-ddTdd:dd:ddZ";
+  int year, month, day, hour, min, sec;
+  int k;
+
+  for ( k = 0; shape[k] != '\0'; ++k )
+  {
+    if ( shape[k] == 'd' )
+    {
+      if ( (value[k] < '0') || (value[k] > '9') ) return 0;
+    }
+    else if ( value[k] != shape[k] )
+      return 0;
+  }
+
+#define DIGITS2(i) ((value[i] - '0') * 10 + (value[(i) + 1] - '0'))
+  year = DIGITS2(0) * 100 + DIGITS2(2);
+  month = DIGITS2(5);
+  day = DIGITS2(8);
+  hour = DIGITS2(11);
+  min = DIGITS2(14);
+  sec = DIGITS2(17);
+#undef DIGITS2
+
+  // a leap second (:60) folds into the next minute, as timegm() would have it
+  if ( (month < 1) || (month > 12) || (day < 1) || (day > 31) || (hour > 23) || (min > 59) || (sec > 60) )
+    return 0;
+
+  *when = (time_t)(daysFromCivil(year, month, day) * 86400 + hour * 3600 + min * 60 + sec);
+  return 1;
+}
+
+int parseDecimal(const char *restrict value, float *restrict number)
+{
+  // decodes the service's decimals ("-12.8", "29.92", "10.0") without
+  // strtod() or the locale: the digits are gathered as one integer and
+  // divided by an exact power of ten.  up to 15 digits, both are exact
+  // doubles, so the one rounding is the division's, as strtod()'s would
+  // be; longer ones go to strtod().  Returns 0, leaving *number alone
+  // (NaN, for absent), if value isn't a plain decimal.
+  static const double scale[16] =
+  {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+  };
+  const char *c;
+  uint64_t digits;
+  int negative, count, places;
+  char *end;
+  double d;
+
+  for ( c = value; (*c == ' ') || (*c == '\t') || (*c == '\n') || (*c == '\r'); ++c );
+  negative = (*c == '-');
+  if ( (*c == '-') || (*c == '+') ) ++c;
+
+  for ( digits = 0, count = 0, places = -1; ; ++c )
+  {
+    if ( (*c >= '0') && (*c <= '9') )
+    {
+      digits = digits * 10 + (uint64_t)(*c - '0');
+      ++count;
+      if ( places >= 0 ) ++places;
+    }
+    else if ( (*c == '.') && (places < 0) )
+      places = 0;
+    else
+      break;
+  }
+  for ( ; (*c == ' ') || (*c == '\t') || (*c == '\n') || (*c == '\r'); ++c );
+  if ( (count == 0) || (*c != '\0') ) return 0;
+
+  if ( count > 15 )
+  {
+    // past 2^53, (double)digits would round before the division does
+    d = strtod(value, &end);
+    *number = (float)d;
+    return 1;
+  }
+
+  d = (double)digits / scale[(places < 0) ? 0 : places];
+  *number = (float)(negative ? -d : d);
+  return 1;
+}
+
+int parseInteger(const char *restrict value, int *restrict number)
+{
+  // the same for whole numbers, up to nine digits; returns 0, leaving
+  // *number alone (-1, for absent), if value isn't one
+  const char *c;
+  int negative, count, n;
+
+  for ( c = value; (*c == ' ') || (*c == '\t') || (*c == '\n') || (*c == '\r'); ++c );
+  negative = (*c == '-');
+  if ( (*c == '-') || (*c == '+') ) ++c;
+
+  for ( n = 0, count = 0; (*c >= '0') && (*c <= '9') && (count < 9); ++c, ++count )
+    n = n * 10 + (*c - '0');
+  for ( ; (*c == ' ') || (*c == '\t') || (*c == '\n') || (*c == '\r'); ++c );
+  if ( (count == 0) || (*c != '\0') ) return 0;
+
+  *number = negative ? -n : n;
+  return 1;
+}
+
+int64_t daysFromCivil(int64_t year, int month, int day)
+{
+  // days between 1970-01-01 and the given proleptic Gregorian date.  Counts
+  // years from March so the leap day falls at the end of each one; see
+  // Howard Hinnant's "chrono-Compatible Low-Level Date Algorithms".
+  int64_t era;
+  int yearOfEra, dayOfYear, dayOfEra;
+
+  if ( month <= 2 ) --year;
+  era = (year >= 0 ? year : year - 399) / 400;
+  yearOfEra = (int)(year - era * 400);
+  dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  return era * 146097 + dayOfEra - 719468;
+}
+
+struct metar_context *openMetarContext(const char *restrict url, const char *restrict path, int flags, int jobs)
+{
+  // everything retrieveMetars() needs, made once: url and path default as
+  // they do for metar (without -u and -p), and of flags, only those that
+  // bear on retrieval are kept.  with METARFLAG_INDEXED, a cache that can't
+  // be opened leaves the context uncached, as it does metar.
+  struct metar_context *ctx;
+  size_t len;
+
+  ctx = (struct metar_context *)calloc(1, sizeof(struct metar_context));
+  if ( !ctx ) return NULL;
+
+  if ( !url ) url = METAR_URL;
+  if ( !path ) path = "/tmp/";
+  len = strlen(path);
+  ctx->url = strdup(url);
+  ctx->path = (char *)malloc(len + 2);
+  if ( !ctx->url || !ctx->path )
+  {
+    closeMetarContext(ctx);
+    return NULL;
+  }
+  strcpy(ctx->path, path);
+  if ( (len == 0) || (ctx->path[len - 1] != '/') )
+    strcat(ctx->path, "/");
+
+  ctx->flags = flags & (METARFLAG_UPDATE | METARFLAG_NOTS | METARFLAG_BATCH | METARFLAG_INDEXED | METARFLAG_GZIP);
+  ctx->settings.maxAge = METAR_MAXAGE;
+  ctx->settings.wanted = wholeReports;
+  if ( (flags & METARFLAG_INDEXED) == METARFLAG_INDEXED )
+    ctx->cache = openIndexedCache(ctx->path);
+
+  xmlInitParser();
+  curl_global_init(CURL_GLOBAL_ALL);
+  ctx->curl = curl_easy_init();
+  if ( !ctx->curl )
+  {
+    closeMetarContext(ctx);
+    return NULL;
+  }
+  if ( jobs > 1 )
+  {
+    ctx->pool = openFetchPool(jobs);
+    if ( !ctx->pool )
+    {
+      closeMetarContext(ctx);
+      return NULL;
+    }
+  }
+
+  return ctx;
+}
+
+void closeMetarContext(struct metar_context *ctx)
+{
+  if ( !ctx ) return;
+
+  closeFetchPool(ctx->pool);
+  closeIndexedCache(ctx->cache);
+  if ( ctx->curl )
+  {
+    curl_easy_cleanup(ctx->curl);
+    curl_global_cleanup();
+  }
+  if ( ctx->url ) free(ctx->url);
+  if ( ctx->path ) free(ctx->path);
+  if ( ctx->slots ) free(ctx->slots);
+  if ( ctx->results ) free(ctx->results);
+  if ( ctx->weather ) free(ctx->weather);
+  freeArena(&ctx->scratch);
+  free(ctx);
+}
+
+int retrieveMetars(struct metar_context *restrict ctx, const char *stations[], size_t count, int hours, const struct metar **restrict weather)
+{
+  // the reports of every station in stations[0..count), station after
+  // station in one array, newest first for each as the service has them.
+  // metarResults(ctx)[k] says where stations[k]'s are, or why it has none.
+  // stations are served from the cache where they can be, and the rest
+  // retrieved exactly as metar does with -b and -j (see fetchStations()).
+  // returns how many reports there are, or -1 if out of memory; either
+  // way, what was handed back is good until the next call.
+  struct metar_result *result;
+  struct prefetch *slot;
+  struct metar_table loaded;
+  size_t k, size;
+  int ret;
+
+  *weather = NULL;
+  ctx->count = 0;
+  resetArena(&ctx->scratch);
+  if ( (count == 0) || (count > INT_MAX) ) return 0;
+
+  if ( count > ctx->stations )
+  {
+    size = ctx->stations ? ctx->stations : 16;
+    while ( size < count ) size *= 2;
+    slot = (struct prefetch *)realloc(ctx->slots, sizeof(struct prefetch) * size);
+    if ( slot ) ctx->slots = slot;
+    result = (struct metar_result *)realloc(ctx->results, sizeof(struct metar_result) * size);
+    if ( result ) ctx->results = result;
+    if ( !slot || !result ) return -1;
+    ctx->stations = size;
+  }
+  memset((void *)ctx->slots, 0, sizeof(struct prefetch) * count);
+
+  ret = fetchStations(ctx->curl, ctx->pool, ctx->cache, ctx->url, ctx->path, hours, ctx->flags, &ctx->settings, 0, (int)count, stations, ctx->slots);
+
+  for ( k = 0; k < count; ++k )
+  {
+    slot = &ctx->slots[k];
+    result = &ctx->results[k];
+    result->station = stations[k];
+    result->first = ctx->count;
+    result->count = 0;
+    result->error = NULL;
+    if ( ret != 0 )
+    {
+      freeMetarTable(&slot->reports);
+      continue;
+    }
+
+    // left out of the requests: cached, or failing that (an id too long
+    // for any request, or a copy gone since it was revalidated), asked for
+    // again on its own
+    if ( !slot->done && (loadCachedMetars(ctx, stations[k], &loaded) == 0) )
+    {
+      if ( appendMetars(ctx, &loaded) != 0 ) ret = -1;
+      result->count = ctx->count - result->first;
+      continue;
+    }
+    if ( !slot->done && (fetchStations(ctx->curl, NULL, ctx->cache, ctx->url, ctx->path, hours, ctx->flags | METARFLAG_UPDATE, &ctx->settings, (int)k, (int)k + 1, stations, ctx->slots) != 0) )
+      ret = -1;
+
+    if ( !slot->done )
+      result->error = "cannot be requested";
+    else if ( slot->error )
+      result->error = slot->error;
+    else if ( appendMetars(ctx, &slot->reports) != 0 )
+      ret = -1;
+    result->count = ctx->count - result->first;
+    freeMetarTable(&slot->reports);
+  }
+
+  if ( ret != 0 ) return -1;
+  *weather = ctx->weather;
+  return (int)ctx->count;
+}
+
+void setMetarMaxAge(struct metar_context *ctx, time_t seconds)
+{
+  // metar's -a: the longest any cached copy is trusted, METAR_MAXAGE
+  // until set
+  ctx->settings.maxAge = (seconds < 1) ? 1 : seconds;
+}
+
+const struct metar_result *metarResults(const struct metar_context *ctx)
+{
+  // what became of each station the last retrieveMetars() was asked for,
+  // in the order asked; good until the next call
+  return ctx->results;
+}
+
+int loadCachedMetars(struct metar_context *restrict ctx, const char *restrict station, struct metar_table *restrict reports)
+{
+  // a fresh copy of the station's reports from whichever cache is in use,
+  // in ctx->scratch until the next retrieveMetars().
+  // an XML cache without a sidecar doesn't count; it's retrieved again.
+  char tmp[METAR_BUFSIZE + 11];
+
+  if ( (ctx->flags & METARFLAG_UPDATE) == METARFLAG_UPDATE )
+    return -1;
+
+  if ( ctx->cache )
+    return findCachedReports(ctx->cache, station, ctx->flags, &ctx->settings, reports, &ctx->scratch);
+
+  cachePath(tmp, ctx->path, station);
+  if ( !isCacheFresh(tmp, ctx->flags, &ctx->settings) )
+    return -1;
+  return readSidecar(tmp, reports, &ctx->scratch);
+}
+
+int appendMetars(struct metar_context *restrict ctx, const struct metar_table *restrict reports)
+{
+  // unpacks every one of reports onto the end of ctx->weather
+  struct metar *weather;
+  size_t k, size;
+
+  if ( (ctx->count + reports->count) > ctx->size )
+  {
+    size = ctx->size ? ctx->size : 64;
+    while ( size < (ctx->count + reports->count) ) size *= 2;
+    weather = (struct metar *)realloc(ctx->weather, sizeof(struct metar) * size);
+    if ( !weather ) return -1;
+    ctx->weather = weather;
+    ctx->size = size;
+  }
+
+  for ( k = 0; k < reports->count; ++k )
+    unpackMetar(reports, k, &ctx->weather[ctx->count++]);
+  return 0;
+}
@@ -31,149 +31,109 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  */
 
-#include <unistd.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <ctype.h>
-#include <string.h>
-#include <strings.h>
-#include <memory.h>
-#include <stdarg.h>
-#include <time.h>
-#include <errno.h>
-#include <math.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <curl/curl.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
-#include <libxml/xpath.h>
-
-#define METARFLAG_DECODED  0x1 // decode the METAR before displaying it
-#define METARFLAG_UPDATE   0x2 // force a retrieval from the internet
-#define METARFLAG_NOTS     0x4 // ignore timestamps when retrieving from the cache
-#define METARFLAG_COLOR    0x8 // attempt to output colors
-#define METARFLAG_SPECIAL 0x10 // special formatting rules apply
-#define METARFLAG_PURGE   0x20 // purge the entire cache before retrieving
-
-#define METAR_MAXURL      8000
-#define METAR_BUFSIZE      512
-#define METAR_TINYBUFSIZE   64
-#define METAR_BIGBUFSIZE  8192
-#define METAR_REPLACEBUF    32
-
-enum flight_rules
+#define _GNU_SOURCE // struct ucred, for SO_PEERCRED
+
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metar_internal.h"
+
+#define METAR_REPLY_REPORTS  METAR_SIDECAR_MAGIC
+#define METAR_REPLY_ERROR    "MTRE"
+#define METAR_REPLY_REFUSED  "MTRR"
+#define METAR_DAEMON_IDLE    3600 // forget stations not asked for in this long
+#define METAR_DAEMON_TIMEOUT 5    // seconds either end waits on the other
+
+enum long_option
 {
-  METAR_CATEGORY_VFR = 0,
-  METAR_CATEGORY_MVFR = 1,
-  METAR_CATEGORY_IFR = 2,
-  METAR_CATEGORY_LIFR = 3,
-  METAR_CATEGORY_UNKNOWN = -1
+  OPTION_DAEMON = 256,
+  OPTION_STATS,
+  OPTION_FEED,
+  OPTION_PREFETCH,
+  OPTION_NEAR,
+  OPTION_BBOX,
+  OPTION_WHERE,
+  OPTION_OUTPUT,
+  OPTION_WATCH
 };
 
-enum metar_type_info
+struct daemon_station
 {
-  METAR_TYPE_METAR = 0,
-  METAR_TYPE_SPECI = 1,
-  METAR_TYPE_UNKNOWN = -1
+  char station[METAR_CACHE_KEYSIZE]; // upper-cased ICAO id
+  int hours;         // -h it was asked for with
+  int pinned;        // named on the daemon's command line; never forgotten
+  time_t fetched;    // 0 until first retrieved
+  time_t expires;    // when to retrieve it again
+  time_t queried;    // when a client last asked for it
+  const char *error; // why the last retrieval failed, if it did
+  struct metar_table reports;
+  time_t shown;      // --watch: the newest report printed so far
+  unsigned long shownText; // ...a hash of its text, for corrections
+  const char *shownError; // ...and the failure last reported
 };
 
-enum sky_cover_type
+struct metar_daemon
 {
-  METAR_SKYCOND_SKC = 0,
-  METAR_SKYCOND_CLR = 1,
-  METAR_SKYCOND_CAVOK = 2,
-  METAR_SKYCOND_FEW = 3,
-  METAR_SKYCOND_SCT = 4,
-  METAR_SKYCOND_BKN = 5,
-  METAR_SKYCOND_OVC = 6,
-  METAR_SKYCOND_OVX = 7,
-  METAR_SKYCOND_UNKNOWN = -1
-};
-
-#define METAR_QUALITY_CORRECTED     0x1
-#define METAR_QUALITY_AUTO          0x2
-#define METAR_QUALITY_AUTO_STATION  0x4
-#define METAR_QUALITY_MAINTENANCE   0x8
-#define METAR_QUALITY_NO_SIGNAL    0x10
-#define METAR_QUALITY_NO_LIGHTNING 0x20
-#define METAR_QUALITY_NO_FREEZING  0x40
-#define METAR_QUALITY_NO_WEATHER   0x80
-
-struct sky_condition_entry
-{
-  /*int*/ enum sky_cover_type sky_cover; // see METAR_SKYCOND_* above
-  int cloud_base_ft_agl;
-};
-
-struct metar
-{
-  char raw_text[METAR_BUFSIZE];
-  char station_id[5];
-  time_t observation_time;
-  float latitude;
-  float longitude;
-  float temp_c;
-  float dewpoint_c;
-  int wind_dir_degrees;
-  int wind_speed_kt;
-  int wind_gust_kt;
-  float visibility_statute_mi;
-  float altim_in_hg;
-  float sea_level_pressure_mb;
-  int quality_control_flags; // see METAR_QUALITY_* above
-  char wx_string[METAR_TINYBUFSIZE];
-  struct sky_condition_entry sky_condition[4];
-  size_t sky_condition_count;
-  /*int*/ enum flight_rules flight_category; // see METAR_CATEGORY_* above
-  float three_hr_pressure_tendency_mb;
-  float maxT_c;
-  float minT_c;
-  float maxT24hr_c;
-  float minT24hr_c;
-  float precip_in;
-  float pcp3hr_in;
-  float pcp6hr_in;
-  float pcp24hr_in;
-  float snow_in;
-  int vert_vis_ft;
-  /*int*/ enum metar_type_info metar_type; // see METAR_TYPE_* above
-  float elevation_m;
+  CURL *curl;
+  struct fetch_pool *pool;
+  struct metar_cache *cache;
+  const char *url, *path;
+  int flags;
+  const struct metar_settings *settings; // -a; everything's asked for
+  struct daemon_station *stations;
+  size_t count, size;
 };
 
-struct document
+void cleanup(char *restrict url, char *restrict format, char *restrict path, struct document *restrict doc, CURL *restrict curl, struct output *restrict out);
+int writeFully(int fd, const void *data, size_t len);
+int readFully(int fd, void *data, size_t len);
+int daemonSocket(const char *restrict path, struct sockaddr_un *restrict addr);
+int sendDaemonReply(int fd, const char *restrict magic, const struct metar_table *restrict reports, const char *restrict message);
+int isOwnDaemon(int fd);
+int queryDaemon(const char *restrict path, const char *restrict url, int hours, int entries, int flags, struct metar_format *restrict format, struct arena *restrict scratch, struct output *restrict out, int first, int last, const char *argv[]);
+void stopDaemon(int sig);
+struct daemon_station *findDaemonStation(struct metar_daemon *restrict d, const char *restrict station, int hours, int add);
+int refreshDaemon(struct metar_daemon *d, time_t now);
+int serveDaemonClient(struct metar_daemon *d, int fd);
+int runDaemon(struct metar_daemon *d, const char *name);
+time_t nextDaemonRefresh(const struct metar_daemon *d, time_t now);
+int runWatch(struct metar_daemon *restrict d, int entries, int flags, struct metar_format *restrict format, struct output *restrict out, const char *name);
+
+const struct option longOptions[] =
 {
-  char *data;
-  size_t len;
+  { "daemon", no_argument, NULL, OPTION_DAEMON },
+  { "stats", no_argument, NULL, OPTION_STATS },
+  { "feed", required_argument, NULL, OPTION_FEED },
+  { "prefetch", optional_argument, NULL, OPTION_PREFETCH },
+  { "near", required_argument, NULL, OPTION_NEAR },
+  { "bbox", required_argument, NULL, OPTION_BBOX },
+  { "where", required_argument, NULL, OPTION_WHERE },
+  { "output", required_argument, NULL, OPTION_OUTPUT },
+  { "watch", no_argument, NULL, OPTION_WATCH },
+  { NULL, 0, NULL, 0 }
 };
 
-int isVfrWeather(enum sky_cover_type ceil);
-const char *skyCondition(enum sky_cover_type ceil);
-void cleanup(char *restrict url, char *restrict format, char *restrict path, struct document *restrict doc, CURL *restrict curl);
-size_t writeDocument(void *data, size_t len, size_t width, void *rest);
-xmlXPathObject *getXmlNodes(xmlDoc *restrict xml, const char *restrict xpath);
-void init_metar(struct metar *weather);
-int xmlToMetar(xmlDoc *restrict xml, struct metar *restrict weather, size_t count);
-size_t xmlGetMetarCount(xmlDoc *xml);
-void strReplace(const char *restrict needle, const char *restrict replacement, const char *restrict haystack, char *dest, size_t len);
-void strReplaceTimeZulu(const char *restrict needle, time_t replacement, const char *restrict haystack, char *dest, size_t len);
-void strReplaceTime(const char *restrict needle, time_t replacement, const char *restrict haystack, char *dest, size_t len);
-void strReplaceInt(const char *restrict needle, int replacement, const char *restrict haystack, char *dest, size_t len);
-void strReplaceFloat(const char *restrict needle, float replacement, const char *restrict haystack, char *dest, size_t len);
-void strReplaceFloat2(const char *restrict needle, float replacement, const char *restrict haystack, char *dest, size_t len);
-const char *flightConditions(enum flight_rules rules, int color);
-time_t metar_timegm(struct tm *t);
+volatile sig_atomic_t daemonStopped = 0; // set by stopDaemon()
 
 int main(int argc, const char *argv[])
 {
   int flags, // how should we retrieve the METARs?  (see above)
-    i, j, k, // for loops, etc.
+    i,       // for loops, etc.
     hours,   // number of hours in the past to retrieve weather data
     entries, // max number of METARs to parse
+    jobs,    // max number of concurrent transfers
+    daemon,  // --daemon?
+    watch,   // --watch?
+    aged,    // -a?
     c;       // what's the current command line flag?
 
   char *format; // format string (for parts)
   size_t formatLen;
+  struct metar_format compiled; // ...and the same, ready to render
+  const char *where;            // --where: which reports to output
+  struct metar_filter filter;   // ...compiled
 
   char *url; // url to xml file
   size_t urlLen;
@@ -181,53 +141,206 @@ int main(int argc, const char *argv[])
   char *path; // path to metar.xml and metar.cmd
   size_t pathLen;
 
+  const char *feed;       // --feed: url to a bulk file of raw METARs
+  struct metar_table all; // ...and every station's reports in it
+  const char *prefetch;   // --prefetch: url to the bulk file to cache first
+
+  struct station_area area;     // --near or --bbox, if area.radius >= 0
+  struct station_match *found;  // ...the stations in it
+  size_t foundCount;
+  const char **stations;        // ...and argv, with them on the end
+  char extra;
+
   char cmdline[METAR_BUFSIZE];
   char cmdline_out[METAR_BUFSIZE];
   char tmp[METAR_BUFSIZE + 11];
   char buf[METAR_BUFSIZE];
-  char ibuf[METAR_REPLACEBUF];
-
-  char *buf1, *buf2;
-
   char request[METAR_MAXURL]; // final url to xml file with query string
-  FILE *fp; // file handles to metar.xml and metar.cmd
+  char projection[METAR_BUFSIZE]; // ...the part asking for only what's shown
+  char chunk[METAR_BIGBUFSIZE];
+  gzFile fp; // file handles to metar.xml and metar.cmd
   size_t fileLen;
-  struct stat fs;
+  int chunkLen;
   
   //struct metar weather;
-  struct metar *weatherReports;
-  size_t reportCount;
+  int reportCount;
 
+  struct metar_settings settings; // -a, and what's shown (see below)
   struct document doc;
-  xmlDoc *xml;
+
+  struct prefetch *prefetched; // per-argv results of the fetch run, if used
+  struct fetch_run *run;       // ...which lands stations as they're waited on
+  struct metar_cache *cache;   // with -i, the indexed cache
+  struct metar_table cached;   // copied out of the indexed cache
+  struct metar_table loaded;   // from a binary sidecar of the XML cache
+  struct validators known;     // what a stale copy was retrieved with
+  struct arena scratch;        // per-station scratch memory
+  struct output out;           // stdout, buffered
+  struct fetch_pool *pool;     // with -j, the concurrent transfers
+  struct metar_daemon server;
+
+  struct metar_stats station;  // with --stats, this station's...
+  struct metar_stats total;    // ...and everyone's
+  const char *source;          // where this station's reports came from
+  const char *error;           // with -H, why it has none
+  char label[METAR_BUFSIZE];
+  int64_t began, mark;
+  size_t allocsAt;
 
   CURL *curl;
   CURLcode res;
 
   LIBXML_TEST_VERSION
 
+  began = clockMicros();
   flags = 0;
   format = url = path = NULL;
+  feed = prefetch = where = NULL;
+  memset((void *)&filter, 0, sizeof(struct metar_filter));
+  memset((void *)&area, 0, sizeof(struct station_area));
+  area.radius = -1;
+  found = NULL;
+  foundCount = 0;
+  stations = NULL;
   formatLen = urlLen = pathLen = 0;
   hours = 1;
   entries = 10;
+  jobs = 1;
+  daemon = watch = aged = 0;
+  settings.maxAge = METAR_MAXAGE;
+  settings.wanted = wholeReports;
 
   curl = NULL;
-  xml = NULL;
+  pool = NULL;
+  prefetched = NULL;
+  run = NULL;
+  cache = NULL;
   doc.data = malloc(1); // will be expanded by realloc()
   doc.len = 0;
+  doc.size = 1;
+  doc.resizes = 0;
+  memset((void *)&scratch, 0, sizeof(struct arena));
+  doc.parser = NULL;
+  doc.window = 0;
+  doc.known = NULL;
+  doc.headers = NULL;
+  doc.stats = NULL;
+  memset((void *)&total, 0, sizeof(struct metar_stats));
+  memset((void *)&station, 0, sizeof(struct metar_stats));
+  source = NULL;
+  allocsAt = 0;
+  initOutput(&out, STDOUT_FILENO);
 
   // retrieve command line args
-  while ( (c = getopt(argc, (char * const *)argv, "de:f:h:np:tu:xG")) != -1 )
+  while ( (c = getopt_long(argc, (char * const *)argv, "a:bde:f:h:ij:np:tu:xzGH", longOptions, NULL)) != -1 )
   {
     switch ( c )
     {
+      case OPTION_DAEMON:
+      {
+        // serve queries from memory
+        daemon = 1;
+        break;
+      }
+      case OPTION_WATCH:
+      {
+        // stay up, printing only what's new
+        watch = 1;
+        break;
+      }
+      case OPTION_STATS:
+      {
+        // timing and counters on stderr
+        flags |= METARFLAG_STATS;
+        break;
+      }
+      case OPTION_FEED:
+      {
+        // one bulk download for every station
+        feed = optarg;
+        break;
+      }
+      case OPTION_PREFETCH:
+      {
+        // ...or one to fill the cache with
+        prefetch = optarg ? optarg : METAR_PREFETCHURL;
+        break;
+      }
+      case OPTION_NEAR:
+      {
+        // every station within so many nautical miles of a point
+        area.radius = 1;
+        if ( (sscanf(optarg, "%lf,%lf,%lf%c", &area.latitude, &area.longitude, &area.nm, &extra) != 3)
+          || (fabs(area.latitude) > 90.0) || (fabs(area.longitude) > 180.0) || !(area.nm > 0.0) )
+        {
+          fprintf(stderr, "%s: error: Option --near takes LAT,LON,NM.\n", argv[0]);
+          cleanup(url, format, path, &doc, curl, &out);
+          return 1;
+        }
+        break;
+      }
+      case OPTION_BBOX:
+      {
+        // ...or in a box; west past east crosses the antimeridian
+        area.radius = 0;
+        if ( (sscanf(optarg, "%lf,%lf,%lf,%lf%c", &area.south, &area.west, &area.north, &area.east, &extra) != 4)
+          || (area.south > area.north) || (area.south < -90.0) || (area.north > 90.0)
+          || (fabs(area.west) > 180.0) || (fabs(area.east) > 180.0) )
+        {
+          fprintf(stderr, "%s: error: Option --bbox takes SOUTH,WEST,NORTH,EAST.\n", argv[0]);
+          cleanup(url, format, path, &doc, curl, &out);
+          return 1;
+        }
+        break;
+      }
+      case OPTION_WHERE:
+      {
+        // only reports that match an expression
+        where = optarg;
+        break;
+      }
+      case OPTION_OUTPUT:
+      {
+        // for a program to read, rather than a person
+        flags &= ~(METARFLAG_JSONL | METARFLAG_BINARY);
+        if ( strcmp(optarg, "jsonl") == 0 )
+          flags |= METARFLAG_JSONL;
+        else if ( strcmp(optarg, "binary") == 0 )
+          flags |= METARFLAG_BINARY;
+        else if ( strcmp(optarg, "text") != 0 )
+        {
+          fprintf(stderr, "%s: error: Option --output takes text, jsonl or binary.\n", argv[0]);
+          cleanup(url, format, path, &doc, curl, &out);
+          return 1;
+        }
+        break;
+      }
       case 'G':
       {
         // color output
         flags |= METARFLAG_COLOR;
         break;
       }
+      case 'H':
+      {
+        // a local history, asked only for what's new
+        flags |= METARFLAG_HISTORY;
+        break;
+      }
+      case 'a':
+      {
+        // longest a cached copy is trusted
+        settings.maxAge = (time_t)atoi(optarg);
+        if ( settings.maxAge < 1 ) settings.maxAge = 1;
+        aged = 1;
+        break;
+      }
+      case 'b':
+      {
+        // batch requests
+        flags |= METARFLAG_BATCH;
+        break;
+      }
       case 'e':
       {
         // number of entries
@@ -245,11 +358,11 @@ int main(int argc, const char *argv[])
         // formatted METAR
         flags |= METARFLAG_DECODED;
         formatLen = strlen(optarg);
-        format = (char *)malloc(formatLen);
+        format = (char *)malloc(formatLen + 1);
         if ( !format )
         {
           fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-          cleanup(url, format, path, &doc, curl);
+          cleanup(url, format, path, &doc, curl, &out);
           return 2;
         }
         strcpy(format, optarg);
@@ -262,6 +375,19 @@ int main(int argc, const char *argv[])
         hours = atoi(optarg);
         break;
       }
+      case 'i':
+      {
+        // indexed cache
+        flags |= METARFLAG_INDEXED;
+        break;
+      }
+      case 'j':
+      {
+        // number of concurrent transfers
+        jobs = atoi(optarg);
+        if ( jobs < 1 ) jobs = 1;
+        break;
+      }
       case 'n':
       {
         // force a redownload
@@ -276,7 +402,7 @@ int main(int argc, const char *argv[])
         if ( !path )
         {
           fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-          cleanup(url, format, path, &doc, curl);
+          cleanup(url, format, path, &doc, curl, &out);
           return 2;
         }
         strcpy(path, optarg);
@@ -295,11 +421,11 @@ int main(int argc, const char *argv[])
       {
         // change web service URL
         urlLen = strlen(optarg);
-        url = (char *)malloc(urlLen);
+        url = (char *)malloc(urlLen + 1);
         if ( !url )
         {
           fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-          cleanup(url, format, path, &doc, curl);
+          cleanup(url, format, path, &doc, curl, &out);
           return 2;
         }
         strcpy(url, optarg);
@@ -311,19 +437,29 @@ int main(int argc, const char *argv[])
         flags |= METARFLAG_PURGE;
         break;
       }
+      case 'z':
+      {
+        // gzip'd cache files
+        flags |= METARFLAG_GZIP;
+        break;
+      }
       case '?':
       {
         // help info
-        if ( (optopt == 'p') || (optopt == 'u') )
+        if ( (optopt == 'j') || (optopt == 'p') || (optopt == 'u') )
         {
           fprintf(stderr, "%s: error: Option -%c requires an argument.\n", argv[0], optopt);
         }
         else if ( optopt == '?' )
         {
-          fputs("Usage: metar [-Gdefhnptux] WXS1 [WXS2 [...]]\n\tWXS1..n:\t4-digit ICAO weather station code\n\t-G\t\tenable color output\n\t-d\t\tdecode METAR text\n\t-e <num>\tdisplay no more than the specified number of entries\n\t-f <str>\toutputs the METAR using the specified format:\n\t\t\t{raw_text}\t\t\tthe raw METAR\n\t\t\t{station_id}\t\t\t4-digit ICAO weather station code\n\t\t\t{observation_time}\t\tthe Zulu time the METAR was observed\n\t\t\t{observation_time_local}\tthe local time the METAR was observed\n\t\t\t{latitude}\t\t\tthe decimal latitude of the station\n\t\t\t{longitude}\t\t\tthe decimal longitude of the station\n\t\t\t{temp_c}\t\t\tthe temperature in Celsius\n\t\t\t{temp_f}\t\t\tthe temperature in Fahrenheit\n\t\t\t{dewpoint_c}\t\t\tthe dewpoint temperature in Celsius\n\t\t\t{dewpoint_f}\t\t\tthe dewpoint temperature in Fahrenheit\n\t\t\t{wind_dir_degrees}\t\tdirection from which the wind is coming, or 0 for variable\n\t\t\t{wind_speed_kt}\t\t\twind speed in knots\n\t\t\t{wind_gust_kt}\t\t\twind gust speed in knots\n\t\t\t{visibility_statute_mi}\t\thorizontal visibility in miles\n\t\t\t{altim_in_hg}\t\t\tstation pressure in inches of mercury\n\t\t\t{sea_level_pressure_mb}\t\tsea-level pressure in millibars\n\t\t\t{quality_control_flags}\t\tremarks about the station\n\t\t\t{wx_string}\t\t\tadverse weather information\n\t\t\t{sky_conditions}\t\tcloud cover and vertical visibility information\n\t\t\t{flight_category}\t\tVFR, MVFR, IFR, or LIFR\n\t\t\t{precip_in}\t\t\tprecipitation in inches\n\t\t\t{snow_in}\t\t\tsnow in inches\n\t\t\t{vert_vis_ft}\t\t\tvertical visibility in feet\n\t\t\t{elevation_m}\t\t\tstation elevation in meters\n\t-h <num>\tthe number of hours in the past to track\n\t-n\t\tforce a redownload of the METAR\n\t-p <path>\tchange cache path (default /tmp/ => /tmp/metar-*.xml)\n\t-t\t\tdon't download a METAR if one is available from the cache\n\t-u <url>\tchange the base URL of the METAR service\n\t-x\t\tpurge the cache before retrieval\n", stderr);
-          cleanup(url, format, path, &doc, curl);
+          fputs("Usage: metar [-GHabdefhijnptuxz] [--daemon | --watch] WXS1 [WXS2 [...]]\n\tWXS1..n:\t4-digit ICAO weather station code\n\t-G\t\tenable color output\n\t-H\t\tkeep every report in a history log per station (<path>metar-*.hist),\n\t\t\tonly asking for those newer than it has; stations are\n\t\t\tretrieved one at a time\n\t-a <num>\tkeep cached METARs no longer than the specified number of seconds\n\t\t\t(default 3600), or until the station's next report is due\n\t-b\t\tretrieve uncached stations with as few requests as possible\n\t-d\t\tdecode METAR text\n\t-e <num>\tdisplay no more than the specified number of entries\n\t-f <str>\toutputs the METAR using the specified format:\n\t\t\t{raw_text}\t\t\tthe raw METAR\n\t\t\t{station_id}\t\t\t4-digit ICAO weather station code\n\t\t\t{observation_time}\t\tthe Zulu time the METAR was observed\n\t\t\t{observation_time_local}\tthe local time the METAR was observed\n\t\t\t{latitude}\t\t\tthe decimal latitude of the station\n\t\t\t{longitude}\t\t\tthe decimal longitude of the station\n\t\t\t{temp_c}\t\t\tthe temperature in Celsius\n\t\t\t{temp_f}\t\t\tthe temperature in Fahrenheit\n\t\t\t{dewpoint_c}\t\t\tthe dewpoint temperature in Celsius\n\t\t\t{dewpoint_f}\t\t\tthe dewpoint temperature in Fahrenheit\n\t\t\t{wind_dir_degrees}\t\tdirection from which the wind is coming, or 0 for variable\n\t\t\t{wind_speed_kt}\t\t\twind speed in knots\n\t\t\t{wind_gust_kt}\t\t\twind gust speed in knots\n\t\t\t{visibility_statute_mi}\t\thorizontal visibility in miles\n\t\t\t{altim_in_hg}\t\t\tstation pressure in inches of mercury\n\t\t\t{sea_level_pressure_mb}\t\tsea-level pressure in millibars\n\t\t\t{quality_control_flags}\t\tremarks about the station\n\t\t\t{wx_string}\t\t\tadverse weather information\n\t\t\t{sky_conditions}\t\tcloud cover and vertical visibility information\n\t\t\t{flight_category}\t\tVFR, MVFR, IFR, or LIFR\n\t\t\t{precip_in}\t\t\tprecipitation in inches\n\t\t\t{snow_in}\t\t\tsnow in inches\n\t\t\t{vert_vis_ft}\t\t\tvertical visibility in feet\n\t\t\t{elevation_m}\t\t\tstation elevation in meters\n\t-h <num>\tthe number of hours in the past to track\n\t-i\t\tkeep decoded METARs in one indexed cache file (<path>metar.cache)\n\t-j <num>\tretrieve up to the specified number of stations at once,\n\t\t\tdecoding large responses on as many threads\n\t-n\t\tforce a redownload of the METAR\n\t-p <path>\tchange cache path (default /tmp/ => /tmp/metar-*.xml)\n\t-t\t\tdon't download a METAR if one is available from the cache\n\t-u <url>\tchange the base URL of the METAR service\n\t-x\t\tpurge the cache before retrieval\n\t-z\t\tkeep cached XML gzip'd\n\t--stats\t\treport where each station's time went on stderr, as key=value pairs\n\t--feed <url>\tlook stations up in a bulk file of raw METARs first, falling\n\t\t\tback to the service for any it doesn't have\n\t--prefetch[=<url>]\tcache every station in the service's bulk file first,\n\t\t\tat most once every 15 minutes\n\t--near <lat>,<lon>,<nm>\n\t\t\talso retrieve every station within so many nautical miles\n\t\t\tof a point, nearest first, in as few requests as possible\n\t--bbox <south>,<west>,<north>,<east>\n\t\t\t...or in a box of latitudes and longitudes; both look\n\t\t\tstations up where --prefetch last saw them, prefetching\n\t\t\tif it never has\n\t--where <expr>\tonly output reports that match, such as\n\t\t\t'flight_category>=IFR or wind_gust_kt>25': {fields} as for -f,\n\t\t\tcompared with = != < <= > >= or ~ (has), joined with and, or, not\n\t--output=<fmt>\ttext (the default), jsonl for a line of JSON per report, or\n\t\t\tbinary for each struct metar as is, after its size in a uint32_t\n\t--daemon\tkeep METARs in memory and up to date, serving them on <path>metar.sock;\n\t\t\tother invocations with the same -p ask it first\n\t--watch\t\tkeep retrieving the stations as their next reports come due,\n\t\t\tprinting only reports that are new (or corrected) since last time\n", stderr);
+          cleanup(url, format, path, &doc, curl, &out);
           return 0;
         }
+        else if ( optopt == 0 )
+        {
+          fprintf(stderr, "%s: error: Unknown option `%s'.\n", argv[0], argv[optind - 1]);
+        }
         else if ( isprint(optopt) )
         {
           fprintf(stderr, "%s: error: Unknown option `-%c'.\n", argv[0], optopt);
@@ -332,7 +468,7 @@ int main(int argc, const char *argv[])
         {
           fprintf(stderr, "%s: error: Unknown option character `\\x%x'.\n", argv[0], optopt);
         }
-        cleanup(url, format, path, &doc, curl);
+        cleanup(url, format, path, &doc, curl, &out);
         return 1;
       }
     }
@@ -340,11 +476,11 @@ int main(int argc, const char *argv[])
 
   if ( url == NULL )
   {
-    url = strdup("http://aviationweather.gov/adds/dataserver_current/httpparam");
+    url = strdup(METAR_URL);
     if ( !url )
     {
       fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-      cleanup(url, format, path, &doc, curl);
+      cleanup(url, format, path, &doc, curl, &out);
       return 2;
     }
 
@@ -357,29 +493,103 @@ int main(int argc, const char *argv[])
     if ( !format )
     {
       fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-      cleanup(url, format, path, &doc, curl);
+      cleanup(url, format, path, &doc, curl, &out);
       return 2;
     }
 
     formatLen = strlen(format);
   }
 
+  if ( compileFormat(&compiled, format) != 0 )
+  {
+    fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+    cleanup(url, format, path, &doc, curl, &out);
+    return 2;
+  }
+
+  if ( where )
+  {
+    c = compileFilter(&filter, where);
+    if ( c == -1 )
+    {
+      fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+      freeFormat(&compiled);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 2;
+    }
+    if ( c > 0 )
+    {
+      if ( where[c - 1] == '\0' )
+        fprintf(stderr, "%s: error: Option --where ends too soon.\n", argv[0]);
+      else
+        fprintf(stderr, "%s: error: Cannot make sense of --where at `%s'.\n", argv[0], &where[c - 1]);
+      freeFormat(&compiled);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 1;
+    }
+    compiled.where = &filter;
+  }
+
+  // only what will be output (or tested) is asked for, parsed and cached;
+  // a history or a daemon keeps everything, since what it's asked later
+  // may differ
+  if ( !daemon && ((flags & METARFLAG_HISTORY) != METARFLAG_HISTORY) )
+  {
+    settings.wanted.fields = formatFields(&compiled, flags) | filterFields(&filter);
+    settings.wanted.latest = (entries <= 1);
+  }
+  projectionQuery(projection, sizeof(projection), 0, &settings.wanted);
+
   if ( path == NULL )
   {
     path = strdup("/tmp/");
     if ( !path )
     {
       fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-      cleanup(url, format, path, &doc, curl);
+      cleanup(url, format, path, &doc, curl, &out);
       return 2;
     }
 
     pathLen = strlen(path);
   }
 
-  if ( (flags & METARFLAG_PURGE) == METARFLAG_PURGE )
+  // a running daemon answers from memory, sparing everything below.  it
+  // keeps to its own -a and -t, so a run given either doesn't ask it.
+  if ( !daemon && !watch && !prefetch && !aged && ((flags & METARFLAG_HISTORY) != METARFLAG_HISTORY) && (optind < argc)
+    && ((flags & (METARFLAG_UPDATE | METARFLAG_PURGE | METARFLAG_NOTS)) == 0) )
   {
-    sprintf(buf, "rm -f %smetar-*.xml", path); // TODO: make this secure
+    mark = clockMicros();
+    i = queryDaemon(path, url, hours, entries, flags, &compiled, &scratch, &out, optind, argc, argv);
+    if ( i < 0 )
+    {
+      fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 2;
+    }
+    if ( ((flags & METARFLAG_STATS) == METARFLAG_STATS) && (i > optind) )
+      fprintf(stderr, "stats daemon stations=%d elapsed_us=%lld\n", i - optind, (long long)(clockMicros() - mark));
+    if ( i >= argc )
+    {
+      freeArena(&scratch);
+      freeFormat(&compiled);
+      freeFilter(&filter);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 0;
+    }
+    optind = i;
+  }
+
+  if ( (flags & METARFLAG_INDEXED) == METARFLAG_INDEXED )
+  {
+    cache = openIndexedCache(path);
+    if ( !cache )
+      fprintf(stderr, "%s: warning: Cannot open %smetar.cache; not caching.\n", argv[0], path);
+    else if ( ((flags & METARFLAG_PURGE) == METARFLAG_PURGE) && (purgeIndexedCache(cache) != 0) )
+      fprintf(stderr, "%s: warning: Cannot purge %smetar.cache.\n", argv[0], path);
+  }
+  else if ( (flags & METARFLAG_PURGE) == METARFLAG_PURGE )
+  {
+    snprintf(buf, METAR_BUFSIZE, "rm -f %smetar-*.xml %smetar-*.bin %smetar-*.hist %smetar-*.hstr", path, path, path, path); // TODO: make this secure
     system(buf);
   }
 
@@ -388,1193 +598,1051 @@ int main(int argc, const char *argv[])
   if ( !curl )
   {
     fprintf(stderr, "%s: error: Cannot initialize CURL.\n", argv[0]);
-    cleanup(url, format, path, &doc, curl);
+    cleanup(url, format, path, &doc, curl, &out);
     return 3;
   }
 
+  if ( (jobs > 1) || daemon || watch )
+  {
+    pool = openFetchPool(jobs);
+    if ( !pool )
+    {
+      fprintf(stderr, "%s: error: Cannot initialize CURL.\n", argv[0]);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 3;
+    }
+  }
+
+  if ( (area.radius >= 0) && !prefetch )
+  {
+    // stations are found where the bulk file says they are
+    if ( findStations(path, &area, &found, &foundCount) == -1 )
+      prefetch = METAR_PREFETCHURL;
+    if ( found ) free(found);
+    found = NULL;
+    foundCount = 0;
+  }
+
+  if ( prefetch )
+  {
+    // later lookups, this run's included, are then cache hits
+    mark = clockMicros();
+    c = prefetchMetars(curl, cache, prefetch, path, flags, &settings);
+    if ( c == -2 )
+    {
+      fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+      closeFetchPool(pool);
+      closeIndexedCache(cache);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 2;
+    }
+    else if ( c == -1 )
+      fprintf(stderr, "%s: warning: Unable to retrieve %s.\n", argv[0], prefetch);
+    else if ( (flags & METARFLAG_STATS) == METARFLAG_STATS )
+      fprintf(stderr, "stats prefetch stations=%d elapsed_us=%lld\n", c, (long long)(clockMicros() - mark));
+
+    if ( (optind >= argc) && (area.radius < 0) )
+    {
+      closeFetchPool(pool);
+      closeIndexedCache(cache);
+      freeFormat(&compiled);
+      freeFilter(&filter);
+      cleanup(url, format, path, &doc, curl, &out);
+      return (c < 0) ? 3 : 0;
+    }
+  }
+
+  if ( area.radius >= 0 )
+  {
+    // the stations in the area go on the end of the ones asked for, to be
+    // retrieved together
+    c = findStations(path, &area, &found, &foundCount);
+    stations = (const char **)malloc(sizeof(const char *) * (argc + foundCount + 1));
+    if ( (c == -2) || !stations )
+    {
+      fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 2;
+    }
+    if ( c == -1 )
+      fprintf(stderr, "%s: warning: No stations are known; see --prefetch.\n", argv[0]);
+    else if ( (foundCount == 0) && (optind >= argc) )
+      fprintf(stderr, "%s: No stations in that area.\n", argv[0]);
+
+    memcpy((void *)stations, (const void *)argv, sizeof(const char *) * argc);
+    for ( i = 0; i < (int)foundCount; ++i )
+      stations[argc + i] = found[i].station.station;
+    stations[argc + foundCount] = NULL;
+    argv = stations;
+    argc += (int)foundCount;
+    if ( foundCount > 0 ) flags |= METARFLAG_BATCH;
+    if ( optind >= argc )
+    {
+      free(stations);
+      if ( found ) free(found);
+      closeFetchPool(pool);
+      closeIndexedCache(cache);
+      freeFormat(&compiled);
+      freeFilter(&filter);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 0;
+    }
+  }
+
+  if ( daemon || watch )
+  {
+    // --watch keeps its stations up to date the same way
+    memset((void *)&server, 0, sizeof(struct metar_daemon));
+    server.curl = curl;
+    server.pool = pool;
+    server.cache = cache;
+    server.url = url;
+    server.path = path;
+    server.flags = flags & ~(METARFLAG_PURGE | METARFLAG_UPDATE | METARFLAG_NOTS);
+    server.settings = &settings;
+
+    // stations named up front are kept warm for good
+    for ( c = 0, i = optind; (i < argc) && (c == 0); ++i )
+    {
+      if ( !findDaemonStation(&server, argv[i], hours, 1) )
+        c = 2;
+      else
+        findDaemonStation(&server, argv[i], hours, 0)->pinned = 1;
+    }
+    if ( (c == 0) && daemon )
+      c = runDaemon(&server, argv[0]);
+    else if ( c == 0 )
+      c = runWatch(&server, entries, flags, &compiled, &out, argv[0]);
+    else
+      fprintf(stderr, "%s: error: Cannot serve %s.\n", argv[0], argv[i - 1]);
+
+    closeFetchPool(pool);
+    closeIndexedCache(cache);
+    freeArena(&scratch);
+    freeFormat(&compiled);
+    freeFilter(&filter);
+    cleanup(url, format, path, &doc, curl, &out);
+    return c;
+  }
+
   if ( optind >= argc )
   {
     if ( (flags & METARFLAG_PURGE) == METARFLAG_PURGE )
     {
       fprintf(stderr, "%s: Cache purged.\n", argv[0]);
-      cleanup(url, format, path, &doc, curl);
+      closeIndexedCache(cache);
+      cleanup(url, format, path, &doc, curl, &out);
       return 0;
     }
     else
     {
       fprintf(stderr, "%s: error: Please specify a weather station by 4-digit ICAO code.\n", argv[0]);
-      cleanup(url, format, path, &doc, curl);
+      cleanup(url, format, path, &doc, curl, &out);
     }
     return 4;
   }
 
+  if ( ((flags & METARFLAG_HISTORY) != METARFLAG_HISTORY)
+    && (((flags & METARFLAG_BATCH) == METARFLAG_BATCH) || (jobs > 1) || feed) )
+  {
+    // stations are printed in order as soon as each one's request lands,
+    // while the rest are still under way
+    prefetched = (struct prefetch *)calloc(argc, sizeof(struct prefetch));
+    if ( prefetched && feed )
+    {
+      // whatever the feed has needs no request of its own; if it can't be
+      // had, every station goes to the service as usual
+      c = loadFeed(curl, feed, path, flags, &settings, &all, &scratch);
+      for ( i = optind; (c == 0) && (i < argc); ++i )
+      {
+        c = selectStationReports(&all, argv[i], time(NULL) - (time_t)hours * 3600, &prefetched[i].reports);
+        if ( c > 0 ) prefetched[i].done = 1;
+        c = (c < 0) ? -2 : 0;
+      }
+      freeMetarTable(&all);
+      resetArena(&scratch);
+      if ( c == -1 )
+        fprintf(stderr, "%s: warning: Unable to retrieve %s.\n", argv[0], feed);
+      else if ( c == -2 )
+      {
+        for ( i = optind; i < argc; ++i ) freeMetarTable(&prefetched[i].reports);
+        free(prefetched);
+        prefetched = NULL;
+      }
+    }
+    if ( prefetched )
+      run = startFetch(curl, pool, cache, url, path, hours, flags, &settings, optind, argc, argv, prefetched);
+    if ( !run )
+    {
+      fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 2;
+    }
+  }
+
+  if ( (flags & METARFLAG_STATS) == METARFLAG_STATS )
+    doc.stats = &station;
+
   for ( i = optind; i < argc; ++i )
   {
+    // a terminal sees each station as soon as it's done
+    if ( out.eager ) flushOutput(&out, NULL, 0);
+    resetArena(&scratch);
+
+    // the last station's stats are in; this one's start from nothing
+    if ( source && ((flags & METARFLAG_STATS) == METARFLAG_STATS) )
+    {
+      station.allocs += scratch.allocs + doc.resizes - allocsAt;
+      snprintf(label, METAR_BUFSIZE, "station=%s source=%s", argv[i - 1], source);
+      printStats(label, &station);
+      addStats(&total, &station);
+    }
+    memset((void *)&station, 0, sizeof(struct metar_stats));
+    allocsAt = scratch.allocs + doc.resizes;
+    source = "network";
+
+    if ( run && (awaitStation(run, i) != 0) )
+    {
+      fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 2;
+    }
+
+    if ( prefetched && prefetched[i].done )
+    {
+      // already retrieved (and cached) by the run
+      station = prefetched[i].stats;
+      source = "prefetched";
+      mark = clockMicros();
+      if ( prefetched[i].error )
+      {
+        outputUnavailable(&out, flags, argv[i], prefetched[i].error);
+      }
+      else if ( printMetars(&prefetched[i].reports, entries, flags, &compiled, &out) != 0 )
+      {
+        fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+        cleanup(url, format, path, &doc, curl, &out);
+        return 2;
+      }
+      station.render += clockMicros() - mark;
+      freeMetarTable(&prefetched[i].reports);
+      continue;
+    }
+
+    if ( (flags & METARFLAG_HISTORY) == METARFLAG_HISTORY )
+    {
+      // the station's log answers for itself, asking only for what's new
+      doc.data[0] = '\0';
+      doc.len = 0;
+      doc.known = NULL;
+      if ( doc.parser )
+        resetMetarParser(doc.parser);
+      else
+        doc.parser = newMetarParser(0, settings.wanted.fields);
+
+      source = "history";
+      c = doc.parser ? historyMetars(curl, &doc, url, path, argv[i], hours, flags, &settings, &loaded, &error) : -2;
+      mark = clockMicros();
+      if ( c == -1 )
+        outputUnavailable(&out, flags, argv[i], error);
+      else if ( (c == -2) || (printMetars(&loaded, entries, flags, &compiled, &out) != 0) )
+      {
+        fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+        cleanup(url, format, path, &doc, curl, &out);
+        return 2;
+      }
+      station.render += clockMicros() - mark;
+      freeMetarTable(&loaded);
+      continue;
+    }
+
     // first, check if we're cached.
-    strncpy(tmp, path, METAR_BUFSIZE);
-    strcat(tmp, "metar-");
-    strncat(tmp, argv[i], METAR_BUFSIZE - strlen(path));
-    strcat(tmp, ".xml");
+    mark = clockMicros();
+    if ( cache && ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE)
+      && (findCachedReports(cache, argv[i], flags, &settings, &cached, &scratch) == 0) )
+    {
+      source = "indexed";
+      station.cache += clockMicros() - mark;
+      mark = clockMicros();
+      if ( printMetars(&cached, entries, flags, &compiled, &out) != 0 )
+      {
+        fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+        cleanup(url, format, path, &doc, curl, &out);
+        return 2;
+      }
+      station.render += clockMicros() - mark;
+      continue;
+    }
 
+    cachePath(tmp, path, argv[i]);
+
+    // a fresh XML cache is read from its decoded sidecar if it has one
+    if ( !cache && ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE) && isCacheFresh(tmp, flags, &settings)
+      && (readSidecar(tmp, &loaded, &scratch) == 0) )
+    {
+      source = "sidecar";
+      station.cache += clockMicros() - mark;
+      mark = clockMicros();
+      if ( printMetars(&loaded, entries, flags, &compiled, &out) != 0 )
+      {
+        fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+        cleanup(url, format, path, &doc, curl, &out);
+        return 2;
+      }
+      station.render += clockMicros() - mark;
+      continue;
+    }
+    station.cache += clockMicros() - mark;
+
+    // the document buffer and parser are kept from one station to the next
     doc.data[0] = '\0';
     doc.len = 0;
+    if ( doc.parser )
+      resetMetarParser(doc.parser);
+    else
+      doc.parser = newMetarParser(0, settings.wanted.fields);
+    if ( !doc.parser )
+    {
+      fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 2;
+    }
 
-    memset((void *)&fs, 0, sizeof(struct stat));
-    if ( (lstat(tmp, &fs) == 0) && ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE) )
+    fileLen = 0;
+    mark = clockMicros();
+    if ( !cache && ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE) && isCacheFresh(tmp, flags, &settings) )
     {
-      if ( ((time(NULL) - fs.st_mtime) < 900) || ((flags & METARFLAG_NOTS) == METARFLAG_NOTS) )
+      fp = gzopen(tmp, "rb");
+      if ( fp )
       {
-        fp = fopen(tmp, "r");
-        if ( fp )
+        source = "xml";
+        // the parser keeps what it needs, so the file is never held whole,
+        // nor (with -z) both it and what it inflates to
+        while ( (chunkLen = gzread(fp, chunk, METAR_BIGBUFSIZE)) > 0 )
         {
-          fseek(fp, 0, SEEK_END);
-          fileLen = ftell(fp);
-          fseek(fp, 0, SEEK_SET);
-          doc.data = realloc(doc.data, fileLen + 1);
-          if ( doc.data == NULL )
+          if ( feedMetarParser(doc.parser, chunk, (size_t)chunkLen) != 0 )
           {
             fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-            cleanup(url, format, path, &doc, curl);
+            gzclose(fp);
+            cleanup(url, format, path, &doc, curl, &out);
             return 2;
           }
-          doc.len = fileLen;
-          fread(doc.data, 1, doc.len, fp);
-          fclose(fp);
+          fileLen += (size_t)chunkLen;
         }
+        gzclose(fp);
       }
     }
-
-    if ( doc.len == 0 )
+    if ( fileLen > 0 )
+      station.parse += clockMicros() - mark;
+
+    doc.known = NULL;
+    if ( (fileLen == 0) && ((flags & METARFLAG_UPDATE) != METARFLAG_UPDATE)
+      && ((cache ? findCachedValidators(cache, argv[i], &settings.wanted, &known) : readValidators(tmp, &known, &settings.wanted)) == 0)
+      && ((known.etag[0] != '\0') || (known.modified[0] != '\0')) )
+      doc.known = &known; // a stale copy may only need revalidating
+    if ( fileLen == 0 )
+      station.cache += clockMicros() - mark;
+
+    if ( fileLen == 0 )
     {
+    retrieve:
       snprintf(request, METAR_MAXURL,
-        "%s?dataSource=metars&requestType=retrieve&format=xml&stationString=%s&hoursBeforeNow=%d",
+        "%s?dataSource=metars&requestType=retrieve&format=xml&stationString=%s&hoursBeforeNow=%d%s",
         url,
         argv[i],
-        hours);
+        hours,
+        projection);
       request[METAR_MAXURL - 1] = '\0';
-      curl_easy_setopt(curl, CURLOPT_URL, request);
-      curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeDocument);
-      curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&doc);
-      curl_easy_setopt(curl, CURLOPT_USERAGENT, "Metar/1.0");
+      setupTransfer(curl, request, &doc); // parsed as it arrives
 
-      res = curl_easy_perform(curl);
+      res = performRequest(curl, &doc);
+      addTransferStats(&station, curl);
       if ( res != CURLE_OK )
       {
-        printf("No weather information for %s: %s.\n", argv[i], curl_easy_strerror(res));
+        if ( doc.parser->error == -2 )
+        {
+          fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+          cleanup(url, format, path, &doc, curl, &out);
+          return 2;
+        }
+        outputUnavailable(&out, flags, argv[i], curl_easy_strerror(res));
+        continue;
+      }
+      if ( doc.status >= 400 )
+      {
+        // out of retries, or not worth one; nothing to cache either way
+        outputUnavailable(&out, flags, argv[i], statusReason(doc.status));
+        continue;
+      }
+
+      if ( doc.known && (doc.status == 304) )
+      {
+        // unchanged since: what's cached will do, as if just retrieved
+        mark = clockMicros();
+        if ( revalidateStation(cache, tmp, argv[i], &settings, &loaded, &scratch) == 0 )
+        {
+          source = "revalidated";
+          station.cache += clockMicros() - mark;
+          mark = clockMicros();
+          if ( printMetars(&loaded, entries, flags, &compiled, &out) != 0 )
+          {
+            fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+            cleanup(url, format, path, &doc, curl, &out);
+            return 2;
+          }
+          station.render += clockMicros() - mark;
+          continue;
+        }
+        station.cache += clockMicros() - mark;
+
+        // ...unless it's gone in the meantime, so ask again for all of it
+        doc.known = NULL;
+        doc.data[0] = '\0';
         doc.len = 0;
+        resetMetarParser(doc.parser);
+        goto retrieve;
       }
-      else
+
+      if ( !cache )
       {
-        unlink(tmp);
-        fp = fopen(tmp, "w");
+        fp = createCacheFile(tmp, flags);
         if ( fp )
         {
-          fwrite(doc.data, 1, doc.len, fp);
-          fclose(fp);
+          gzwrite(fp, doc.data, (unsigned int)doc.len);
+          gzclose(fp);
         }
       }
     }
 
-    if ( doc.len != 0 )
+    // we have our data, presumably.
+    mark = clockMicros();
+    reportCount = finishMetarParser(doc.parser);
+    station.parse += clockMicros() - mark;
+    mark = clockMicros();
+    if ( cache && (fileLen == 0) && (reportCount >= 0) )
+      storeCachedReports(cache, argv[i], &doc.parser->reports, &doc.validators, &settings.wanted);
+    else if ( !cache && (reportCount >= 0) )
+      writeSidecar(tmp, &doc.parser->reports, (fileLen == 0) ? &doc.validators : NULL, &settings.wanted);
+    station.cache += clockMicros() - mark;
+    mark = clockMicros();
+    if ( reportCount == -1 )
     {
-      // we have our data, presumably.  fire up XML!
-      xml = xmlReadMemory(doc.data, doc.len, "metar.xml", NULL, 0);
+      outputUnavailable(&out, flags, argv[i], "invalid XML data");
+    }
+    else if ( (reportCount == -2)
+      || ((reportCount > 0) && (printMetars(&doc.parser->reports, entries, flags, &compiled, &out) != 0)) )
+    {
+      fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
+      cleanup(url, format, path, &doc, curl, &out);
+      return 2;
+    }
+    station.render += clockMicros() - mark;
+  }
 
-      reportCount = xmlGetMetarCount(xml);
-      if ( reportCount > 0 )
-      {
-        weatherReports = (struct metar *)malloc(sizeof(struct metar) * reportCount);
-        if ( weatherReports == NULL )
-        {
-          fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-          cleanup(url, format, path, &doc, curl);
-          return 2;
-        }
-        switch ( xmlToMetar(xml, weatherReports, reportCount) )
-        {
-          case -3:
-            printf("No weather information for %s: invalid XPath expression.\n", argv[i]);
-            goto startOver;
-          case -2:
-            printf("No weather information for %s: invalid XPath context.\n", argv[i]);
-            goto startOver;
-          case -1:
-            printf("No weather information for %s: invalid XML data.\n", argv[i]);
-            goto startOver;
-          case 0:
-            printf("No weather information for %s is available at this time.\n", argv[i]);
-            goto startOver;
-        }
+  closeOutput(&out);
 
-        for ( j = 0; (j < reportCount) && (j < entries); ++j )
-        {
-          if ( (flags & METARFLAG_DECODED) != METARFLAG_DECODED )
-          {
-            // output raw, I guess.
-            printf("%s\n", weatherReports[j].raw_text);
-          }
-          else if ( (flags & METARFLAG_SPECIAL) == METARFLAG_SPECIAL )
-          {
-            // build our format.
-            buf1 = (char *)malloc(METAR_BIGBUFSIZE);
-            buf2 = (char *)malloc(METAR_BUFSIZE);
-            if ( !buf1 || !buf2 )
-            {
-              fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-              xmlFreeDoc(xml);
-              cleanup(url, format, path, &doc, curl);
-              return 2;
-            }
-
-            strftime(buf2, METAR_BUFSIZE, "%Y-%m-%d %H:%M:%S",
-              gmtime(&weatherReports[j].observation_time));
-
-            sprintf(buf1,
-              "%s (%.2f, %.2f) [%s] at %s\n",
-              weatherReports[j].station_id,
-              weatherReports[j].latitude,
-              weatherReports[j].longitude,
-              flightConditions(weatherReports[j].flight_category,
-                (flags & METARFLAG_COLOR) == METARFLAG_COLOR ? 1 : 0),
-              buf2);
-
-            strftime(buf2, METAR_BUFSIZE, "%Y-%m-%d %H:%M:%S",
-              localtime(&weatherReports[j].observation_time));
-
-            snprintf(buf, METAR_BUFSIZE,
-              "(Local time: %s)\n",
-              buf2);
-            buf[METAR_BUFSIZE - 1] = '\0';
-
-            strcat(buf1, buf);
-
-            // corrected?
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_CORRECTED) == METAR_QUALITY_CORRECTED )
-            {
-              if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                strcat(buf1, "\033[1;33mCorrected version\033[0m\n");
-              else
-                strcat(buf1, "Corrected version\n");
-            }
-
-            strcat(buf1, "\n");
-
-            // winds
-            if ( weatherReports[j].wind_dir_degrees >= 0 )
-            {
-              if ( weatherReports[j].wind_speed_kt == 0 )
-              {
-                strcat(buf1, "\tWinds: Calm\n");
-              }
-              else
-              {
-                if ( weatherReports[j].wind_dir_degrees == 0 )
-                {
-                  if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                  {
-                    if ( weatherReports[j].wind_speed_kt >= 10 )
-                      snprintf(buf, METAR_BUFSIZE, "\033[1;31m%d knots\033[0m", weatherReports[j].wind_speed_kt);
-                    else
-                      snprintf(buf, METAR_BUFSIZE, "%d knots", weatherReports[j].wind_speed_kt);
-                    buf[METAR_BUFSIZE - 1] = '\0';
-
-                    strcat(buf1, "\tWinds: Variable at ");
-                    strcat(buf1, buf);
-
-                    if ( weatherReports[j].wind_gust_kt > 0 )
-                    {
-                      if ( (weatherReports[j].wind_gust_kt - weatherReports[j].wind_speed_kt) >= 5 )
-                        snprintf(buf, METAR_BUFSIZE, " \033[1;31mgusting %d knots\033[0m", weatherReports[j].wind_gust_kt);
-                      else
-                        snprintf(buf, METAR_BUFSIZE, " gusting %d knots", weatherReports[j].wind_gust_kt);
-                      buf[METAR_BUFSIZE - 1] = '\0';
-                      strcat(buf1, buf);
-                    }
-
-                    strcat(buf1, "\n");
-                  }
-                  else
-                  {
-                    if ( weatherReports[j].wind_gust_kt > 0 )
-                      snprintf(buf, METAR_BUFSIZE,
-                        "\tWinds: Variable at %d knots gusting %d knots\n",
-                        weatherReports[j].wind_speed_kt,
-                        weatherReports[j].wind_gust_kt);
-                    else
-                      snprintf(buf, METAR_BUFSIZE,
-                        "\tWinds: Variable at %d knots\n",
-                        weatherReports[j].wind_speed_kt);
-                    buf[METAR_BUFSIZE - 1] = '\0';
-                    strcat(buf1, buf);
-                  }
-                }
-                else
-                {
-                  if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                  {
-                    if ( weatherReports[j].wind_speed_kt >= 10 )
-                      snprintf(buf, METAR_BUFSIZE, "%d* at \033[1;31m%d knots\033[0m",
-                        weatherReports[j].wind_dir_degrees,
-                        weatherReports[j].wind_speed_kt);
-                    else
-                      snprintf(buf, METAR_BUFSIZE, "%d* at %d knots",
-                        weatherReports[j].wind_dir_degrees,
-                        weatherReports[j].wind_speed_kt);
-                    buf[METAR_BUFSIZE - 1] = '\0';
-
-                    strcat(buf1, "\tWinds: ");
-                    strcat(buf1, buf);
-
-                    if ( weatherReports[j].wind_gust_kt > 0 )
-                    {
-                      if ( (weatherReports[j].wind_gust_kt - weatherReports[j].wind_speed_kt) >= 5 )
-                        snprintf(buf, METAR_BUFSIZE, " \033[1;31mgusting %d knots\033[0m", weatherReports[j].wind_gust_kt);
-                      else
-                        snprintf(buf, METAR_BUFSIZE, " gusting %d knots", weatherReports[j].wind_gust_kt);
-                      buf[METAR_BUFSIZE - 1] = '\0';
-                      strcat(buf1, buf);
-                    }
-
-                    strcat(buf1, "\n");
-                  }
-                  else
-                  {
-                    if ( weatherReports[j].wind_gust_kt > 0 )
-                      snprintf(buf, METAR_BUFSIZE,
-                        "\tWinds: %d* at %d knots gusting %d knots\n",
-                        weatherReports[j].wind_dir_degrees,
-                        weatherReports[j].wind_speed_kt,
-                        weatherReports[j].wind_gust_kt);
-                    else
-                      snprintf(buf, METAR_BUFSIZE,
-                        "\tWinds: %d* at %d knots\n",
-                        weatherReports[j].wind_dir_degrees,
-                        weatherReports[j].wind_speed_kt);
-                    buf[METAR_BUFSIZE - 1] = '\0';
-                    strcat(buf1, buf);
-                  }
-                }
-              }
-            }
-
-            // visibility
-            if ( !isnan(weatherReports[j].visibility_statute_mi) )
-            {
-              if ( ((flags & METARFLAG_COLOR) == METARFLAG_COLOR) && (weatherReports[j].visibility_statute_mi < 5.0f) )
-              {
-                if ( weatherReports[j].visibility_statute_mi >= 3.0f )
-                  snprintf(buf, METAR_BUFSIZE,
-                    "\tVisibility: \033[1;34m%.1f miles\033[0m\n",
-                    weatherReports[j].visibility_statute_mi);
-                else if ( weatherReports[j].visibility_statute_mi >= 1.0f )
-                  snprintf(buf, METAR_BUFSIZE,
-                    "\tVisibility: \033[1;31m%.1f miles\033[0m\n",
-                    weatherReports[j].visibility_statute_mi);
-                else
-                  snprintf(buf, METAR_BUFSIZE,
-                    "\tVisibility: \033[1;35m%.1f miles\033[0m\n",
-                    weatherReports[j].visibility_statute_mi);
-              }
-              else
-              {
-                snprintf(buf, METAR_BUFSIZE,
-                  "\tVisibility: %.1f miles\n",
-                  weatherReports[j].visibility_statute_mi);
-              }
-              buf[METAR_BUFSIZE - 1] = '\0';
-              strcat(buf1, buf);
-            }
-
-            // sky conditions
-            if ( weatherReports[j].sky_condition_count > 0 )
-            {
-              for ( k = 0; k < weatherReports[j].sky_condition_count; ++k )
-              {
-                if ( weatherReports[j].sky_condition[k].sky_cover == METAR_SKYCOND_CLR )
-                {
-                  strcat(buf1, "\tSky condition: Clear\n");
-                }
-                else
-                {
-                  if ( ((flags & METARFLAG_COLOR) == METARFLAG_COLOR) && (!isVfrWeather(weatherReports[j].sky_condition[k].sky_cover)) && (weatherReports[j].sky_condition[k].cloud_base_ft_agl <= 3000) )
-                  {
-                    if ( weatherReports[j].sky_condition[k].cloud_base_ft_agl >= 1000 )
-                      snprintf(buf, METAR_BUFSIZE,
-                        "\tSky condition: \033[1;34m%s at %d feet\033[0m above ground level\n",
-                        skyCondition(weatherReports[j].sky_condition[k].sky_cover),
-                        weatherReports[j].sky_condition[k].cloud_base_ft_agl);
-                    else if ( weatherReports[j].sky_condition[k].cloud_base_ft_agl >= 500 )
-                      snprintf(buf, METAR_BUFSIZE,
-                        "\tSky condition: \033[1;31m%s at %d feet\033[0m above ground level\n",
-                        skyCondition(weatherReports[j].sky_condition[k].sky_cover),
-                        weatherReports[j].sky_condition[k].cloud_base_ft_agl);
-                    else
-                      snprintf(buf, METAR_BUFSIZE,
-                        "\tSky condition: \033[1;35m%s at %d feet\033[0m above ground level\n",
-                        skyCondition(weatherReports[j].sky_condition[k].sky_cover),
-                        weatherReports[j].sky_condition[k].cloud_base_ft_agl);
-                  }
-                  else
-                  {
-                    snprintf(buf, METAR_BUFSIZE,
-                      "\tSky condition: %s at %d feet above ground level\n",
-                      skyCondition(weatherReports[j].sky_condition[k].sky_cover),
-                      weatherReports[j].sky_condition[k].cloud_base_ft_agl);
-                  }
-                  buf[METAR_BUFSIZE - 1] = '\0';
-                  strcat(buf1, buf);
-                }
-              }
-            }
-
-            // temperature
-            if ( !isnan(weatherReports[j].temp_c) )
-            {
-              snprintf(buf, METAR_BUFSIZE, "\tTemperature: %.1f*C (%.1f*F)\n",
-                weatherReports[j].temp_c,
-                weatherReports[j].temp_c * 9.0f/5.0f + 32.0f);
-              buf[METAR_BUFSIZE - 1] = '\0';
-              strcat(buf1, buf);
-            }
-
-            // dewpoint
-            if ( !isnan(weatherReports[j].dewpoint_c) )
-            {
-              snprintf(buf, METAR_BUFSIZE, "\tDewpoint: %.1f*C (%.1f*F)\n",
-                weatherReports[j].dewpoint_c,
-                weatherReports[j].dewpoint_c * 9.0f/5.0f + 32.0f);
-              buf[METAR_BUFSIZE - 1] = '\0';
-              strcat(buf1, buf);
-            }
-
-            // altimeter
-            if ( !isnan(weatherReports[j].altim_in_hg) )
-            {
-              snprintf(buf, METAR_BUFSIZE, "\tPressure: %.2f\" Hg (%.1f mb)\n",
-                weatherReports[j].altim_in_hg,
-                33.85f * weatherReports[j].altim_in_hg);
-              buf[METAR_BUFSIZE - 1] = '\0';
-              strcat(buf1, buf);
-            }
-
-            // adverse weather
-            if ( weatherReports[j].wx_string[0] != '\0' )
-            {
-              strcat(buf1, "\tAdverse weather: ");
-              if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                strcat(buf1, "\033[1;33m");
-              strcat(buf1, weatherReports[j].wx_string);
-              if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                strcat(buf1, "\033[0m");
-              strcat(buf1, "\n");
-            }
-
-            // notes
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_MAINTENANCE) == METAR_QUALITY_MAINTENANCE )
-            {
-              if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                strcat(buf1, "\t\033[1;33mWarning\033[0m: Station needs maintenance\n");
-              else
-                strcat(buf1, "\tWarning: Station needs maintenance\n");
-            }
-
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_NO_WEATHER) == METAR_QUALITY_MAINTENANCE )
-            {
-              if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                strcat(buf1, "\t\033[1;31mWarning\033[0m: Station offline\n");
-              else
-                strcat(buf1, "\tWarning: Station offline\n");
-            }
-
-            if ( (weatherReports[j].quality_control_flags & (METAR_QUALITY_AUTO | METAR_QUALITY_AUTO_STATION)) )
-            {
-              strcat(buf1, "\tAutomated weather available.\n");
-            }
-
-            // raw
-            strcat(buf1, "\t");
-            strcat(buf1, weatherReports[j].raw_text);
-            strcat(buf1, "\n");
-
-            puts(buf1);
-            free(buf1);
-            free(buf2);
-          }
-          else
-          {
-            // formatting time!
-            buf1 = (char *)malloc(METAR_BIGBUFSIZE);
-            buf2 = (char *)malloc(METAR_BIGBUFSIZE);
-
-            if ( !buf1 || !buf2 )
-            {
-              fprintf(stderr, "%s: error: Out of memory.\n", argv[0]);
-              xmlFreeDoc(xml);
-              cleanup(url, format, path, &doc, curl);
-              return 2;
-            }
-
-            strReplace("{raw_text}", weatherReports[j].raw_text, format, buf1, METAR_BIGBUFSIZE);
-            strReplace("{station_id}", weatherReports[j].station_id, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceTimeZulu("{observation_time}", weatherReports[j].observation_time, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceTime("{observation_localtime}", weatherReports[j].observation_time, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat2("{latitude}", weatherReports[j].latitude, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat2("{longitude}", weatherReports[j].longitude, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat("{temp_c}", weatherReports[j].temp_c, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat("{dewpoint_c}", weatherReports[j].dewpoint_c, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat("{temp_f}", weatherReports[j].temp_c * 9.0f/5.0f + 32.0f, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat("{dewpoint_f}", weatherReports[j].dewpoint_c * 9.0f/5.0f + 32.0f, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceInt("{wind_dir_degrees}", weatherReports[j].wind_dir_degrees, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceInt("{wind_speed_kt}", weatherReports[j].wind_speed_kt, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceInt("{wind_gust_kt}", weatherReports[j].wind_gust_kt, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat("{visibility_statute_mi}", weatherReports[j].visibility_statute_mi, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat2("{altim_in_hg}", weatherReports[j].altim_in_hg, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat2("{sea_level_pressure_mb}", weatherReports[j].altim_in_hg, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplace("{wx_string}", weatherReports[j].wx_string, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat2("{three_hr_pressure_tendency_mb}", weatherReports[j].three_hr_pressure_tendency_mb, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat("{maxT_c}", weatherReports[j].maxT_c, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat("{minT_c}", weatherReports[j].minT_c, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat("{maxT24hr_c}", weatherReports[j].maxT24hr_c, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat("{minT24hr_c}", weatherReports[j].minT24hr_c, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat("{precip_in}", weatherReports[j].precip_in, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat("{pcp3hr_in}", weatherReports[j].pcp3hr_in, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat("{pcp6hr_in}", weatherReports[j].pcp6hr_in, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceFloat("{pcp24hr_in}", weatherReports[j].pcp24hr_in, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat("{snow_in}", weatherReports[j].snow_in, buf2, buf1, METAR_BIGBUFSIZE);
-            strReplaceInt("{vert_vis_ft}", weatherReports[j].vert_vis_ft, buf1, buf2, METAR_BIGBUFSIZE);
-            strReplaceFloat("{elevation_m}", weatherReports[j].elevation_m, buf2, buf1, METAR_BIGBUFSIZE);
-
-            // quality control flags
-            strcpy(buf, "");
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_CORRECTED) == METAR_QUALITY_CORRECTED )
-              strcat(buf, "COR ");
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_AUTO) == METAR_QUALITY_AUTO )
-              strcat(buf, "AUTO ");
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_AUTO_STATION) == METAR_QUALITY_AUTO_STATION )
-              strcat(buf, "AUTOST ");
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_MAINTENANCE) == METAR_QUALITY_MAINTENANCE )
-              strcat(buf, "MAINT ");
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_NO_SIGNAL) == METAR_QUALITY_NO_SIGNAL )
-              strcat(buf, "NOSIG ");
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_NO_LIGHTNING) == METAR_QUALITY_NO_LIGHTNING )
-              strcat(buf, "NOLTN ");
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_NO_FREEZING) == METAR_QUALITY_NO_FREEZING )
-              strcat(buf, "NOFRZ ");
-            if ( (weatherReports[j].quality_control_flags & METAR_QUALITY_NO_WEATHER) == METAR_QUALITY_NO_WEATHER )
-              strcat(buf, "INOP ");
-            if ( buf[0] != '\0' )
-              buf[strlen(buf) - 1] = '\0';
-            strReplace("{quality_control_flags}", buf, buf1, buf2, METAR_BIGBUFSIZE);
-
-            // sky condition
-            strcpy(buf, "");
-            for ( k = 0; k < weatherReports[j].sky_condition_count; ++k )
-            {
-              switch ( weatherReports[j].sky_condition[k].sky_cover )
-              {
-                case METAR_SKYCOND_SKC:
-                  strcat(buf, "SKC");
-                  break;
-                case METAR_SKYCOND_CLR:
-                  strcat(buf, "CLR");
-                  break;
-                case METAR_SKYCOND_CAVOK:
-                  strcat(buf, "CAVOK");
-                  break;
-                case METAR_SKYCOND_FEW:
-                  strcat(buf, "FEW");
-                  break;
-                case METAR_SKYCOND_SCT:
-                  strcat(buf, "SCT");
-                  break;
-                case METAR_SKYCOND_BKN:
-                  strcat(buf, "BKN");
-                  break;
-                case METAR_SKYCOND_OVC:
-                  strcat(buf, "OVC");
-                  break;
-                case METAR_SKYCOND_OVX:
-                  strcat(buf, "OVX");
-                  break;
-                default:
-                  strcat(buf, "???");
-                  break;
-              }
-
-              if ( weatherReports[j].sky_condition[k].sky_cover != METAR_SKYCOND_CLR )
-              {
-                sprintf(ibuf, "%d", weatherReports[j].sky_condition[k].cloud_base_ft_agl);
-                strcat(buf, ibuf);
-              }
-
-              strcat(buf, " ");
-            }
-            if ( buf[0] != '\0' )
-              buf[strlen(buf) - 1] = '\0';
-            strReplace("{sky_condition}", buf, buf2, buf1, METAR_BIGBUFSIZE);
-
-            if ( weatherReports[j].metar_type == METAR_TYPE_SPECI )
-              strReplace("{metar_type}", "SPECI", buf1, buf2, METAR_BIGBUFSIZE);
-            else
-              strReplace("{metar_type}", "METAR", buf1, buf2, METAR_BIGBUFSIZE);
-
-            strReplace("{flight_category}",
-              flightConditions(weatherReports[j].flight_category,
-                (flags & METARFLAG_COLOR) == METARFLAG_COLOR ? 1 : 0),
-              buf2,
-              buf1,
-              METAR_BIGBUFSIZE);
-
-            /*switch ( weatherReports[j].flight_category )
-            {
-              case METAR_CATEGORY_VFR:
-                if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                  strReplace("{flight_category}", "\033[1;32mVFR\033[0m", buf2, buf1, METAR_BIGBUFSIZE);
-                else
-                  strReplace("{flight_category}", "VFR", buf2, buf1, METAR_BIGBUFSIZE);
-                break;
-              case METAR_CATEGORY_MVFR:
-                if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                  strReplace("{flight_category}", "\033[1;34mMVFR\033[0m", buf2, buf1, METAR_BIGBUFSIZE);
-                else
-                  strReplace("{flight_category}", "MVFR", buf2, buf1, METAR_BIGBUFSIZE);
-                break;
-              case METAR_CATEGORY_IFR:
-                if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                  strReplace("{flight_category}", "\033[1;31mIFR\033[0m", buf2, buf1, METAR_BIGBUFSIZE);
-                else
-                  strReplace("{flight_category}", "IFR", buf2, buf1, METAR_BIGBUFSIZE);
-                break;
-              case METAR_CATEGORY_LIFR:
-                if ( (flags & METARFLAG_COLOR) == METARFLAG_COLOR )
-                  strReplace("{flight_category}", "\033[1;35mLIFR\033[0m", buf2, buf1, METAR_BIGBUFSIZE);
-                else
-                  strReplace("{flight_category}", "LIFR", buf2, buf1, METAR_BIGBUFSIZE);
-                break;
-              default:
-                strReplace("{flight_category}", "???", buf2, buf1, METAR_BIGBUFSIZE);
-                break;
-            }*/
-
-            // finally, output the buffer to the screen.
-            puts(buf1);
-
-            free(buf2);
-            free(buf1);
-          }
-        }
-      }
+  if ( source && ((flags & METARFLAG_STATS) == METARFLAG_STATS) )
+  {
+    station.allocs += scratch.allocs + doc.resizes - allocsAt;
+    snprintf(label, METAR_BUFSIZE, "station=%s source=%s", argv[argc - 1], source);
+    printStats(label, &station);
+    addStats(&total, &station);
 
-      startOver:
-      xmlFreeDoc(xml);
+    snprintf(label, METAR_BUFSIZE, "total stations=%d elapsed_us=%lld", argc - optind, (long long)(clockMicros() - began));
+    printStats(label, &total);
+  }
 
-#ifndef METAR_NO_THROTTLE
-      if ( (i + 1) < argc )
-        sleep(1); // to prevent server throttling
+#ifdef DEBUG
+  fprintf(stderr, "%s: debug: %lu scratch allocations (%lu blocks), %lu document resizes, %lu writes.\n",
+    argv[0],
+    (unsigned long)scratch.allocs,
+    (unsigned long)scratch.blocks,
+    (unsigned long)doc.resizes,
+    (unsigned long)out.writes);
 #endif
-    }
-  }
 
-  cleanup(url, format, path, &doc, curl);
+  endFetch(run);
+  if ( prefetched ) free(prefetched);
+  if ( stations ) free(stations);
+  if ( found ) free(found);
+  closeFetchPool(pool);
+  freeArena(&scratch);
+  closeIndexedCache(cache);
+  freeFormat(&compiled);
+  freeFilter(&filter);
+  cleanup(url, format, path, &doc, curl, &out);
   return 0;
 }
 
-const char *flightConditions(enum flight_rules rules, int color)
+int writeFully(int fd, const void *data, size_t len)
 {
-  switch ( rules )
+  const char *p = (const char *)data;
+  ssize_t n;
+
+  while ( len > 0 )
   {
-    case METAR_CATEGORY_VFR:
-      if ( color )
-        return "\033[1;32mVFR\033[0m";
-      else
-        return "VFR";
-    case METAR_CATEGORY_MVFR:
-      if ( color )
-        return "\033[1;34mMVFR\033[0m";
-      else
-        return "MVFR";
-    case METAR_CATEGORY_IFR:
-      if ( color )
-        return "\033[1;31mIFR\033[0m";
-      else
-        return "IFR";
-    case METAR_CATEGORY_LIFR:
-      if ( color )
-        return "\033[1;35mLIFR\033[0m";
-      else
-        return "LIFR";
-    default:
-      return "???";
+    n = write(fd, p, len);
+    if ( (n < 0) && (errno == EINTR) ) continue;
+    if ( n <= 0 ) return -1;
+    p += n;
+    len -= n;
   }
+  return 0;
 }
 
-void cleanup(char *restrict url, char *restrict format, char *restrict path, struct document *restrict doc, CURL *restrict curl)
+int readFully(int fd, void *data, size_t len)
 {
-  if ( url ) free((void *)url);
-  if ( format ) free((void *)format);
-  if ( path ) free((void *)path);
+  char *p = (char *)data;
+  ssize_t n;
 
-  if ( doc )
+  while ( len > 0 )
   {
-    if ( doc->data ) free(doc->data);
-    doc->data = NULL;
-    doc->len = 0;
+    n = read(fd, p, len);
+    if ( (n < 0) && (errno == EINTR) ) continue;
+    if ( n <= 0 ) return -1;
+    p += n;
+    len -= n;
   }
+  return 0;
+}
 
-  if ( curl )
-  {
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
-  }
+int daemonSocket(const char *restrict path, struct sockaddr_un *restrict addr)
+{
+  // a socket for <path>metar.sock, or -1 if that name is too long for one
+  memset((void *)addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if ( snprintf(addr->sun_path, sizeof(addr->sun_path), "%smetar.sock", path) >= (int)sizeof(addr->sun_path) )
+    return -1;
 
-  xmlCleanupParser();
+  return socket(AF_UNIX, SOCK_STREAM, 0);
 }
 
-size_t writeDocument(void *data, size_t len, size_t width, void *rest)
+int sendDaemonReply(int fd, const char *restrict magic, const struct metar_table *restrict reports, const char *restrict message)
 {
-  size_t actual = len * width;
-  struct document *mem = (struct document *)rest;
+  // one station's answer: a sidecar header, then either the packed reports
+  // and their text (METAR_REPLY_REPORTS) or a message (the other two)
+  struct sidecar_header header;
 
-  mem->data = realloc(mem->data, mem->len + actual + 1);
-  if ( !mem->data )
+  if ( reports )
   {
-    fputs("Not enough memory to write the XML document.\n", stderr);
-    return 0;
+    fillSidecarHeader(&header, magic, reports->count, reports->stringsLen, &wholeReports);
+    return ((writeFully(fd, &header, sizeof(header)) == 0)
+      && (writeFully(fd, reports->reports, sizeof(struct metar_packed) * reports->count) == 0)
+      && (writeFully(fd, reports->strings, reports->stringsLen) == 0)) ? 0 : -1;
   }
 
-  memcpy(&(mem->data[mem->len]), data, actual);
-  mem->len += actual;
-  mem->data[mem->len] = 0;
-
-  return actual;
+  fillSidecarHeader(&header, magic, 0, message ? strlen(message) : 0, &wholeReports);
+  return ((writeFully(fd, &header, sizeof(header)) == 0)
+    && (!message || (writeFully(fd, message, header.strings) == 0))) ? 0 : -1;
 }
 
-void init_metar(struct metar *weather)
+int isOwnDaemon(int fd)
 {
-  //memset((void *)weather, 0, sizeof(struct metar));
-  weather->flight_category = METAR_CATEGORY_UNKNOWN;
-  weather->metar_type = METAR_TYPE_UNKNOWN;
-  weather->observation_time = 0;
-  weather->quality_control_flags = 0;
-  weather->raw_text[0] =
-    weather->station_id[0] =
-    weather->wx_string[0] = '\0';
-  weather->vert_vis_ft =
-    weather->wind_dir_degrees =
-    weather->wind_gust_kt =
-    weather->wind_speed_kt = -1;
-  weather->altim_in_hg =
-    weather->dewpoint_c =
-    weather->elevation_m =
-    weather->latitude =
-    weather->longitude =
-    weather->maxT24hr_c =
-    weather->maxT_c =
-    weather->minT24hr_c =
-    weather->minT_c =
-    weather->pcp24hr_in =
-    weather->pcp3hr_in =
-    weather->pcp6hr_in =
-    weather->precip_in =
-    weather->sea_level_pressure_mb =
-    weather->snow_in =
-    weather->temp_c =
-    weather->three_hr_pressure_tendency_mb =
-    weather->visibility_statute_mi =
-    0.0f / 0.0f; // NaN
-  weather->sky_condition_count = 0;
-  weather->sky_condition[0].cloud_base_ft_agl =
-    weather->sky_condition[1].cloud_base_ft_agl =
-    weather->sky_condition[2].cloud_base_ft_agl =
-    weather->sky_condition[3].cloud_base_ft_agl = -1;
-  weather->sky_condition[0].sky_cover =
-    weather->sky_condition[1].sky_cover =
-    weather->sky_condition[2].sky_cover =
-    weather->sky_condition[3].sky_cover = METAR_SKYCOND_UNKNOWN;
+  // whether what's listening on the other end of fd runs as this user.
+  // the socket is in the cache path, /tmp/ by default, where anyone could
+  // have put one.
+#ifdef SO_PEERCRED
+  struct ucred peer;
+  socklen_t len = sizeof(peer);
+
+  return (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) == 0) && (peer.uid == getuid());
+#else
+  uid_t uid;
+  gid_t gid;
+
+  return (getpeereid(fd, &uid, &gid) == 0) && (uid == getuid());
+#endif
 }
 
-size_t xmlGetMetarCount(xmlDoc *xml)
+int queryDaemon(const char *restrict path, const char *restrict url, int hours, int entries, int flags, struct metar_format *restrict format, struct arena *restrict scratch, struct output *restrict out, int first, int last, const char *argv[])
 {
-  xmlXPathContext *xpath;
-  xmlXPathObject *expr;
-  size_t val;
+  // asks a running `metar --daemon' for argv[first..last) and prints its
+  // answers.  returns the index of the first station it couldn't answer
+  // for, which is first when there is no daemon or it refuses (say, for a
+  // different -u), or -1 if memory ran out.  a daemon that isn't this
+  // user's isn't asked, and what it says is checked as the sidecars are.
+  struct sockaddr_un addr;
+  struct timeval wait;
+  struct sidecar_header header;
+  struct metar_table reports;
+  void (*onPipe)(int);
+  char *request, *message;
+  size_t len, n, runs;
+  int fd, i, ok;
+
+  if ( strpbrk(url, " \t\r\n") ) return first;
+  for ( len = strlen(url) + 16, i = first; i < last; ++i )
+  {
+    if ( (argv[i][0] == '\0') || strpbrk(argv[i], " \t\r\n") ) return first;
+    len += strlen(argv[i]) + 1;
+  }
+
+  fd = daemonSocket(path, &addr);
+  if ( fd < 0 ) return first;
+  if ( (connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) != 0) || !isOwnDaemon(fd) )
+  {
+    close(fd);
+    return first;
+  }
 
-  if ( !xml ) return 0;
+  // nor may a daemon that's stopped answering hold this run up for long
+  wait.tv_sec = METAR_DAEMON_TIMEOUT;
+  wait.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait));
 
-  xpath = xmlXPathNewContext(xml);
-  if ( !xpath ) return 0;
+  // "<hours> <url> <station> ...\n"
+  request = (char *)malloc(len + 1);
+  if ( !request )
+  {
+    close(fd);
+    return -1;
+  }
+  n = sprintf(request, "%d %s", hours, url);
+  for ( i = first; i < last; ++i )
+    n += sprintf(&request[n], " %s", argv[i]);
+  request[n++] = '\n';
 
-  expr = xmlXPathEvalExpression("count(//response/data/METAR)", xpath);
-  xmlXPathFreeContext(xpath);
+  onPipe = signal(SIGPIPE, SIG_IGN);
+  ok = (writeFully(fd, request, n) == 0);
+  signal(SIGPIPE, onPipe);
+  free(request);
 
-  if ( !expr ) return 0;
-  val = (size_t)expr->floatval;
-  xmlXPathFreeObject(expr);
+  for ( i = first; ok && (i < last); ++i )
+  {
+    resetArena(scratch);
+    if ( (readFully(fd, &header, sizeof(header)) != 0)
+      || (header.version != METAR_SIDECAR_VERSION)
+      || (header.byteOrder != 0x01020304)
+      || (header.layout != (uint32_t)metarLayoutHash())
+      || (header.count > METAR_CACHE_MAXSIZE / sizeof(struct metar_packed))
+      || (header.strings > METAR_CACHE_MAXSIZE)
+      || (header.count * sizeof(struct metar_packed) + header.strings > METAR_CACHE_MAXSIZE)
+      || (memcmp(header.magic, METAR_REPLY_REFUSED, 4) == 0) )
+      break;
+
+    if ( memcmp(header.magic, METAR_REPLY_ERROR, 4) == 0 )
+    {
+      message = (char *)arenaAlloc(scratch, header.strings + 1);
+      if ( !message ) break;
+      if ( readFully(fd, message, header.strings) != 0 ) break;
+      message[header.strings] = '\0';
+      outputUnavailable(out, flags, argv[i], message);
+      continue;
+    }
+    if ( memcmp(header.magic, METAR_REPLY_REPORTS, 4) != 0 )
+      break;
+
+    initMetarTable(&reports);
+    runs = sizeof(struct metar_packed) * header.count;
+    reports.reports = (struct metar_packed *)arenaAlloc(scratch, runs);
+    reports.strings = (char *)arenaAlloc(scratch, header.strings);
+    if ( !reports.reports || !reports.strings )
+    {
+      close(fd);
+      return -1;
+    }
+    if ( (readFully(fd, reports.reports, runs) != 0) || (readFully(fd, reports.strings, header.strings) != 0) )
+      break;
+    reports.count = header.count;
+    reports.stringsLen = header.strings;
+    if ( !isMetarTableValid(&reports) )
+      break;
+
+    if ( printMetars(&reports, entries, flags, format, out) != 0 )
+    {
+      close(fd);
+      return -1;
+    }
+  }
 
-  return val;
+  close(fd);
+  return i;
 }
 
-int xmlToMetar(xmlDoc *restrict xml, struct metar *restrict w, size_t count)
+void stopDaemon(int sig)
 {
-  size_t i;
-  xmlNode *cur, *inner;
-  xmlXPathContext *xpath;
-  xmlXPathObject *expr;
-  xmlAttr *xattr;
-  xmlChar *xstr, *xstrInner;
-  struct metar *weather;
-  struct tm when;
-
-  weather = w;
-
-      if ( !xml )
-      {
-        //printf("No weather information for %s: invalid XML data.\n", argv[i]);
-        return -1;
-      }
+  daemonStopped = 1;
+}
 
-      xpath = xmlXPathNewContext(xml);
-      if ( !xpath )
-      {
-        //printf("No weather information for %s: invalid XPath context.\n", argv[i]);
-        return -2;
-      }
+struct daemon_station *findDaemonStation(struct metar_daemon *restrict d, const char *restrict station, int hours, int add)
+{
+  // NULL if the station isn't known (and add isn't set), isn't a valid id,
+  // or there's no memory for it
+  char key[METAR_CACHE_KEYSIZE];
+  struct daemon_station *stations;
+  size_t k, size;
 
-      // compile our weather information
-      expr = xmlXPathEvalExpression("//response/data/METAR", xpath);
-      xmlXPathFreeContext(xpath);
+  if ( cacheKey(key, station) != 0 ) return NULL;
 
-      if ( !expr )
-      {
-        //printf("No weather information for %s: invalid XPath expression.\n", argv[i]);
-        return -3;
-      }
+  for ( k = 0; k < d->count; ++k )
+    if ( (d->stations[k].hours == hours) && (memcmp(d->stations[k].station, key, METAR_CACHE_KEYSIZE) == 0) )
+      return &d->stations[k];
 
-      if ( xmlXPathNodeSetIsEmpty(expr->nodesetval) )
-      {
-        //printf("No weather information for %s is available at this time.\n", argv[i]);
-        return 0;
-      }
+  if ( !add ) return NULL;
 
-      for ( i = 0; (i < expr->nodesetval->nodeNr) && (i < count); ++i )
-      {
-        // all elements directly contain text except sky_condition,
-        // which has the sky_cover and cloud_base_ft_agl attributes.
-        if ( strcmp(expr->nodesetval->nodeTab[i]->name, "METAR") == 0 )
-        {
-          init_metar(weather);
-          for ( cur = expr->nodesetval->nodeTab[i]->children;
-                cur;
-                cur = cur->next )
-          {
-            if ( cur->type != XML_ELEMENT_NODE ) continue;
-
-            xstr = xmlNodeGetContent(cur);
-            if ( strcmp(cur->name, "sky_condition") == 0 )
-            {
-              // <sky_condition sky_cover="string" cloud_base_ft_agl="string"/>
-              xattr = cur->properties;
-              while ( xattr && xattr->name && xattr->children && (weather->sky_condition_count < 4) )
-              {
-                xstrInner = xmlNodeGetContent(xattr->children);
-                if ( strcmp(xattr->name, "sky_cover") == 0 )
-                {
-                  if ( strcmp(xstrInner, "SKC") == 0 )
-                    weather->sky_condition[weather->sky_condition_count].sky_cover = METAR_SKYCOND_SKC;
-                  else if ( strcmp(xstrInner, "CLR") == 0 )
-                    weather->sky_condition[weather->sky_condition_count++].sky_cover = METAR_SKYCOND_CLR;
-                  else if ( strcmp(xstrInner, "CAVOK") == 0 )
-                    weather->sky_condition[weather->sky_condition_count].sky_cover = METAR_SKYCOND_CAVOK;
-                  else if ( strcmp(xstrInner, "FEW") == 0 )
-                    weather->sky_condition[weather->sky_condition_count].sky_cover = METAR_SKYCOND_FEW;
-                  else if ( strcmp(xstrInner, "SCT") == 0 )
-                    weather->sky_condition[weather->sky_condition_count].sky_cover = METAR_SKYCOND_SCT;
-                  else if ( strcmp(xstrInner, "BKN") == 0 )
-                    weather->sky_condition[weather->sky_condition_count].sky_cover = METAR_SKYCOND_BKN;
-                  else if ( strcmp(xstrInner, "OVC") == 0 )
-                    weather->sky_condition[weather->sky_condition_count].sky_cover = METAR_SKYCOND_OVC;
-                  else if ( strcmp(xstrInner, "OVX") == 0 )
-                    weather->sky_condition[weather->sky_condition_count].sky_cover = METAR_SKYCOND_OVX;
-                  else
-                    weather->sky_condition[weather->sky_condition_count].sky_cover = METAR_SKYCOND_UNKNOWN;
-                }
-                else if ( strcmp(xattr->name, "cloud_base_ft_agl") == 0 )
-                {
-                  weather->sky_condition[weather->sky_condition_count++].cloud_base_ft_agl = atoi(xstrInner);
-                }
-                xmlFree(xstrInner); // inside a loop, unfortunately
-
-                xattr = xattr->next;
-              }
-            }
-            else if ( strcmp(cur->name, "raw_text") == 0 )
-            {
-              // <raw_text>string</raw_text>
-              strncpy(weather->raw_text, xstr, METAR_BUFSIZE);
-              weather->raw_text[METAR_BUFSIZE - 1] = '\0';
-            }
-            else if ( strcmp(cur->name, "station_id") == 0 )
-            {
-              // <station_id>char(4)</station_id>
-              strncpy(weather->station_id, xstr, 4);
-              weather->station_id[4] = '\0';
-            }
-            else if ( strcmp(cur->name, "observation_time") == 0 )
-            {
-              // <observation_time>ISO8601 string</observation_time>
-
-              //struct tm when;
-              if ( strptime(xstr, "%Y-%m-%dT%H:%M:%SZ", &when) != NULL )
-                weather->observation_time = metar_timegm(&when); //mktime(&when);
-
-              //if ( getdate_r(cur->content, &when) == 0 )   // damn, doesn't work on OS X!
-              //  weather->observation_time = mktime(&when);
-
-              //when = getdate(xstr);
-              //if ( when )
-              //  weather->observation_time = mktime(when);
-            }
-            else if ( strcmp(cur->name, "latitude") == 0 )
-            {
-              // <latitude>float</latitude>
-              weather->latitude = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "longitude") == 0 )
-            {
-              // <longitude>float</longitude>
-              weather->longitude = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "temp_c") == 0 )
-            {
-              // <temp_c>float</temp_c>
-              weather->temp_c = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "dewpoint_c") == 0 )
-            {
-              // <dewpoint_c>float</dewpoint_c>
-              weather->dewpoint_c = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "wind_dir_degrees") == 0 )
-            {
-              // <wind_dir_degrees>int</wind_dir_degrees>
-              weather->wind_dir_degrees = atoi(xstr);
-            }
-            else if ( strcmp(cur->name, "wind_speed_kt") == 0 )
-            {
-              // <wind_speed_kt>int</wind_speed_kt>
-              weather->wind_speed_kt = atoi(xstr);
-            }
-            else if ( strcmp(cur->name, "wind_gust_kt") == 0 )
-            {
-              // <wind_gust_kt>int</wind_gust_kt>
-              weather->wind_gust_kt = atoi(xstr);
-            }
-            else if ( strcmp(cur->name, "visibility_statute_mi") == 0 )
-            {
-              // <visibility_statue_mi>float</visibility_statue_mi>
-              weather->visibility_statute_mi = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "altim_in_hg") == 0 )
-            {
-              // <altim_in_hg>float</altim_in_hg>
-              weather->altim_in_hg = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "sea_level_pressure_mb") == 0 )
-            {
-              // <sea_level_pressure_mb>float</sea_level_pressure_mb>
-              weather->sea_level_pressure_mb = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "quality_control_flags") == 0 )
-            {
-              // <quality_control_flags>
-              //  <corrected>bool</corrected>
-              //  <auto>bool</auto>
-              //  <auto_station>bool</auto_station>
-              //  <maintenance_indicator>bool?</maintenance_indicator>
-              //  <no_signal>bool</no_signal>
-              //  <lightning_sensor_off>bool</lightning_sensor_off>
-              //  <freezing_rain_sensor_off>bool</freezing_rain_sensor_off>
-              //  <present_weather_sensor_off>bool</present_weather_sensor_off>
-              // </quality_control_flags>
-              for ( inner = cur->children; inner; inner = inner->next )
-              {
-                xstrInner = xmlNodeGetContent(inner);
-                if ( strcasecmp(xstrInner, "TRUE") != 0 )
-                {
-                  xmlFree(xstrInner);
-                  continue;
-                }
-                xmlFree(xstrInner);
-
-                if ( strcmp(inner->name, "corrected") == 0 )
-                  weather->quality_control_flags |= METAR_QUALITY_CORRECTED;
-                else if ( strcmp(inner->name, "auto") == 0 )
-                  weather->quality_control_flags |= METAR_QUALITY_AUTO;
-                else if ( strcmp(inner->name, "auto_station") == 0 )
-                  weather->quality_control_flags |= METAR_QUALITY_AUTO_STATION;
-                else if ( strcmp(inner->name, "maintenance_indicator") == 0 )
-                  weather->quality_control_flags |= METAR_QUALITY_MAINTENANCE;
-                else if ( strcmp(inner->name, "no_signal") == 0 )
-                  weather->quality_control_flags |= METAR_QUALITY_NO_SIGNAL;
-                else if ( strcmp(inner->name, "lightning_sensor_off") == 0 )
-                  weather->quality_control_flags |= METAR_QUALITY_NO_LIGHTNING;
-                else if ( strcmp(inner->name, "freezing_rain_sensor_off") == 0 )
-                  weather->quality_control_flags |= METAR_QUALITY_NO_FREEZING;
-                else if ( strcmp(inner->name, "present_weather_sensor_off") == 0 )
-                  weather->quality_control_flags |= METAR_QUALITY_NO_WEATHER;
-              }
-            }
-            else if ( strcmp(cur->name, "wx_string") == 0 )
-            {
-              // <wx_string>unknown</wx_string>
-              strncpy(weather->wx_string, xstr, METAR_TINYBUFSIZE);
-              weather->wx_string[METAR_TINYBUFSIZE - 1] = '\0';
-            }
-            else if ( strcmp(cur->name, "flight_category") == 0 )
-            {
-              // <flight_category>string</flight_category>
-              if ( strcmp(xstr, "VFR") == 0 )
-                weather->flight_category = METAR_CATEGORY_VFR;
-              else if ( strcmp(xstr, "MVFR") == 0 )
-                weather->flight_category = METAR_CATEGORY_MVFR;
-              else if ( strcmp(xstr, "IFR") == 0 )
-                weather->flight_category = METAR_CATEGORY_IFR;
-              else if ( strcmp(xstr, "LIFR") == 0 )
-                weather->flight_category = METAR_CATEGORY_LIFR;
-              else
-                weather->flight_category = METAR_CATEGORY_UNKNOWN;
-            }
-            else if ( strcmp(cur->name, "three_hr_pressure_tendency_mb") == 0 )
-            {
-              // <three_hr_pressure_tendency_mb>float</three_hr_pressure_tendency_mb>
-              weather->three_hr_pressure_tendency_mb = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "maxT_c") == 0 )
-            {
-              // <maxT_c>float</maxT_c>
-              weather->maxT_c = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "minT_c") == 0 )
-            {
-              // <minT_c>float</minT_c>
-              weather->minT_c = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "maxT24hr_c") == 0 )
-            {
-              // <maxT24hr_c>float</maxT24hr_c>
-              weather->maxT24hr_c = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "minT24hr_c") == 0 )
-            {
-              // <minT24hr_c>float</minT24hr_c>
-              weather->minT24hr_c = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "precip_in") == 0 )
-            {
-              // <precip_in>float</precip_in>
-              weather->precip_in = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "pcp3hr_in") == 0 )
-            {
-              // <pcp3hr_in>float</pcp3hr_in>
-              weather->pcp3hr_in = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "pcp6hr_in") == 0 )
-            {
-              // <pcp6hr_in>float</pcp6hr_in>
-              weather->pcp6hr_in = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "pcp24hr_in") == 0 )
-            {
-              // <pcp24hr_in>float</pcp24hr_in>
-              weather->pcp24hr_in = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "snow_in") == 0 )
-            {
-              // <snow_in>float</snow_in>
-              weather->snow_in = (float)atof(xstr);
-            }
-            else if ( strcmp(cur->name, "vert_vis_ft") == 0 )
-            {
-              // <vert_vis_ft>int</vert_vis_ft>
-              weather->vert_vis_ft = atoi(xstr);
-            }
-            else if ( strcmp(cur->name, "metar_type") == 0 )
-            {
-              // <metar_type>string</metar_type>
-              if ( strcmp(xstr, "METAR") == 0 )
-                weather->metar_type = METAR_TYPE_METAR;
-              else if ( strcmp(xstr, "SPECI") == 0 )
-                weather->metar_type = METAR_TYPE_SPECI;
-              else
-                weather->metar_type = METAR_TYPE_UNKNOWN;
-            }
-            else if ( strcmp(cur->name, "elevation_m") == 0 )
-            {
-              // <elevation_m>float</elevation_m>
-              weather->elevation_m = (float)atof(xstr);
-            }
-
-            if ( xstr != NULL )
-            {
-              xmlFree(xstr);
-              xstr = NULL;
-            }
-          }
-          ++weather;
-        }
-      }
+  if ( d->count == d->size )
+  {
+    size = d->size ? d->size * 2 : 16;
+    stations = (struct daemon_station *)realloc(d->stations, sizeof(struct daemon_station) * size);
+    if ( !stations ) return NULL;
+    d->stations = stations;
+    d->size = size;
+  }
 
-  xmlXPathFreeObject(expr);
-  return i;
+  memset((void *)&d->stations[d->count], 0, sizeof(struct daemon_station));
+  memcpy(d->stations[d->count].station, key, METAR_CACHE_KEYSIZE);
+  d->stations[d->count].hours = hours;
+  return &d->stations[d->count++];
 }
 
-void strReplaceTime(const char *restrict needle, time_t replacement, const char *restrict haystack, char *dest, size_t len)
+int refreshDaemon(struct metar_daemon *d, time_t now)
 {
-  char buf[METAR_BUFSIZE];
-  if ( replacement != 0 )
+  // forgets stations nobody has asked about for METAR_DAEMON_IDLE seconds,
+  // then re-retrieves every one that's due a newer report (see
+  // predictExpiry()), as few requests at a time as -b and -j allow.
+  // failures are retried after a minute.
+  struct daemon_station *st;
+  struct prefetch *slots;
+  const char **names;
+  size_t *which;
+  size_t k, n;
+  int hours, ret;
+
+  for ( k = 0; k < d->count; )
   {
-    strftime(buf, METAR_BUFSIZE, "%Y-%m-%d %H:%M:%S (local)", localtime(&replacement));
-    strReplace(needle, buf, haystack, dest, len);
+    st = &d->stations[k];
+    if ( st->pinned || ((now - st->queried) < METAR_DAEMON_IDLE) )
+    {
+      ++k;
+      continue;
+    }
+    freeMetarTable(&st->reports);
+    *st = d->stations[--d->count];
   }
-  else
+  if ( d->count == 0 ) return 0;
+
+  names = (const char **)malloc(sizeof(const char *) * d->count);
+  which = (size_t *)malloc(sizeof(size_t) * d->count);
+  slots = (struct prefetch *)calloc(d->count, sizeof(struct prefetch));
+  ret = (names && which && slots) ? 0 : -1;
+
+  while ( ret == 0 )
   {
-    strReplace(needle, "(unknown)", haystack, dest, len);
+    // one -h value per round
+    for ( hours = 0, n = 0, k = 0; k < d->count; ++k )
+    {
+      st = &d->stations[k];
+      if ( now < st->expires ) continue;
+      if ( n == 0 ) hours = st->hours;
+      if ( st->hours != hours ) continue;
+      names[n] = st->station;
+      which[n++] = k;
+    }
+    if ( n == 0 ) break;
+
+    memset((void *)slots, 0, sizeof(struct prefetch) * n);
+    if ( fetchStations(d->curl, d->pool, d->cache, d->url, d->path, hours, d->flags | METARFLAG_UPDATE, d->settings, 0, (int)n, names, slots) != 0 )
+      ret = -1;
+
+    for ( k = 0; k < n; ++k )
+    {
+      st = &d->stations[which[k]];
+      st->fetched = now;
+      st->error = slots[k].error;
+      if ( !slots[k].done )
+        st->error = "cannot be requested";
+      if ( st->error || (ret != 0) )
+      {
+        st->expires = now + 60;
+        freeMetarTable(&slots[k].reports);
+        continue;
+      }
+      freeMetarTable(&st->reports);
+      st->reports = slots[k].reports;
+      st->expires = cacheDeadline(now, predictExpiry(&st->reports, now), d->settings->maxAge);
+    }
   }
+
+  if ( names ) free((void *)names);
+  if ( which ) free(which);
+  if ( slots ) free(slots);
+  return ret;
 }
 
-void strReplaceTimeZulu(const char *restrict needle, time_t replacement, const char *restrict haystack, char *dest, size_t len)
+int serveDaemonClient(struct metar_daemon *d, int fd)
 {
-  char buf[METAR_BUFSIZE];
-  if ( replacement != 0 )
+  // reads one "<hours> <url> <station> ..." line and answers for each
+  // station in turn.  returns -1 only if memory ran out.
+  struct daemon_station *st;
+  char line[METAR_MAXURL * 2];
+  char **stations, *token, *rest;
+  size_t len, count, k;
+  ssize_t n;
+  time_t now;
+  int hours, ret;
+
+  for ( len = 0; (len == 0) || (line[len - 1] != '\n'); len += n )
   {
-    strftime(buf, METAR_BUFSIZE, "%Y-%m-%d %H:%M:%S (UTC)", gmtime(&replacement));
-    strReplace(needle, buf, haystack, dest, len);
+    if ( len >= sizeof(line) - 1 ) return 0;
+    n = read(fd, &line[len], sizeof(line) - 1 - len);
+    if ( (n < 0) && (errno == EINTR) ) n = 0;
+    else if ( n <= 0 ) return 0;
   }
-  else
+  line[len] = '\0';
+
+  token = strtok_r(line, " \t\r\n", &rest);
+  hours = token ? atoi(token) : 0;
+  token = strtok_r(NULL, " \t\r\n", &rest);
+  if ( (hours < 1) || !token || (strcmp(token, d->url) != 0) )
   {
-    strReplace(needle, "(unknown)", haystack, dest, len);
+    sendDaemonReply(fd, METAR_REPLY_REFUSED, NULL, NULL);
+    return 0;
   }
-}
 
-void strReplaceInt(const char *restrict needle, int replacement, const char *restrict haystack, char *dest, size_t len)
-{
-  char buf[METAR_REPLACEBUF];
-  if ( replacement >= 0 )
+  stations = (char **)malloc(sizeof(char *) * (len / 2 + 1));
+  if ( !stations ) return -1;
+
+  ret = 0;
+  now = time(NULL);
+  for ( count = 0; (token = strtok_r(NULL, " \t\r\n", &rest)) != NULL; )
   {
-    snprintf(buf, METAR_REPLACEBUF, "%d", replacement);
-    buf[METAR_REPLACEBUF - 1] = '\0';
-    strReplace(needle, buf, haystack, dest, len);
+    stations[count++] = token;
+    st = findDaemonStation(d, token, hours, 1);
+    if ( st ) st->queried = now;
   }
-  else
+
+  if ( refreshDaemon(d, now) != 0 )
+    ret = -1;
+
+  for ( k = 0; k < count; ++k )
   {
-    strReplace(needle, "(unknown)", haystack, dest, len);
+    st = findDaemonStation(d, stations[k], hours, 0);
+    if ( !st )
+      n = sendDaemonReply(fd, METAR_REPLY_ERROR, NULL, "unknown station");
+    else if ( st->error || !st->fetched )
+      n = sendDaemonReply(fd, METAR_REPLY_ERROR, NULL, st->error ? st->error : "not retrieved");
+    else
+      n = sendDaemonReply(fd, METAR_REPLY_REPORTS, &st->reports, NULL);
+    if ( n != 0 ) break;
   }
+
+  free(stations);
+  return ret;
 }
 
-void strReplaceFloat(const char *restrict needle, float replacement, const char *restrict haystack, char *dest, size_t len)
+int runDaemon(struct metar_daemon *d, const char *name)
 {
-  char buf[METAR_REPLACEBUF * 2];
-  if ( !isnan(replacement) )
+  // serves <path>metar.sock until SIGINT or SIGTERM, keeping every station
+  // asked for in memory and up to date in the meantime
+  struct sockaddr_un addr;
+  struct timeval wait;
+  struct pollfd pfd;
+  time_t now, due;
+  size_t k;
+  int fd, client, ret;
+  mode_t mask;
+
+  fd = daemonSocket(d->path, &addr);
+  if ( fd < 0 )
   {
-    snprintf(buf, METAR_REPLACEBUF * 2, "%.1f", roundf(replacement * 10.0f) / 10.0f);
-    buf[(METAR_REPLACEBUF * 2) - 1] = '\0';
-    strReplace(needle, buf, haystack, dest, len);
+    fprintf(stderr, "%s: error: Cannot create %smetar.sock.\n", name, d->path);
+    return 3;
   }
-  else
+
+  // a socket left behind by a daemon that died is replaced; a live one isn't
+  if ( connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == 0 )
   {
-    strReplace(needle, "(unknown)", haystack, dest, len);
+    fprintf(stderr, "%s: error: A daemon is already serving %s.\n", name, addr.sun_path);
+    close(fd);
+    return 3;
   }
-}
-
-void strReplaceFloat2(const char *restrict needle, float replacement, const char *restrict haystack, char *dest, size_t len)
-{
-  char buf[METAR_REPLACEBUF * 2];
-  if ( !isnan(replacement) )
+  close(fd);
+  unlink(addr.sun_path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  mask = umask(077);
+  ret = (fd >= 0) && (bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == 0) && (listen(fd, 16) == 0);
+  umask(mask);
+  if ( !ret )
   {
-    snprintf(buf, METAR_REPLACEBUF * 2, "%.2f", roundf(replacement * 100.0f) / 100.0f);
-    buf[(METAR_REPLACEBUF * 2) - 1] = '\0';
-    strReplace(needle, buf, haystack, dest, len);
+    fprintf(stderr, "%s: error: Cannot listen on %s: %s.\n", name, addr.sun_path, strerror(errno));
+    if ( fd >= 0 ) close(fd);
+    return 3;
   }
-  else
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, stopDaemon);
+  signal(SIGTERM, stopDaemon);
+
+  ret = 0;
+  while ( !daemonStopped && (ret == 0) )
   {
-    strReplace(needle, "(unknown)", haystack, dest, len);
+    now = time(NULL);
+    if ( refreshDaemon(d, now) != 0 )
+    {
+      ret = 2;
+      break;
+    }
+
+    // sleep until the next station goes stale, or a minute at most
+    due = nextDaemonRefresh(d, now);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if ( poll(&pfd, 1, (int)(due - now) * 1000) <= 0 )
+      continue;
+
+    client = accept(fd, NULL, NULL);
+    if ( client < 0 ) continue;
+
+    // a stuck client mustn't hold up everyone else for long
+    wait.tv_sec = METAR_DAEMON_TIMEOUT;
+    wait.tv_usec = 0;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait));
+    if ( serveDaemonClient(d, client) != 0 )
+      ret = 2;
+    close(client);
   }
+
+  if ( ret == 2 )
+    fprintf(stderr, "%s: error: Out of memory.\n", name);
+
+  close(fd);
+  unlink(addr.sun_path);
+  for ( k = 0; k < d->count; ++k )
+    freeMetarTable(&d->stations[k].reports);
+  if ( d->stations ) free(d->stations);
+  d->stations = NULL;
+  d->count = d->size = 0;
+  return ret;
 }
 
-void strReplace(const char *restrict needle, const char *restrict replacement, const char *restrict haystack, char *dest, size_t len)
+time_t nextDaemonRefresh(const struct metar_daemon *d, time_t now)
 {
-  size_t haystackLength, needleLength, replacementLength, pos;
-  int i;
-
-  needleLength = strlen(needle);
-  haystackLength = strlen(haystack);
-  replacementLength = strlen(replacement);
-
-  pos = 0;
+  // when the next station goes stale, a minute away at most
+  time_t due;
+  size_t k;
+
+  due = now + 60;
+  for ( k = 0; k < d->count; ++k )
+    if ( d->stations[k].expires < due )
+      due = d->stations[k].expires;
+  return (due <= now) ? now + 1 : due;
+}
 
-  for ( i = 0; i <= haystackLength; ++i )
+int runWatch(struct metar_daemon *restrict d, int entries, int flags, struct metar_format *restrict format, struct output *restrict out, const char *name)
+{
+  // --watch: keeps every station up to date just as a daemon does, but
+  // prints each one's reports once and after that only those newer than
+  // the newest already printed, or a correction of it (its text changes),
+  // until SIGINT or SIGTERM.  a failure is reported when it starts.
+  struct daemon_station *st;
+  struct metar_table view;
+  const struct metar_packed *p;
+  const char *text;
+  unsigned long hash;
+  time_t now, newest;
+  size_t j, k, n;
+  int ret;
+
+  signal(SIGINT, stopDaemon);
+  signal(SIGTERM, stopDaemon);
+
+  ret = 0;
+  while ( !daemonStopped && (ret == 0) )
   {
-    if ( (i <= (haystackLength - needleLength)) && (strncmp(&haystack[i], needle, needleLength) == 0) )
+    now = time(NULL);
+    if ( refreshDaemon(d, now) != 0 )
     {
-      if ( (pos + replacementLength) < len )
-      {
-        strncpy(&dest[pos], replacement, replacementLength);
-        pos += replacementLength;
-        i += needleLength - 1;
-      }
+      ret = 2;
+      break;
     }
-    else
+
+    for ( k = 0; (k < d->count) && (ret == 0); ++k )
     {
-      if ( (pos + 1) < len )
+      st = &d->stations[k];
+      if ( st->fetched != now ) continue; // not retrieved this time around
+
+      if ( st->error )
       {
-        dest[pos] = haystack[i];
-        ++pos;
+        if ( st->error != st->shownError )
+          outputUnavailable(out, flags, st->station, st->error);
+        st->shownError = st->error;
+        continue;
       }
+      st->shownError = NULL;
+      if ( st->reports.count == 0 ) continue;
+
+      // newest first, as the service has them
+      for ( n = 0; (n < st->reports.count) && ((time_t)st->reports.reports[n].observation_time > st->shown); ++n ) ;
+
+      p = &st->reports.reports[0];
+      text = &st->reports.strings[p->raw_text];
+      for ( hash = 2166136261UL; *text; ++text )
+        hash = ((hash ^ (unsigned char)*text) * 16777619UL) & 0xffffffffUL;
+      if ( (n == 0) && ((time_t)p->observation_time == st->shown) && (hash != st->shownText) )
+        n = 1;
+
+      newest = st->shown;
+      for ( j = 0; j < st->reports.count; ++j )
+        if ( (time_t)st->reports.reports[j].observation_time > newest )
+          newest = (time_t)st->reports.reports[j].observation_time;
+      if ( n == 0 ) continue;
+
+      view = st->reports;
+      view.count = n;
+      view.size = view.stringsSize = 0; // borrowed
+      if ( printMetars(&view, entries, flags, format, out) != 0 )
+        ret = 2;
+      st->shown = newest;
+      st->shownText = hash;
     }
+    if ( flushOutput(out, NULL, 0) != 0 )
+      break; // nobody's reading any more
+
+    // sleep(), unlike poll() in runDaemon(), is cut short by the signals
+    now = time(NULL);
+    if ( !daemonStopped && (ret == 0) )
+      sleep((unsigned int)(nextDaemonRefresh(d, now) - now));
   }
 
-  dest[pos] = '\0';
+  if ( ret == 2 )
+    fprintf(stderr, "%s: error: Out of memory.\n", name);
+
+  for ( k = 0; k < d->count; ++k )
+    freeMetarTable(&d->stations[k].reports);
+  if ( d->stations ) free(d->stations);
+  d->stations = NULL;
+  d->count = d->size = 0;
+  return (ret == 2) ? 2 : 0;
 }
 
-const char *skyCondition(enum sky_cover_type ceil)
+void cleanup(char *restrict url, char *restrict format, char *restrict path, struct document *restrict doc, CURL *restrict curl, struct output *restrict out)
 {
-  switch ( ceil )
+  if ( out ) closeOutput(out);
+  if ( url ) free((void *)url);
+  if ( format ) free((void *)format);
+  if ( path ) free((void *)path);
+
+  if ( doc )
   {
-    case METAR_SKYCOND_BKN: return "Broken clouds";
-    case METAR_SKYCOND_CAVOK: return "Ceiling/visibility okay";
-    case METAR_SKYCOND_FEW: return "Few clouds";
-    case METAR_SKYCOND_OVC: return "Overcast";
-    case METAR_SKYCOND_OVX: return "Sky obscured";
-    case METAR_SKYCOND_SCT: return "Scattered clouds";
-    case METAR_SKYCOND_SKC: return "Sky clear";
-    default: return "Unknown";
+    if ( doc->data ) free(doc->data);
+    if ( doc->parser ) freeMetarParser(doc->parser);
+    if ( doc->headers ) curl_slist_free_all(doc->headers);
+    doc->headers = NULL;
+    doc->data = NULL;
+    doc->len = 0;
+    doc->parser = NULL;
   }
-}
 
-int isVfrWeather(enum sky_cover_type ceil)
-{
-  if ( (ceil == METAR_SKYCOND_CAVOK) || (ceil == METAR_SKYCOND_FEW) || (ceil == METAR_SKYCOND_SCT)
-    || (ceil == METAR_SKYCOND_SKC) || (ceil == METAR_SKYCOND_CLR) )
-    return 1;
-  return 0;
-}
+  if ( curl )
+  {
+    curl_easy_cleanup(curl);
+    curl_global_cleanup();
+  }
 
-time_t metar_timegm(struct tm *t)
-{
-  time_t val;
-  char *tz;
-
-  tz = getenv("TZ");
-  setenv("TZ", "", 1);
-  tzset();
-  val = mktime(t);
-  if ( tz )
-    setenv("TZ", tz, 1);
-  else
-    unsetenv("TZ");
-  tzset();
-  return val;
+  xmlCleanupParser();
 }
-
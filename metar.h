@@ -0,0 +1,154 @@
+/*
+ *
+ * metar.h - libmetar: retrieving METARs in batches, cached
+ * some rights reserved under the BSD License:
+
+Copyright (c) 2013, Nijumi "Ninja" Ardetus-Libera
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the software nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ *
+ */
+
+#ifndef METAR_H
+#define METAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define METARFLAG_DECODED  0x1 // decode the METAR before displaying it
+#define METARFLAG_UPDATE   0x2 // force a retrieval from the internet
+#define METARFLAG_NOTS     0x4 // ignore timestamps when retrieving from the cache
+#define METARFLAG_COLOR    0x8 // attempt to output colors
+#define METARFLAG_SPECIAL 0x10 // special formatting rules apply
+#define METARFLAG_PURGE   0x20 // purge the entire cache before retrieving
+#define METARFLAG_BATCH   0x40 // combine cache misses into as few requests as possible
+#define METARFLAG_INDEXED 0x80 // keep the cache in one indexed file of decoded reports
+#define METARFLAG_STATS  0x100 // report where each station's time went on stderr
+#define METARFLAG_GZIP   0x200 // write XML cache files gzip'd
+#define METARFLAG_HISTORY 0x400 // keep every report in a per-station log, answering -h from it
+#define METARFLAG_JSONL  0x800 // output a line of JSON per report instead of text
+#define METARFLAG_BINARY 0x1000 // ...or each struct metar as is, after its size
+
+#define METAR_URL "http://aviationweather.gov/adds/dataserver_current/httpparam"
+
+#define METAR_BUFSIZE      512
+#define METAR_TINYBUFSIZE   64
+
+enum flight_rules
+{
+  METAR_CATEGORY_VFR = 0,
+  METAR_CATEGORY_MVFR = 1,
+  METAR_CATEGORY_IFR = 2,
+  METAR_CATEGORY_LIFR = 3,
+  METAR_CATEGORY_UNKNOWN = -1
+};
+
+enum metar_type_info
+{
+  METAR_TYPE_METAR = 0,
+  METAR_TYPE_SPECI = 1,
+  METAR_TYPE_UNKNOWN = -1
+};
+
+enum sky_cover_type
+{
+  METAR_SKYCOND_SKC = 0,
+  METAR_SKYCOND_CLR = 1,
+  METAR_SKYCOND_CAVOK = 2,
+  METAR_SKYCOND_FEW = 3,
+  METAR_SKYCOND_SCT = 4,
+  METAR_SKYCOND_BKN = 5,
+  METAR_SKYCOND_OVC = 6,
+  METAR_SKYCOND_OVX = 7,
+  METAR_SKYCOND_UNKNOWN = -1
+};
+
+#define METAR_QUALITY_CORRECTED     0x1
+#define METAR_QUALITY_AUTO          0x2
+#define METAR_QUALITY_AUTO_STATION  0x4
+#define METAR_QUALITY_MAINTENANCE   0x8
+#define METAR_QUALITY_NO_SIGNAL    0x10
+#define METAR_QUALITY_NO_LIGHTNING 0x20
+#define METAR_QUALITY_NO_FREEZING  0x40
+#define METAR_QUALITY_NO_WEATHER   0x80
+
+struct sky_condition_entry
+{
+  /*int*/ enum sky_cover_type sky_cover; // see METAR_SKYCOND_* above
+  int cloud_base_ft_agl;
+};
+
+struct metar
+{
+  char raw_text[METAR_BUFSIZE];
+  char station_id[5];
+  time_t observation_time;
+  float latitude;
+  float longitude;
+  float temp_c;
+  float dewpoint_c;
+  int wind_dir_degrees;
+  int wind_speed_kt;
+  int wind_gust_kt;
+  float visibility_statute_mi;
+  float altim_in_hg;
+  float sea_level_pressure_mb;
+  int quality_control_flags; // see METAR_QUALITY_* above
+  char wx_string[METAR_TINYBUFSIZE];
+  struct sky_condition_entry sky_condition[4];
+  size_t sky_condition_count;
+  /*int*/ enum flight_rules flight_category; // see METAR_CATEGORY_* above
+  float three_hr_pressure_tendency_mb;
+  float maxT_c;
+  float minT_c;
+  float maxT24hr_c;
+  float minT24hr_c;
+  float precip_in;
+  float pcp3hr_in;
+  float pcp6hr_in;
+  float pcp24hr_in;
+  float snow_in;
+  int vert_vis_ft;
+  /*int*/ enum metar_type_info metar_type; // see METAR_TYPE_* above
+  float elevation_m;
+};
+
+struct metar_result
+{
+  const char *station;   // as asked for
+  size_t first, count;   // its reports, in the array retrieveMetars() returned
+  const char *error;     // why it has none, or NULL
+};
+
+struct metar_context; // see openMetarContext()
+
+struct metar_context *openMetarContext(const char *restrict url, const char *restrict path, int flags, int jobs);
+void closeMetarContext(struct metar_context *ctx);
+int retrieveMetars(struct metar_context *restrict ctx, const char *stations[], size_t count, int hours, const struct metar **restrict weather);
+void setMetarMaxAge(struct metar_context *ctx, time_t seconds);
+const struct metar_result *metarResults(const struct metar_context *ctx);
+
+#endif // METAR_H
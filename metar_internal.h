@@ -0,0 +1,820 @@
+/*
+ *
+ * metar_internal.h - what libmetar, metar and bench share beyond metar.h
+ * some rights reserved under the BSD License:
+
+Copyright (c) 2013, Nijumi "Ninja" Ardetus-Libera
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the software nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ *
+ */
+
+#ifndef METAR_INTERNAL_H
+#define METAR_INTERNAL_H
+
+#include "metar.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <memory.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <curl/curl.h>
+#include <zlib.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+
+#define METAR_PREFETCHURL "http://aviationweather.gov/adds/dataserver_current/current/metars.cache.xml.gz"
+
+#define METAR_MAXURL      8000
+#define METAR_BIGBUFSIZE  8192
+#define METAR_REPLACEBUF    32
+#define METAR_ARENABLOCK  16384
+#define METAR_OUTBUFSIZE  65536
+#define METAR_DECODEWINDOW (256UL * 1024) // batched responses past this decode in parallel
+#define METAR_DECODEMIN    64             // fewest reports worth a thread of their own
+#define METAR_PARSECHUNK   (1UL << 20)    // most handed to libxml2 at once
+#define METAR_RAWTOKENS    96             // most groups read of a raw METAR
+
+#define METAR_CACHE_MAGIC    "MTRC"
+#define METAR_CACHE_VERSION  5
+#define METAR_CACHE_SLOTS    8192 // must be a power of two; room for a whole bulk file
+#define METAR_CACHE_KEYSIZE  8
+#define METAR_CACHE_MAXSIZE  (64UL * 1024 * 1024)
+
+#define METAR_ETAGSIZE       88
+#define METAR_DATESIZE       40
+
+#define METAR_SIDECAR_MAGIC   "MTRB"
+#define METAR_SIDECAR_VERSION 5
+
+#define METAR_HISTORY_MAGIC   "MTRH"
+#define METAR_HISTORY_VERSION 1
+#define METAR_HISTORY_TAIL    16 // newest reports predictExpiry() is shown
+
+#define METAR_STATIONS_MAGIC   "MTRS"
+#define METAR_STATIONS_VERSION 1
+#define METAR_GRID_CELLS       (180 * 360) // one per degree of latitude and longitude
+#define METAR_EARTH_NM         3440.065    // mean radius of the earth
+
+#define METAR_XMLNAMES       128  // slots in xmlNames[]; see lookupXmlName()
+#define METAR_FIELDS_ALL     0x7ffffffeUL // a bit per <METAR> child, XML_RAW_TEXT..XML_QUALITY_CONTROL_FLAGS
+
+#define METAR_MAXAGE         3600 // default -a: the most any cached copy is trusted
+#define METAR_OLDAGE         900  // ...and what one without a prediction gets
+#define METAR_CADENCE        3600 // routine reports, unless a station shows otherwise
+#define METAR_ISSUELAG       360  // how long after its observation a report shows up
+#define METAR_RETRYAGE       120  // how soon to look again for a late one
+
+#define METAR_RATE           60       // requests a minute the service is sent, on average...
+#define METAR_BURST          5        // ...of which this many may go at once
+#define METAR_RETRIES        3        // more attempts at a request the service failed
+#define METAR_BACKOFF        1000000  // micros before the first, doubled for each failure in a row
+#define METAR_MAXBACKOFF     60000000 // ...up to this
+
+enum xml_name
+{
+  XML_UNKNOWN = 0,
+  // <METAR> children with text
+  XML_RAW_TEXT,
+  XML_STATION_ID,
+  XML_OBSERVATION_TIME,
+  XML_LATITUDE,
+  XML_LONGITUDE,
+  XML_TEMP_C,
+  XML_DEWPOINT_C,
+  XML_WIND_DIR_DEGREES,
+  XML_WIND_SPEED_KT,
+  XML_WIND_GUST_KT,
+  XML_VISIBILITY_STATUTE_MI,
+  XML_ALTIM_IN_HG,
+  XML_SEA_LEVEL_PRESSURE_MB,
+  XML_WX_STRING,
+  XML_FLIGHT_CATEGORY,
+  XML_THREE_HR_PRESSURE_TENDENCY_MB,
+  XML_MAXT_C,
+  XML_MINT_C,
+  XML_MAXT24HR_C,
+  XML_MINT24HR_C,
+  XML_PRECIP_IN,
+  XML_PCP3HR_IN,
+  XML_PCP6HR_IN,
+  XML_PCP24HR_IN,
+  XML_SNOW_IN,
+  XML_VERT_VIS_FT,
+  XML_METAR_TYPE,
+  XML_ELEVATION_M,
+  // ...and the two without
+  XML_SKY_CONDITION,
+  XML_QUALITY_CONTROL_FLAGS,
+  // <quality_control_flags> children
+  XML_CORRECTED,
+  XML_AUTO,
+  XML_AUTO_STATION,
+  XML_MAINTENANCE_INDICATOR,
+  XML_NO_SIGNAL,
+  XML_LIGHTNING_SENSOR_OFF,
+  XML_FREEZING_RAIN_SENSOR_OFF,
+  XML_PRESENT_WEATHER_SENSOR_OFF,
+  // <sky_condition> attributes
+  XML_SKY_COVER,
+  XML_CLOUD_BASE_FT_AGL,
+  // sky_cover, flight_category and metar_type values
+  XML_SKC,
+  XML_CLR,
+  XML_CAVOK,
+  XML_FEW,
+  XML_SCT,
+  XML_BKN,
+  XML_OVC,
+  XML_OVX,
+  XML_VFR,
+  XML_MVFR,
+  XML_IFR,
+  XML_LIFR,
+  XML_METAR,
+  XML_SPECI,
+  // the path down to each report (METAR is above)
+  XML_RESPONSE,
+  XML_DATA
+};
+
+struct metar_packed
+{
+  // the same report in about a sixth of the space.  the float fields of
+  // struct metar are fixed-point here (see packedFields[]), with a bit in
+  // present for each one that was reported instead of a NaN.  the text
+  // lives in the owning struct metar_table.
+  int64_t observation_time;
+  uint32_t present;
+  uint32_t raw_text;     // offsets into metar_table.strings
+  uint32_t wx_string;
+  int32_t latitude;      // 1e-5 degrees
+  int32_t longitude;
+  int32_t altim_in_hg;   // 1e-6 inHg
+  int32_t elevation_m;   // 1e-1 m
+  int32_t precip_in;     // 1e-3 in, as are the four below
+  int32_t pcp3hr_in;
+  int32_t pcp6hr_in;
+  int32_t pcp24hr_in;
+  int32_t snow_in;
+  int32_t cloud_base_ft_agl[4];
+  int16_t temp_c;        // 1e-1 degrees, as are the five below
+  int16_t dewpoint_c;
+  int16_t maxT_c;
+  int16_t minT_c;
+  int16_t maxT24hr_c;
+  int16_t minT24hr_c;
+  int16_t sea_level_pressure_mb;         // 1e-1 mb
+  int16_t three_hr_pressure_tendency_mb; // 1e-1 mb
+  int16_t visibility_statute_mi;         // 1e-2 mi
+  int16_t wind_dir_degrees;
+  int16_t wind_speed_kt;
+  int16_t wind_gust_kt;
+  int16_t vert_vis_ft;
+  uint8_t quality_control_flags;
+  int8_t flight_category;
+  int8_t metar_type;
+  uint8_t sky_condition_count;
+  int8_t sky_cover[4];
+  char station_id[5];
+};
+
+struct metar_table
+{
+  struct metar_packed *reports;
+  size_t count, size;
+  char *strings;         // every report's raw_text and wx_string; 0 is ""
+  size_t stringsLen, stringsSize; // size and stringsSize are 0 in views
+};
+
+struct packed_field
+{
+  size_t full;           // offsetof(struct metar, ...), a float
+  size_t packed;         // offsetof(struct metar_packed, ...)
+  int wide;              // int32_t if set, otherwise int16_t
+  double scale;          // fixed-point units per unit
+};
+
+enum format_field
+{
+  FORMAT_LITERAL = 0,
+  FORMAT_RAW_TEXT,
+  FORMAT_STATION_ID,
+  FORMAT_OBSERVATION_TIME,
+  FORMAT_OBSERVATION_LOCALTIME,
+  FORMAT_LATITUDE,
+  FORMAT_LONGITUDE,
+  FORMAT_TEMP_C,
+  FORMAT_TEMP_F,
+  FORMAT_DEWPOINT_C,
+  FORMAT_DEWPOINT_F,
+  FORMAT_WIND_DIR_DEGREES,
+  FORMAT_WIND_SPEED_KT,
+  FORMAT_WIND_GUST_KT,
+  FORMAT_VISIBILITY_STATUTE_MI,
+  FORMAT_ALTIM_IN_HG,
+  FORMAT_SEA_LEVEL_PRESSURE_MB,
+  FORMAT_WX_STRING,
+  FORMAT_THREE_HR_PRESSURE_TENDENCY_MB,
+  FORMAT_MAXT_C,
+  FORMAT_MINT_C,
+  FORMAT_MAXT24HR_C,
+  FORMAT_MINT24HR_C,
+  FORMAT_PRECIP_IN,
+  FORMAT_PCP3HR_IN,
+  FORMAT_PCP6HR_IN,
+  FORMAT_PCP24HR_IN,
+  FORMAT_SNOW_IN,
+  FORMAT_VERT_VIS_FT,
+  FORMAT_ELEVATION_M,
+  FORMAT_QUALITY_CONTROL_FLAGS,
+  FORMAT_SKY_CONDITION,
+  FORMAT_METAR_TYPE,
+  FORMAT_FLIGHT_CATEGORY
+};
+
+struct xml_name_slot
+{
+  const char *name;  // element, attribute or value, as the service spells it
+  size_t len;
+  enum xml_name code;
+};
+
+struct format_name
+{
+  const char *name; // as written between the braces
+  enum format_field field;
+};
+
+struct format_token
+{
+  enum format_field field;
+  const char *text; // FORMAT_LITERAL only: not NUL-terminated
+  size_t len;
+};
+
+enum filter_code
+{
+  // tests of one field...
+  FILTER_PRESENT = 0,
+  FILTER_EQ,
+  FILTER_NE,
+  FILTER_LT,
+  FILTER_LE,
+  FILTER_GT,
+  FILTER_GE,
+  FILTER_HAS,
+  // ...and what joins them
+  FILTER_AND,
+  FILTER_OR,
+  FILTER_NOT
+};
+
+struct filter_op
+{
+  enum filter_code code;
+  enum format_field field; // tests only: what's tested, by its -f name
+  double number;           // ...against this,
+  const char *text;        // or, for text fields, this: not NUL-terminated
+  size_t len;
+};
+
+struct metar_filter
+{
+  struct filter_op *ops;   // the --where expression, compiled by compileFilter()
+  size_t count;            // ...in postfix order
+  char *stack;             // count bytes, reused for every report
+};
+
+struct metar_format
+{
+  struct format_token *tokens; // the -f string, compiled by compileFormat()
+  size_t count;
+  char *out;                   // METAR_BIGBUFSIZE bytes, reused for every report
+  const struct metar_filter *where; // reports it doesn't match aren't output, if set
+};
+
+struct metar_parser;
+
+struct validators
+{
+  char etag[METAR_ETAGSIZE];     // a response's ETag, quotes and all, or ""
+  char modified[METAR_DATESIZE]; // its Last-Modified, or ""
+};
+
+struct metar_projection
+{
+  // which fields of which reports are asked for and kept: a run's, and what
+  // each cached copy was retrieved with.  see formatFields().
+  uint32_t fields;   // a bit per <METAR> child; METAR_FIELDS_ALL for all
+  int latest;        // nonzero if only each station's newest report
+};
+
+struct metar_settings
+{
+  // what a run (or a context) asks of the cache and the service
+  time_t maxAge;      // -a; how long any cached copy is trusted
+  struct metar_projection wanted; // what it shows, and so asks for
+};
+
+struct metar_stats
+{
+  // with --stats, where one station's (or the whole run's) time went, in
+  // microseconds
+  int64_t cache;     // finding it in, and reading it from, the caches
+  int64_t dns;       // the phases of its requests, as curl has them
+  int64_t connect;
+  int64_t tls;
+  int64_t transfer;
+  int64_t parse;     // SAX parsing, which decodes reports as it goes
+  int64_t render;    // printMetars()
+  uint64_t requests; // HTTP requests it took
+  uint64_t bytes;    // ...and the bytes they brought
+  uint64_t allocs;   // scratch allocations and document resizes
+};
+
+struct document
+{
+  char *data;
+  size_t len;
+  size_t size;                 // bytes allocated for data; grows geometrically
+  size_t resizes;              // how many times it had to (see DEBUG below)
+  struct metar_parser *parser; // if set, also fed every chunk as it arrives...
+  size_t window;               // ...unless nonzero and exceeded by len
+  const struct validators *known; // if set, sent to make the request conditional
+  struct validators validators;   // what the response came with
+  long status;                 // its HTTP status
+  long retryAfter;             // seconds, if it said how long to hold off
+  struct curl_slist *headers;  // the conditions, as sent
+  struct metar_stats *stats;   // if set, parsing is timed into it
+};
+
+struct inflater
+{
+  // a gzip'd response, decompressed as it arrives and handed to a parser
+  z_stream stream;
+  int state;                   // 0 until it starts, then 1 if gzip'd, 2 if not
+  int error;                   // -1 for a corrupt stream, -2 for out of memory
+  struct metar_parser *parser;
+  size_t bytes;                // what came over the wire
+  char out[METAR_BIGBUFSIZE];
+};
+
+struct prefetch_pick
+{
+  char station[8];  // a report's station_id...
+  int64_t observed; // ...its observation_time...
+  size_t k;         // ...and where it is in the bulk file
+};
+
+struct output
+{
+  int fd;           // where rendered reports end up
+  char *data;       // METAR_OUTBUFSIZE bytes, once anything's been written
+  size_t len;
+  int eager;        // a terminal; flushed after every station
+  size_t writes;    // writev() calls made (see DEBUG below)
+};
+
+struct decode_job
+{
+  struct metar_parser *parser; // this worker's own, without echo
+  const char *head, *body, *tail;
+  size_t headLen, bodyLen, tailLen;
+  size_t count;                // reports in body
+  int started;                 // running on a thread of its own
+  int result;                  // finishMetarParser()'s
+};
+
+struct arena_block
+{
+  struct arena_block *next;
+  size_t size, used;
+  char data[];
+};
+
+struct arena
+{
+  struct arena_block *head; // the newest, and after a reset the only, block
+  size_t allocs;            // requests served
+  size_t blocks;            // of which needed a malloc()
+};
+
+struct metar_parser
+{
+  xmlParserCtxt *ctxt;   // libxml2 push parser driving the callbacks below
+  struct metar current;  // the report being decoded
+  struct metar_table reports; // ...and every one finished so far
+  size_t size;           // room in spans, in reports
+  size_t *spans;         // where each report begins and ends in echo
+  struct document echo;  // the <METAR>s re-serialized, if asked for
+  int depth;             // current element depth; the root is 1
+  int matched;           // how much of response/data/METAR we're inside
+  int flags;             // nonzero inside <quality_control_flags>
+  int error;             // 0, -1 for malformed XML, -2 for out of memory
+  uint32_t fields;       // the <METAR> children kept; the rest are skipped
+  enum xml_name element; // field whose text is being collected, if any
+  char text[METAR_BUFSIZE];
+  size_t textLen;
+};
+
+struct prefetch
+{
+  int done;              // 1 once a fetch run has covered this station, -1 until
+                         // its request has landed
+  const char *error;     // why the station has no weather information, or NULL
+  struct metar_table reports; // this station's share of the response
+  struct metar_stats stats; // with --stats, its request's, if it came first in it
+};
+
+struct cache_header
+{
+  char magic[4];     // METAR_CACHE_MAGIC
+  uint32_t version;  // METAR_CACHE_VERSION
+  uint32_t byteOrder; // 0x01020304, as the writer saw it
+  uint32_t layout;   // metarLayoutHash() of the writer
+  uint64_t slots;    // METAR_CACHE_SLOTS
+  uint64_t end;      // where the next record goes
+};
+
+struct cache_slot
+{
+  char station[METAR_CACHE_KEYSIZE]; // upper-cased ICAO id, or "" if free
+  int64_t fetched;   // when the reports were retrieved
+  int64_t expires;   // when a newer one is expected; see predictExpiry()
+  uint64_t offset;   // where they are in the file
+  uint64_t count;    // how many struct metar_packed are there
+  uint64_t strings;  // the bytes of text that follow them, and then a
+                     // struct validators
+  uint32_t fields;   // of the projection they were retrieved with
+  uint32_t latest;   // nonzero if only the newest report was asked for
+};
+
+struct sidecar_header
+{
+  char magic[4];     // METAR_SIDECAR_MAGIC
+  uint32_t version;  // METAR_SIDECAR_VERSION
+  uint32_t byteOrder; // 0x01020304, as the writer saw it
+  uint32_t layout;   // metarLayoutHash() of the writer
+  uint64_t count;    // how many struct metar_packed follow
+  uint64_t strings;  // the bytes of text after those
+  uint32_t fields;   // of the projection they were retrieved with
+  uint32_t latest;   // nonzero if only the newest report was asked for
+  int64_t expires;   // when a newer report is expected; see predictExpiry()
+  struct validators validators; // for revalidating the XML beside it
+};
+
+struct history_header
+{
+  // metar-XXXX.hist: this, then struct metar_packed, oldest first.  their
+  // text is in metar-XXXX.hstr, after an int64_t generation that must
+  // match this one's; a log that's rewritten gets a new one.
+  char magic[4];       // METAR_HISTORY_MAGIC
+  uint32_t version;    // METAR_HISTORY_VERSION
+  uint32_t byteOrder;  // 0x01020304, as the writer saw it
+  uint32_t layout;     // metarLayoutHash() of the writer
+  int64_t generation;
+  int64_t covered;     // every report observed since then is in the log...
+  int64_t fetched;     // ...as of when it was last retrieved
+  int64_t expires;     // when a newer one is expected; see predictExpiry()
+  uint64_t count;      // how many reports there are
+  uint64_t strings;    // the bytes of text after the generation
+};
+
+struct station_location
+{
+  char station[8];     // upper-cased ICAO id
+  int32_t latitude;    // 1e-5 degrees, as in struct metar_packed
+  int32_t longitude;
+  int32_t elevation_m; // 1e-1 m, or INT32_MIN if unknown
+  uint32_t cell;       // stationCell()
+};
+
+struct station_header
+{
+  // metar-stations.bin: this, then METAR_GRID_CELLS + 1 uint32_t (where
+  // each cell's stations start), then the stations, by cell and then id
+  char magic[4];       // METAR_STATIONS_MAGIC
+  uint32_t version;    // METAR_STATIONS_VERSION
+  uint32_t byteOrder;  // 0x01020304, as the writer saw it
+  uint32_t count;      // how many stations there are
+};
+
+struct station_index
+{
+  void *map;
+  size_t size;
+  const struct station_header *header;
+  const uint32_t *cells;
+  const struct station_location *stations;
+};
+
+struct station_match
+{
+  struct station_location station;
+  double nm;           // how far it is from the middle of a --near, or 0
+};
+
+struct station_area
+{
+  // --near (a radius around a point) or --bbox (a box, which may cross
+  // the antimeridian), in degrees and nautical miles
+  int radius;
+  double latitude, longitude, nm;
+  double south, west, north, east;
+};
+
+struct metar_history
+{
+  // a station's history log, mapped and locked
+  int fd, strfd;
+  struct history_header header; // zeroed if there's no (valid) log
+  void *map, *strMap;
+  size_t mapSize, strMapSize;
+  struct metar_table view;      // the header's reports, borrowed from the maps
+};
+
+struct metar_cache
+{
+  int fd;
+  char *map;         // the whole file, shared
+  size_t size;
+  struct cache_header *header;
+  struct cache_slot *slots;
+};
+
+struct fetch_pool
+{
+  CURLM *multi;
+  CURLSH *share;     // DNS, TLS sessions and connections
+  CURL **handles;    // one per transfer in flight
+  int jobs;
+};
+
+struct rate_limiter
+{
+  // a token bucket for requests to the service, shared by every transfer
+  // in flight, and by every context's; see requestDelay() and noteRequest()
+  pthread_mutex_t lock;
+  double tokens;         // requests that may go now
+  int64_t refilled;      // clockMicros() when tokens was last topped up
+  int64_t until;         // nothing goes before this, after a failure
+  int failures;          // in a row, for the backoff
+  uint32_t seed;         // for its jitter
+};
+
+struct transfer
+{
+  char *request;         // url with query string
+  struct document doc;   // response body
+  CURLcode res;
+  int first, last;       // span of argv covered by this request
+  int single;            // nonzero if it asks for exactly one station
+  struct validators known; // ...and if so, what its cached copy came with
+  struct metar_stats stats;
+  int attempts;          // made so far
+  int retry;             // nonzero if failed, and due another attempt
+};
+
+struct fetch_run
+{
+  // a fetchStations() in progress, handing stations out as their requests
+  // land; see startFetch()
+  CURL *curl;              // without a pool, for one request after another
+  struct fetch_pool *pool;
+  struct metar_cache *cache;
+  const char *path;
+  int flags;               // METARFLAG_GZIP, for the cache files written
+  const char **argv;
+  struct prefetch *slots;
+  struct transfer *xfers;
+  size_t count;            // requests
+  size_t next;             // the first not yet under way
+  size_t active;           // under way on the pool
+  size_t landed;           // done with, in whatever order
+  size_t retries;          // failed, and waiting on the limiter to go again
+  CURL **idle;             // pool handles with nothing under way
+  size_t idles;
+  struct arena scratch;    // where revalidated copies are read into
+  struct metar_settings settings; // what its requests ask for, and how long copies keep
+  int error;               // -1 once out of memory
+};
+
+struct metar_context
+{
+  // what a program linking libmetar keeps from one retrieveMetars() to the
+  // next, in place of everything main() sets up: the handles (and with -j,
+  // the pool) whose connections are reused, the cache, and the memory the
+  // last batch was handed back in.  see openMetarContext().
+  CURL *curl;
+  struct fetch_pool *pool;     // with jobs > 1
+  struct metar_cache *cache;   // with METARFLAG_INDEXED
+  char *url, *path;
+  int flags;                   // METARFLAG_UPDATE, _NOTS, _BATCH and _INDEXED
+  struct metar_settings settings; // everything asked for; see setMetarMaxAge()
+  struct prefetch *slots;      // fetchStations()'s, one per station asked for
+  struct metar_result *results; // ...and what became of each
+  size_t stations;             // room in both
+  struct arena scratch;        // sidecars read back
+  struct metar *weather;       // every report of the last batch, in order
+  size_t count, size;
+};
+
+int isVfrWeather(enum sky_cover_type ceil);
+const char *skyCondition(enum sky_cover_type ceil);
+size_t writeDocument(void *data, size_t len, size_t width, void *rest);
+size_t inflateDocument(void *data, size_t len, size_t width, void *rest);
+void initOutput(struct output *o, int fd);
+int flushOutput(struct output *o, const char *extra, size_t len);
+void closeOutput(struct output *o);
+int outputBytes(struct output *o, const char *text, size_t len);
+int outputString(struct output *o, const char *text);
+int outputFormat(struct output *o, const char *format, ...);
+xmlXPathObject *getXmlNodes(xmlDoc *restrict xml, const char *restrict xpath);
+void *arenaAlloc(struct arena *a, size_t len);
+void resetArena(struct arena *a);
+void freeArena(struct arena *a);
+void init_metar(struct metar *weather);
+void initMetarTable(struct metar_table *t);
+void freeMetarTable(struct metar_table *t);
+int internMetarString(struct metar_table *restrict t, const char *restrict text, uint32_t *restrict offset);
+int packMetar(struct metar_table *restrict t, const struct metar *restrict w);
+int copyPackedMetar(struct metar_table *restrict dst, const struct metar_table *restrict src, size_t k);
+void unpackMetar(const struct metar_table *restrict t, size_t k, struct metar *restrict w);
+int isMetarTableValid(const struct metar_table *t);
+void cachePath(char *restrict dest, const char *restrict path, const char *restrict station);
+gzFile createCacheFile(const char *file, int flags);
+int isCacheFresh(const char *restrict file, int flags, const struct metar_settings *restrict settings);
+time_t predictExpiry(const struct metar_table *reports, time_t fetched);
+time_t cacheDeadline(time_t fetched, time_t expires, time_t maxAge);
+int touchSidecar(const char *file, time_t expires);
+void sidecarPath(char *restrict dest, const char *restrict file);
+void fillSidecarHeader(struct sidecar_header *restrict header, const char *restrict magic, uint64_t count, uint64_t strings, const struct metar_projection *restrict kept);
+int writeSidecar(const char *restrict file, const struct metar_table *restrict reports, const struct validators *restrict validators, const struct metar_projection *restrict kept);
+int openSidecar(const char *restrict file, struct sidecar_header *restrict header);
+int readSidecar(const char *restrict file, struct metar_table *restrict reports, struct arena *restrict scratch);
+int readValidators(const char *restrict file, struct validators *restrict validators, const struct metar_projection *restrict wanted);
+void setupTransfer(CURL *curl, const char *request, struct document *doc);
+int64_t clockMicros(void);
+void sleepMicros(int64_t micros);
+int64_t requestDelay(int take);
+void awaitRequest(void);
+int noteRequest(CURLcode res, const struct document *doc, int attempt);
+const char *statusReason(long status);
+void rewindDocument(struct document *doc);
+CURLcode performRequest(CURL *curl, struct document *doc);
+void addTransferStats(struct metar_stats *restrict stats, CURL *restrict curl);
+void addStats(struct metar_stats *restrict total, const struct metar_stats *restrict stats);
+void printStats(const char *restrict label, const struct metar_stats *restrict stats);
+size_t readHeader(char *line, size_t size, size_t count, void *rest);
+int revalidateStation(struct metar_cache *restrict cache, const char *restrict file, const char *restrict station, const struct metar_settings *restrict settings, struct metar_table *restrict reports, struct arena *restrict scratch);
+void historyPath(char *restrict dest, const char *restrict path, const char *restrict station, const char *restrict extension);
+int openHistory(struct metar_history *restrict h, const char *restrict path, const char *restrict station, int writable);
+void closeHistory(struct metar_history *h);
+size_t findHistory(const struct metar_history *h, time_t since);
+int readHistory(const struct metar_history *restrict h, time_t since, struct metar_table *restrict reports);
+int isInHistory(const struct metar_history *restrict h, const struct metar_table *restrict reports, size_t k);
+int appendHistory(const char *restrict path, const char *restrict station, const struct metar_table *restrict fresh, time_t covered, time_t fetched);
+int historyMetars(CURL *restrict curl, struct document *restrict doc, const char *restrict url, const char *restrict path, const char *restrict station, int hours, int flags, const struct metar_settings *restrict settings, struct metar_table *restrict reports, const char **restrict error);
+struct fetch_pool *openFetchPool(int jobs);
+void closeFetchPool(struct fetch_pool *pool);
+struct fetch_run *startFetch(CURL *curl, struct fetch_pool *pool, struct metar_cache *cache, const char *url, const char *path, int hours, int flags, const struct metar_settings *settings, int first, int last, const char *argv[], struct prefetch *slots);
+void dispatchFetch(struct fetch_run *run);
+int stepFetch(struct fetch_run *run);
+int awaitStation(struct fetch_run *run, int station);
+int finishTransfer(struct fetch_run *run, struct transfer *xfer);
+void freeTransfer(struct transfer *xfer);
+int endFetch(struct fetch_run *run);
+int fetchStations(CURL *curl, struct fetch_pool *pool, struct metar_cache *cache, const char *url, const char *path, int hours, int flags, const struct metar_settings *settings, int first, int last, const char *argv[], struct prefetch *slots);
+int loadFeed(CURL *restrict curl, const char *restrict url, const char *restrict path, int flags, const struct metar_settings *restrict settings, struct metar_table *restrict reports, struct arena *restrict scratch);
+int comparePicks(const void *a, const void *b);
+int prefetchMetars(CURL *restrict curl, struct metar_cache *restrict cache, const char *restrict url, const char *restrict path, int flags, const struct metar_settings *restrict settings);
+uint32_t stationCell(double latitude, double longitude);
+int compareStationIds(const void *a, const void *b);
+int compareStationCells(const void *a, const void *b);
+int compareStationMatches(const void *a, const void *b);
+int openStationIndex(struct station_index *restrict ix, const char *restrict path);
+void closeStationIndex(struct station_index *ix);
+int updateStationIndex(const char *restrict path, const struct metar_table *restrict reports);
+double stationDistance(double lat1, double lon1, double lat2, double lon2);
+int findStations(const char *restrict path, const struct station_area *restrict area, struct station_match **restrict found, size_t *restrict count);
+int selectStationReports(const struct metar_table *restrict all, const char *restrict station, time_t since, struct metar_table *restrict reports);
+int isStationFresh(struct metar_cache *cache, const char *path, const char *station, int flags, const struct metar_settings *settings);
+unsigned long metarLayoutHash(void);
+int cacheKey(char *restrict key, const char *restrict station);
+struct cache_slot *findCacheSlot(struct metar_cache *cache, const char *station, int vacant);
+int mapIndexedCache(struct metar_cache *cache);
+int resetIndexedCache(struct metar_cache *cache);
+int isIndexedCacheValid(const struct metar_cache *cache);
+struct metar_cache *openIndexedCache(const char *path);
+void closeIndexedCache(struct metar_cache *cache);
+int purgeIndexedCache(struct metar_cache *cache);
+int isCacheSlotValid(const struct metar_cache *restrict cache, const struct cache_slot *restrict slot);
+int copyCachedReports(const struct metar_cache *restrict cache, const struct cache_slot *restrict slot, struct metar_table *restrict reports, struct arena *restrict scratch);
+int findCachedReports(struct metar_cache *restrict cache, const char *restrict station, int flags, const struct metar_settings *restrict settings, struct metar_table *restrict reports, struct arena *restrict scratch);
+int storeCachedReports(struct metar_cache *restrict cache, const char *restrict station, const struct metar_table *restrict reports, const struct validators *restrict validators, const struct metar_projection *restrict kept);
+int findCachedValidators(struct metar_cache *restrict cache, const char *restrict station, const struct metar_projection *restrict wanted, struct validators *restrict validators);
+int touchCachedReports(struct metar_cache *cache, const char *station);
+int xmlToMetar(xmlDoc *restrict xml, struct metar *restrict weather, size_t count);
+size_t xmlGetMetarCount(xmlDoc *xml);
+enum xml_name lookupXmlName(const char *name, size_t len);
+void setMetarField(struct metar *restrict weather, enum xml_name field, const char *restrict value);
+void setMetarSkyCondition(struct metar *restrict weather, enum xml_name attr, const char *restrict value);
+void setMetarQualityFlag(struct metar *restrict weather, enum xml_name flag, const char *restrict value);
+struct metar_parser *newMetarParser(int echo, uint32_t fields);
+void resetMetarParser(struct metar_parser *p);
+void freeMetarParser(struct metar_parser *p);
+int feedMetarParser(struct metar_parser *p, const char *data, size_t len);
+int finishMetarParser(struct metar_parser *p);
+void metarParserEcho(struct metar_parser *p, const char *text, size_t len, int escape);
+void metarParserStart(void *ctx, const xmlChar *name, const xmlChar *prefix, const xmlChar *uri, int nsCount, const xmlChar **ns, int attrCount, int defaulted, const xmlChar **attrs);
+void metarParserEnd(void *ctx, const xmlChar *name, const xmlChar *prefix, const xmlChar *uri);
+void metarParserText(void *ctx, const xmlChar *text, int len);
+int findMetarRecords(const char *restrict data, size_t **restrict records, size_t *restrict count);
+void *runDecodeJob(void *arg);
+int decodeMetars(struct metar_parser *restrict p, const char *restrict data, size_t len, int threads);
+int compileFormat(struct metar_format *restrict fmt, const char *restrict format);
+void freeFormat(struct metar_format *fmt);
+const char *renderFormat(struct metar_format *restrict fmt, const struct metar *restrict w, int color, size_t *restrict len);
+const char *flightConditions(enum flight_rules rules, int color);
+int printMetars(const struct metar_table *reports, int entries, int flags, struct metar_format *format, struct output *out);
+void printJsonMetar(struct output *restrict o, const struct metar *restrict w);
+char *jsonString(char *restrict p, const char *restrict key, const char *restrict value);
+char *jsonNumber(char *restrict p, const char *restrict key, double value, int digits);
+void printBinaryMetar(struct output *restrict o, const struct metar *restrict w);
+void outputUnavailable(struct output *restrict o, int flags, const char *restrict station, const char *restrict reason);
+uint32_t formatFields(const struct metar_format *fmt, int flags);
+void projectionQuery(char *restrict dest, size_t size, int batched, const struct metar_projection *restrict wanted);
+int coversProjection(uint32_t fields, uint32_t latest, const struct metar_projection *wanted);
+int compileFilter(struct metar_filter *restrict f, const char *restrict expr);
+int compileFilterExpr(struct metar_filter *restrict f, const char **restrict p, int level);
+int compileFilterTest(struct metar_filter *restrict f, const char **restrict p);
+size_t nextFilterToken(const char *restrict p, const char **restrict start);
+int isFilterWord(const char *restrict token, size_t len, const char *restrict word);
+void freeFilter(struct metar_filter *f);
+uint32_t filterFields(const struct metar_filter *f);
+int filterField(const struct metar *restrict w, enum format_field field, double *restrict number, const char **restrict text);
+int matchesFilter(const struct metar_filter *restrict f, const struct metar *restrict w);
+int decodeRawMetar(const char *restrict text, time_t reference, struct metar *restrict weather);
+int parseRawTime(const char *restrict group, time_t reference, time_t *restrict when);
+int parseRawFraction(const char *restrict group, size_t len, float *restrict value);
+int decodeRawWind(const char *restrict group, size_t len, struct metar *restrict weather);
+int decodeRawSky(const char *restrict group, size_t len, struct metar *restrict weather);
+int decodeRawTemperatures(const char *restrict group, struct metar *restrict weather);
+int parseRawDegrees(const char *restrict group, size_t len, float *restrict value);
+void appendRawWeather(const char *restrict group, size_t len, struct metar *restrict weather);
+void decodeRawRemark(const char *restrict group, size_t len, struct metar *restrict weather);
+int rawDigits(const char *group, size_t count);
+int decodeMetarCycle(const char *restrict data, size_t len, time_t fetched, struct metar_table *restrict reports);
+int parseIsoTime(const char *restrict value, time_t *restrict when);
+int parseDecimal(const char *restrict value, float *restrict number);
+int parseInteger(const char *restrict value, int *restrict number);
+int64_t daysFromCivil(int64_t year, int month, int day);
+
+int loadCachedMetars(struct metar_context *restrict ctx, const char *restrict station, struct metar_table *restrict reports);
+int appendMetars(struct metar_context *restrict ctx, const struct metar_table *restrict reports);
+
+extern const struct metar_projection wholeReports; // everything, as the bulk files are kept
+
+#endif // METAR_INTERNAL_H